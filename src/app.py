@@ -10,10 +10,14 @@ import threading
 import signal
 import secrets
 import json
+import zlib
+import collections
+import queue
+import urllib.request
 from scapy.all import sniff, IP, TCP
 import bcrypt
 import pyotp
-from flask import Flask, render_template, request, redirect, url_for, flash, jsonify, session
+from flask import Flask, render_template, request, redirect, url_for, flash, jsonify, session, Response, stream_with_context
 from flask_login import LoginManager, UserMixin, login_user, login_required, logout_user, current_user
 
 app = Flask(__name__)
@@ -142,9 +146,7 @@ def logout():
 @app.route('/')
 @login_required
 def home():
-    cpu_usage = psutil.cpu_percent(interval=1)
-    ram_usage = psutil.virtual_memory().percent
-    uptime = system_uptime()
+    cpu_usage, ram_usage, uptime = system_metrics()
 
     return render_template("index.html", 
                            cpu_usage=cpu_usage, 
@@ -447,14 +449,88 @@ def public_ip_settings_page():
     ip_status = {ip: ("banned" if ip in banned_ips else "unbanned") for ip in connected_ips}
     return render_template('public_ip_settings.html', ip_status=ip_status, banned_ips=banned_ips)
 
+# cpu_percent(interval=None) measures since the previous call, so one shared sample
+# at most once a second serves every page and stream without blocking a request
+metrics_lock = threading.Lock()
+metrics_cache = {"time": 0.0, "cpu": psutil.cpu_percent(interval=None)}
+
+def system_metrics():
+    with metrics_lock:
+        now = time.time()
+        if now - metrics_cache["time"] >= 1.0:
+            metrics_cache["cpu"] = psutil.cpu_percent(interval=None)
+            metrics_cache["time"] = now
+        cpu_usage = metrics_cache["cpu"]
+    return cpu_usage, psutil.virtual_memory().percent, system_uptime()
+
 @app.route('/metrics')
 @cache.cached(timeout=5)
 def metrics():
-    cpu_usage = psutil.cpu_percent(interval=1)  
-    ram_usage = psutil.virtual_memory().percent
-    uptime_value = system_uptime()  
+    cpu_usage, ram_usage, uptime_value = system_metrics()
     return jsonify({"cpu_usage": cpu_usage, "ram_usage": ram_usage, "uptime": uptime_value})
 
+def relay_stream(source, address, port, interval_ms, events, stop):
+    # forwards the forwarder's GET /stream events as (source, event, data); a blocked
+    # put holds the relay back, and the forwarder folds the missed ticks into one delta
+    def put(item):
+        while not stop.is_set():
+            try:
+                events.put(item, timeout=1)
+                return
+            except queue.Full:
+                pass
+
+    url = f"http://{address}:{port}/stream?interval_ms={interval_ms}"
+    while not stop.is_set():
+        try:
+            with urllib.request.urlopen(url, timeout=max(5, 3 * interval_ms / 1000)) as stream:
+                event = "message"
+                for raw in stream:
+                    if stop.is_set():
+                        return
+                    line = raw.decode("utf-8", "replace").rstrip("\r\n")
+                    if line.startswith("event: "):
+                        event = line[7:]
+                    elif line.startswith("data: "):
+                        put((source, event, line[6:]))
+        except Exception:
+            pass
+        put((source, "down", "{}"))
+        stop.wait(5)
+
+@app.route('/live-stats')
+@login_required
+def live_stats():
+    control = config.get("control") or {}
+    interval_ms = max(100, int(control.get("stream_interval_ms", 1000)))
+    events = queue.Queue(maxsize=64)
+    stop = threading.Event()
+    if control.get("enabled"):
+        address = control.get("address", "127.0.0.1")
+        for source, key, default in (("tcp", "tcp_port", 9100), ("udp", "udp_port", 9101)):
+            threading.Thread(target=relay_stream, daemon=True,
+                             args=(source, address, control.get(key, default), interval_ms, events, stop)).start()
+
+    def generate():
+        try:
+            next_metrics = 0.0
+            while True:
+                if time.time() >= next_metrics:
+                    cpu_usage, ram_usage, uptime_value = system_metrics()
+                    data = json.dumps({"cpu_usage": cpu_usage, "ram_usage": ram_usage, "uptime": uptime_value})
+                    yield f"event: metrics\ndata: {data}\n\n"
+                    next_metrics = time.time() + max(1.0, interval_ms / 1000)
+                try:
+                    source, event, data = events.get(timeout=max(0.05, next_metrics - time.time()))
+                    yield f"event: {source}-{event}\ndata: {data}\n\n"
+                except queue.Empty:
+                    pass
+        finally:
+            stop.set()
+
+    return Response(stream_with_context(generate()), mimetype="text/event-stream",
+                    headers={"Cache-Control": "no-cache", "X-Accel-Buffering": "no"})
+
 
 @app.route('/network-stats')
 def network_stats():
@@ -561,16 +637,130 @@ def obtain_system_logs():
 
 @app.route('/api/tunnel-logs')
 def api_tunnel_logs():
-    logs = obtain_tunnel_logs()
+    count = request.args.get("lines", 50, type=int)
+    logs = obtain_tunnel_logs(max(1, min(count, 5000)), request.args.get("since"), request.args.get("until"))
     return jsonify({"logs": logs})
 
-def obtain_tunnel_logs():
+def read_log_index(path):
+    """Rotated segments of a forwarder log, oldest first, from the .idx it keeps next to the log."""
+    segments = []
+    try:
+        with open(path + ".idx", "r") as file:
+            for line in file:
+                fields = line.split()
+                if len(fields) == 6 and fields[0] == "segment":
+                    segments.append({"path": os.path.join(os.path.dirname(path), fields[5]),
+                                     "first": int(fields[2]), "last": int(fields[3]),
+                                     "bytes": int(fields[4]), "blocks": []})
+                elif len(fields) == 4 and fields[0] == "block" and segments:
+                    segments[-1]["blocks"].append(tuple(int(field) for field in fields[1:]))
+    except (OSError, ValueError):
+        pass
+    for segment in segments:
+        if not segment["blocks"]:
+            segment["blocks"] = [(segment["first"], 0, 0)]
+    return [segment for segment in segments if os.path.exists(segment["path"])]
+
+def read_log_block(segment, i):
+    """Lines of one block of a segment; compressed segments hold each block as its own gzip member."""
+    _, raw, stored = segment["blocks"][i]
+    last = i + 1 == len(segment["blocks"])
+    with open(segment["path"], "rb") as file:
+        if segment["path"].endswith(".gz"):
+            file.seek(stored)
+            data = file.read() if last else file.read(segment["blocks"][i + 1][2] - stored)
+            data = zlib.decompressobj(31).decompress(data)
+        else:
+            file.seek(raw)
+            data = file.read((segment["bytes"] if last else segment["blocks"][i + 1][1]) - raw)
+    return data.splitlines(keepends=True)
+
+def tail_log_file(path, count, chunk=65536):
+    """Last count lines of a file, read backwards from its end."""
+    with open(path, "rb") as file:
+        end = file.seek(0, os.SEEK_END)
+        data = b""
+        while end > 0 and data.count(b"\n") <= count:
+            start = max(0, end - chunk)
+            file.seek(start)
+            data = file.read(end - start) + data
+            end = start
+    return data.splitlines(keepends=True)[-count:]
+
+def log_line_time(line):
+    try:
+        return time.mktime(time.strptime(line[1:20].decode(), "%Y-%m-%d %H:%M:%S"))
+    except (ValueError, UnicodeDecodeError):
+        return None
+
+def tail_log(path, count):
+    """Last count lines of a log, continuing into rotated segments when the active file is short."""
+    lines = tail_log_file(path, count) if os.path.exists(path) else []
+    for segment in reversed(read_log_index(path)):
+        for i in reversed(range(len(segment["blocks"]))):
+            if len(lines) >= count:
+                return lines[-count:]
+            lines = read_log_block(segment, i) + lines
+    return lines[-count:]
+
+def log_between(path, since, until, count):
+    """Last count lines logged between since and until, seeking via the index and by bisecting the active file."""
+    lines = collections.deque(maxlen=count)
+    def take(batch):
+        keep = False
+        for line in batch:
+            logged = log_line_time(line)
+            if logged is not None:
+                keep = since <= logged <= until
+            if keep:
+                lines.append(line)
+
+    for segment in read_log_index(path):
+        # times in the index are when lines were written, a little after they were logged
+        if segment["last"] < since or segment["first"] > until + 1:
+            continue
+        blocks = segment["blocks"]
+        first = max([i for i, block in enumerate(blocks) if block[0] < since] or [0])
+        for i in range(first, len(blocks)):
+            if blocks[i][0] > until + 1:
+                break
+            take(read_log_block(segment, i))
+
+    if os.path.exists(path):
+        with open(path, "rb") as file:
+            low, high = 0, file.seek(0, os.SEEK_END)
+            while high - low > 65536:
+                middle = (low + high) // 2
+                file.seek(middle)
+                file.readline()
+                logged = log_line_time(file.readline())
+                if logged is not None and logged < since:
+                    low = middle
+                else:
+                    high = middle
+            file.seek(low)
+            if low:
+                file.readline()
+            take(file)
+    return list(lines)
+
+def parse_log_time(value):
+    """Unix seconds, or local time as the forwarder logs it."""
     try:
-        if not os.path.exists(tunnel_log_file):
+        return float(value)
+    except ValueError:
+        return time.mktime(time.strptime(value, "%Y-%m-%d %H:%M:%S"))
+
+def obtain_tunnel_logs(count=50, since=None, until=None):
+    try:
+        if not os.path.exists(tunnel_log_file) and not os.path.exists(tunnel_log_file + ".idx"):
             return "No tunnel logs found."
-        with open(tunnel_log_file, "r") as file:
-            lines = file.readlines()[-50:]
-        return "".join(lines)
+        if since or until:
+            lines = log_between(tunnel_log_file, parse_log_time(since) if since else 0,
+                                parse_log_time(until) if until else time.time(), count)
+        else:
+            lines = tail_log(tunnel_log_file, count)
+        return b"".join(lines).decode(errors="replace")
     except Exception as e:
         return f"error reading tunnel logs: {str(e)}"
 
@@ -591,6 +781,10 @@ def tunnel_status():
 def clear_tunnel_logs():
     try:
         open(tunnel_log_file, "w").close()
+        for segment in read_log_index(tunnel_log_file):
+            os.remove(segment["path"])
+        if os.path.exists(tunnel_log_file + ".idx"):
+            os.remove(tunnel_log_file + ".idx")
         return "Logs cleared successfully.", 200
     except Exception as e:
         return f"Failed to clear logs: {str(e)}", 500
@@ -0,0 +1,47 @@
+#!/bin/bash
+# builds tcp_forwarder at two git revisions and runs loopback_bench.py against both,
+# alternating so drift on the machine hits both alike. with the same options on
+# both sides this shows what a change costs a listener that does not use it:
+#
+#   ./compare_revisions.sh HEAD~1 HEAD                   # plain listener, 4 rounds
+#   ROUNDS=8 ./compare_revisions.sh main HEAD --sessions 8
+#
+# CXXFLAGS and LIBS override the compiler flags and libraries of forwarder.sh.
+
+set -euo pipefail
+
+if [ $# -lt 2 ]; then
+    echo "usage: $0 <revision-a> <revision-b> [loopback_bench.py options]" >&2
+    exit 1
+fi
+
+BENCH_DIR="$(cd "$(dirname "$0")" && pwd)"
+REPO_DIR="$(git -C "$BENCH_DIR" rev-parse --show-toplevel)"
+PREFIX="$(git -C "$BENCH_DIR" rev-parse --show-prefix)"
+SOURCE="${PREFIX%bench/}tcp_forwarder.cpp"
+ROUNDS="${ROUNDS:-4}"
+CXXFLAGS="${CXXFLAGS:--std=c++17 -O2 -pthread}"
+LIBS="${LIBS:--lboost_system -lyaml-cpp -lssl -lcrypto -lzstd -llz4 -lz}"
+WORK_DIR="$(mktemp -d)"
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+revisions=("$1" "$2")
+shift 2
+
+for i in 0 1; do
+    echo "building ${revisions[$i]}" >&2
+    git -C "$REPO_DIR" show "${revisions[$i]}:$SOURCE" > "$WORK_DIR/tcp_forwarder_$i.cpp"
+    # shellcheck disable=SC2086
+    ${CXX:-g++} "$WORK_DIR/tcp_forwarder_$i.cpp" -o "$WORK_DIR/tcp_forwarder_$i" $CXXFLAGS $LIBS
+done
+
+for round in $(seq "$ROUNDS"); do
+    for i in 0 1; do
+        python3 "$BENCH_DIR/loopback_bench.py" "$WORK_DIR/tcp_forwarder_$i" "$@" |
+            python3 -c 'import json, sys
+report = json.load(sys.stdin)
+forwarder = report.get("forwarder", {})
+print("%-12s round %s  %8.3f Gbit/s  %8.4f cpu s/Gbit" % (sys.argv[1], sys.argv[2], report["gbit_per_s"],
+      forwarder.get("cpu_seconds_per_gbit", 0.0)))' "${revisions[$i]}" "$round"
+    done
+done
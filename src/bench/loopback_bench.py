@@ -0,0 +1,325 @@
+#!/usr/bin/env python3
+"""Loopback throughput and CPU cost of tcp_forwarder.
+
+Pushes data through a forwarder to a local sink over loopback and reports
+Gbit/s, the forwarder's CPU seconds per Gbit forwarded, and Gbit/s per core
+it kept busy. Run it once per variant of the same binary, or against two
+builds, and compare:
+
+    ./loopback_bench.py ../tcp_forwarder                      # forward_data path
+    ./loopback_bench.py ../tcp_forwarder --splice             # BPF sockmap (root)
+    ./loopback_bench.py ../tcp_forwarder --sessions 8 --mb 4096
+    ./loopback_bench.py ../tcp_forwarder --count-allocs         # heap allocations per MB
+    ./loopback_bench.py ../tcp_forwarder --seal aes-256-gcm     # encrypted pair, per side
+    ./loopback_bench.py ../tcp_forwarder --tls ktls             # TLS pair, against --tls user
+
+The sender and sink are python processes; --direct measures them without a
+forwarder in between, which is the ceiling of this harness on the machine.
+With --splice the forwarding runs in softirq context and is mostly not
+charged to the forwarder process, so compare its Gbit/s, not its CPU.
+--seal puts a client side and a server side forwarder with encryption between
+the sender and the sink and reports Gbit/s per core for each; run it once per
+cipher to compare the backends. --tls does the same for a TLS pair with records
+in user space or in the kernel; the report's tls stats show whether kTLS was
+taken or the sessions fell back to user space.
+"""
+
+import argparse
+import json
+import multiprocessing
+import os
+import shutil
+import struct
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import urllib.request
+
+CHUNK = 1 << 20
+CLK_TCK = os.sysconf("SC_CLK_TCK")
+
+
+def free_port():
+    with socket.socket() as s:
+        s.bind(("127.0.0.1", 0))
+        return s.getsockname()[1]
+
+
+def wait_port(port, timeout=10.0):
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        try:
+            socket.create_connection(("127.0.0.1", port), timeout=0.2).close()
+            return
+        except OSError:
+            time.sleep(0.05)
+    raise RuntimeError("nothing listens on port %d" % port)
+
+
+def cpu_seconds(pid):
+    # utime + stime of every thread, fields 14 and 15 of /proc/<pid>/stat
+    with open("/proc/%d/stat" % pid) as f:
+        fields = f.read().rsplit(")", 1)[1].split()
+    return (int(fields[11]) + int(fields[12])) / CLK_TCK
+
+
+def sink(port, expected, done):
+    """accepts connections and discards what arrives until `expected` bytes were read"""
+    server = socket.socket()
+    server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    server.bind(("127.0.0.1", port))
+    server.listen(256)
+    received = [0]
+    lock = threading.Lock()
+    finished = threading.Event()
+
+    def drain(conn):
+        buffer = bytearray(CHUNK)
+        while True:
+            n = conn.recv_into(buffer)
+            if not n:
+                break
+            with lock:
+                received[0] += n
+                if received[0] >= expected:
+                    finished.set()
+        conn.close()
+
+    def accept():
+        while True:
+            conn, _ = server.accept()
+            threading.Thread(target=drain, args=(conn,), daemon=True).start()
+
+    threading.Thread(target=accept, daemon=True).start()
+    done.send("ready")
+    finished.wait()
+    done.send(received[0])
+
+
+def sender(port, total, pattern):
+    payload = memoryview(os.urandom(CHUNK) if pattern == "random" else b"\0" * CHUNK)
+    conn = socket.create_connection(("127.0.0.1", port))
+    sent = 0
+    while sent < total:
+        n = min(CHUNK, total - sent)
+        conn.sendall(payload[:n])
+        sent += n
+    conn.shutdown(socket.SHUT_WR)
+    # the forwarder closes the session once the sink has it all
+    conn.settimeout(60)
+    try:
+        while conn.recv(65536):
+            pass
+    except OSError:
+        pass
+    conn.close()
+
+
+class Forwarder:
+    """one tcp_forwarder process with a generated config"""
+
+    def __init__(self, binary, workdir, name, listeners, extra, control_port=None, preload=None):
+        self.config = os.path.join(workdir, name + ".yaml")
+        self.log = os.path.join(workdir, name + ".log")
+        self.control_port = control_port
+        self.alloc_file = os.path.join(workdir, name + ".allocs") if preload else None
+        config = {
+            "forwarders": listeners,
+            "thread_pool": {"threads": extra.pop("threads", 2)},
+            "max_connections": 1000,
+            "retry_attempts": 2,
+            "retry_delay": 1,
+            "tcp_no_delay": True,
+            "buffer_size": extra.pop("buffer_size", 65536),
+            "health_check": {"enabled": False, "interval": 300},
+            "logging": {"enabled": True, "file": self.log, "level": "WARN"},
+            "control": {"enabled": control_port is not None, "address": "127.0.0.1",
+                        "tcp_port": control_port or 0},
+        }
+        config.update(extra)
+        with open(self.config, "w") as f:
+            json.dump(config, f)  # JSON is YAML
+        env = dict(os.environ)
+        if preload:
+            env.update(LD_PRELOAD=preload, MALLOC_COUNT_FILE=self.alloc_file)
+        self.process = subprocess.Popen([binary, self.config], cwd=workdir, env=env,
+                                        stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+
+    def allocations(self):
+        if not self.alloc_file:
+            return None
+        with open(self.alloc_file, "rb") as f:
+            return struct.unpack("=Q", f.read(8))[0]
+
+    def stats(self):
+        if not self.control_port:
+            return None
+        with urllib.request.urlopen("http://127.0.0.1:%d/stats" % self.control_port, timeout=5) as response:
+            return json.loads(response.read())
+
+    def stop(self):
+        self.process.send_signal(signal.SIGKILL)
+        self.process.wait()
+
+
+def listener(listen_port, target_port, **options):
+    entry = {"listen_address": "127.0.0.1", "listen_port": listen_port,
+             "target_address": "127.0.0.1", "target_port": target_port, "count_bytes": False}
+    entry.update(options)
+    return entry
+
+
+def build_malloc_count(workdir):
+    """malloc_count.so for LD_PRELOAD, built next to the run's configs"""
+    source = os.path.join(os.path.dirname(os.path.abspath(__file__)), "malloc_count.c")
+    library = os.path.join(workdir, "malloc_count.so")
+    subprocess.check_call([os.environ.get("CC", "cc"), "-shared", "-fPIC", "-O2", "-o", library, source])
+    return library
+
+
+def make_certificate(workdir):
+    """a throwaway self-signed certificate for the TLS pair"""
+    certificate = os.path.join(workdir, "cert.pem")
+    private_key = os.path.join(workdir, "key.pem")
+    subprocess.check_call(["openssl", "req", "-x509", "-newkey", "ec", "-pkeyopt", "ec_paramgen_curve:prime256v1",
+                           "-nodes", "-subj", "/CN=loopback_bench", "-days", "1",
+                           "-keyout", private_key, "-out", certificate],
+                          stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    return certificate, private_key
+
+
+def paired_link(args, workdir):
+    """the listener options of each side of a --seal or --tls pair, by side"""
+    if args.seal:
+        key = os.urandom(32).hex()
+        return {side: {"encryption": {"side": side, "cipher": args.seal, "key": key}} for side in ("client", "server")}
+    certificate, private_key = make_certificate(workdir)
+    ktls = args.tls == "ktls"
+    return {"client": {"tls": {"side": "client", "ktls": ktls}},
+            "server": {"tls": {"side": "server", "certificate": certificate, "private_key": private_key, "ktls": ktls}}}
+
+
+def build_chain(args, workdir, entry_port, sink_port):
+    """the forwarders between the sender and the sink, in the order the data passes them"""
+    def extra():
+        options = {"threads": args.threads, "buffer_size": args.buffer_size}
+        if args.splice:
+            options["sockmap_splice"] = {"enabled": True, "idle_timeout": 0}
+        return options
+
+    preload = build_malloc_count(workdir) if args.count_allocs else None
+    if not args.seal and not args.tls:
+        return [Forwarder(args.binary, workdir, "forwarder", [listener(entry_port, sink_port)], extra(), free_port(), preload)]
+    link = paired_link(args, workdir)
+    paired_port = free_port()
+    return [Forwarder(args.binary, workdir, name, [listener(listen, target, **link[side])], extra(), free_port(), preload)
+            for name, side, listen, target in (("client_side", "client", entry_port, paired_port),
+                                               ("server_side", "server", paired_port, sink_port))]
+
+
+def run(args):
+    workdir = tempfile.mkdtemp(prefix="loopback_bench.")
+    sink_port = free_port()
+    entry_port = sink_port if args.direct else free_port()
+    total = args.mb << 20
+    per_session = total // args.sessions
+
+    sink_end, bench_end = multiprocessing.Pipe()
+    sink_process = multiprocessing.Process(target=sink, args=(sink_port, per_session * args.sessions, sink_end), daemon=True)
+    sink_process.start()
+    bench_end.recv()
+
+    chain = [] if args.direct else build_chain(args, workdir, entry_port, sink_port)
+    try:
+        wait_port(entry_port)
+        for forwarder in chain:
+            if forwarder.process.poll() is not None:
+                raise RuntimeError("forwarder exited, see " + forwarder.log)
+
+        cpu_before = [cpu_seconds(f.process.pid) for f in chain]
+        allocs_before = [f.allocations() for f in chain]
+        started = time.perf_counter()
+        senders = [multiprocessing.Process(target=sender, args=(entry_port, per_session, args.pattern))
+                   for _ in range(args.sessions)]
+        for process in senders:
+            process.start()
+        if not bench_end.poll(args.timeout):
+            raise RuntimeError("transfer did not finish in %ds" % args.timeout)
+        received = bench_end.recv()
+        elapsed = time.perf_counter() - started
+        cpu = [cpu_seconds(f.process.pid) - before for f, before in zip(chain, cpu_before)]
+        allocs = [None if before is None else f.allocations() - before for f, before in zip(chain, allocs_before)]
+        stats = [f.stats() for f in chain]
+        for process in senders:
+            process.join(5)
+            if process.is_alive():
+                process.terminate()
+    finally:
+        for forwarder in chain:
+            forwarder.stop()
+        sink_process.terminate()
+
+    gbit = received * 8 / 1e9
+    report = {"mode": describe(args), "sessions": args.sessions, "mb": received >> 20,
+              "seconds": round(elapsed, 3), "gbit_per_s": round(gbit / elapsed, 3)}
+    for index, seconds in enumerate(cpu):
+        side = "forwarder" if len(cpu) == 1 else ("client_side", "server_side")[index]
+        report[side] = {"cpu_seconds": round(seconds, 3),
+                        "cpu_seconds_per_gbit": round(seconds / gbit, 4),
+                        "cores": round(seconds / elapsed, 2),
+                        "gbit_per_s_per_core": round(gbit / seconds, 3) if seconds else None}
+        if allocs[index] is not None:
+            report[side]["allocations"] = allocs[index]
+            report[side]["allocations_per_mb"] = round(allocs[index] / (received / (1 << 20)), 3)
+    add_details(report, args, stats)
+    print(json.dumps(report, indent=2))
+    shutil.rmtree(workdir, ignore_errors=True)
+
+
+def describe(args):
+    if args.direct:
+        return "direct"
+    mode = "splice" if args.splice else "forward_data"
+    if args.seal:
+        return mode + "+" + args.seal
+    return mode + "+tls_" + args.tls if args.tls else mode
+
+
+def add_details(report, args, stats):
+    if args.splice and stats and stats[0]:
+        report["sockmap_splice"] = stats[0].get("sockmap_splice")
+    if args.tls and stats and stats[-1]:
+        # ktls_sessions against ktls_fallbacks tells which record layer actually ran
+        report["tls"] = stats[-1].get("tls")
+
+
+def parse_args(argv):
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("binary", nargs="?", default=os.path.join(os.path.dirname(__file__), "..", "tcp_forwarder"))
+    parser.add_argument("--direct", action="store_true", help="no forwarder, sender straight to the sink")
+    parser.add_argument("--splice", action="store_true", help="enable sockmap_splice (needs root and BPF)")
+    parser.add_argument("--sessions", type=int, default=4)
+    parser.add_argument("--mb", type=int, default=2048, help="MiB in total, split over the sessions")
+    parser.add_argument("--threads", type=int, default=2, help="thread_pool.threads of the forwarder")
+    parser.add_argument("--buffer-size", type=int, default=65536)
+    parser.add_argument("--pattern", choices=("zero", "random"), default="random")
+    parser.add_argument("--timeout", type=int, default=300)
+    parser.add_argument("--count-allocs", action="store_true",
+                        help="count the forwarder's heap allocations with malloc_count.so (needs a C compiler)")
+    parser.add_argument("--seal", choices=("aes-256-gcm", "chacha20-poly1305"),
+                        help="two forwarders with encryption between them, reported per side")
+    parser.add_argument("--tls", choices=("user", "ktls"),
+                        help="two forwarders with TLS between them, records in user space or kTLS (needs the tls module)")
+    args = parser.parse_args(argv)
+    if args.seal and args.tls:
+        parser.error("--seal and --tls are exclusive")
+    args.binary = os.path.abspath(args.binary)
+    return args
+
+
+if __name__ == "__main__":
+    run(parse_args(sys.argv[1:]))
@@ -0,0 +1,216 @@
+#!/usr/bin/env python3
+"""FEC recovery of udp_forwarder over an emulated lossy link.
+
+Sends numbered datagrams through a client side udp_forwarder, a relay that
+drops a random fraction of them, and a server side udp_forwarder to a sink,
+and reports how many arrived. --parity 0 runs the same link without FEC,
+which is the loss FEC has to beat:
+
+    ./lossy_udp_bench.py ../udp_forwarder --loss 0.05               # data 8, parity 2
+    ./lossy_udp_bench.py ../udp_forwarder --loss 0.05 --parity 0    # no FEC
+    ./lossy_udp_bench.py ../udp_forwarder --loss 0.2 --data 20 --parity 6 --seed 7
+
+udp_forwarder reads config.yaml from its working directory, so each side
+runs in a directory of its own. The loss lives here and not in the
+forwarder, so a build under test carries no testing knobs.
+"""
+
+import argparse
+import json
+import os
+import random
+import select
+import shutil
+import signal
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import urllib.request
+
+
+def free_ports(count, kind=socket.SOCK_DGRAM):
+    """distinct ports, all held until each was picked"""
+    sockets = [socket.socket(socket.AF_INET, kind) for _ in range(count)]
+    for s in sockets:
+        s.bind(("127.0.0.1", 0))
+    ports = [s.getsockname()[1] for s in sockets]
+    for s in sockets:
+        s.close()
+    return ports
+
+
+class UdpForwarder:
+    """one udp_forwarder process in a directory with its generated config.yaml"""
+
+    def __init__(self, binary, workdir, name, listen_port, target_port, fec_side, args):
+        self.directory = os.path.join(workdir, name)
+        os.mkdir(self.directory)
+        self.log = os.path.join(self.directory, "forwarder.log")
+        self.control_port = free_ports(1, socket.SOCK_STREAM)[0]
+        config = {
+            "srcAddrPorts": ["127.0.0.1:%d" % listen_port],
+            "dstAddrPorts": ["127.0.0.1:%d" % target_port],
+            "timeout": 60,
+            "buffer_size": 2048,
+            "thread_pool": {"threads": 1},
+            "logging": {"enabled": True, "file": self.log, "level": "WARN"},
+            "control": {"enabled": True, "address": "127.0.0.1", "udp_port": self.control_port},
+        }
+        if args.parity > 0:
+            config["fec"] = {"data": args.data, "parity": args.parity, "flush_ms": args.flush_ms,
+                             "window": args.window, "sides": [fec_side]}
+        with open(os.path.join(self.directory, "config.yaml"), "w") as f:
+            json.dump(config, f)  # JSON is YAML
+        self.process = subprocess.Popen([binary], cwd=self.directory,
+                                        stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+
+    def stats(self):
+        deadline = time.time() + 5
+        while True:
+            try:
+                with urllib.request.urlopen("http://127.0.0.1:%d/stats" % self.control_port, timeout=2) as response:
+                    return json.loads(response.read())["proxies"][0]
+            except OSError:
+                if time.time() > deadline:
+                    raise
+                time.sleep(0.05)
+
+    def stop(self):
+        self.process.send_signal(signal.SIGKILL)
+        self.process.wait()
+
+
+class LossyRelay:
+    """passes datagrams between the two forwarders and drops `loss` of them in each direction"""
+
+    def __init__(self, listen_port, target_port, loss, seed):
+        self.socket = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.socket.bind(("127.0.0.1", listen_port))
+        self.target = ("127.0.0.1", target_port)
+        self.loss = loss
+        self.random = random.Random(seed)
+        self.passed = 0
+        self.dropped = 0
+        self.running = True
+        self.thread = threading.Thread(target=self.run, daemon=True)
+        self.thread.start()
+
+    def run(self):
+        client = None
+        while self.running:
+            if not select.select([self.socket], [], [], 0.1)[0]:
+                continue
+            data, source = self.socket.recvfrom(65536)
+            if source == self.target:
+                destination = client
+            else:
+                client, destination = source, self.target
+            if destination is None:
+                continue
+            if self.random.random() < self.loss:
+                self.dropped += 1
+                continue
+            self.passed += 1
+            self.socket.sendto(data, destination)
+
+    def stop(self):
+        self.running = False
+        self.thread.join()
+        self.socket.close()
+
+
+def run(args):
+    workdir = tempfile.mkdtemp(prefix="lossy_udp_bench.")
+    entry_port, relay_port, server_port, sink_port = free_ports(4)
+
+    sink = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sink.bind(("127.0.0.1", sink_port))
+    sink.settimeout(0.2)
+    relay = LossyRelay(relay_port, server_port, args.loss, args.seed)
+    client_side = UdpForwarder(args.binary, workdir, "client_side", entry_port, relay_port, "client", args)
+    server_side = UdpForwarder(args.binary, workdir, "server_side", server_port, sink_port, "server", args)
+    try:
+        client_side.stats()
+        server_side.stats()
+        for forwarder in (client_side, server_side):
+            if forwarder.process.poll() is not None:
+                raise RuntimeError("udp_forwarder exited, see " + forwarder.log)
+
+        seen = set()
+        duplicates = 0
+
+        def receive():
+            nonlocal duplicates
+            quiet_since = None
+            while True:
+                try:
+                    data = sink.recv(65536)
+                except socket.timeout:
+                    if sending.is_set():
+                        continue
+                    quiet_since = quiet_since or time.time()
+                    # a partial group gets its parity after flush_ms
+                    if time.time() - quiet_since > max(1.0, 3 * args.flush_ms / 1000):
+                        return
+                    continue
+                quiet_since = None
+                number = struct.unpack_from("!I", data)[0]
+                if number in seen:
+                    duplicates += 1
+                seen.add(number)
+
+        sending = threading.Event()
+        sending.set()
+        receiver = threading.Thread(target=receive)
+        receiver.start()
+
+        sender = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        padding = os.urandom(max(0, args.size - 4))
+        started = time.perf_counter()
+        for number in range(args.count):
+            sender.sendto(struct.pack("!I", number) + padding, ("127.0.0.1", entry_port))
+            # paced, so the loss on the link is the relay's and not the socket buffers'
+            pause = started + (number + 1) / args.rate - time.perf_counter()
+            if pause > 0:
+                time.sleep(pause)
+        sending.clear()
+        receiver.join()
+        fec = server_side.stats().get("fec")
+    finally:
+        relay.stop()
+        client_side.stop()
+        server_side.stop()
+        sink.close()
+
+    report = {"loss": args.loss, "fec": "%d+%d" % (args.data, args.parity) if args.parity > 0 else "off",
+              "sent": args.count, "delivered": len(seen), "delivered_fraction": round(len(seen) / args.count, 5),
+              "duplicates": duplicates, "relay": {"passed": relay.passed, "dropped": relay.dropped}}
+    if fec:
+        report["server_side_fec"] = {key: fec[key] for key in ("recovered", "lost_groups", "duplicates", "malformed")}
+    print(json.dumps(report, indent=2))
+    shutil.rmtree(workdir, ignore_errors=True)
+
+
+def parse_args(argv):
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("binary", nargs="?", default=os.path.join(os.path.dirname(__file__), "..", "udp_forwarder"))
+    parser.add_argument("--loss", type=float, default=0.05, help="fraction of datagrams the relay drops")
+    parser.add_argument("--data", type=int, default=8, help="fec.data of both sides")
+    parser.add_argument("--parity", type=int, default=2, help="fec.parity of both sides, 0 runs without FEC")
+    parser.add_argument("--flush-ms", type=int, default=20)
+    parser.add_argument("--window", type=int, default=32)
+    parser.add_argument("--count", type=int, default=20000, help="datagrams sent")
+    parser.add_argument("--size", type=int, default=1000, help="bytes per datagram")
+    parser.add_argument("--rate", type=int, default=20000, help="datagrams per second")
+    parser.add_argument("--seed", type=int, default=1, help="seed of the relay's drops")
+    args = parser.parse_args(argv)
+    args.binary = os.path.abspath(args.binary)
+    return args
+
+
+if __name__ == "__main__":
+    run(parse_args(sys.argv[1:]))
@@ -0,0 +1,260 @@
+// per-chunk cost of Session<Policy> against the copy loop Session ran before it
+// was templated, in one process over loopback.
+//
+//     g++ session_bench.cpp -o session_bench -std=c++17 -O2 -pthread -lboost_system -lyaml-cpp -lssl -lcrypto -lzstd -llz4 -lz
+//     ./session_bench                       # 256 MiB per run, 1 KiB chunks, 5 rounds
+//     ./session_bench 1024 65536 9          # MiB per run, buffer_size, rounds
+//
+// a writer thread pushes the data through one session to a sink thread; the
+// forwarding runs alone on an io_context thread, and its CPU time per MiB is
+// the cost compared. small chunks make the loop's own work show next to the
+// two syscalls each chunk costs. the variants run in alternation, so drift on
+// the machine hits all of them alike, and the median of the rounds is reported:
+//
+//   baseline  read_some, write, read_some again: the loop before SessionPolicy
+//   plain     Session<PlainPolicy>, what a listener without count_bytes or rate_limit gets
+//   counted   Session with count_bytes
+//   limited   Session with count_bytes and a rate_limit too high to ever pause
+
+#define main tcp_forwarder_main
+#include "../tcp_forwarder.cpp"
+#undef main
+
+#include <time.h>
+
+namespace
+{
+
+// the pre-SessionPolicy loop: each direction reads a chunk, writes it and reads again
+class BaselineCopy : public std::enable_shared_from_this<BaselineCopy>
+{
+public:
+    BaselineCopy(tcp::socket in_socket, tcp::socket out_socket, std::size_t buffer_size, Logger &logger)
+        : in_socket_(std::move(in_socket)),
+          out_socket_(std::move(out_socket)),
+          logger_(logger),
+          upstream_(in_socket_, out_socket_, buffer_size),
+          downstream_(out_socket_, in_socket_, buffer_size) {}
+
+    void start()
+    {
+        forward_data(upstream_, shared_from_this());
+        forward_data(downstream_, shared_from_this());
+    }
+
+private:
+    struct Direction
+    {
+        Direction(tcp::socket &src, tcp::socket &dst, std::size_t buffer_size)
+            : source(src), destination(dst), buffer(buffer_size) {}
+
+        tcp::socket &source;
+        tcp::socket &destination;
+        std::vector<char> buffer;
+        HandlerMemory memory;
+    };
+
+    void forward_data(Direction &dir, std::shared_ptr<BaselineCopy> self)
+    {
+        dir.source.async_read_some(boost::asio::buffer(dir.buffer), make_alloc_handler(dir.memory, [this, self = std::move(self), &dir](boost::system::error_code ec, std::size_t length) mutable
+                                                                                           {
+            if (ec)
+            {
+                clean_up();
+                return;
+            }
+            if (logger_.must_log(Logger::LogLevel::DEBUG))
+            {
+                logger_.debug("Data read from source. Length: " + std::to_string(length));
+            }
+            boost::asio::async_write(dir.destination, boost::asio::buffer(dir.buffer, length),
+                                     make_alloc_handler(dir.memory, [this, self = std::move(self), &dir](boost::system::error_code write_ec, std::size_t) mutable
+                                                        {
+                if (write_ec)
+                {
+                    clean_up();
+                    return;
+                }
+                if (logger_.must_log(Logger::LogLevel::TRACE))
+                {
+                    logger_.trace("Data forwarded successfully.");
+                }
+                forward_data(dir, std::move(self)); })); }));
+    }
+
+    void clean_up()
+    {
+        boost::system::error_code ec;
+        in_socket_.close(ec);
+        out_socket_.close(ec);
+    }
+
+    tcp::socket in_socket_;
+    tcp::socket out_socket_;
+    Logger &logger_;
+    Direction upstream_;
+    Direction downstream_;
+};
+
+enum class Variant
+{
+    baseline,
+    plain,
+    counted,
+    limited
+};
+
+const char *variant_name(Variant variant)
+{
+    switch (variant)
+    {
+    case Variant::baseline:
+        return "baseline";
+    case Variant::plain:
+        return "plain";
+    case Variant::counted:
+        return "counted";
+    default:
+        return "limited";
+    }
+}
+
+double thread_cpu_seconds()
+{
+    timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return static_cast<double>(now.tv_sec) + static_cast<double>(now.tv_nsec) / 1e9;
+}
+
+struct Result
+{
+    double seconds;
+    double cpu_seconds;
+};
+
+// one session carrying `bytes` upstream from a writer thread to a sink thread
+Result run(Variant variant, std::size_t bytes, std::size_t buffer_size, Logger &logger)
+{
+    boost::asio::io_context io_context;
+    auto loopback = boost::asio::ip::make_address("127.0.0.1");
+    tcp::acceptor front(io_context, tcp::endpoint(loopback, 0));
+    tcp::acceptor target(io_context, tcp::endpoint(loopback, 0));
+
+    std::atomic<std::size_t> received{0};
+    std::thread sink([&]()
+                     {
+        tcp::socket socket(io_context);
+        target.accept(socket);
+        std::vector<char> buffer(1 << 20);
+        boost::system::error_code ec;
+        while (!ec)
+            received += socket.read_some(boost::asio::buffer(buffer), ec); });
+
+    auto started = std::chrono::steady_clock::now();
+    std::thread writer([&]()
+                       {
+        tcp::socket socket(io_context);
+        socket.connect(front.local_endpoint());
+        std::vector<char> chunk(1 << 16, 'x');
+        for (std::size_t sent = 0; sent < bytes;)
+            sent += boost::asio::write(socket, boost::asio::buffer(chunk, std::min(chunk.size(), bytes - sent)));
+        socket.shutdown(tcp::socket::shutdown_send); });
+
+    tcp::socket in_socket(io_context);
+    front.accept(in_socket);
+
+    auto options = std::make_shared<ListenerOptions>();
+    options->name = "bench";
+    options->target = std::make_shared<ResolvedTarget>("127.0.0.1");
+    options->target->update({loopback});
+    options->target_port = target.local_endpoint().port();
+    options->buffer_size = buffer_size;
+    options->retry_attempts = 1;
+    options->count_bytes = variant != Variant::plain;
+    options->rate_limit = variant == Variant::limited ? std::size_t(1) << 50 : 0;
+    CaptureRing capture(1 << 16, 256);
+    options->capture = &capture;
+    AdmissionControl admission(io_context, 16, 0, 10, logger);
+
+    if (variant == Variant::baseline)
+    {
+        tcp::socket out_socket(io_context);
+        out_socket.connect(target.local_endpoint());
+        std::make_shared<BaselineCopy>(std::move(in_socket), std::move(out_socket), buffer_size, logger)->start();
+    }
+    else if (variant == Variant::plain)
+    {
+        admission.admit(std::move(in_socket), options, &start_session<PlainPolicy>);
+    }
+    else if (variant == Variant::counted)
+    {
+        admission.admit(std::move(in_socket), options, &start_session<SessionPolicy<false, RecordLayer::plain, true, false>>);
+    }
+    else
+    {
+        admission.admit(std::move(in_socket), options, &start_session<SessionPolicy<false, RecordLayer::plain, true, true>>);
+    }
+
+    double cpu_before = thread_cpu_seconds();
+    io_context.run();
+    double cpu = thread_cpu_seconds() - cpu_before;
+    writer.join();
+    sink.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    if (received != bytes)
+        throw std::runtime_error(std::string(variant_name(variant)) + " delivered " + std::to_string(received) + " of " + std::to_string(bytes) + " bytes");
+    return Result{seconds, cpu};
+}
+
+double median(std::vector<double> values)
+{
+    std::sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    std::size_t mib = argc > 1 ? std::stoul(argv[1]) : 256;
+    std::size_t buffer_size = argc > 2 ? std::stoul(argv[2]) : 1024;
+    int rounds = argc > 3 ? std::stoi(argv[3]) : 5;
+    std::size_t bytes = mib << 20;
+
+    Logger logger(false, "", "WARN");
+    const Variant variants[] = {Variant::baseline, Variant::plain, Variant::counted, Variant::limited};
+    std::map<Variant, std::vector<double>> cpu_per_mib;
+    std::map<Variant, std::vector<double>> mib_per_second;
+    try
+    {
+        for (int round = 0; round < rounds; ++round)
+        {
+            for (Variant variant : variants)
+            {
+                Result result = run(variant, bytes, buffer_size, logger);
+                cpu_per_mib[variant].push_back(result.cpu_seconds * 1e6 / static_cast<double>(mib));
+                mib_per_second[variant].push_back(static_cast<double>(mib) / result.seconds);
+            }
+        }
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "session_bench: " << e.what() << std::endl;
+        return 1;
+    }
+
+    double baseline = median(cpu_per_mib[Variant::baseline]);
+    std::cout << mib << " MiB per run, buffer_size " << buffer_size << ", median of " << rounds << " rounds\n";
+    std::cout << std::left << std::setw(10) << "variant" << std::right << std::setw(16) << "cpu us/MiB" << std::setw(14) << "vs baseline"
+              << std::setw(12) << "MiB/s" << "\n";
+    for (Variant variant : variants)
+    {
+        double cpu = median(cpu_per_mib[variant]);
+        std::ostringstream delta;
+        delta << std::showpos << std::fixed << std::setprecision(1) << (cpu / baseline - 1) * 100 << "%";
+        std::cout << std::left << std::setw(10) << variant_name(variant) << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(16) << cpu << std::setw(14) << delta.str() << std::setw(12) << std::setprecision(0)
+                  << median(mib_per_second[variant]) << "\n";
+    }
+    return 0;
+}
@@ -124,7 +124,7 @@ function install_stuff() {
     sudo apt-get update -y
 
     print_info "Installing required stuff..."
-    sudo apt-get install -y g++ libboost-all-dev libyaml-cpp-dev python3 python3-venv python3-pip net-tools iptables-persistent
+    sudo apt-get install -y g++ libboost-all-dev libyaml-cpp-dev libssl-dev libzstd-dev liblz4-dev zlib1g-dev python3 python3-venv python3-pip net-tools iptables-persistent
     print_success "Packages installed successfully."
 }
 
@@ -163,7 +163,7 @@ function install_python_stuff() {
 function compile_tcp_forwarder() {
     if [ ! -f "tcp_forwarder" ] || [ main.cpp -nt tcp_forwarder ]; then
         print_info "Compiling the TCP forwarder..."
-        g++ tcp_forwarder.cpp -o tcp_forwarder -lboost_system -lyaml-cpp -pthread
+        g++ tcp_forwarder.cpp -o tcp_forwarder -lboost_system -lyaml-cpp -lssl -lcrypto -lzstd -llz4 -lz -pthread
         if [ $? -eq 0 ]; then
             print_success "TCP forwarder compiled successfully."
         else
@@ -178,7 +178,7 @@ function compile_tcp_forwarder() {
 function compile_udp_forwarder() {
     if [ ! -f "udp_forwarder" ] || [ main.cpp -nt udp_forwarder ]; then
         print_info "Compiling the UDP forwarder..."
-        g++ udp_forwarder.cpp -o udp_forwarder -lboost_system -lyaml-cpp -pthread
+        g++ udp_forwarder.cpp -o udp_forwarder -lboost_system -lyaml-cpp -lcrypto -pthread
         if [ $? -eq 0 ]; then
             print_success "UDP forwarder compiled successfully."
         else
@@ -192,10 +192,18 @@ function compile_udp_forwarder() {
 
 function kill_forwarder() {
     print_info "Checking for existing forwarder processes..."
-    existing_pid=$(pgrep -f "tcp_forwarder|udp_forwarder")
+    # prefork workers are left to their supervisor, which forwards the signal once
+    existing_pid=$(for pid in $(pgrep -f "tcp_forwarder|udp_forwarder"); do
+        [ "$(ps -o comm= -p "$(ps -o ppid= -p "$pid" | tr -d " ")")" = "tcp_forwarder" ] || echo "$pid"
+    done)
     if [ -n "$existing_pid" ]; then
-        print_warning "Existing forwarder process found (PID: $existing_pid). Killing it..."
-        kill -9 "$existing_pid"
+        print_warning "Existing forwarder process found (PID: $existing_pid). Stopping it, letting its sessions drain..."
+        kill -TERM $existing_pid 2>/dev/null
+        for _ in $(seq 1 40); do
+            kill -0 $existing_pid 2>/dev/null || break
+            sleep 1
+        done
+        kill -9 $existing_pid 2>/dev/null
         print_success "Existing forwarder process terminated."
     else
         print_info "No existing forwarder process found."
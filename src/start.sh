@@ -76,3 +76,20 @@ sudo systemctl daemon-reload
 sudo systemctl enable tcp_forwarder.service
 
 sudo systemctl start tcp_forwarder.service
+
+
+socket activation, so connections queue in the kernel while the forwarder restarts:
+tcp_forwarder.socket, one ListenStream= per listen_address:listen_port in config.yaml
+(udp_forwarder takes ListenDatagram= the same way, matched against srcAddrPorts)
+[Socket]
+ListenStream=0.0.0.0:8080
+ListenStream=0.0.0.0:8081
+
+[Install]
+WantedBy=sockets.target
+
+the matching tcp_forwarder.service must start the binary itself, not a script, so that
+LISTEN_PID is the forwarder's own pid:
+ExecStart=/path/to/your/script/directory/tcp_forwarder /path/to/your/script/directory/config.yaml
+
+sudo systemctl enable --now tcp_forwarder.socket
@@ -1,12 +1,14 @@
 #include <iostream>
 #include <fstream>
 #include <memory>
+#include <optional>
 #include <vector>
 #include <iomanip>
 #include <ctime>
 #include <atomic>
 #include <mutex>
 #include <queue>
+#include <deque>
 #include <condition_variable>
 #include <boost/asio.hpp>
 #include <boost/asio/ip/tcp.hpp>
@@ -14,9 +16,403 @@
 #include <yaml-cpp/yaml.h>
 #include <sstream>
 #include <unordered_map>
+#include <map>
+#include <functional>
+#include <cstring>
+#include <string_view>
+#include <strings.h>
+#include <cerrno>
+#include <thread>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <csignal>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <linux/sockios.h>
+#include <linux/bpf.h>
+#include <netdb.h>
+#include <resolv.h>
+#include <arpa/nameser.h>
+#include <sys/auxv.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <zstd.h>
+#include <lz4.h>
+#include <zlib.h>
 
 using boost::asio::ip::tcp;
 
+// rotation settings of the log file, and of the access log next to it
+struct RotationOptions
+{
+    std::size_t max_bytes = 0; // rotate once the active file reaches this size, 0 = never
+    int max_seconds = 0;       // rotate once the active file is this old, 0 = never
+    int keep = 10;             // rotated segments kept, older ones are deleted
+    bool compress = true;      // gzip segments in the background, one member per block
+
+    bool enabled() const { return max_bytes > 0 || max_seconds > 0; }
+};
+
+// where a reader can start inside a segment: the time the block's first line was
+// written, and its offset in the raw file and in the stored one
+struct LogBlock
+{
+    std::time_t time; // 0 for lines written before this process opened the file
+    uint64_t raw_offset;
+    uint64_t stored_offset;
+};
+
+struct LogSegment
+{
+    std::string path; // <file>.<seq>, or <file>.<seq>.gz once compressed
+    uint64_t seq = 0;
+    std::time_t first = 0;
+    std::time_t last = 0;
+    uint64_t bytes = 0; // uncompressed
+    std::vector<LogBlock> blocks;
+};
+
+// compresses rotated segments, prunes old ones and keeps <file>.idx, all on its own
+// thread so the log writer only ever renames a file. the index is plain text that is
+// replaced atomically, one "segment <seq> <first> <last> <bytes> <name>" line per
+// segment, oldest first, each followed by its "block <time> <raw> <stored>" lines.
+class LogArchiver
+{
+public:
+    explicit LogArchiver(const RotationOptions &options) : options_(options)
+    {
+        thread_ = std::thread(&LogArchiver::run, this);
+    }
+
+    ~LogArchiver()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        if (thread_.joinable())
+        {
+            thread_.join();
+        }
+    }
+
+    const RotationOptions &options() const { return options_; }
+
+    // loads an existing index so numbering and pruning carry on across restarts.
+    // returns the next free segment number.
+    uint64_t attach(const std::string &base)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::deque<LogSegment> &segments = segments_[base];
+        std::ifstream index(base + ".idx");
+        std::string line;
+        while (std::getline(index, line))
+        {
+            std::istringstream fields(line);
+            std::string kind;
+            fields >> kind;
+            if (kind == "segment")
+            {
+                LogSegment segment;
+                std::string name;
+                fields >> segment.seq >> segment.first >> segment.last >> segment.bytes >> name;
+                segment.path = directory_of(base) + name;
+                segments.push_back(std::move(segment));
+            }
+            else if (kind == "block" && !segments.empty())
+            {
+                LogBlock block{};
+                fields >> block.time >> block.raw_offset >> block.stored_offset;
+                segments.back().blocks.push_back(block);
+            }
+        }
+        uint64_t seq = segments.empty() ? 1 : segments.back().seq + 1;
+        // segments rotated but not yet indexed when the last process stopped
+        while (::access(segment_path(base, seq).c_str(), F_OK) == 0 || ::access((segment_path(base, seq) + ".gz").c_str(), F_OK) == 0)
+        {
+            ++seq;
+        }
+        return seq;
+    }
+
+    void submit(const std::string &base, LogSegment segment)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_.emplace_back(base, std::move(segment));
+        }
+        cv_.notify_one();
+    }
+
+    static std::string segment_path(const std::string &base, uint64_t seq)
+    {
+        char suffix[24];
+        snprintf(suffix, sizeof(suffix), ".%06llu", static_cast<unsigned long long>(seq));
+        return base + suffix;
+    }
+
+private:
+    void run()
+    {
+        while (true)
+        {
+            std::pair<std::string, LogSegment> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this]()
+                         { return !pending_.empty() || stop_; });
+                if (pending_.empty())
+                    break;
+                job = std::move(pending_.front());
+                pending_.pop_front();
+            }
+
+            if (options_.compress)
+            {
+                compress(job.second);
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            std::deque<LogSegment> &segments = segments_[job.first];
+            segments.push_back(std::move(job.second));
+            while (segments.size() > static_cast<std::size_t>(std::max(options_.keep, 0)))
+            {
+                unlink(segments.front().path.c_str());
+                segments.pop_front();
+            }
+            // segments deleted from outside, e.g. by clearing the logs
+            segments.erase(std::remove_if(segments.begin(), segments.end(), [](const LogSegment &segment)
+                                          { return ::access(segment.path.c_str(), F_OK) != 0; }),
+                           segments.end());
+            write_index(job.first, segments);
+        }
+    }
+
+    // one gzip member per block, so a reader can start decompressing at any block
+    void compress(LogSegment &segment)
+    {
+        int in = open(segment.path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (in < 0)
+            return;
+        std::string stored = segment.path + ".gz";
+        std::string partial = stored + ".tmp";
+        std::ofstream out(partial, std::ios::binary | std::ios::trunc);
+        std::vector<LogBlock> blocks = segment.blocks;
+        if (blocks.empty())
+        {
+            blocks.push_back({segment.first, 0, 0});
+        }
+
+        z_stream zs{};
+        bool ok = out && deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+        std::vector<unsigned char> raw;
+        std::vector<unsigned char> packed;
+        uint64_t written = 0;
+        for (std::size_t i = 0; ok && i < blocks.size(); ++i)
+        {
+            uint64_t end = i + 1 < blocks.size() ? blocks[i + 1].raw_offset : segment.bytes;
+            raw.resize(end - blocks[i].raw_offset);
+            ok = pread(in, raw.data(), raw.size(), static_cast<off_t>(blocks[i].raw_offset)) == static_cast<ssize_t>(raw.size());
+            if (!ok)
+                break;
+            packed.resize(deflateBound(&zs, raw.size()) + 32);
+            deflateReset(&zs);
+            zs.next_in = raw.data();
+            zs.avail_in = static_cast<uInt>(raw.size());
+            zs.next_out = packed.data();
+            zs.avail_out = static_cast<uInt>(packed.size());
+            ok = deflate(&zs, Z_FINISH) == Z_STREAM_END;
+            std::size_t length = packed.size() - zs.avail_out;
+            blocks[i].stored_offset = written;
+            out.write(reinterpret_cast<const char *>(packed.data()), static_cast<std::streamsize>(length));
+            written += length;
+        }
+        deflateEnd(&zs);
+        close(in);
+        out.close();
+
+        if (ok && out && rename(partial.c_str(), stored.c_str()) == 0)
+        {
+            unlink(segment.path.c_str());
+            segment.path = stored;
+            segment.blocks = std::move(blocks);
+        }
+        else
+        {
+            std::cerr << "compressing log segment failed: " << segment.path << std::endl;
+            unlink(partial.c_str());
+        }
+    }
+
+    static void write_index(const std::string &base, const std::deque<LogSegment> &segments)
+    {
+        std::string partial = base + ".idx.tmp";
+        {
+            std::ofstream index(partial, std::ios::trunc);
+            for (const LogSegment &segment : segments)
+            {
+                index << "segment " << segment.seq << " " << segment.first << " " << segment.last << " " << segment.bytes << " "
+                      << segment.path.substr(segment.path.find_last_of('/') + 1) << "\n";
+                for (const LogBlock &block : segment.blocks)
+                {
+                    index << "block " << block.time << " " << block.raw_offset << " " << block.stored_offset << "\n";
+                }
+            }
+        }
+        rename(partial.c_str(), (base + ".idx").c_str());
+    }
+
+    static std::string directory_of(const std::string &path)
+    {
+        std::size_t slash = path.find_last_of('/');
+        return slash == std::string::npos ? "" : path.substr(0, slash + 1);
+    }
+
+    RotationOptions options_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stop_ = false;
+    std::deque<std::pair<std::string, LogSegment>> pending_;
+    std::map<std::string, std::deque<LogSegment>> segments_;
+    std::thread thread_;
+};
+
+// a log file written only by the logger's worker thread. each batch goes out in
+// one write; with rotation on, the file is renamed to the next segment once it is
+// big or old enough, and blocks of about block_bytes are noted for the index.
+class LogFile
+{
+public:
+    ~LogFile()
+    {
+        if (fd_ >= 0)
+            close(fd_);
+    }
+
+    bool open(const std::string &path, LogArchiver *archiver)
+    {
+        path_ = path;
+        fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd_ < 0)
+            return false;
+        archiver_ = archiver;
+        if (archiver_)
+        {
+            seq_ = archiver_->attach(path_);
+            opened_ = std::time(nullptr);
+            if (lseek(fd_, 0, SEEK_END) > 0)
+            {
+                blocks_.push_back({0, 0, 0});
+            }
+        }
+        return true;
+    }
+
+    void write(const std::vector<std::string> &batch)
+    {
+        if (fd_ < 0 || batch.empty())
+            return;
+
+        std::time_t now = std::time(nullptr);
+        uint64_t size = 0;
+        if (archiver_)
+        {
+            off_t end = lseek(fd_, 0, SEEK_END);
+            size = end > 0 ? static_cast<uint64_t>(end) : 0;
+            if (!blocks_.empty() && size < blocks_.back().raw_offset)
+            {
+                // truncated from outside
+                blocks_.clear();
+            }
+            const RotationOptions &rotation = archiver_->options();
+            if (size > 0 && ((rotation.max_bytes > 0 && size >= rotation.max_bytes) ||
+                             (rotation.max_seconds > 0 && now - opened_ >= rotation.max_seconds)))
+            {
+                rotate(size, now);
+                size = 0;
+            }
+        }
+
+        std::string out;
+        for (const std::string &entry : batch)
+        {
+            if (archiver_ && (blocks_.empty() || size + out.size() - blocks_.back().raw_offset >= block_bytes))
+            {
+                blocks_.push_back({now, size + out.size(), 0});
+            }
+            out += entry;
+        }
+        last_write_ = now;
+
+        const char *data = out.data();
+        std::size_t left = out.size();
+        while (left > 0)
+        {
+            ssize_t n = ::write(fd_, data, left);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+            {
+                std::cerr << "Logging error: " << strerror(errno) << std::endl;
+                return;
+            }
+            data += n;
+            left -= static_cast<std::size_t>(n);
+        }
+    }
+
+private:
+    void rotate(uint64_t size, std::time_t now)
+    {
+        LogSegment segment;
+        segment.seq = seq_;
+        segment.path = LogArchiver::segment_path(path_, seq_);
+        segment.first = blocks_.empty() ? last_write_ : blocks_.front().time;
+        segment.last = last_write_ ? last_write_ : now;
+        segment.bytes = size;
+        segment.blocks = std::move(blocks_);
+        blocks_.clear();
+
+        if (rename(path_.c_str(), segment.path.c_str()) != 0)
+        {
+            std::cerr << "rotating log file failed: " << path_ << ": " << strerror(errno) << std::endl;
+            return;
+        }
+        int fd = ::open(path_.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd >= 0)
+        {
+            close(fd_);
+            fd_ = fd;
+        }
+        ++seq_;
+        opened_ = now;
+        archiver_->submit(path_, std::move(segment));
+    }
+
+    std::string path_;
+    int fd_ = -1;
+    LogArchiver *archiver_ = nullptr; // null unless rotating
+    uint64_t seq_ = 1;
+    std::time_t opened_ = 0;
+    std::time_t last_write_ = 0;
+    std::vector<LogBlock> blocks_; // of the active file
+    static constexpr uint64_t block_bytes = 65536;
+};
+
 class Logger
 {
 public:
@@ -30,26 +426,16 @@ public:
         ALL
     };
 
-    Logger(bool enabled, const std::string &file, const std::string &level)
-        : enabled_(enabled), stop_worker_(false)
+    Logger(bool enabled, const std::string &file, const std::string &level, const RotationOptions &rotation = RotationOptions())
+        : enabled_(enabled), stop_worker_(false), log_level_(parse_level(level))
     {
-        if (level == "TRACE")
-            log_level_ = LogLevel::TRACE;
-        else if (level == "DEBUG")
-            log_level_ = LogLevel::DEBUG;
-        else if (level == "INFO")
-            log_level_ = LogLevel::INFO;
-        else if (level == "WARN")
-            log_level_ = LogLevel::WARN;
-        else if (level == "ERROR")
-            log_level_ = LogLevel::ERROR;
-        else
-            log_level_ = LogLevel::ALL;
-
+        if (rotation.enabled())
+        {
+            archiver_ = std::make_unique<LogArchiver>(rotation);
+        }
         if (enabled_)
         {
-            logfile_.open(file, std::ios::app);
-            if (!logfile_)
+            if (!logfile_.open(file, archiver_.get()))
             {
                 std::cerr << "opennig log file failed: " << file << std::endl;
                 enabled_ = false;
@@ -64,28 +450,45 @@ public:
 
     ~Logger()
     {
-        if (enabled_)
         {
-            {
-                std::lock_guard<std::mutex> lock(queue_mutex_);
-                stop_worker_ = true;
-                queue_cv_.notify_all();
-            }
-            if (worker_thread_.joinable())
-            {
-                worker_thread_.join();
-            }
+            std::lock_guard<std::mutex> lock(queue_mutex_);
+            stop_worker_ = true;
+            queue_cv_.notify_all();
+        }
+        if (worker_thread_.joinable())
+        {
+            worker_thread_.join();
+        }
+    }
 
-            if (logfile_.is_open())
-            {
-                logfile_.close();
-            }
+    // second sink for per-session records, written and rotated by the same worker.
+    // works with logging disabled; must be opened before any thread logs.
+    bool open_access(const std::string &file)
+    {
+        if (!access_file_.open(file, archiver_.get()))
+        {
+            std::cerr << "opennig access log file failed: " << file << std::endl;
+            return false;
+        }
+        if (!worker_thread_.joinable())
+        {
+            worker_thread_ = std::thread(&Logger::process_queue, this);
         }
+        return true;
+    }
+
+    void access(std::string record)
+    {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex_);
+            access_queue_.push_back(std::move(record));
+        }
+        queue_cv_.notify_one();
     }
 
     void log(const std::string &level, const std::string &message, LogLevel msg_level)
     {
-        if (enabled_ && must_log(msg_level))
+        if (must_log(msg_level))
         {
             std::time_t now = std::time(nullptr);
             std::tm *ltm = std::localtime(&now);
@@ -96,7 +499,7 @@ public:
 
             {
                 std::lock_guard<std::mutex> lock(queue_mutex_);
-                log_queue_.emplace(log_entry.str());
+                log_queue_.push_back(log_entry.str());
             }
             queue_cv_.notify_one();
         }
@@ -108,47 +511,84 @@ public:
     void warn(const std::string &message) { log("WARN", message, LogLevel::WARN); }
     void error(const std::string &message) { log("ERROR", message, LogLevel::ERROR); }
 
-private:
-    bool must_log(LogLevel msg_level)
+    static LogLevel parse_level(const std::string &level)
+    {
+        if (level == "TRACE")
+            return LogLevel::TRACE;
+        else if (level == "DEBUG")
+            return LogLevel::DEBUG;
+        else if (level == "INFO")
+            return LogLevel::INFO;
+        else if (level == "WARN")
+            return LogLevel::WARN;
+        else if (level == "ERROR")
+            return LogLevel::ERROR;
+        else
+            return LogLevel::ALL;
+    }
+
+    LogLevel level() const { return log_level_; }
+
+    // the level that logs less of the two; ALL logs everything
+    static LogLevel stricter(LogLevel a, LogLevel b)
     {
-        return log_level_ <= msg_level || log_level_ == LogLevel::ALL;
+        if (a == LogLevel::ALL)
+            return b;
+        if (b == LogLevel::ALL)
+            return a;
+        return std::max(a, b);
     }
 
+    // load shedding raises the threshold while the event loop lags
+    void set_level(LogLevel level) { log_level_ = level; }
+
+    // lets hot paths skip building messages that would be dropped anyway
+    bool must_log(LogLevel msg_level) const
+    {
+        return enabled_ && (log_level_ <= msg_level || log_level_ == LogLevel::ALL);
+    }
+
+private:
+
+    // takes whatever queued up as one batch, so writing and the single flush per
+    // batch happen without the lock that the logging threads contend on
     void process_queue()
     {
+        std::vector<std::string> lines;
+        std::vector<std::string> records;
         while (true)
         {
-            std::unique_lock<std::mutex> lock(queue_mutex_);
-            queue_cv_.wait(lock, [this]()
-                           { return !log_queue_.empty() || stop_worker_; });
-
-            while (!log_queue_.empty())
+            bool stopping;
             {
-                try
-                {
-                    logfile_ << log_queue_.front();
-                    logfile_.flush();
-                }
-                catch (const std::exception &e)
-                {
-                    std::cerr << "Logging error: " << e.what() << std::endl;
-                }
-                log_queue_.pop();
+                std::unique_lock<std::mutex> lock(queue_mutex_);
+                queue_cv_.wait(lock, [this]()
+                               { return !log_queue_.empty() || !access_queue_.empty() || stop_worker_; });
+                lines.swap(log_queue_);
+                records.swap(access_queue_);
+                stopping = stop_worker_;
             }
 
-            if (stop_worker_)
+            logfile_.write(lines);
+            access_file_.write(records);
+            lines.clear();
+            records.clear();
+
+            if (stopping)
                 break;
         }
     }
 
     bool enabled_;
-    std::ofstream logfile_;
+    std::unique_ptr<LogArchiver> archiver_; // outlives the files, which hand it segments
+    LogFile logfile_;
+    LogFile access_file_;
     std::mutex queue_mutex_;
-    std::queue<std::string> log_queue_;
+    std::vector<std::string> log_queue_;
+    std::vector<std::string> access_queue_;
     std::condition_variable queue_cv_;
     std::thread worker_thread_;
     std::atomic<bool> stop_worker_;
-    LogLevel log_level_;
+    std::atomic<LogLevel> log_level_;
 };
 
 void help()
@@ -189,9 +629,35 @@ void help()
     std::cout << "    - A list of forwarder configurations. Each forwarder must include:\n";
     std::cout << "      * " << green << "listen_address" << reset << ": The address to listen on.\n";
     std::cout << "      * " << green << "listen_port" << reset << ": The port to listen on.\n";
-    std::cout << "      * " << green << "target_address" << reset << ": The address to forward traffic to.\n";
+    std::cout << "      * " << green << "target_address" << reset << ": The address or hostname to forward traffic to. Hostnames are resolved in the background and every A/AAAA record is used.\n";
     std::cout << "      * " << green << "target_port" << reset << ": The port to forward traffic to.\n";
-    std::cout << "      * " << green << "port_range" << reset << " (optional): Specify a start and end port for forwarding a range of ports.\n\n";
+    std::cout << "      * " << green << "port_range" << reset << " (optional): Specify a start and end port for forwarding a range of ports.\n";
+    std::cout << "      * " << green << "source_addresses" << reset << " (optional): Local IPs to spread upstream connects over. Each one gets its own ephemeral port space.\n";
+    std::cout << "      * " << green << "rate_limit" << reset << " (optional): Bytes per second per direction of each session. Default: unlimited.\n";
+    std::cout << "      * " << green << "proxy_protocol" << reset << " (optional): Send a PROXY protocol header (1 or 2) to the target before any data.\n";
+    std::cout << "      * " << green << "count_bytes" << reset << " (optional): Keep per-listener byte counters for /stats. Default: control.enabled.\n";
+    std::cout << "      * " << green << "mux" << reset << " (optional): Carry connections between two forwarders as streams over a few persistent links.\n";
+    std::cout << "        role: client on the near side (target is the peer's mux listener), server on the far side (target is the real backend).\n";
+    std::cout << "        connections: links the client keeps open (default 2). window: receive window per stream in bytes (default 262144).\n";
+    std::cout << "        keepalive: seconds between pings (default 10). timeout: seconds of silence, or without a hello, before a link is dropped (default 30).\n";
+    std::cout << "      * " << green << "encryption" << reset << " (optional): Authenticated encryption between two forwarders, same 64 hex digit key on both.\n";
+    std::cout << "        side: client where the target is the paired forwarder, server where its connections arrive. cipher: auto, aes-256-gcm or chacha20-poly1305.\n";
+    std::cout << "      * " << green << "tls" << reset << " (optional): TLS 1.3 between two forwarders, each direction handed to the kernel (kTLS) where it takes it.\n";
+    std::cout << "        side: client or server as for encryption. certificate, private_key: PEM files (required on the server). ca: verify the peer.\n";
+    std::cout << "        server_name: SNI and name to verify on the client. ktls: false keeps all records in user space (default true).\n";
+    std::cout << "      * " << green << "compression" << reset << " (optional): Compress the link between two forwarders, side as for encryption.\n";
+    std::cout << "        algorithm: zstd (default) or lz4. level: zstd level (default 1). bypass: send incompressible data as is (default true).\n";
+    std::cout << "        With tls it needs kTLS: ktls: false is refused at load, a session the kernel refuses is closed. Compressed then\n";
+    std::cout << "        encrypted lengths leak how alike the data is (CRIME); avoid it where secrets share a session with untrusted input.\n";
+    std::cout << "      * " << green << "routing" << reset << " (optional): Share the listen port between targets, picked from the client's first bytes.\n";
+    std::cout << "        rules: first match wins; each has sni (TLS), host (HTTP) or protocol (tls, http, ssh), plus target_address and target_port.\n";
+    std::cout << "        \"*.example.com\" matches names below example.com. Unmatched sessions go to the forwarder's target.\n";
+    std::cout << "        peek_timeout_ms: how long to wait for the first bytes, e.g. of server-first protocols (default 1000).\n";
+    std::cout << "      * " << green << "mirror" << reset << " (optional): Copy sessions to a shadow target_address/target_port; its responses are discarded.\n";
+    std::cout << "        directions: upstream (default) or both, downstream over a second connection. queue_bytes: per direction of\n";
+    std::cout << "        a session (default 1048576); a copy that falls behind further is cut, the session itself never waits.\n";
+    std::cout << "        Mirror pipes grow to queue_bytes within half of fs.pipe-user-pages-soft, beyond it they keep 64 KiB.\n";
+    std::cout << "        A mirrored session holds up to 7 more file descriptors (10 with both); raise the open file limit to match.\n\n";
 
     std::cout << bold << "  buffer_size: " << reset << "(Optional) Size of the buffer in bytes for data forwarding. Default: 8192.\n";
     std::cout << bold << "  tcp_no_delay: " << reset << "(Optional) Boolean to disable Nagle's algorithm (for low latency). Default: true.\n";
@@ -199,6 +665,11 @@ void help()
     std::cout << bold << "  retry_delay: " << reset << "(Optional) Delay between retry attempts, in seconds. Default: 2.\n";
     std::cout << bold << "  max_connections: " << reset << "(Optional) Maximum number of simultaneous connections. Default: 100.\n\n";
 
+    std::cout << bold << "  admission_queue:\n"
+              << reset;
+    std::cout << "    - " << green << "size" << reset << ": (Optional) Connections that may wait for a free slot once max_connections is reached; 0 rejects them at once. Default: max_connections.\n";
+    std::cout << "    - " << green << "timeout" << reset << ": (Optional) Seconds a queued connection waits before it is closed. Default: 10.\n\n";
+
     std::cout << bold << "  thread_pool:\n"
               << reset;
     std::cout << "    - " << green << "threads" << reset << ": Number of threads to handle connections. Recommended: At least the number of CPU cores.\n\n";
@@ -206,13 +677,92 @@ void help()
     std::cout << bold << "  logging:\n"
               << reset;
     std::cout << "    - " << green << "enabled" << reset << ": Boolean to enable or disable logging.\n";
-    std::cout << "    - " << green << "file" << reset << ": The file name for saving log output.\n\n";
+    std::cout << "    - " << green << "file" << reset << ": The file name for saving log output.\n";
+    std::cout << "    - " << green << "rotate" << reset << ": (Optional) max_bytes and/or max_seconds start a new file once the current one is that big or old;\n";
+    std::cout << "      the old one becomes file.000001, file.000002, ... and keep (default 10) of them are kept. With compress (default true)\n";
+    std::cout << "      they are gzipped in the background, one member per 64 KiB block. file.idx lists the segments, their time span and\n";
+    std::cout << "      block offsets, so readers can seek to the last lines or a time range. Applies to the access log too.\n\n";
+
+    std::cout << bold << "  access_log:\n"
+              << reset;
+    std::cout << "    - " << green << "enabled" << reset << ": (Optional) Write one record per session as it closes: client, target, connect and total time, bytes each way and close reason. Default: false.\n";
+    std::cout << "    - " << green << "file" << reset << ": File the records are appended to, in batches by the logging thread. Works with logging disabled.\n";
+    std::cout << "    - " << green << "format" << reset << ": (Optional) json for one JSON object per line, or binary for length-prefixed little-endian records. Default: json.\n";
+    std::cout << "    - " << green << "sample" << reset << ": (Optional) Fraction of sessions that closed normally to record; failed sessions are always recorded. Default: 1.0.\n";
+    std::cout << "      With the access log on, per-session INFO lines (accept, nodelay, keepalive, connect, EOF, cleanup) drop to DEBUG.\n\n";
 
     std::cout << bold << "  health_check:\n"
               << reset;
     std::cout << "    - " << green << "enabled" << reset << ": Boolean to enable or disable health checks.\n";
     std::cout << "    - " << green << "interval" << reset << ": Interval in seconds between health checks.\n\n";
 
+    std::cout << bold << "  control:\n"
+              << reset;
+    std::cout << "    - " << green << "enabled" << reset << ": (Optional) Serve JSON stats over HTTP on GET /stats. Default: false.\n";
+    std::cout << "    - " << green << "address" << reset << ": (Optional) Address of the control server. Default: 127.0.0.1.\n";
+    std::cout << "    - " << green << "tcp_port" << reset << ": (Optional) Port of the TCP forwarder's control server. Default: 9100.\n";
+    std::cout << "    - " << green << "stream_interval_ms" << reset << ": (Optional) Period of GET /stream, a Server-Sent Events stream of counters: a snapshot,\n";
+    std::cout << "      then only the counters that changed, as differences. ?interval_ms= overrides it per subscriber. Default: 1000.\n";
+    std::cout << "    - GET /capture/start?listener=ip:port, ?client=ip or ?session=id records that traffic's payload; GET /capture/stop ends it,\n";
+    std::cout << "      GET /capture/dump returns the recording as pcapng and GET /capture its state. Session ids are in the INFO log.\n\n";
+
+    std::cout << bold << "  shutdown:\n"
+              << reset;
+    std::cout << "    - " << green << "drain_timeout" << reset << ": (Optional) On SIGTERM or SIGINT the listeners close and open sessions get this many seconds\n";
+    std::cout << "      to finish before they are closed; /stats shows the drain. A second signal exits at once. Default: 30.\n\n";
+
+    std::cout << bold << "  prefork:\n"
+              << reset;
+    std::cout << "    - " << green << "workers" << reset << ": (Optional) Run a supervisor that binds every listener once per worker with SO_REUSEPORT and\n";
+    std::cout << "      starts this many worker processes on them; a crashed worker takes only its own sessions down. 0 runs one process. Default: 0.\n";
+    std::cout << "      Workers log to <file>.worker<N>; the supervisor serves /stats and /stream with their counters summed.\n";
+    std::cout << "    - " << green << "backoff_ms" << reset << " / " << green << "max_backoff_ms" << reset << ": (Optional) Delay before a crashed worker restarts, doubled while\n";
+    std::cout << "      it keeps crashing within 10s of its start. Default: 100 / 30000.\n\n";
+
+    std::cout << bold << "  socket activation:\n"
+              << reset;
+    std::cout << "    - Listening sockets passed in with LISTEN_FDS/LISTEN_PID (systemd .socket units) are used by the listener\n";
+    std::cout << "      with the same address and port instead of binding; ones that match no listener are closed.\n\n";
+
+    std::cout << bold << "  tcp_info:\n"
+              << reset;
+    std::cout << "    - " << green << "enabled" << reset << ": (Optional) Sample TCP_INFO of the client and target socket of every session, and once as it closes. Default: false.\n";
+    std::cout << "    - " << green << "interval_ms" << reset << ": (Optional) Period of the sampling timer. Default: 1000.\n";
+    std::cout << "      RTT, retransmits, cwnd and delivery rate land in log2 histograms per listener and target address under /stats tcp_info.\n\n";
+
+    std::cout << bold << "  capture:\n"
+              << reset;
+    std::cout << "    - " << green << "ring_bytes" << reset << ": (Optional) Memory set aside at startup for captured chunks, oldest overwritten first; 0 disables capture. Default: 4194304.\n";
+    std::cout << "    - " << green << "snap_bytes" << reset << ": (Optional) Bytes kept of each chunk, at most 65475. Default: 65000.\n\n";
+
+    std::cout << bold << "  dns:\n"
+              << reset;
+    std::cout << "    - " << green << "min_ttl" << reset << ": (Optional) Lower bound in seconds for cached hostname records. Default: 5.\n";
+    std::cout << "    - " << green << "max_ttl" << reset << ": (Optional) Upper bound in seconds for cached hostname records. Default: 3600.\n";
+    std::cout << "    - " << green << "retry_interval" << reset << ": (Optional) Seconds between retries of a failed lookup; the last good records stay in use. Default: 5.\n\n";
+
+    std::cout << bold << "  loop_monitor:\n"
+              << reset;
+    std::cout << "    - " << green << "interval_ms" << reset << ": (Optional) Period of the event loop lag probe. Default: 100.\n";
+    std::cout << "    - " << green << "shedding" << reset << ": (Optional) Shed load while the smoothed lag is above high_lag_ms, until it drops below low_lag_ms. Default: false.\n";
+    std::cout << "    - " << green << "high_lag_ms" << reset << " / " << green << "low_lag_ms" << reset << ": (Optional) Shedding thresholds. Default: 50 / 10.\n";
+    std::cout << "    - " << green << "pause_accept" << reset << ": (Optional) Stop accepting while shedding; clients wait in the listen backlog. Default: true.\n";
+    std::cout << "    - " << green << "log_level" << reset << ": (Optional) Log level while shedding, empty to keep the configured one. Default: WARN.\n\n";
+
+    std::cout << bold << "  outlier_detection:\n"
+              << reset;
+    std::cout << "    - " << green << "enabled" << reset << ": (Optional) Eject target addresses that fail connects, reset sessions or close them without a byte. Default: false.\n";
+    std::cout << "    - " << green << "consecutive_failures" << reset << ": (Optional) Failures in a row that eject a target. Default: 5.\n";
+    std::cout << "    - " << green << "failure_ratio" << reset << " / " << green << "min_requests" << reset << ": (Optional) Failure share that ejects a target once a window has this many outcomes. Default: 0.5 / 20.\n";
+    std::cout << "    - " << green << "interval" << reset << ": (Optional) Length of the failure ratio window in seconds. Default: 10.\n";
+    std::cout << "    - " << green << "base_ejection_time" << reset << " / " << green << "max_ejection_time" << reset << ": (Optional) Ejection time in seconds, doubled on each repeated ejection up to the max. Default: 30 / 300.\n\n";
+
+    std::cout << bold << "  sockmap_splice:\n"
+              << reset;
+    std::cout << "    - " << green << "enabled" << reset << ": (Optional) Forward established sessions inside the kernel with a BPF sockmap. Needs root/CAP_BPF. Default: false.\n";
+    std::cout << "    - " << green << "idle_timeout" << reset << ": (Optional) Close spliced sessions idle for this many seconds, 0 to disable. Default: 300.\n";
+    std::cout << "    - " << green << "max_sessions" << reset << ": (Optional) Capacity of the BPF maps in sessions. Default: 65536.\n\n";
+
     std::cout << bold << underline << "Example Configuration (config.yaml):\n"
               << reset;
     std::cout << "--------------------------------------\n";
@@ -285,6 +835,19 @@ void validate_and_set_defaults(YAML::Node &config)
         config["max_connections"] = 100;
     }
 
+    if (!config["admission_queue"])
+    {
+        config["admission_queue"]["size"] = config["max_connections"].as<int>();
+    }
+    if (!config["admission_queue"]["size"])
+    {
+        config["admission_queue"]["size"] = config["max_connections"].as<int>();
+    }
+    if (!config["admission_queue"]["timeout"])
+    {
+        config["admission_queue"]["timeout"] = 10;
+    }
+
     if (!config["logging"] || !config["logging"]["enabled"] || !config["logging"]["file"])
     {
         throw std::runtime_error("Error: 'logging.enabled' and 'logging.file' must be specified.");
@@ -314,356 +877,7659 @@ void validate_and_set_defaults(YAML::Node &config)
             config["tcp_keep_alive"]["count"] = 5;
         }
     }
-}
 
-class Session : public std::enable_shared_from_this<Session>
-{
-public:
-    Session(boost::asio::io_context &io_context, tcp::socket in_socket, const tcp::endpoint &target_endpoint,
-            std::size_t buffer_size, bool tcp_no_delay, int retry_attempts, int retry_delay, Logger &logger,
-            std::atomic<int> &active_connections, const YAML::Node &tcp_keep_alive)
-        : io_context_(io_context),
-          in_socket_(std::move(in_socket)),
-          out_socket_(io_context),
-          target_endpoint_(target_endpoint),
-          buffer_size_(buffer_size),
-          tcp_no_delay_(tcp_no_delay),
-          retry_attempts_(retry_attempts),
-          retry_delay_(retry_delay),
-          current_attempt_(0),
-          timer_(io_context),
-          logger_(logger),
-          active_connections_(active_connections),
-          tcp_keep_alive_(tcp_keep_alive),
-          data_in_(buffer_size),
-          data_out_(buffer_size)
+    if (!config["control"])
+    {
+        config["control"]["enabled"] = false;
+    }
+    if (!config["control"]["address"])
+    {
+        config["control"]["address"] = "127.0.0.1";
+    }
+    if (!config["control"]["tcp_port"])
     {
-        ++active_connections_;
-        logger_.debug("Session created. Active connections: " + std::to_string(active_connections_));
+        config["control"]["tcp_port"] = 9100;
+    }
+    if (!config["control"]["stream_interval_ms"])
+    {
+        config["control"]["stream_interval_ms"] = 1000;
+    }
 
-    boost::system::error_code ec;
-    in_socket_.set_option(tcp::no_delay(tcp_no_delay_), ec);
-    if (ec)
+    if (!config["prefork"])
     {
-        logger_.error("seting up TCP nodelay on incoming socket failed: " + ec.message());
+        config["prefork"]["workers"] = 0;
     }
-    else
+    if (!config["prefork"]["workers"])
     {
-        logger_.info("TCP nodelay has been set on incoming socket");
+        config["prefork"]["workers"] = 0;
+    }
+    if (!config["prefork"]["backoff_ms"])
+    {
+        config["prefork"]["backoff_ms"] = 100;
+    }
+    if (!config["prefork"]["max_backoff_ms"])
+    {
+        config["prefork"]["max_backoff_ms"] = 30000;
     }
-}
 
-~Session()
+    if (!config["shutdown"])
     {
-        --active_connections_;
-        logger_.debug("Session destroyed. Active connections: " + std::to_string(active_connections_));
+        config["shutdown"]["drain_timeout"] = 30;
     }
-    void set_keep_alive_options(tcp::socket &socket)
+    if (!config["shutdown"]["drain_timeout"])
     {
-        if (tcp_keep_alive_["enabled"].as<bool>())
-        {
-            boost::system::error_code ec;
-            socket.set_option(boost::asio::socket_base::keep_alive(true), ec);
-            if (ec)
-            {
-                logger_.warn("enabling TCP keepalive failed: " + ec.message());
-                return;
-            }
+        config["shutdown"]["drain_timeout"] = 30;
+    }
 
-#ifdef _WIN32
+    if (!config["dns"])
+    {
+        config["dns"]["min_ttl"] = 5;
+    }
+    if (!config["dns"]["min_ttl"])
+    {
+        config["dns"]["min_ttl"] = 5;
+    }
+    if (!config["dns"]["max_ttl"])
+    {
+        config["dns"]["max_ttl"] = 3600;
+    }
+    if (!config["dns"]["retry_interval"])
+    {
+        config["dns"]["retry_interval"] = 5;
+    }
+
+    if (!config["loop_monitor"])
+    {
+        config["loop_monitor"]["shedding"] = false;
+    }
+    if (!config["loop_monitor"]["interval_ms"])
+    {
+        config["loop_monitor"]["interval_ms"] = 100;
+    }
+    if (!config["loop_monitor"]["shedding"])
+    {
+        config["loop_monitor"]["shedding"] = false;
+    }
+    if (!config["loop_monitor"]["high_lag_ms"])
+    {
+        config["loop_monitor"]["high_lag_ms"] = 50;
+    }
+    if (!config["loop_monitor"]["low_lag_ms"])
+    {
+        config["loop_monitor"]["low_lag_ms"] = 10;
+    }
+    if (!config["loop_monitor"]["pause_accept"])
+    {
+        config["loop_monitor"]["pause_accept"] = true;
+    }
+    if (!config["loop_monitor"]["log_level"])
+    {
+        config["loop_monitor"]["log_level"] = "WARN";
+    }
+
+    if (!config["outlier_detection"])
+    {
+        config["outlier_detection"]["enabled"] = false;
+    }
+    if (!config["outlier_detection"]["consecutive_failures"])
+    {
+        config["outlier_detection"]["consecutive_failures"] = 5;
+    }
+    if (!config["outlier_detection"]["failure_ratio"])
+    {
+        config["outlier_detection"]["failure_ratio"] = 0.5;
+    }
+    if (!config["outlier_detection"]["min_requests"])
+    {
+        config["outlier_detection"]["min_requests"] = 20;
+    }
+    if (!config["outlier_detection"]["interval"])
+    {
+        config["outlier_detection"]["interval"] = 10;
+    }
+    if (!config["outlier_detection"]["base_ejection_time"])
+    {
+        config["outlier_detection"]["base_ejection_time"] = 30;
+    }
+    if (!config["outlier_detection"]["max_ejection_time"])
+    {
+        config["outlier_detection"]["max_ejection_time"] = 300;
+    }
+
+    if (!config["sockmap_splice"])
+    {
+        config["sockmap_splice"]["enabled"] = false;
+    }
+    if (!config["sockmap_splice"]["idle_timeout"])
+    {
+        config["sockmap_splice"]["idle_timeout"] = 300;
+    }
+    if (!config["sockmap_splice"]["max_sessions"])
+    {
+        config["sockmap_splice"]["max_sessions"] = 65536;
+    }
+}
+
+// in-kernel splicing of established sessions: both sockets of a session go into a
+// BPF sockhash keyed by socket cookie and an sk_skb verdict program redirects every
+// skb to the peer socket, so payload never comes up to user space.
+class SockmapSplicer
+{
+public:
+    SockmapSplicer(std::size_t max_sessions, Logger &logger)
+        : logger_(logger), spliced_sessions_(0), spliced_bytes_(0)
+    {
+        uint32_t max_sockets = static_cast<uint32_t>(max_sessions * 2);
+
+        sock_map_fd_ = create_map(BPF_MAP_TYPE_SOCKHASH, sizeof(uint64_t), sizeof(uint32_t), max_sockets);
+        peer_map_fd_ = create_map(BPF_MAP_TYPE_HASH, sizeof(uint64_t), sizeof(uint64_t), max_sockets);
+        bytes_map_fd_ = create_map(BPF_MAP_TYPE_HASH, sizeof(uint64_t), sizeof(uint64_t), max_sockets);
+        if (sock_map_fd_ < 0 || peer_map_fd_ < 0 || bytes_map_fd_ < 0)
+        {
+            logger_.warn("creating BPF maps failed: " + std::string(strerror(errno)) + ". sockmap splicing disabled");
+            return;
+        }
+
+        parser_fd_ = load_program(parser_program());
+        verdict_fd_ = load_program(verdict_program());
+        if (parser_fd_ < 0 || verdict_fd_ < 0)
+        {
+            logger_.warn("loading sk_skb programs failed: " + std::string(strerror(errno)) + ". sockmap splicing disabled");
+            return;
+        }
+
+        if (attach(parser_fd_, BPF_SK_SKB_STREAM_PARSER) < 0 || attach(verdict_fd_, BPF_SK_SKB_STREAM_VERDICT) < 0)
+        {
+            logger_.warn("attaching sk_skb programs failed: " + std::string(strerror(errno)) + ". sockmap splicing disabled");
+            return;
+        }
+
+        ready_ = true;
+        logger_.info("sockmap splicing enabled for up to " + std::to_string(max_sessions) + " sessions");
+    }
+
+    ~SockmapSplicer()
+    {
+        for (int fd : {verdict_fd_, parser_fd_, bytes_map_fd_, peer_map_fd_, sock_map_fd_})
+        {
+            if (fd >= 0)
+                close(fd);
+        }
+    }
+
+    bool ready() const { return ready_; }
+
+    static uint64_t socket_cookie(int fd)
+    {
+        uint64_t cookie = 0;
+        socklen_t len = sizeof(cookie);
+        if (getsockopt(fd, SOL_SOCKET, SO_COOKIE, &cookie, &len) < 0)
+            return 0;
+        return cookie;
+    }
+
+    // pairs both sockets; from here on the kernel forwards their payload.
+    bool splice(int in_fd, int out_fd, uint64_t &in_cookie, uint64_t &out_cookie)
+    {
+        in_cookie = socket_cookie(in_fd);
+        out_cookie = socket_cookie(out_fd);
+        if (in_cookie == 0 || out_cookie == 0)
+            return false;
+
+        uint64_t zero = 0;
+        if (update(peer_map_fd_, &in_cookie, &out_cookie) < 0 || update(peer_map_fd_, &out_cookie, &in_cookie) < 0 ||
+            update(bytes_map_fd_, &in_cookie, &zero) < 0 || update(bytes_map_fd_, &out_cookie, &zero) < 0)
+        {
+            unsplice(in_cookie, out_cookie);
+            return false;
+        }
+
+        uint32_t in_value = static_cast<uint32_t>(in_fd);
+        uint32_t out_value = static_cast<uint32_t>(out_fd);
+        if (update(sock_map_fd_, &in_cookie, &in_value) < 0 || update(sock_map_fd_, &out_cookie, &out_value) < 0)
+        {
+            unsplice(in_cookie, out_cookie);
+            return false;
+        }
+
+        ++spliced_sessions_;
+        return true;
+    }
+
+    // bytes the verdict program redirected away from this socket so far
+    uint64_t bytes(uint64_t cookie) const
+    {
+        uint64_t value = 0;
+        lookup(bytes_map_fd_, &cookie, &value);
+        return value;
+    }
+
+    uint64_t unsplice(uint64_t in_cookie, uint64_t out_cookie)
+    {
+        uint64_t total = bytes(in_cookie) + bytes(out_cookie);
+        for (uint64_t cookie : {in_cookie, out_cookie})
+        {
+            remove(sock_map_fd_, &cookie);
+            remove(peer_map_fd_, &cookie);
+            remove(bytes_map_fd_, &cookie);
+        }
+        spliced_bytes_ += total;
+        return total;
+    }
+
+    uint64_t spliced_sessions() const { return spliced_sessions_; }
+    uint64_t spliced_bytes() const { return spliced_bytes_; }
+
+private:
+    static long bpf(int cmd, union bpf_attr &attr)
+    {
+        return syscall(__NR_bpf, cmd, &attr, sizeof(attr));
+    }
+
+    static int create_map(bpf_map_type type, uint32_t key_size, uint32_t value_size, uint32_t max_entries)
+    {
+        union bpf_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.map_type = type;
+        attr.key_size = key_size;
+        attr.value_size = value_size;
+        attr.max_entries = max_entries;
+        return static_cast<int>(bpf(BPF_MAP_CREATE, attr));
+    }
+
+    static int update(int map_fd, const void *key, const void *value)
+    {
+        union bpf_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.map_fd = map_fd;
+        attr.key = reinterpret_cast<uint64_t>(key);
+        attr.value = reinterpret_cast<uint64_t>(value);
+        attr.flags = BPF_ANY;
+        return static_cast<int>(bpf(BPF_MAP_UPDATE_ELEM, attr));
+    }
+
+    static int lookup(int map_fd, const void *key, void *value)
+    {
+        union bpf_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.map_fd = map_fd;
+        attr.key = reinterpret_cast<uint64_t>(key);
+        attr.value = reinterpret_cast<uint64_t>(value);
+        return static_cast<int>(bpf(BPF_MAP_LOOKUP_ELEM, attr));
+    }
+
+    static int remove(int map_fd, const void *key)
+    {
+        union bpf_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.map_fd = map_fd;
+        attr.key = reinterpret_cast<uint64_t>(key);
+        return static_cast<int>(bpf(BPF_MAP_DELETE_ELEM, attr));
+    }
+
+    int load_program(const std::vector<bpf_insn> &insns)
+    {
+        static const char license[] = "GPL";
+        union bpf_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.prog_type = BPF_PROG_TYPE_SK_SKB;
+        attr.insns = reinterpret_cast<uint64_t>(insns.data());
+        attr.insn_cnt = static_cast<uint32_t>(insns.size());
+        attr.license = reinterpret_cast<uint64_t>(license);
+        return static_cast<int>(bpf(BPF_PROG_LOAD, attr));
+    }
+
+    int attach(int prog_fd, bpf_attach_type type)
+    {
+        union bpf_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.target_fd = sock_map_fd_;
+        attr.attach_bpf_fd = prog_fd;
+        attr.attach_type = type;
+        return static_cast<int>(bpf(BPF_PROG_ATTACH, attr));
+    }
+
+    static bpf_insn insn(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm)
+    {
+        bpf_insn i;
+        i.code = code;
+        i.dst_reg = dst;
+        i.src_reg = src;
+        i.off = off;
+        i.imm = imm;
+        return i;
+    }
+
+    static void load_map_fd(std::vector<bpf_insn> &prog, uint8_t dst, int map_fd)
+    {
+        prog.push_back(insn(BPF_LD | BPF_DW | BPF_IMM, dst, BPF_PSEUDO_MAP_FD, 0, map_fd));
+        prog.push_back(insn(0, 0, 0, 0, 0));
+    }
+
+    // every skb is one message: r0 = skb->len
+    std::vector<bpf_insn> parser_program() const
+    {
+        return {
+            insn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_0, BPF_REG_1, offsetof(__sk_buff, len), 0),
+            insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+        };
+    }
+
+    // peer = peers[cookie(skb)]; bytes[cookie] += skb->len; redirect to sockets[peer]
+    std::vector<bpf_insn> verdict_program() const
+    {
+        std::vector<bpf_insn> prog;
+        prog.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0));
+        prog.push_back(insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_get_socket_cookie));
+        prog.push_back(insn(BPF_STX | BPF_MEM | BPF_DW, BPF_REG_10, BPF_REG_0, -8, 0));
+        load_map_fd(prog, BPF_REG_1, peer_map_fd_);
+        prog.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0));
+        prog.push_back(insn(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -8));
+        prog.push_back(insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem));
+        std::size_t no_peer = prog.size();
+        prog.push_back(insn(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 0, 0));
+        prog.push_back(insn(BPF_LDX | BPF_MEM | BPF_DW, BPF_REG_1, BPF_REG_0, 0, 0));
+        prog.push_back(insn(BPF_STX | BPF_MEM | BPF_DW, BPF_REG_10, BPF_REG_1, -16, 0));
+
+        load_map_fd(prog, BPF_REG_1, bytes_map_fd_);
+        prog.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0));
+        prog.push_back(insn(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -8));
+        prog.push_back(insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem));
+        prog.push_back(insn(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 2, 0));
+        prog.push_back(insn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_1, BPF_REG_6, offsetof(__sk_buff, len), 0));
+        prog.push_back(insn(BPF_STX | BPF_ATOMIC | BPF_DW, BPF_REG_0, BPF_REG_1, 0, BPF_ADD));
+
+        prog.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0));
+        load_map_fd(prog, BPF_REG_2, sock_map_fd_);
+        prog.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0));
+        prog.push_back(insn(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -16));
+        prog.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0));
+        prog.push_back(insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_redirect_hash));
+        prog.push_back(insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+        prog[no_peer].off = static_cast<int16_t>(prog.size() - no_peer - 1);
+        prog.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, SK_PASS));
+        prog.push_back(insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+        return prog;
+    }
+
+    Logger &logger_;
+    bool ready_ = false;
+    int sock_map_fd_ = -1;
+    int peer_map_fd_ = -1;
+    int bytes_map_fd_ = -1;
+    int parser_fd_ = -1;
+    int verdict_fd_ = -1;
+    std::atomic<uint64_t> spliced_sessions_;
+    std::atomic<uint64_t> spliced_bytes_;
+};
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
+// source addresses for upstream connects of one forwarder entry. binding with
+// IP_BIND_ADDRESS_NO_PORT defers port selection to connect(), so each source
+// address gets its own ephemeral port space per target.
+class SourceAddressPool
+{
+public:
+    struct Source
+    {
+        explicit Source(const boost::asio::ip::address &addr) : address(addr) {}
+
+        boost::asio::ip::address address;
+        std::atomic<int> active{0};
+        std::atomic<uint64_t> connects{0};
+        std::atomic<uint64_t> failures{0};
+    };
+
+    explicit SourceAddressPool(const std::vector<std::string> &addresses)
+    {
+        for (const auto &address : addresses)
+        {
+            sources_.push_back(std::make_unique<Source>(boost::asio::ip::make_address(address)));
+        }
+    }
+
+    // least loaded source of the target's family; the start index rotates so ties spread.
+    // picking and counting happen under the lock so concurrent connects see each other
+    Source *acquire(const tcp::endpoint &target)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Source *best = nullptr;
+        std::size_t start = next_++;
+        for (std::size_t i = 0; i < sources_.size(); ++i)
+        {
+            Source *source = sources_[(start + i) % sources_.size()].get();
+            if (source->address.is_v6() != target.address().is_v6())
+                continue;
+            if (!best || source->active < best->active)
+                best = source;
+        }
+        if (best)
+        {
+            ++best->active;
+            ++best->connects;
+        }
+        return best;
+    }
+
+    void release(Source *source)
+    {
+        if (source)
+            --source->active;
+    }
+
+    std::string stats_json() const
+    {
+        std::ostringstream out;
+        out << "[";
+        for (std::size_t i = 0; i < sources_.size(); ++i)
+        {
+            const Source &source = *sources_[i];
+            out << (i ? "," : "") << "{\"address\":\"" << source.address.to_string()
+                << "\",\"active\":" << source.active
+                << ",\"connects\":" << source.connects
+                << ",\"failures\":" << source.failures << "}";
+        }
+        out << "]";
+        return out.str();
+    }
+
+private:
+    std::vector<std::unique_ptr<Source>> sources_;
+    std::size_t next_ = 0;
+    std::mutex mutex_;
+};
+
+// addresses a target name currently resolves to. sessions read the snapshot
+// without locking; the resolver thread swaps in a new one when the records change.
+class ResolvedTarget
+{
+public:
+    using Addresses = std::vector<boost::asio::ip::address>;
+
+    explicit ResolvedTarget(const std::string &host)
+        : host_(host),
+          addresses_(std::make_shared<const Addresses>()) {}
+
+    const std::string &host() const { return host_; }
+
+    std::shared_ptr<const Addresses> addresses() const { return std::atomic_load(&addresses_); }
+
+    void update(Addresses addresses)
+    {
+        std::atomic_store(&addresses_, std::shared_ptr<const Addresses>(std::make_shared<const Addresses>(std::move(addresses))));
+    }
+
+    // start index into the records; rotating it spreads sessions and their retries over all of them
+    std::size_t rotate() { return next_++; }
+
+private:
+    std::string host_;
+    std::shared_ptr<const Addresses> addresses_;
+    std::atomic<std::size_t> next_{0};
+};
+
+// resolves hostname targets off the accept path. each name is resolved once while
+// the config loads, then a background thread queries it again before its TTL runs
+// out. when a refresh fails the last good records stay in use.
+class DnsResolver
+{
+public:
+    DnsResolver(const YAML::Node &dns, Logger &logger)
+        : min_ttl_(dns["min_ttl"].as<int>()),
+          max_ttl_(dns["max_ttl"].as<int>()),
+          retry_interval_(dns["retry_interval"].as<int>()),
+          logger_(logger),
+          stop_(false) {}
+
+    ~DnsResolver()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_one();
+        if (worker_.joinable())
+            worker_.join();
+    }
+
+    // literal addresses resolve to themselves and are never refreshed. the first
+    // lookup of a name blocks the caller, but not the resolver thread or other callers
+    std::shared_ptr<ResolvedTarget> target(const std::string &host)
+    {
+        if (auto known = find(host))
+            return known;
+
+        auto target = std::make_shared<ResolvedTarget>(host);
+        boost::system::error_code ec;
+        boost::asio::ip::address literal = boost::asio::ip::make_address(host, ec);
+        if (!ec)
+        {
+            target->update({literal});
+            return target;
+        }
+
+        auto entry = std::make_unique<Entry>(target);
+        refresh(*entry);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto &known : entries_)
+        {
+            // another caller resolved the same name meanwhile
+            if (known->target->host() == host)
+                return known->target;
+        }
+        entries_.push_back(std::move(entry));
+        if (!worker_.joinable())
+            worker_ = std::thread(&DnsResolver::run, this);
+        return target;
+    }
+
+    std::string stats_json() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::ostringstream out;
+        out << "[";
+        for (std::size_t i = 0; i < entries_.size(); ++i)
+        {
+            const Entry &entry = *entries_[i];
+            auto addresses = entry.target->addresses();
+            out << (i ? "," : "") << "{\"host\":\"" << entry.target->host() << "\",\"addresses\":[";
+            for (std::size_t j = 0; j < addresses->size(); ++j)
+            {
+                out << (j ? "," : "") << "\"" << (*addresses)[j].to_string() << "\"";
+            }
+            out << "],\"ttl\":" << entry.ttl << ",\"refreshes\":" << entry.refreshes << ",\"failures\":" << entry.failures << "}";
+        }
+        out << "]";
+        return out.str();
+    }
+
+private:
+    struct Entry
+    {
+        explicit Entry(std::shared_ptr<ResolvedTarget> resolved) : target(std::move(resolved)) {}
+
+        std::shared_ptr<ResolvedTarget> target;
+        std::chrono::steady_clock::time_point refresh_at;
+        std::atomic<int> ttl{0};
+        std::atomic<uint64_t> refreshes{0};
+        std::atomic<uint64_t> failures{0};
+    };
+
+    std::shared_ptr<ResolvedTarget> find(const std::string &host) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto &entry : entries_)
+        {
+            if (entry->target->host() == host)
+                return entry->target;
+        }
+        return nullptr;
+    }
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!stop_)
+        {
+            auto now = std::chrono::steady_clock::now();
+            auto wake_at = now + std::chrono::seconds(max_ttl_);
+            std::vector<Entry *> due;
+            for (const auto &entry : entries_)
+            {
+                if (entry->refresh_at <= now)
+                    due.push_back(entry.get());
+                else
+                    wake_at = std::min(wake_at, entry->refresh_at);
+            }
+
+            if (due.empty())
+            {
+                wake_.wait_until(lock, wake_at);
+                continue;
+            }
+
+            lock.unlock();
+            for (Entry *entry : due)
+            {
+                refresh(*entry);
+            }
+            lock.lock();
+        }
+    }
+
+    // queries without holding mutex_; only the refresh time is written under it
+    void refresh(Entry &entry)
+    {
+        const std::string &host = entry.target->host();
+        ResolvedTarget::Addresses addresses;
+        uint32_t ttl = std::numeric_limits<uint32_t>::max();
+        query(host, ns_t_a, addresses, ttl);
+        query(host, ns_t_aaaa, addresses, ttl);
+        if (addresses.empty())
+        {
+            // /etc/hosts and other NSS sources carry no TTL
+            lookup_hosts(host, addresses);
+            ttl = static_cast<uint32_t>(min_ttl_);
+        }
+
+        ++entry.refreshes;
+        auto now = std::chrono::steady_clock::now();
+        if (addresses.empty())
+        {
+            ++entry.failures;
+            schedule(entry, now + std::chrono::seconds(retry_interval_));
+            logger_.warn("resolving " + host + " failed, keeping " + std::to_string(entry.target->addresses()->size()) + " cached address(es)");
+            return;
+        }
+
+        int clamped = static_cast<int>(std::min<uint32_t>(std::max<uint32_t>(ttl, min_ttl_), max_ttl_));
+        entry.ttl = clamped;
+        // refresh at three quarters of the TTL so new records are in place before the old ones expire
+        schedule(entry, now + std::chrono::milliseconds(static_cast<int64_t>(clamped) * 750));
+
+        std::sort(addresses.begin(), addresses.end());
+        if (*entry.target->addresses() != addresses)
+        {
+            std::string list;
+            for (const auto &address : addresses)
+            {
+                list += (list.empty() ? "" : ", ") + address.to_string();
+            }
+            logger_.info(host + " resolved to " + list + " (ttl " + std::to_string(clamped) + "s)");
+            entry.target->update(std::move(addresses));
+        }
+    }
+
+    void schedule(Entry &entry, std::chrono::steady_clock::time_point at)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        entry.refresh_at = at;
+    }
+
+    // A or AAAA records straight from the DNS answer, so their TTL is known
+    static void query(const std::string &host, int type, ResolvedTarget::Addresses &addresses, uint32_t &ttl)
+    {
+        struct __res_state state;
+        std::memset(&state, 0, sizeof(state));
+        if (res_ninit(&state) != 0)
+            return;
+
+        unsigned char answer[4096];
+        int len = res_nsearch(&state, host.c_str(), ns_c_in, type, answer, sizeof(answer));
+        res_nclose(&state);
+        if (len < NS_HFIXEDSZ)
+            return;
+        len = std::min<int>(len, sizeof(answer));
+
+        auto get16 = [&answer](int pos)
+        { return (answer[pos] << 8) | answer[pos + 1]; };
+        auto skip_name = [&answer, len](int pos)
+        {
+            while (pos < len)
+            {
+                if (answer[pos] == 0)
+                    return pos + 1;
+                if ((answer[pos] & 0xC0) == 0xC0)
+                    return pos + 2;
+                pos += answer[pos] + 1;
+            }
+            return len;
+        };
+
+        int pos = NS_HFIXEDSZ;
+        for (int i = get16(4); i > 0 && pos < len; --i)
+        {
+            pos = skip_name(pos) + NS_QFIXEDSZ;
+        }
+        for (int i = get16(6); i > 0; --i)
+        {
+            pos = skip_name(pos);
+            if (pos + NS_RRFIXEDSZ > len)
+                break;
+            int rr_type = get16(pos);
+            uint32_t rr_ttl = (static_cast<uint32_t>(get16(pos + 4)) << 16) | static_cast<uint32_t>(get16(pos + 6));
+            int rdlength = get16(pos + 8);
+            pos += NS_RRFIXEDSZ;
+            if (pos + rdlength > len)
+                break;
+
+            if (rr_type == type && type == ns_t_a && rdlength == 4)
+            {
+                boost::asio::ip::address_v4::bytes_type bytes;
+                std::memcpy(bytes.data(), answer + pos, bytes.size());
+                addresses.push_back(boost::asio::ip::address_v4(bytes));
+                ttl = std::min(ttl, rr_ttl);
+            }
+            else if (rr_type == type && type == ns_t_aaaa && rdlength == 16)
+            {
+                boost::asio::ip::address_v6::bytes_type bytes;
+                std::memcpy(bytes.data(), answer + pos, bytes.size());
+                addresses.push_back(boost::asio::ip::address_v6(bytes));
+                ttl = std::min(ttl, rr_ttl);
+            }
+            pos += rdlength;
+        }
+    }
+
+    static void lookup_hosts(const std::string &host, ResolvedTarget::Addresses &addresses)
+    {
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo *result = nullptr;
+        if (getaddrinfo(host.c_str(), nullptr, &hints, &result) != 0)
+            return;
+
+        for (addrinfo *info = result; info; info = info->ai_next)
+        {
+            boost::asio::ip::address address;
+            if (info->ai_family == AF_INET)
+            {
+                boost::asio::ip::address_v4::bytes_type bytes;
+                std::memcpy(bytes.data(), &reinterpret_cast<sockaddr_in *>(info->ai_addr)->sin_addr, bytes.size());
+                address = boost::asio::ip::address_v4(bytes);
+            }
+            else if (info->ai_family == AF_INET6)
+            {
+                boost::asio::ip::address_v6::bytes_type bytes;
+                std::memcpy(bytes.data(), &reinterpret_cast<sockaddr_in6 *>(info->ai_addr)->sin6_addr, bytes.size());
+                address = boost::asio::ip::address_v6(bytes);
+            }
+            else
+            {
+                continue;
+            }
+            if (std::find(addresses.begin(), addresses.end(), address) == addresses.end())
+                addresses.push_back(address);
+        }
+        freeaddrinfo(result);
+    }
+
+    int min_ttl_;
+    int max_ttl_;
+    int retry_interval_;
+    Logger &logger_;
+    mutable std::mutex mutex_;
+    std::condition_variable wake_;
+    bool stop_;
+    std::vector<std::unique_ptr<Entry>> entries_;
+    std::thread worker_;
+};
+
+struct OutlierOptions
+{
+    bool enabled = false;
+    int consecutive_failures = 5;
+    double failure_ratio = 0.5;
+    int min_requests = 20;
+    std::chrono::seconds interval{10};
+    std::chrono::seconds base_ejection_time{30};
+    std::chrono::seconds max_ejection_time{300};
+};
+
+// passive health of one target endpoint, fed by the outcomes sessions observe. all
+// state is atomics, so every worker thread reads it without locking.
+class CircuitBreaker
+{
+public:
+    enum class Admission
+    {
+        denied,
+        allowed,
+        trial
+    };
+
+    explicit CircuitBreaker(const OutlierOptions &options)
+        : options_(options),
+          window_start_(now()) {}
+
+    // once an ejection runs out the breaker is half-open: a single trial connection
+    // decides whether it closes again or the target is ejected for longer
+    Admission admit()
+    {
+        int64_t until = ejected_until_.load(std::memory_order_acquire);
+        if (until == 0)
+            return Admission::allowed;
+        if (now() < until)
+            return Admission::denied;
+        bool expected = false;
+        return trial_in_flight_.compare_exchange_strong(expected, true) ? Admission::trial : Admission::denied;
+    }
+
+    void success(bool trial)
+    {
+        consecutive_failures_.store(0, std::memory_order_relaxed);
+        count(false);
+        if (trial)
+        {
+            ejected_until_.store(0, std::memory_order_release);
+            trial_in_flight_.store(false, std::memory_order_release);
+        }
+    }
+
+    void failure(bool trial)
+    {
+        int consecutive = consecutive_failures_.fetch_add(1, std::memory_order_relaxed) + 1;
+        bool ratio_exceeded = count(true);
+        if (trial)
+        {
+            eject(ejected_until_.load(std::memory_order_acquire));
+            trial_in_flight_.store(false, std::memory_order_release);
+        }
+        else if (consecutive >= options_.consecutive_failures || ratio_exceeded)
+        {
+            eject(0);
+        }
+    }
+
+    // a trial connection ended before it showed whether the target works
+    void abandon(bool trial)
+    {
+        if (trial)
+            trial_in_flight_.store(false, std::memory_order_release);
+    }
+
+    std::string stats_json() const
+    {
+        int64_t until = ejected_until_.load(std::memory_order_acquire);
+        const char *state = until == 0 ? "closed" : now() < until ? "open" : "half_open";
+        std::ostringstream out;
+        out << "{\"state\":\"" << state << "\",\"consecutive_failures\":" << consecutive_failures_
+            << ",\"ejections\":" << ejections_ << ",\"ejected_total\":" << ejected_total_ << "}";
+        return out.str();
+    }
+
+private:
+    static int64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // failure ratio over a fixed window; a window without failures also forgives
+    // earlier ejections, so only repeated ejections keep growing
+    bool count(bool failed)
+    {
+        int64_t current = now();
+        int64_t start = window_start_.load(std::memory_order_relaxed);
+        if (current - start >= std::chrono::duration_cast<std::chrono::milliseconds>(options_.interval).count() &&
+            window_start_.compare_exchange_strong(start, current))
+        {
+            if (window_failures_.exchange(0) == 0 && ejected_until_.load(std::memory_order_acquire) == 0)
+                ejections_.store(0, std::memory_order_relaxed);
+            window_total_.store(0);
+        }
+
+        uint32_t total = window_total_.fetch_add(1) + 1;
+        uint32_t failures = failed ? window_failures_.fetch_add(1) + 1 : window_failures_.load();
+        return failed && total >= static_cast<uint32_t>(options_.min_requests) &&
+               failures >= options_.failure_ratio * total;
+    }
+
+    // only the thread that moves the state away from `expected` ejects, so
+    // concurrent failures eject once
+    void eject(int64_t expected)
+    {
+        int ejections = std::min(ejections_.load(std::memory_order_relaxed), 16);
+        auto duration = std::min<int64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(options_.base_ejection_time).count() << ejections,
+                                          std::chrono::duration_cast<std::chrono::milliseconds>(options_.max_ejection_time).count());
+        if (!ejected_until_.compare_exchange_strong(expected, now() + duration, std::memory_order_acq_rel))
+            return;
+        ejections_.fetch_add(1, std::memory_order_relaxed);
+        ejected_total_.fetch_add(1, std::memory_order_relaxed);
+        consecutive_failures_.store(0, std::memory_order_relaxed);
+    }
+
+    const OutlierOptions &options_;
+    std::atomic<int64_t> ejected_until_{0}; // steady clock ms, 0 while closed
+    std::atomic<bool> trial_in_flight_{false};
+    std::atomic<int> consecutive_failures_{0};
+    std::atomic<int> ejections_{0};
+    std::atomic<uint64_t> ejected_total_{0};
+    std::atomic<int64_t> window_start_;
+    std::atomic<uint32_t> window_total_{0};
+    std::atomic<uint32_t> window_failures_{0};
+};
+
+// circuit breakers of one listener's target, one per endpoint. the table follows the
+// target's current records: when DNS changes them a new table keeps the breakers of
+// endpoints that stayed and drops the rest. sessions hold the breaker they picked,
+// so a dropped one lives until its last session ends, and lookups never lock.
+class TargetBreakers
+{
+public:
+    explicit TargetBreakers(const OutlierOptions &options) : options_(options) {}
+
+    std::shared_ptr<CircuitBreaker> find(const ResolvedTarget &target, const tcp::endpoint &endpoint)
+    {
+        auto addresses = target.addresses();
+        auto table = std::atomic_load(&table_);
+        if (!table || table->source != addresses || table->port != endpoint.port())
+        {
+            table = rebuild(addresses, endpoint.port());
+        }
+        auto entry = table->breakers.find(endpoint);
+        return entry == table->breakers.end() ? nullptr : entry->second;
+    }
+
+    std::string stats_json() const
+    {
+        std::ostringstream out;
+        out << "[";
+        auto table = std::atomic_load(&table_);
+        bool first = true;
+        for (std::size_t i = 0; table && i < table->source->size(); ++i)
+        {
+            auto entry = table->breakers.find(tcp::endpoint((*table->source)[i], table->port));
+            if (entry == table->breakers.end())
+                continue;
+            std::string breaker = entry->second->stats_json();
+            out << (first ? "" : ",") << "{\"address\":\"" << entry->first.address().to_string() << "\"," << breaker.substr(1);
+            first = false;
+        }
+        out << "]";
+        return out.str();
+    }
+
+private:
+    struct Table
+    {
+        std::shared_ptr<const ResolvedTarget::Addresses> source;
+        unsigned short port = 0;
+        std::map<tcp::endpoint, std::shared_ptr<CircuitBreaker>> breakers;
+    };
+
+    // a session still holding an older snapshot of the records looks up the current
+    // table, so two snapshots never take turns replacing it
+    std::shared_ptr<const Table> rebuild(const std::shared_ptr<const ResolvedTarget::Addresses> &addresses, unsigned short port)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto current = std::atomic_load(&table_);
+        if (current && current->source == addresses && current->port == port)
+            return current;
+
+        auto table = std::make_shared<Table>();
+        table->source = addresses;
+        table->port = port;
+        for (const auto &address : *addresses)
+        {
+            tcp::endpoint endpoint(address, port);
+            std::shared_ptr<CircuitBreaker> breaker;
+            if (current)
+            {
+                auto kept = current->breakers.find(endpoint);
+                if (kept != current->breakers.end())
+                    breaker = kept->second;
+            }
+            table->breakers.emplace(endpoint, breaker ? breaker : std::make_shared<CircuitBreaker>(options_));
+        }
+        std::shared_ptr<const Table> installed = std::move(table);
+        std::atomic_store(&table_, installed);
+        return installed;
+    }
+
+    const OutlierOptions &options_;
+    std::mutex mutex_;
+    std::shared_ptr<const Table> table_;
+};
+
+// memory for the handlers of one forwarding direction. a direction never has a
+// read and a write in flight at once, and asio frees an operation before calling
+// its handler, so a single block is reused for every chunk of the session.
+class HandlerMemory
+{
+public:
+    HandlerMemory() : in_use_(false) {}
+    HandlerMemory(const HandlerMemory &) = delete;
+    HandlerMemory &operator=(const HandlerMemory &) = delete;
+
+    void *allocate(std::size_t size)
+    {
+        if (!in_use_ && size < sizeof(storage_))
+        {
+            in_use_ = true;
+            return &storage_;
+        }
+        return ::operator new(size);
+    }
+
+    void deallocate(void *pointer)
+    {
+        if (pointer == &storage_)
+        {
+            in_use_ = false;
+        }
+        else
+        {
+            ::operator delete(pointer);
+        }
+    }
+
+private:
+    typename std::aligned_storage<1024>::type storage_;
+    bool in_use_;
+};
+
+template <typename T>
+class HandlerAllocator
+{
+public:
+    using value_type = T;
+
+    explicit HandlerAllocator(HandlerMemory &memory) : memory_(memory) {}
+
+    template <typename U>
+    HandlerAllocator(const HandlerAllocator<U> &other) noexcept : memory_(other.memory_) {}
+
+    bool operator==(const HandlerAllocator &other) const noexcept { return &memory_ == &other.memory_; }
+    bool operator!=(const HandlerAllocator &other) const noexcept { return &memory_ != &other.memory_; }
+
+    T *allocate(std::size_t n) const { return static_cast<T *>(memory_.allocate(sizeof(T) * n)); }
+    void deallocate(T *pointer, std::size_t /*n*/) const { memory_.deallocate(pointer); }
+
+private:
+    template <typename>
+    friend class HandlerAllocator;
+
+    HandlerMemory &memory_;
+};
+
+// wraps a completion handler so asio allocates its operation from a HandlerMemory
+template <typename Handler>
+class AllocHandler
+{
+public:
+    using allocator_type = HandlerAllocator<Handler>;
+
+    AllocHandler(HandlerMemory &memory, Handler handler)
+        : memory_(memory),
+          handler_(std::move(handler)) {}
+
+    allocator_type get_allocator() const noexcept { return allocator_type(memory_); }
+
+    template <typename... Args>
+    void operator()(Args &&...args)
+    {
+        handler_(std::forward<Args>(args)...);
+    }
+
+private:
+    HandlerMemory &memory_;
+    Handler handler_;
+};
+
+template <typename Handler>
+inline AllocHandler<Handler> make_alloc_handler(HandlerMemory &memory, Handler handler)
+{
+    return AllocHandler<Handler>(memory, std::move(handler));
+}
+
+struct KeepAliveOptions
+{
+    bool enabled = false;
+    int idle_time = 30;
+    int interval = 10;
+    int count = 5;
+};
+
+// ciphers sealed sessions can use. the sealing side names its cipher in the stream,
+// so both ends may prefer different ones
+enum class SealCipher : uint8_t
+{
+    aes_256_gcm = 1,
+    chacha20_poly1305 = 2
+};
+
+const EVP_CIPHER *seal_cipher(uint8_t id)
+{
+    switch (static_cast<SealCipher>(id))
+    {
+    case SealCipher::aes_256_gcm:
+        return EVP_aes_256_gcm();
+    case SealCipher::chacha20_poly1305:
+        return EVP_chacha20_poly1305();
+    }
+    return nullptr;
+}
+
+// AES-GCM where the CPU has AES and carry-less multiply instructions, ChaCha20-Poly1305
+// elsewhere. libcrypto then picks its AVX-512/AVX2/NEON code for either at run time.
+SealCipher preferred_seal_cipher()
+{
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul"))
+        return SealCipher::aes_256_gcm;
+#elif defined(__aarch64__)
+    if ((getauxval(AT_HWCAP) & HWCAP_AES) && (getauxval(AT_HWCAP) & HWCAP_PMULL))
+        return SealCipher::aes_256_gcm;
+#endif
+    return SealCipher::chacha20_poly1305;
+}
+
+SealCipher parse_seal_cipher(const std::string &name)
+{
+    if (name == "auto")
+        return preferred_seal_cipher();
+    if (name == "aes-256-gcm")
+        return SealCipher::aes_256_gcm;
+    if (name == "chacha20-poly1305")
+        return SealCipher::chacha20_poly1305;
+    throw std::runtime_error("'encryption.cipher' must be auto, aes-256-gcm or chacha20-poly1305");
+}
+
+// encryption between paired forwarders. the client side's target is the paired
+// forwarder, the server side's clients are
+struct SealOptions
+{
+    bool seal_upstream = true;
+    SealCipher cipher = SealCipher::chacha20_poly1305;
+    unsigned char key[32];
+};
+
+// a counter each thread bumps on its own cache line, so sessions forwarding on
+// different threads never contend for it. readers sum the slots without a lock.
+class ShardedCounter
+{
+public:
+    void add(uint64_t n) { slots_[slot()].value.fetch_add(n, std::memory_order_relaxed); }
+
+    uint64_t load() const
+    {
+        uint64_t sum = 0;
+        for (const Slot &slot : slots_)
+            sum += slot.value.load(std::memory_order_relaxed);
+        return sum;
+    }
+
+private:
+    struct alignas(64) Slot
+    {
+        std::atomic<uint64_t> value{0};
+    };
+
+    // threads past the slot count share slots, which costs contention, not counts
+    static std::size_t slot()
+    {
+        static std::atomic<std::size_t> next{0};
+        thread_local std::size_t mine = next.fetch_add(1, std::memory_order_relaxed) % slot_count;
+        return mine;
+    }
+
+    static constexpr std::size_t slot_count = 16;
+    std::array<Slot, slot_count> slots_;
+};
+
+struct ListenerStats
+{
+    std::atomic<uint64_t> sessions{0};
+    ShardedCounter bytes_in;
+    ShardedCounter bytes_out;
+    std::atomic<uint64_t> record_failures{0}; // records of the paired forwarder that failed to open or decode
+};
+
+struct MuxStats
+{
+    std::atomic<int> connections{0};
+    std::atomic<int> streams{0};
+    std::atomic<uint64_t> streams_opened{0};
+    std::atomic<uint64_t> resets{0};
+    std::atomic<uint64_t> window_stalls{0};
+    std::atomic<uint64_t> timeouts{0}; // links dropped for a silent peer or a missing hello
+};
+
+// what the first bytes a client sends say about its protocol. the parsers work in
+// place on the peeked bytes and never look past them
+enum class SniffedProtocol
+{
+    unknown,
+    tls,
+    http,
+    ssh
+};
+
+struct Sniffed
+{
+    bool complete = false; // more bytes would not change the result
+    SniffedProtocol protocol = SniffedProtocol::unknown;
+    std::string_view name; // TLS server_name or HTTP Host without the port; points into the peeked bytes
+};
+
+// server_name of a ClientHello, as long as it sits in the first record
+Sniffed sniff_tls(const unsigned char *data, std::size_t size)
+{
+    Sniffed sniffed;
+    sniffed.protocol = SniffedProtocol::tls;
+    if (size < 9)
+        return sniffed;
+    std::size_t record_end = 5 + (std::size_t(data[3]) << 8 | data[4]);
+    std::size_t end = std::min(size, record_end);
+    bool truncated = end < record_end;
+    sniffed.complete = !truncated;
+    if (data[5] != 1) // not a ClientHello
+    {
+        sniffed.complete = true;
+        return sniffed;
+    }
+
+    auto be16 = [data](std::size_t at)
+    { return std::size_t(data[at]) << 8 | data[at + 1]; };
+    std::size_t pos = 5 + 4 + 2 + 32; // handshake header, legacy version, random
+    if (pos + 1 > end)
+        return sniffed;
+    pos += 1 + data[pos]; // session id
+    if (pos + 2 > end)
+        return sniffed;
+    pos += 2 + be16(pos); // cipher suites
+    if (pos + 1 > end)
+        return sniffed;
+    pos += 1 + data[pos]; // compression methods
+    if (pos + 2 > end)
+        return sniffed;
+    std::size_t extensions_end = pos + 2 + be16(pos);
+    pos += 2;
+    while (pos < extensions_end)
+    {
+        if (pos + 4 > end)
+            return sniffed;
+        std::size_t type = be16(pos), length = be16(pos + 2);
+        pos += 4;
+        if (type == 0)
+        {
+            // server_name_list: list length, then entries of name type 0 (host_name) and length
+            if (pos + length > end)
+                return sniffed;
+            if (length >= 5 && data[pos + 2] == 0 && 5 + be16(pos + 3) <= length)
+                sniffed.name = std::string_view(reinterpret_cast<const char *>(data) + pos + 5, be16(pos + 3));
+            sniffed.complete = true;
+            return sniffed;
+        }
+        pos += length;
+    }
+    sniffed.complete = true;
+    return sniffed;
+}
+
+// Host header of an HTTP/1 request, read up to the end of the headers
+Sniffed sniff_http(const char *data, std::size_t size)
+{
+    Sniffed sniffed;
+    sniffed.protocol = SniffedProtocol::http;
+    std::size_t pos = 0;
+    while (true)
+    {
+        const char *newline = static_cast<const char *>(std::memchr(data + pos, '\n', size - pos));
+        if (!newline)
+            return sniffed;
+        std::string_view line(data + pos, newline - (data + pos));
+        pos = newline - data + 1;
+        if (!line.empty() && line.back() == '\r')
+            line.remove_suffix(1);
+        if (line.empty())
+            break;
+        if (line.size() > 5 && strncasecmp(line.data(), "host:", 5) == 0)
+        {
+            std::string_view host = line.substr(5);
+            while (!host.empty() && (host.front() == ' ' || host.front() == '\t'))
+                host.remove_prefix(1);
+            while (!host.empty() && (host.back() == ' ' || host.back() == '\t'))
+                host.remove_suffix(1);
+            std::size_t port = host.rfind(':');
+            if (!host.empty() && host.front() == '[')
+                host = host.substr(1, host.find(']') == std::string_view::npos ? 0 : host.find(']') - 1);
+            else if (port != std::string_view::npos)
+                host = host.substr(0, port);
+            sniffed.name = host;
+            break;
+        }
+    }
+    sniffed.complete = true;
+    return sniffed;
+}
+
+Sniffed sniff_stream(const char *data, std::size_t size)
+{
+    Sniffed sniffed;
+    if (size == 0)
+        return sniffed;
+    if (static_cast<unsigned char>(data[0]) == 0x16)
+        return sniff_tls(reinterpret_cast<const unsigned char *>(data), size);
+    if (std::memcmp(data, "SSH-", std::min<std::size_t>(size, 4)) == 0)
+    {
+        sniffed.protocol = size >= 4 ? SniffedProtocol::ssh : SniffedProtocol::unknown;
+        sniffed.complete = size >= 4;
+        return sniffed;
+    }
+    // an HTTP/1 request line starts with an upper case method and a space
+    std::size_t method = 0;
+    while (method < size && method < 16 && data[method] >= 'A' && data[method] <= 'Z')
+        ++method;
+    if (method == size && method < 16)
+        return sniffed;
+    if (method > 0 && method < 16 && data[method] == ' ')
+        return sniff_http(data, size);
+    sniffed.complete = true;
+    return sniffed;
+}
+
+// "*.example.com" matches names below example.com, anything else matches itself; case is ignored
+bool match_server_name(const std::string &pattern, std::string_view name)
+{
+    if (!name.empty() && name.back() == '.')
+        name.remove_suffix(1);
+    if (pattern.size() > 2 && pattern[0] == '*' && pattern[1] == '.')
+    {
+        std::size_t suffix = pattern.size() - 1;
+        return name.size() > suffix && strncasecmp(name.data() + name.size() - suffix, pattern.data() + 1, suffix) == 0;
+    }
+    return name.size() == pattern.size() && strncasecmp(name.data(), pattern.data(), name.size()) == 0;
+}
+
+// one entry of a listener's rule table: what the first bytes must show, and where such sessions go
+struct RouteRule
+{
+    SniffedProtocol protocol = SniffedProtocol::unknown; // unknown matches any protocol
+    std::string name;                                    // sni or host pattern, empty matches any
+    std::string label;
+    std::shared_ptr<ResolvedTarget> target;
+    unsigned short target_port = 0;
+    std::unique_ptr<TargetBreakers> breakers; // null unless outlier detection is enabled
+    std::atomic<uint64_t> hits{0};
+
+    bool matches(const Sniffed &sniffed) const
+    {
+        return (protocol == SniffedProtocol::unknown || protocol == sniffed.protocol) &&
+               (name.empty() || match_server_name(name, sniffed.name));
+    }
+};
+
+// routing on a shared listen port: sessions wait for the client's first bytes and take
+// the target of the first rule they match, or the listener's own target
+struct RoutingOptions
+{
+    std::chrono::milliseconds peek_timeout{1000};
+    std::vector<std::unique_ptr<RouteRule>> rules;
+    std::atomic<uint64_t> unmatched{0};
+    std::atomic<uint64_t> timeouts{0};
+
+    RouteRule *match(const Sniffed &sniffed) const
+    {
+        for (const auto &rule : rules)
+        {
+            if (rule->matches(sniffed))
+                return rule.get();
+        }
+        return nullptr;
+    }
+};
+
+class MuxClient;
+struct TlsOptions;
+struct CompressionOptions;
+struct MirrorOptions;
+class CaptureRing;
+class TcpInfoSampler;
+struct TcpInfoMetrics;
+class AccessLog;
+
+// one listening endpoint's settings, parsed once at startup and shared by its sessions
+struct ListenerOptions
+{
+    std::string name;
+    std::shared_ptr<ResolvedTarget> target;
+    unsigned short target_port = 0;
+    std::unique_ptr<TargetBreakers> breakers; // null unless outlier detection is enabled
+    std::size_t buffer_size = 8192;
+    bool tcp_no_delay = true;
+    int retry_attempts = 3;
+    int retry_delay = 2;
+    KeepAliveOptions keep_alive;
+    SockmapSplicer *splicer = nullptr;
+    int splice_idle_timeout = 0;
+    SourceAddressPool *source_pool = nullptr;
+    bool count_bytes = false;
+    std::size_t rate_limit = 0; // bytes per second per direction, 0 = unlimited
+    int proxy_protocol = 0;     // PROXY protocol version sent upstream, 0 = off
+    bool trace_chunks = false;
+    ListenerStats stats;
+    MuxClient *mux_client = nullptr; // near side of a mux tunnel
+    bool mux_server = false;         // far side: accepted sockets are mux connections
+    std::size_t mux_window = 262144; // receive window per stream
+    int mux_keepalive = 10;          // seconds between pings
+    int mux_timeout = 30;            // seconds of silence before a link is dropped
+    MuxStats mux;
+    std::unique_ptr<SealOptions> seal;
+    std::unique_ptr<TlsOptions> tls;
+    std::unique_ptr<CompressionOptions> compression;
+    std::unique_ptr<RoutingOptions> routing;
+    std::unique_ptr<MirrorOptions> mirror;
+    CaptureRing *capture = nullptr; // shared by all listeners, never null
+    TcpInfoSampler *tcp_info_sampler = nullptr; // null unless TCP_INFO sampling is enabled
+    std::unique_ptr<TcpInfoMetrics> tcp_info;
+    AccessLog *access_log = nullptr; // null unless the access log is enabled
+};
+
+// where the payload of a session passes a record layer in user space, if anywhere
+enum class RecordLayer
+{
+    plain,
+    sealed,    // SessionCipher between paired forwarders
+    tls,       // TLS link on a kernel without kTLS
+    compressed // CompressedRecords between paired forwarders
+};
+
+// compile-time feature set of a Session: what each chunk passes through on its way.
+// select_session_starter picks the smallest one a listener's config needs, so a
+// listener that neither counts nor throttles has no branch for either per chunk.
+// PROXY headers go out once per session and chunk tracing follows the log level,
+// so those two stay runtime checks.
+template <bool Spliced, RecordLayer Records, bool Counted, bool RateLimited>
+struct SessionPolicy
+{
+    // the kernel can neither throttle nor transform records
+    static_assert(!Spliced || (Records == RecordLayer::plain && !RateLimited), "no such session");
+
+    static constexpr bool spliced = Spliced;
+    static constexpr RecordLayer records = Records;
+    static constexpr bool layered = Records != RecordLayer::plain;
+    static constexpr bool counted = Counted;
+    static constexpr bool rate_limited = RateLimited;
+};
+
+using PlainPolicy = SessionPolicy<false, RecordLayer::plain, false, false>;
+
+// per-direction token bucket of rate-limited sessions
+struct TokenBucket
+{
+    TokenBucket(boost::asio::io_context &io_context, const ListenerOptions &options)
+        : timer(io_context),
+          rate(static_cast<double>(options.rate_limit)),
+          burst(static_cast<double>(std::max(options.rate_limit, options.buffer_size))),
+          tokens(burst),
+          last_refill(std::chrono::steady_clock::now()) {}
+
+    // takes the bytes just forwarded, returns how long to wait before the next read
+    std::chrono::steady_clock::duration consume(std::size_t bytes)
+    {
+        auto now = std::chrono::steady_clock::now();
+        tokens = std::min(burst, tokens + rate * std::chrono::duration<double>(now - last_refill).count());
+        last_refill = now;
+        tokens -= static_cast<double>(bytes);
+        if (tokens >= 0)
+            return std::chrono::steady_clock::duration::zero();
+        return std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(-tokens / rate));
+    }
+
+    boost::asio::steady_timer timer;
+    double rate;
+    double burst;
+    double tokens;
+    std::chrono::steady_clock::time_point last_refill;
+};
+
+struct NoTokenBucket
+{
+    NoTokenBucket(boost::asio::io_context &, const ListenerOptions &) {}
+};
+
+// one direction of a sealed session. the sealing side opens its stream with a cipher
+// id and a random salt that both ends derive this direction's key from, then sends
+// records of [length][ciphertext][tag] with the record number as nonce. the length
+// travels in the clear but is covered by the tag. an empty record ends the stream, so
+// a stream cut short by anyone but the sealing side fails to open. records are sealed
+// and opened in place in the direction's buffer.
+class SessionCipher
+{
+public:
+    static constexpr std::size_t preamble_size = 33;
+    static constexpr std::size_t header_size = 2;
+    static constexpr std::size_t tag_size = 16;
+    static constexpr std::size_t max_record = 65535;
+
+    SessionCipher(const ListenerOptions &options, bool sealing)
+        : options_(*options.seal), sealing_(sealing), ctx_(EVP_CIPHER_CTX_new()) {}
+
+    ~SessionCipher() { EVP_CIPHER_CTX_free(ctx_); }
+
+    SessionCipher(const SessionCipher &) = delete;
+    SessionCipher &operator=(const SessionCipher &) = delete;
+
+    // the sealing side reads plaintext behind room for the preamble and a header; the
+    // opening side always has room for at least one whole record
+    std::size_t buffer_size(const ListenerOptions &options) const
+    {
+        return preamble_size + header_size + (sealing_ ? std::min(options.buffer_size, max_record) : max_record) + tag_size;
+    }
+
+    boost::asio::mutable_buffer read_buffer(std::vector<char> &buffer) const
+    {
+        if (sealing_)
+            return boost::asio::buffer(buffer.data() + preamble_size + header_size, buffer.size() - preamble_size - header_size - tag_size);
+        return boost::asio::buffer(buffer.data() + fill_, buffer.size() - fill_);
+    }
+
+    // turns `length` bytes just read into output(); false when the peer's stream fails
+    // to authenticate. the output may be empty while a record is still incomplete.
+    bool transform(std::vector<char> &buffer, std::size_t length)
+    {
+        return sealing_ ? seal(buffer, length) : open(buffer, length);
+    }
+
+    boost::asio::const_buffer output() const { return output_; }
+
+    // the sealing side's source ended: output() is the record that ends the stream
+    bool seal_end(std::vector<char> &buffer) { return seal(buffer, 0); }
+
+    // the peer's stream ended with its closing record
+    bool finished() const { return finished_; }
+
+    // the output is written; what is left of a partial record moves to the front
+    void written(std::vector<char> &buffer)
+    {
+        if (consumed_ > 0)
+        {
+            std::memmove(buffer.data(), buffer.data() + consumed_, fill_ - consumed_);
+            fill_ -= consumed_;
+            consumed_ = 0;
+        }
+    }
+
+private:
+    bool seal(std::vector<char> &buffer, std::size_t length)
+    {
+        unsigned char *start = reinterpret_cast<unsigned char *>(buffer.data());
+        bool first = !keyed_;
+        if (first)
+        {
+            start[0] = static_cast<uint8_t>(options_.cipher);
+            if (RAND_bytes(start + 1, 32) != 1 || !set_key(start[0], start + 1))
+                return false;
+        }
+
+        unsigned char *record = start + preamble_size;
+        record[0] = static_cast<unsigned char>(length >> 8);
+        record[1] = static_cast<unsigned char>(length & 0xff);
+        unsigned char *payload = record + header_size;
+        int out_length = 0;
+        if (EVP_EncryptInit_ex(ctx_, nullptr, nullptr, nullptr, next_nonce()) != 1 ||
+            EVP_EncryptUpdate(ctx_, nullptr, &out_length, record, header_size) != 1 ||
+            EVP_EncryptUpdate(ctx_, payload, &out_length, payload, static_cast<int>(length)) != 1 ||
+            EVP_EncryptFinal_ex(ctx_, payload + length, &out_length) != 1 ||
+            EVP_CIPHER_CTX_ctrl(ctx_, EVP_CTRL_AEAD_GET_TAG, tag_size, payload + length) != 1)
+            return false;
+
+        unsigned char *begin = first ? start : record;
+        output_ = boost::asio::buffer(begin, payload + length + tag_size - begin);
+        return true;
+    }
+
+    bool open(std::vector<char> &buffer, std::size_t length)
+    {
+        fill_ += length;
+        unsigned char *data = reinterpret_cast<unsigned char *>(buffer.data());
+        std::size_t pos = 0;
+        if (!keyed_)
+        {
+            if (fill_ < preamble_size)
+            {
+                output_ = boost::asio::const_buffer();
+                return true;
+            }
+            if (!set_key(data[0], data + 1))
+                return false;
+            pos = preamble_size;
+        }
+
+        // plaintexts of later records in the same read move up behind the first one
+        unsigned char *out = nullptr;
+        std::size_t out_length = 0;
+        while (fill_ - pos >= header_size)
+        {
+            if (finished_)
+                return false; // nothing follows the closing record
+            std::size_t record_length = (std::size_t(data[pos]) << 8) | data[pos + 1];
+            if (fill_ - pos < header_size + record_length + tag_size)
+                break;
+
+            unsigned char *payload = data + pos + header_size;
+            int ignored = 0;
+            if (EVP_DecryptInit_ex(ctx_, nullptr, nullptr, nullptr, next_nonce()) != 1 ||
+                EVP_DecryptUpdate(ctx_, nullptr, &ignored, data + pos, header_size) != 1 ||
+                EVP_DecryptUpdate(ctx_, payload, &ignored, payload, static_cast<int>(record_length)) != 1 ||
+                EVP_CIPHER_CTX_ctrl(ctx_, EVP_CTRL_AEAD_SET_TAG, tag_size, payload + record_length) != 1 ||
+                EVP_DecryptFinal_ex(ctx_, payload + record_length, &ignored) != 1)
+                return false;
+            if (record_length == 0)
+                finished_ = true;
+
+            if (!out)
+                out = payload;
+            else if (out + out_length != payload)
+                std::memmove(out + out_length, payload, record_length);
+            out_length += record_length;
+            pos += header_size + record_length + tag_size;
+        }
+        consumed_ = pos;
+        output_ = boost::asio::const_buffer(out, out_length);
+        return true;
+    }
+
+    // a fresh key for this direction of this session, so record numbers never repeat under one key
+    bool set_key(uint8_t cipher_id, const unsigned char *salt)
+    {
+        const EVP_CIPHER *cipher = seal_cipher(cipher_id);
+        if (!cipher)
+            return false;
+
+        static const unsigned char info[] = "proxyforwarder session";
+        unsigned char key[32];
+        std::size_t key_length = sizeof(key);
+        EVP_PKEY_CTX *kdf = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr);
+        bool derived = kdf && EVP_PKEY_derive_init(kdf) > 0 && EVP_PKEY_CTX_set_hkdf_md(kdf, EVP_sha256()) > 0 &&
+                       EVP_PKEY_CTX_set1_hkdf_salt(kdf, salt, 32) > 0 && EVP_PKEY_CTX_set1_hkdf_key(kdf, options_.key, 32) > 0 &&
+                       EVP_PKEY_CTX_add1_hkdf_info(kdf, info, sizeof(info) - 1) > 0 && EVP_PKEY_derive(kdf, key, &key_length) > 0;
+        EVP_PKEY_CTX_free(kdf);
+
+        bool ready = derived && (sealing_ ? EVP_EncryptInit_ex(ctx_, cipher, nullptr, key, nullptr)
+                                          : EVP_DecryptInit_ex(ctx_, cipher, nullptr, key, nullptr)) == 1;
+        OPENSSL_cleanse(key, sizeof(key));
+        keyed_ = ready;
+        return ready;
+    }
+
+    const unsigned char *next_nonce()
+    {
+        uint64_t counter = counter_++;
+        for (int i = 0; i < 8; ++i)
+            nonce_[i] = static_cast<unsigned char>(counter >> (8 * i));
+        return nonce_;
+    }
+
+    const SealOptions &options_;
+    bool sealing_;
+    EVP_CIPHER_CTX *ctx_;
+    bool keyed_ = false;
+    bool finished_ = false;
+    uint64_t counter_ = 0;
+    unsigned char nonce_[12] = {0};
+    std::size_t fill_ = 0;
+    std::size_t consumed_ = 0;
+    boost::asio::const_buffer output_;
+};
+
+struct NoSessionCipher
+{
+    NoSessionCipher(const ListenerOptions &, bool) {}
+
+    std::size_t buffer_size(const ListenerOptions &options) const { return options.buffer_size; }
+};
+
+// TLS 1.3 on the link between paired forwarders. with SSL_OP_ENABLE_KTLS OpenSSL
+// hands each direction to the kernel (kTLS) as its keys are set, and sessions treat
+// that direction of the socket as plain.
+struct TlsOptions
+{
+    ~TlsOptions() { SSL_CTX_free(ctx); }
+
+    bool client = true; // the client side's target is the paired forwarder, the server side's clients are
+    SSL_CTX *ctx = nullptr;
+    std::string server_name;
+    bool ktls = true; // false keeps every record in user space
+    std::atomic<uint64_t> handshakes{0};
+    std::atomic<uint64_t> handshake_failures{0};
+    std::atomic<uint64_t> ktls_sessions{0};  // both directions in the kernel
+    std::atomic<uint64_t> ktls_fallbacks{0}; // at least one direction stayed in user space
+};
+
+// one session's TLS connection. after the handshake the directions the kernel did not
+// take move to memory BIOs, and the session's two TlsRecords take turns on the SSL object.
+struct TlsLink
+{
+    ~TlsLink() { SSL_free(ssl); }
+
+    SSL *ssl = nullptr;
+    std::mutex mutex;
+};
+
+std::string tls_error()
+{
+    char text[256];
+    ERR_error_string_n(ERR_get_error(), text, sizeof(text));
+    return text;
+}
+
+std::unique_ptr<TlsOptions> make_tls_options(const YAML::Node &node)
+{
+    auto tls = std::make_unique<TlsOptions>();
+    std::string side = node["side"].as<std::string>();
+    if (side != "client" && side != "server")
+        throw std::runtime_error("'tls.side' must be client or server");
+    tls->client = side == "client";
+
+    tls->ctx = SSL_CTX_new(tls->client ? TLS_client_method() : TLS_server_method());
+    if (!tls->ctx)
+        throw std::runtime_error("creating TLS context failed: " + tls_error());
+    SSL_CTX_set_min_proto_version(tls->ctx, TLS1_3_VERSION);
+    // tickets are not used by the pair, and no record should follow the handshake
+    SSL_CTX_set_num_tickets(tls->ctx, 0);
+    SSL_CTX_set_session_cache_mode(tls->ctx, SSL_SESS_CACHE_OFF);
+
+    if (node["certificate"] || !tls->client)
+    {
+        std::string certificate = node["certificate"].as<std::string>();
+        std::string private_key = node["private_key"].as<std::string>();
+        if (SSL_CTX_use_certificate_chain_file(tls->ctx, certificate.c_str()) != 1 ||
+            SSL_CTX_use_PrivateKey_file(tls->ctx, private_key.c_str(), SSL_FILETYPE_PEM) != 1 ||
+            SSL_CTX_check_private_key(tls->ctx) != 1)
+            throw std::runtime_error("loading TLS certificate " + certificate + " failed: " + tls_error());
+    }
+    if (node["ca"])
+    {
+        // the client verifies the server; a server with a ca requires client certificates
+        std::string ca = node["ca"].as<std::string>();
+        if (SSL_CTX_load_verify_locations(tls->ctx, ca.c_str(), nullptr) != 1)
+            throw std::runtime_error("loading TLS ca " + ca + " failed: " + tls_error());
+        SSL_CTX_set_verify(tls->ctx, SSL_VERIFY_PEER | (tls->client ? 0 : SSL_VERIFY_FAIL_IF_NO_PEER_CERT), nullptr);
+    }
+    if (node["server_name"])
+        tls->server_name = node["server_name"].as<std::string>();
+
+    // OpenSSL tries TLS_TX and TLS_RX per session and keeps a direction in user space
+    // when the kernel refuses it, so nothing is probed here
+    tls->ktls = !node["ktls"] || node["ktls"].as<bool>();
+    if (tls->ktls)
+        SSL_CTX_set_options(tls->ctx, SSL_OP_ENABLE_KTLS);
+    return tls;
+}
+
+// one direction of a TLS link. a direction the kernel took passes the socket's bytes
+// as they are; otherwise the SSL object seals or opens them against memory BIOs.
+class TlsRecords
+{
+public:
+    TlsRecords(const ListenerOptions &, bool sealing) : sealing_(sealing) {}
+
+    std::size_t buffer_size(const ListenerOptions &options) const { return options.buffer_size; }
+
+    boost::asio::mutable_buffer read_buffer(std::vector<char> &buffer) const { return boost::asio::buffer(buffer); }
+
+    void attach(std::shared_ptr<TlsLink> link, bool kernel)
+    {
+        link_ = std::move(link);
+        kernel_ = kernel;
+    }
+
+    bool transform(std::vector<char> &buffer, std::size_t length)
+    {
+        if (kernel_)
+        {
+            chunk_ = boost::asio::buffer(buffer.data(), length);
+            return true;
+        }
+        std::lock_guard<std::mutex> lock(link_->mutex);
+        ERR_clear_error();
+        bool done = sealing_ ? seal(buffer.data(), length) : open(buffer.data(), length);
+        chunk_ = boost::asio::buffer(out_.data(), out_length_);
+        return done;
+    }
+
+    boost::asio::const_buffer output() const { return chunk_; }
+
+    void written(std::vector<char> &) {}
+
+private:
+    bool seal(const char *data, std::size_t length)
+    {
+        out_length_ = 0;
+        if (SSL_write(link_->ssl, data, static_cast<int>(length)) <= 0)
+            return false;
+        BIO *records = SSL_get_wbio(link_->ssl);
+        out_length_ = BIO_ctrl_pending(records);
+        if (out_.size() < out_length_)
+            out_.resize(out_length_);
+        return BIO_read(records, out_.data(), static_cast<int>(out_length_)) == static_cast<int>(out_length_);
+    }
+
+    bool open(const char *data, std::size_t length)
+    {
+        out_length_ = 0;
+        if (BIO_write(SSL_get_rbio(link_->ssl), data, static_cast<int>(length)) != static_cast<int>(length))
+            return false;
+        for (;;)
+        {
+            if (out_.size() - out_length_ < 16384)
+                out_.resize(out_length_ + 16384);
+            int n = SSL_read(link_->ssl, out_.data() + out_length_, static_cast<int>(out_.size() - out_length_));
+            if (n > 0)
+            {
+                out_length_ += static_cast<std::size_t>(n);
+                continue;
+            }
+            int error = SSL_get_error(link_->ssl, n);
+            return error == SSL_ERROR_WANT_READ || error == SSL_ERROR_ZERO_RETURN;
+        }
+    }
+
+    bool sealing_;
+    bool kernel_ = false;
+    std::shared_ptr<TlsLink> link_;
+    std::vector<char> out_;
+    std::size_t out_length_ = 0;
+    boost::asio::const_buffer chunk_;
+};
+
+enum class CompressionAlgorithm : uint8_t
+{
+    lz4 = 1,
+    zstd = 2
+};
+
+// idle codec contexts of one listener. sessions take theirs from here, so a busy
+// listener stops allocating compression state once it has warmed up
+template <typename Context>
+class ContextPool
+{
+public:
+    std::unique_ptr<Context> acquire()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (idle_.empty())
+            return std::make_unique<Context>();
+        std::unique_ptr<Context> context = std::move(idle_.back());
+        idle_.pop_back();
+        return context;
+    }
+
+    void release(std::unique_ptr<Context> context)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (context && idle_.size() < max_idle)
+            idle_.push_back(std::move(context));
+    }
+
+    static constexpr std::size_t max_idle = 64;
+
+private:
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<Context>> idle_;
+};
+
+// lz4 blocks refer back into the previous 64 KiB, so each block stays put in a ring
+// that both ends wrap at the same point
+struct StreamCompressor
+{
+    ~StreamCompressor()
+    {
+        ZSTD_freeCCtx(zstd);
+        LZ4_freeStream(lz4);
+    }
+
+    ZSTD_CCtx *zstd = nullptr;
+    LZ4_stream_t *lz4 = nullptr;
+    std::vector<char> ring;
+    std::size_t ring_pos = 0;
+};
+
+struct StreamDecompressor
+{
+    ~StreamDecompressor()
+    {
+        ZSTD_freeDCtx(zstd);
+        LZ4_freeStreamDecode(lz4);
+    }
+
+    ZSTD_DCtx *zstd = nullptr;
+    LZ4_streamDecode_t *lz4 = nullptr;
+    std::vector<char> ring;
+    std::size_t ring_pos = 0;
+};
+
+// compression between paired forwarders, with the same sides as encryption
+struct CompressionOptions
+{
+    bool compress_upstream = true;
+    CompressionAlgorithm algorithm = CompressionAlgorithm::zstd;
+    int level = 1;
+    bool bypass = true; // incompressible data goes out as is
+    ContextPool<StreamCompressor> compressors;
+    ContextPool<StreamDecompressor> decompressors;
+    std::atomic<uint64_t> raw_out{0};  // bytes handed to the compressing side
+    std::atomic<uint64_t> wire_out{0}; // what it sent, framing included
+    std::atomic<uint64_t> bypassed{0}; // raw_out bytes sent uncompressed
+    std::atomic<uint64_t> wire_in{0};
+    std::atomic<uint64_t> raw_in{0};
+    std::atomic<uint64_t> compress_ns{0};
+    std::atomic<uint64_t> decompress_ns{0};
+};
+
+CompressionAlgorithm parse_compression_algorithm(const std::string &name)
+{
+    if (name == "zstd")
+        return CompressionAlgorithm::zstd;
+    if (name == "lz4")
+        return CompressionAlgorithm::lz4;
+    throw std::runtime_error("'compression.algorithm' must be zstd or lz4");
+}
+
+// one direction of a compressed session. the stream is a series of frames of
+// [type][24-bit length][payload]: a hello naming the algorithm and block size, then
+// compressed blocks, and raw blocks for data that does not compress. reads that
+// leave more data queued on the socket are compressed without a flush, so bulk
+// transfers get large blocks and interactive sessions never wait for more input.
+class CompressedRecords
+{
+public:
+    static constexpr std::size_t header_size = 4;
+    static constexpr std::size_t max_block = 65536;
+    static constexpr std::size_t max_payload = max_block + 512; // LZ4_COMPRESSBOUND(max_block) fits
+    static constexpr std::size_t max_output = 16 << 20;        // plaintext of one read, caps decompression bombs
+    static constexpr std::size_t min_block = 64;               // smaller reads go out raw
+    static constexpr std::size_t judge_after = 256 * 1024;     // ratio check within long zstd blocks
+    static constexpr int zstd_window_log = 17;
+
+    CompressedRecords(const ListenerOptions &options, bool compressing)
+        : options_(*options.compression), compressing_(compressing), block_(std::min(options.buffer_size, max_block))
+    {
+        if (compressing_)
+        {
+            context_ = options_.compressors.acquire();
+            if (options_.algorithm == CompressionAlgorithm::zstd)
+            {
+                if (context_->zstd)
+                {
+                    ZSTD_CCtx_reset(context_->zstd, ZSTD_reset_session_only);
+                }
+                else if ((context_->zstd = ZSTD_createCCtx()))
+                {
+                    ZSTD_CCtx_setParameter(context_->zstd, ZSTD_c_compressionLevel, options_.level);
+                    ZSTD_CCtx_setParameter(context_->zstd, ZSTD_c_windowLog, zstd_window_log);
+                }
+            }
+            else
+            {
+                if (context_->lz4)
+                    LZ4_resetStream_fast(context_->lz4);
+                else
+                    context_->lz4 = LZ4_createStream();
+                context_->ring.resize(64 * 1024 + 2 * block_);
+                context_->ring_pos = 0;
+            }
+        }
+        else
+        {
+            decoder_ = options_.decompressors.acquire();
+            if (decoder_->zstd)
+                ZSTD_DCtx_reset(decoder_->zstd, ZSTD_reset_session_only);
+            if (decoder_->lz4)
+                LZ4_setStreamDecode(decoder_->lz4, nullptr, 0);
+            decoder_->ring_pos = 0;
+        }
+    }
+
+    ~CompressedRecords()
+    {
+        options_.compressors.release(std::move(context_));
+        options_.decompressors.release(std::move(decoder_));
+    }
+
+    CompressedRecords(const CompressedRecords &) = delete;
+    CompressedRecords &operator=(const CompressedRecords &) = delete;
+
+    std::size_t buffer_size(const ListenerOptions &) const { return compressing_ ? block_ : header_size + max_payload; }
+
+    boost::asio::mutable_buffer read_buffer(std::vector<char> &buffer) const
+    {
+        if (compressing_)
+            return boost::asio::buffer(buffer);
+        return boost::asio::buffer(buffer.data() + fill_, buffer.size() - fill_);
+    }
+
+    // true when the read filled the buffer and more is queued: no flush yet
+    void expect_more(bool more) { more_ = more; }
+
+    bool transform(std::vector<char> &buffer, std::size_t length)
+    {
+        auto start = std::chrono::steady_clock::now();
+        bool done = compressing_ ? compress(buffer.data(), length) : decompress(buffer, length);
+        uint64_t spent = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        (compressing_ ? options_.compress_ns : options_.decompress_ns).fetch_add(spent, std::memory_order_relaxed);
+        return done;
+    }
+
+    boost::asio::const_buffer output() const { return boost::asio::buffer(out_.data(), out_length_); }
+
+    void written(std::vector<char> &buffer)
+    {
+        if (consumed_ > 0)
+        {
+            std::memmove(buffer.data(), buffer.data() + consumed_, fill_ - consumed_);
+            fill_ -= consumed_;
+            consumed_ = 0;
+        }
+    }
+
+private:
+    enum FrameType : uint8_t
+    {
+        raw = 0,
+        lz4 = 1,
+        zstd = 2,
+        hello = 0x7f
+    };
+
+    bool compress(const char *data, std::size_t length)
+    {
+        out_length_ = 0;
+        if (!hello_sent_)
+        {
+            std::size_t at = reserve_frame(4);
+            out_[at] = static_cast<char>(options_.algorithm);
+            put_u24(out_.data() + at + 1, block_);
+            commit_frame(hello, at, 4);
+            hello_sent_ = true;
+        }
+        options_.raw_out.fetch_add(length, std::memory_order_relaxed);
+
+        // a zstd block left open by the last read must be finished before raw data can pass it
+        if (!pending_ && (length < min_block || (options_.bypass && skip_ > 0)))
+        {
+            if (length >= min_block)
+                --skip_;
+            std::size_t at = reserve_frame(length);
+            std::memcpy(out_.data() + at, data, length);
+            commit_frame(raw, at, length);
+            options_.bypassed.fetch_add(length, std::memory_order_relaxed);
+            options_.wire_out.fetch_add(out_length_, std::memory_order_relaxed);
+            return true;
+        }
+
+        if (!context_->zstd && !context_->lz4)
+            return false;
+        std::size_t before = out_length_;
+        if (options_.algorithm == CompressionAlgorithm::zstd)
+        {
+            if (!zstd_stream(data, length, more_ ? ZSTD_e_continue : ZSTD_e_flush))
+                return false;
+            pending_ = more_;
+        }
+        else
+        {
+            std::vector<char> &ring = context_->ring;
+            if (context_->ring_pos + block_ > ring.size())
+                context_->ring_pos = 0;
+            char *source = ring.data() + context_->ring_pos;
+            std::memcpy(source, data, length);
+            std::size_t at = reserve_frame(max_payload);
+            int size = LZ4_compress_fast_continue(context_->lz4, source, out_.data() + at, static_cast<int>(length), static_cast<int>(max_payload), 1);
+            if (size <= 0)
+                return false;
+            context_->ring_pos += length;
+            commit_frame(lz4, at, static_cast<std::size_t>(size));
+        }
+
+        block_raw_ += length;
+        block_wire_ += out_length_ - before;
+        if (!pending_ || block_raw_ >= judge_after)
+        {
+            // a block that saved less than 1/16 backs off for 8 reads, doubling up to 256.
+            // a long zstd block is judged on the way and closed so raw frames can follow
+            if (block_wire_ * 16 > block_raw_ * 15)
+            {
+                backoff_ = std::min<std::size_t>(backoff_ ? backoff_ * 2 : 8, 256);
+                skip_ = backoff_;
+                if (pending_ && !zstd_stream(nullptr, 0, ZSTD_e_flush))
+                    return false;
+                pending_ = false;
+            }
+            else
+            {
+                backoff_ = 0;
+            }
+            block_raw_ = 0;
+            block_wire_ = 0;
+        }
+        options_.wire_out.fetch_add(out_length_, std::memory_order_relaxed);
+        return true;
+    }
+
+    bool zstd_stream(const char *data, std::size_t length, ZSTD_EndDirective mode)
+    {
+        ZSTD_inBuffer in{data, length, 0};
+        for (;;)
+        {
+            std::size_t at = reserve_frame(max_payload);
+            ZSTD_outBuffer out{out_.data() + at, max_payload, 0};
+            std::size_t left = ZSTD_compressStream2(context_->zstd, &out, &in, mode);
+            if (ZSTD_isError(left))
+                return false;
+            commit_frame(zstd, at, out.pos);
+            if (in.pos == in.size && (mode == ZSTD_e_continue || left == 0))
+                return true;
+        }
+    }
+
+    bool decompress(std::vector<char> &buffer, std::size_t length)
+    {
+        fill_ += length;
+        options_.wire_in.fetch_add(length, std::memory_order_relaxed);
+        const unsigned char *data = reinterpret_cast<const unsigned char *>(buffer.data());
+        std::size_t pos = 0;
+        out_length_ = 0;
+        while (fill_ - pos >= header_size)
+        {
+            std::size_t size = get_u24(data + pos + 1);
+            if (size > max_payload)
+                return false;
+            if (fill_ - pos < header_size + size)
+                break;
+
+            const char *payload = buffer.data() + pos + header_size;
+            switch (data[pos])
+            {
+            case hello:
+                if (size != 4 || !start_decoding(static_cast<uint8_t>(payload[0]), get_u24(data + pos + header_size + 1)))
+                    return false;
+                break;
+            case raw:
+                std::memcpy(reserve(size), payload, size);
+                out_length_ += size;
+                break;
+            case zstd:
+                if (!decode_zstd(payload, size))
+                    return false;
+                break;
+            case lz4:
+                if (!decode_lz4(payload, size))
+                    return false;
+                break;
+            default:
+                return false;
+            }
+            if (out_length_ > max_output)
+                return false;
+            pos += header_size + size;
+        }
+        consumed_ = pos;
+        options_.raw_in.fetch_add(out_length_, std::memory_order_relaxed);
+        return true;
+    }
+
+    bool start_decoding(uint8_t algorithm, std::size_t block)
+    {
+        if (block == 0 || block > max_block)
+            return false;
+        if (algorithm == static_cast<uint8_t>(CompressionAlgorithm::zstd))
+        {
+            if (!decoder_->zstd)
+            {
+                decoder_->zstd = ZSTD_createDCtx();
+                if (!decoder_->zstd || ZSTD_isError(ZSTD_DCtx_setParameter(decoder_->zstd, ZSTD_d_windowLogMax, zstd_window_log)))
+                    return false;
+            }
+            peer_ = zstd;
+            return true;
+        }
+        if (algorithm == static_cast<uint8_t>(CompressionAlgorithm::lz4))
+        {
+            if (!decoder_->lz4 && !(decoder_->lz4 = LZ4_createStreamDecode()))
+                return false;
+            peer_block_ = block;
+            decoder_->ring.resize(64 * 1024 + 2 * block);
+            peer_ = lz4;
+            return true;
+        }
+        return false;
+    }
+
+    bool decode_zstd(const char *payload, std::size_t size)
+    {
+        if (peer_ != zstd)
+            return false;
+        ZSTD_inBuffer in{payload, size, 0};
+        for (;;)
+        {
+            char *at = reserve(max_block);
+            ZSTD_outBuffer out{at, max_block, 0};
+            std::size_t result = ZSTD_decompressStream(decoder_->zstd, &out, &in);
+            if (ZSTD_isError(result))
+                return false;
+            out_length_ += out.pos;
+            // a full output buffer may leave more behind in the context
+            if (in.pos == in.size && out.pos < out.size)
+                return true;
+            if (out_length_ > max_output)
+                return false;
+        }
+    }
+
+    bool decode_lz4(const char *payload, std::size_t size)
+    {
+        if (peer_ != lz4)
+            return false;
+        std::vector<char> &ring = decoder_->ring;
+        if (decoder_->ring_pos + peer_block_ > ring.size())
+            decoder_->ring_pos = 0;
+        char *target = ring.data() + decoder_->ring_pos;
+        int decoded = LZ4_decompress_safe_continue(decoder_->lz4, payload, target, static_cast<int>(size), static_cast<int>(peer_block_));
+        if (decoded < 0)
+            return false;
+        decoder_->ring_pos += static_cast<std::size_t>(decoded);
+        std::memcpy(reserve(decoded), target, decoded);
+        out_length_ += static_cast<std::size_t>(decoded);
+        return true;
+    }
+
+    char *reserve(std::size_t size)
+    {
+        if (out_.size() < out_length_ + size)
+            out_.resize(out_length_ + size);
+        return out_.data() + out_length_;
+    }
+
+    // room for a frame of up to `size` payload bytes, returns the payload offset
+    std::size_t reserve_frame(std::size_t size)
+    {
+        reserve(header_size + size);
+        return out_length_ + header_size;
+    }
+
+    // frames that came out empty are dropped
+    void commit_frame(FrameType type, std::size_t at, std::size_t size)
+    {
+        if (size == 0 && type != hello)
+            return;
+        char *header = out_.data() + at - header_size;
+        header[0] = static_cast<char>(type);
+        put_u24(header + 1, size);
+        out_length_ = at + size;
+    }
+
+    static void put_u24(char *at, std::size_t value)
+    {
+        at[0] = static_cast<char>(value >> 16);
+        at[1] = static_cast<char>(value >> 8);
+        at[2] = static_cast<char>(value);
+    }
+
+    static std::size_t get_u24(const unsigned char *at)
+    {
+        return (std::size_t(at[0]) << 16) | (std::size_t(at[1]) << 8) | at[2];
+    }
+
+    CompressionOptions &options_;
+    bool compressing_;
+    std::size_t block_;
+    std::unique_ptr<StreamCompressor> context_;
+    std::unique_ptr<StreamDecompressor> decoder_;
+    bool hello_sent_ = false;
+    bool more_ = false;
+    bool pending_ = false; // zstd holds input that is not flushed yet
+    std::size_t block_raw_ = 0;
+    std::size_t block_wire_ = 0;
+    std::size_t backoff_ = 0;
+    std::size_t skip_ = 0;
+    uint8_t peer_ = raw; // algorithm named by the peer's hello
+    std::size_t peer_block_ = 0;
+    std::size_t fill_ = 0;
+    std::size_t consumed_ = 0;
+    std::vector<char> out_;
+    std::size_t out_length_ = 0;
+};
+
+// copies of a listener's sessions for a shadow target, e.g. a new backend under real load
+struct MirrorOptions
+{
+    std::shared_ptr<ResolvedTarget> target;
+    unsigned short target_port = 0;
+    bool both = false;                // downstream too, over a second connection per session
+    std::size_t queue_bytes = 1 << 20; // per direction of each session
+    std::atomic<uint64_t> streams{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> dropped_bytes{0};
+    std::atomic<uint64_t> cut_streams{0};
+    std::atomic<uint64_t> connect_failures{0};
+};
+
+// bytes of mirror pipes grown past the default size, process-wide. pipe pages are a
+// per-user budget (fs.pipe-user-pages-soft): once it is used up, every new pipe of the
+// user gets two pages, the sessions' own included. so mirror pipes only grow while all
+// of them together stay within half of it, and otherwise keep the default size.
+std::atomic<std::size_t> mirror_pipe_bytes{0};
+
+std::size_t mirror_pipe_budget()
+{
+    static const std::size_t budget = []
+    {
+        std::size_t pages = 16384; // the kernel's default
+        std::ifstream limit("/proc/sys/fs/pipe-user-pages-soft");
+        limit >> pages;
+        return pages == 0 ? SIZE_MAX : pages * static_cast<std::size_t>(sysconf(_SC_PAGESIZE)) / 2;
+    }();
+    return budget;
+}
+
+// one direction of a session on its way to the shadow target. a pipe is the queue: the
+// session puts bytes in without waiting (tee() from its own pipe, or write()), and they
+// are spliced on to the shadow socket. bytes that do not fit are dropped, and as a
+// stream with a hole is of no use to the shadow, its copy ends there. the session never
+// notices; the stream drains on its own and lingers a little after the session ended.
+class MirrorStream : public std::enable_shared_from_this<MirrorStream>
+{
+public:
+    MirrorStream(boost::asio::io_context &io_context, MirrorOptions &options, Logger &logger)
+        : socket_(io_context), linger_(io_context), options_(options), logger_(logger) {}
+
+    ~MirrorStream()
+    {
+        close_pipe();
+    }
+
+    void start()
+    {
+        auto addresses = options_.target->addresses();
+        if (addresses->empty() || pipe2(pipe_, O_NONBLOCK | O_CLOEXEC) < 0)
+        {
+            ++options_.connect_failures;
+            pipe_[0] = pipe_[1] = -1;
+            stopped_ = true;
+            return;
+        }
+        grow_pipe();
+        ++options_.streams;
+
+        tcp::endpoint shadow((*addresses)[options_.target->rotate() % addresses->size()], options_.target_port);
+        auto self(shared_from_this());
+        socket_.async_connect(shadow, [this, self](boost::system::error_code ec)
+                              {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stopped_)
+                return;
+            if (ec)
+            {
+                ++options_.connect_failures;
+                logger_.debug("Connecting to the shadow target failed: " + ec.message());
+                cut(queued_);
+                return;
+            }
+            socket_.native_non_blocking(true, ec);
+            connected_ = true;
+            discard_responses();
+            drain(); });
+    }
+
+    // user space: the session's plaintext chunk
+    void write(const char *data, std::size_t length)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopped_)
+        {
+            options_.dropped_bytes.fetch_add(length, std::memory_order_relaxed);
+            return;
+        }
+        ssize_t written = ::write(pipe_[1], data, length);
+        accepted(length, written);
+    }
+
+    // kernel: the first length bytes waiting in the session's own pipe, left in place there
+    void tee(int session_pipe, std::size_t length)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopped_)
+        {
+            options_.dropped_bytes.fetch_add(length, std::memory_order_relaxed);
+            return;
+        }
+        ssize_t copied = ::tee(session_pipe, pipe_[1], length, SPLICE_F_NONBLOCK);
+        accepted(length, copied);
+    }
+
+    // the session is over: the copy gets linger_seconds to reach the shadow, which then
+    // sees the stream end like the target did
+    void finish()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (finished_ || stopped_)
+            return;
+        finished_ = true;
+        auto self(shared_from_this());
+        linger_.expires_after(std::chrono::seconds(linger_seconds));
+        linger_.async_wait([this, self](boost::system::error_code ec)
+                           {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!ec && !stopped_)
+            {
+                // whatever the shadow has not taken by now is lost with the socket
+                int unsent = 0;
+                if (connected_ && ioctl(socket_.native_handle(), SIOCOUTQ, &unsent) < 0)
+                    unsent = 0;
+                std::size_t lost = queued_ + static_cast<std::size_t>(unsent);
+                if (lost > 0)
+                    cut(lost);
+                else
+                    stop();
+            } });
+        drain();
+    }
+
+private:
+    static constexpr int linger_seconds = 5;
+
+    void accepted(std::size_t length, ssize_t taken)
+    {
+        std::size_t kept = taken > 0 ? static_cast<std::size_t>(taken) : 0;
+        queued_ += kept;
+        options_.bytes.fetch_add(kept, std::memory_order_relaxed);
+        if (kept < length)
+        {
+            cut(length - kept);
+            return;
+        }
+        drain();
+    }
+
+    void drain()
+    {
+        if (!connected_ || draining_ || stopped_)
+            return;
+        while (queued_ > 0)
+        {
+            ssize_t moved = splice(pipe_[0], nullptr, socket_.native_handle(), nullptr, queued_, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (moved > 0)
+            {
+                queued_ -= static_cast<std::size_t>(moved);
+                continue;
+            }
+            if (moved < 0 && errno == EAGAIN)
+            {
+                draining_ = true;
+                auto self(shared_from_this());
+                socket_.async_wait(tcp::socket::wait_write, [this, self](boost::system::error_code ec)
+                                   {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    draining_ = false;
+                    if (!ec)
+                        drain(); });
+                return;
+            }
+            cut(queued_);
+            return;
+        }
+        if (finished_ && !send_closed_)
+        {
+            // closing now would reset the connection over unread responses and lose
+            // what the socket still holds, so only the sending side closes
+            boost::system::error_code ec;
+            socket_.shutdown(tcp::socket::shutdown_send, ec);
+            send_closed_ = true;
+        }
+    }
+
+    // shadow responses are dropped in the kernel, MSG_TRUNC copies nothing
+    void discard_responses()
+    {
+        auto self(shared_from_this());
+        socket_.async_wait(tcp::socket::wait_read, [this, self](boost::system::error_code ec)
+                           {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (ec || stopped_)
+                return;
+            while (true)
+            {
+                ssize_t length = recv(socket_.native_handle(), nullptr, 1 << 16, MSG_TRUNC | MSG_DONTWAIT);
+                if (length > 0)
+                    continue;
+                if (length < 0 && errno == EAGAIN)
+                {
+                    discard_responses();
+                    return;
+                }
+                if (send_closed_)
+                    stop();
+                else
+                    cut(queued_); // the shadow hung up early
+                return;
+            }
+        });
+    }
+
+    void cut(std::size_t dropped)
+    {
+        options_.dropped_bytes.fetch_add(dropped, std::memory_order_relaxed);
+        if (!stopped_)
+        {
+            ++options_.cut_streams;
+            logger_.debug("Mirror stream cut, " + std::to_string(dropped) + " bytes dropped");
+        }
+        stop();
+    }
+
+    void stop()
+    {
+        stopped_ = true;
+        queued_ = 0;
+        linger_.cancel();
+        boost::system::error_code ec;
+        socket_.close(ec);
+        close_pipe();
+    }
+
+    // queue_bytes of pipe, if the process-wide budget has room for it
+    void grow_pipe()
+    {
+        std::size_t wanted = std::min<std::size_t>(options_.queue_bytes, INT_MAX);
+        if (mirror_pipe_bytes.fetch_add(wanted) + wanted > mirror_pipe_budget())
+        {
+            mirror_pipe_bytes -= wanted;
+            logger_.debug("Mirror pipes are at their budget, this queue stays at the default pipe size.");
+            return;
+        }
+        int capacity = fcntl(pipe_[1], F_SETPIPE_SZ, static_cast<int>(wanted));
+        if (capacity < 0)
+        {
+            mirror_pipe_bytes -= wanted;
+            logger_.debug("Mirror queue stays at the default pipe size: " + std::string(strerror(errno)));
+            return;
+        }
+        grown_ = static_cast<std::size_t>(capacity);
+        mirror_pipe_bytes += grown_;
+        mirror_pipe_bytes -= wanted;
+    }
+
+    void close_pipe()
+    {
+        for (int &fd : pipe_)
+        {
+            if (fd != -1)
+                ::close(fd);
+            fd = -1;
+        }
+        mirror_pipe_bytes -= grown_;
+        grown_ = 0;
+    }
+
+    tcp::socket socket_;
+    boost::asio::steady_timer linger_;
+    MirrorOptions &options_;
+    Logger &logger_;
+    std::mutex mutex_;
+    int pipe_[2] = {-1, -1};
+    std::size_t queued_ = 0;
+    std::size_t grown_ = 0; // bytes of pipe counted in mirror_pipe_bytes
+    bool connected_ = false;
+    bool draining_ = false;
+    bool finished_ = false;
+    bool send_closed_ = false;
+    bool stopped_ = false;
+};
+
+static bool both_v4(const tcp::endpoint &a, const tcp::endpoint &b)
+{
+    return a.address().is_v4() && b.address().is_v4();
+}
+
+static boost::asio::ip::address_v6 as_v6(const boost::asio::ip::address &address)
+{
+    return address.is_v6() ? address.to_v6() : boost::asio::ip::make_address_v6(boost::asio::ip::v4_mapped, address.to_v4());
+}
+
+// value of key in a "a=1&b=2" query string, empty when absent
+static std::string query_param(const std::string &query, const std::string &key)
+{
+    std::size_t pos = 0;
+    while (pos <= query.size())
+    {
+        std::size_t end = query.find('&', pos);
+        if (end == std::string::npos)
+            end = query.size();
+        std::size_t equals = query.find('=', pos);
+        if (equals < end && query.compare(pos, equals - pos, key) == 0 && equals - pos == key.size())
+            return query.substr(equals + 1, end - equals - 1);
+        pos = end + 1;
+    }
+    return "";
+}
+
+// on-demand capture of session payload for one listener, client IP or session. chunks
+// are recorded with a timestamp into a ring allocated at startup, oldest overwritten
+// first, and dumped as pcapng with made-up IP/TCP headers so tools can follow the
+// streams. sessions check armed() once per chunk; everything else is off the fast path.
+class CaptureRing
+{
+public:
+    CaptureRing(std::size_t ring_bytes, std::size_t snap_bytes)
+        : ring_(ring_bytes), snap_bytes_(std::min(snap_bytes, max_snap_bytes)), wrap_at_(ring_bytes) {}
+
+    bool armed() const { return armed_.load(std::memory_order_relaxed); }
+
+    // bumped whenever the filter changes, so sessions re-check whether they match
+    uint64_t generation() const { return generation_.load(std::memory_order_acquire); }
+
+    bool matches(const std::string &listener, const boost::asio::ip::address &client, uint64_t session) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        switch (filter_)
+        {
+        case Filter::listener:
+            return listener == listener_;
+        case Filter::client:
+            return client == client_ || (client.is_v6() && client.to_v6().is_v4_mapped() &&
+                                         boost::asio::ip::make_address_v4(boost::asio::ip::v4_mapped, client.to_v6()) == client_);
+        case Filter::session:
+            return session == session_;
+        default:
+            return false;
+        }
+    }
+
+    // GET /capture/start?listener=ip:port | client=ip | session=id, replacing the previous capture
+    std::string start(const std::string &query)
+    {
+        if (ring_.empty())
+            throw std::runtime_error("capture.ring_bytes is 0");
+        std::string listener = query_param(query, "listener");
+        std::string client = query_param(query, "client");
+        std::string session = query_param(query, "session");
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!listener.empty())
+        {
+            filter_ = Filter::listener;
+            listener_ = listener;
+        }
+        else if (!client.empty())
+        {
+            filter_ = Filter::client;
+            client_ = boost::asio::ip::make_address(client);
+        }
+        else if (!session.empty())
+        {
+            filter_ = Filter::session;
+            session_ = std::stoull(session);
+        }
+        else
+        {
+            throw std::runtime_error("capture needs listener, client or session");
+        }
+        head_ = tail_ = records_ = 0;
+        wrap_at_ = ring_.size();
+        recorded_ = evicted_ = truncated_ = 0;
+        generation_.fetch_add(1, std::memory_order_release);
+        armed_.store(true, std::memory_order_relaxed);
+        return status_locked();
+    }
+
+    // GET /capture/stop: what was recorded stays for /capture/dump
+    std::string stop()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        armed_.store(false, std::memory_order_relaxed);
+        filter_ = Filter::none;
+        generation_.fetch_add(1, std::memory_order_release);
+        return status_locked();
+    }
+
+    std::string status_json() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return status_locked();
+    }
+
+    void record(uint64_t session, bool upstream, const tcp::endpoint &client, const tcp::endpoint &local,
+                uint32_t seq, uint32_t ack, const char *data, std::size_t length)
+    {
+        Record header{};
+        header.length = static_cast<uint32_t>(std::min<std::size_t>(length, UINT32_MAX));
+        header.stored = static_cast<uint32_t>(std::min(length, snap_bytes_));
+        header.seq = seq;
+        header.ack = ack;
+        header.session = session;
+        header.upstream = upstream;
+        header.v4 = both_v4(client, local);
+        header.client_port = client.port();
+        header.local_port = local.port();
+        put_address(header.client, client.address(), header.v4);
+        put_address(header.local, local.address(), header.v4);
+        header.ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        header.size = static_cast<uint32_t>((sizeof(Record) + header.stored + 7) & ~std::size_t(7));
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!armed_.load(std::memory_order_relaxed) || header.size > ring_.size())
+            return;
+        make_room(header.size);
+        std::memcpy(&ring_[tail_], &header, sizeof(header));
+        std::memcpy(&ring_[tail_ + sizeof(header)], data, header.stored);
+        tail_ += header.size;
+        ++records_;
+        ++recorded_;
+        if (header.stored < header.length)
+            ++truncated_;
+    }
+
+    // GET /capture/dump: the ring as pcapng, raw IP link type, nanosecond timestamps
+    std::string dump_pcapng() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::string out;
+        block(out, 0x0A0D0D0A, [](std::string &body)
+              {
+            put32(body, 0x1A2B3C4D); // byte-order magic
+            put16(body, 1);
+            put16(body, 0);
+            put32(body, 0xffffffff); // section length unknown
+            put32(body, 0xffffffff); });
+        block(out, 1, [](std::string &body)
+              {
+            put16(body, 101); // LINKTYPE_RAW
+            put16(body, 0);
+            put32(body, 0);
+            option(body, 2, "tcp_forwarder");
+            option(body, 9, std::string(1, '\x09')); // if_tsresol: nanoseconds
+            put32(body, 0); });
+
+        std::size_t pos = head_;
+        for (std::size_t i = 0; i < records_; ++i)
+        {
+            if (pos == wrap_at_)
+                pos = 0;
+            Record header;
+            std::memcpy(&header, &ring_[pos], sizeof(header));
+            const char *payload = &ring_[pos + sizeof(header)];
+            pos += header.size;
+            block(out, 6, [&](std::string &body)
+                  {
+                std::string packet = packet_headers(header);
+                std::size_t original = packet.size() + header.length;
+                packet.append(payload, header.stored);
+                put32(body, 0);
+                put32(body, static_cast<uint32_t>(static_cast<uint64_t>(header.ns) >> 32));
+                put32(body, static_cast<uint32_t>(header.ns));
+                put32(body, static_cast<uint32_t>(packet.size()));
+                put32(body, static_cast<uint32_t>(std::min<std::size_t>(original, UINT32_MAX)));
+                body += packet;
+                body.append((4 - packet.size() % 4) % 4, '\0');
+                option(body, 1, "session " + std::to_string(header.session) + (header.upstream ? " upstream" : " downstream"));
+                std::string flags;
+                put32(flags, header.upstream ? 1 : 2); // inbound from the client, outbound to it
+                option(body, 2, flags);
+                put32(body, 0); });
+        }
+        return out;
+    }
+
+private:
+    enum class Filter
+    {
+        none,
+        listener,
+        client,
+        session
+    };
+
+    struct Record
+    {
+        uint32_t size; // bytes taken in the ring, header included
+        uint32_t length;
+        uint32_t stored;
+        uint32_t seq;
+        uint32_t ack;
+        uint16_t client_port;
+        uint16_t local_port;
+        uint64_t session;
+        int64_t ns;
+        uint8_t client[16];
+        uint8_t local[16];
+        bool upstream;
+        bool v4;
+    };
+
+    // an IP total length has 16 bits
+    static constexpr std::size_t max_snap_bytes = 65535 - 60;
+
+    // drops the oldest records until size bytes are free at tail_, wrapping to the
+    // start of the ring when the end is too short
+    void make_room(std::size_t size)
+    {
+        if (tail_ + size > ring_.size())
+        {
+            while (records_ && head_ >= tail_)
+                evict();
+            wrap_at_ = tail_;
+            tail_ = 0;
+        }
+        while (records_ && head_ >= tail_ && head_ < tail_ + size)
+            evict();
+        if (!records_)
+        {
+            head_ = tail_;
+            wrap_at_ = ring_.size();
+        }
+    }
+
+    void evict()
+    {
+        Record header;
+        std::memcpy(&header, &ring_[head_], sizeof(header));
+        head_ += header.size;
+        --records_;
+        ++evicted_;
+        if (head_ == wrap_at_)
+        {
+            head_ = 0;
+            wrap_at_ = ring_.size();
+        }
+    }
+
+    std::string status_locked() const
+    {
+        std::ostringstream out;
+        out << "{\"armed\":" << (armed_ ? "true" : "false") << ",\"filter\":\"";
+        if (filter_ == Filter::listener)
+            out << "listener " << listener_;
+        else if (filter_ == Filter::client)
+            out << "client " << client_.to_string();
+        else if (filter_ == Filter::session)
+            out << "session " << session_;
+        out << "\",\"ring_bytes\":" << ring_.size() << ",\"snap_bytes\":" << snap_bytes_
+            << ",\"records\":" << records_ << ",\"recorded\":" << recorded_
+            << ",\"evicted\":" << evicted_ << ",\"truncated\":" << truncated_ << "}";
+        return out.str();
+    }
+
+    static void put_address(uint8_t *out, const boost::asio::ip::address &address, bool v4)
+    {
+        if (v4)
+        {
+            auto bytes = address.to_v4().to_bytes();
+            std::memcpy(out, bytes.data(), bytes.size());
+        }
+        else
+        {
+            auto bytes = as_v6(address).to_bytes();
+            std::memcpy(out, bytes.data(), bytes.size());
+        }
+    }
+
+    // IPv4 or IPv6 header plus a TCP header with PSH|ACK, for the client-facing connection
+    static std::string packet_headers(const Record &header)
+    {
+        const uint8_t *src = header.upstream ? header.client : header.local;
+        const uint8_t *dst = header.upstream ? header.local : header.client;
+        std::string packet;
+        if (header.v4)
+        {
+            std::size_t total = std::min<std::size_t>(40 + header.length, 65535);
+            packet += std::string("\x45\x00", 2);
+            put16be(packet, static_cast<uint16_t>(total));
+            packet += std::string("\x00\x00\x40\x00\x40\x06\x00\x00", 8); // DF, ttl 64, TCP, checksum below
+            packet.append(reinterpret_cast<const char *>(src), 4);
+            packet.append(reinterpret_cast<const char *>(dst), 4);
+            uint32_t sum = 0;
+            for (std::size_t i = 0; i < 20; i += 2)
+                sum += (static_cast<uint8_t>(packet[i]) << 8) | static_cast<uint8_t>(packet[i + 1]);
+            while (sum >> 16)
+                sum = (sum & 0xffff) + (sum >> 16);
+            packet[10] = static_cast<char>(~sum >> 8);
+            packet[11] = static_cast<char>(~sum);
+        }
+        else
+        {
+            packet += std::string("\x60\x00\x00\x00", 4);
+            put16be(packet, static_cast<uint16_t>(std::min<std::size_t>(20 + header.length, 65535)));
+            packet += std::string("\x06\x40", 2); // TCP, hop limit 64
+            packet.append(reinterpret_cast<const char *>(src), 16);
+            packet.append(reinterpret_cast<const char *>(dst), 16);
+        }
+        put16be(packet, header.upstream ? header.client_port : header.local_port);
+        put16be(packet, header.upstream ? header.local_port : header.client_port);
+        put16be(packet, static_cast<uint16_t>(header.seq >> 16));
+        put16be(packet, static_cast<uint16_t>(header.seq));
+        put16be(packet, static_cast<uint16_t>(header.ack >> 16));
+        put16be(packet, static_cast<uint16_t>(header.ack));
+        packet += std::string("\x50\x18\xff\xff\x00\x00\x00\x00", 8); // 20 byte header, PSH|ACK, window, no checksum
+        return packet;
+    }
+
+    template <typename Body>
+    static void block(std::string &out, uint32_t type, Body body_of)
+    {
+        std::string body;
+        body_of(body);
+        put32(out, type);
+        put32(out, static_cast<uint32_t>(body.size() + 12));
+        out += body;
+        put32(out, static_cast<uint32_t>(body.size() + 12));
+    }
+
+    static void option(std::string &body, uint16_t code, const std::string &value)
+    {
+        put16(body, code);
+        put16(body, static_cast<uint16_t>(value.size()));
+        body += value;
+        body.append((4 - value.size() % 4) % 4, '\0');
+    }
+
+    static void put16(std::string &out, uint16_t value) { out.append(reinterpret_cast<const char *>(&value), 2); }
+    static void put32(std::string &out, uint32_t value) { out.append(reinterpret_cast<const char *>(&value), 4); }
+    static void put16be(std::string &out, uint16_t value)
+    {
+        out.push_back(static_cast<char>(value >> 8));
+        out.push_back(static_cast<char>(value));
+    }
+
+    std::vector<char> ring_;
+    std::size_t snap_bytes_;
+    mutable std::mutex mutex_;
+    std::atomic<bool> armed_{false};
+    std::atomic<uint64_t> generation_{0};
+    Filter filter_ = Filter::none;
+    std::string listener_;
+    boost::asio::ip::address client_;
+    uint64_t session_ = 0;
+    std::size_t head_ = 0;
+    std::size_t tail_ = 0;
+    std::size_t wrap_at_;
+    std::size_t records_ = 0;
+    uint64_t recorded_ = 0;
+    uint64_t evicted_ = 0;
+    uint64_t truncated_ = 0;
+};
+
+// glibc's tcp_info stops at tcpi_total_retrans. the kernel only ever appends to the
+// struct, so the fields after it are declared here up to tcpi_delivery_rate
+struct KernelTcpInfo
+{
+    struct tcp_info base;
+    uint64_t pacing_rate;
+    uint64_t max_pacing_rate;
+    uint64_t bytes_acked;
+    uint64_t bytes_received;
+    uint32_t segs_out;
+    uint32_t segs_in;
+    uint32_t notsent_bytes;
+    uint32_t min_rtt;
+    uint32_t data_segs_in;
+    uint32_t data_segs_out;
+    uint64_t delivery_rate;
+};
+static_assert(offsetof(KernelTcpInfo, pacing_rate) == 104, "tcp_info prefix does not match the kernel's");
+
+// bucket 0 counts zeros, bucket i values in [2^(i-1), 2^i). percentiles are reported
+// as the upper bound of the bucket they fall in, at most the largest value seen
+class Log2Histogram
+{
+public:
+    void add(uint64_t value)
+    {
+        int bucket = value ? std::min(64 - __builtin_clzll(value), bucket_count - 1) : 0;
+        buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+        samples_.fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(value, std::memory_order_relaxed);
+        uint64_t max = max_.load(std::memory_order_relaxed);
+        while (value > max && !max_.compare_exchange_weak(max, value, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    std::string json() const
+    {
+        uint64_t counts[bucket_count];
+        uint64_t samples = 0;
+        for (int i = 0; i < bucket_count; ++i)
+        {
+            counts[i] = buckets_[i].load(std::memory_order_relaxed);
+            samples += counts[i];
+        }
+        uint64_t max = max_.load(std::memory_order_relaxed);
+        std::ostringstream out;
+        out << "{\"samples\":" << samples << ",\"mean\":" << (samples ? sum_.load() / samples : 0)
+            << ",\"p50\":" << std::min(percentile(counts, samples, 0.5), max) << ",\"p90\":" << std::min(percentile(counts, samples, 0.9), max)
+            << ",\"p99\":" << std::min(percentile(counts, samples, 0.99), max) << ",\"max\":" << max << ",\"buckets\":[";
+        bool first = true;
+        for (int i = 0; i < bucket_count; ++i)
+        {
+            if (!counts[i])
+                continue;
+            out << (first ? "" : ",") << "[" << upper_bound(i) << "," << counts[i] << "]";
+            first = false;
+        }
+        out << "]}";
+        return out.str();
+    }
+
+private:
+    static constexpr int bucket_count = 48;
+
+    static uint64_t upper_bound(int bucket) { return bucket ? (uint64_t(1) << bucket) - 1 : 0; }
+
+    static uint64_t percentile(const uint64_t *counts, uint64_t samples, double fraction)
+    {
+        uint64_t rank = static_cast<uint64_t>(std::ceil(fraction * samples));
+        uint64_t seen = 0;
+        for (int i = 0; i < bucket_count; ++i)
+        {
+            seen += counts[i];
+            if (seen >= rank && seen)
+                return upper_bound(i);
+        }
+        return 0;
+    }
+
+    std::atomic<uint64_t> buckets_[bucket_count] = {};
+    std::atomic<uint64_t> samples_{0};
+    std::atomic<uint64_t> sum_{0};
+    std::atomic<uint64_t> max_{0};
+};
+
+// TCP_INFO of one side of the sessions: clients, or the targets they were forwarded to
+struct LegMetrics
+{
+    Log2Histogram rtt_us;
+    Log2Histogram retransmits;   // segments retransmitted since the previous sample
+    Log2Histogram cwnd;          // segments
+    Log2Histogram delivery_rate; // bytes per second, once data was acknowledged
+    std::atomic<uint64_t> sessions{0};
+
+    std::string json() const
+    {
+        return "{\"sessions\":" + std::to_string(sessions.load()) + ",\"rtt_us\":" + rtt_us.json() +
+               ",\"retransmits\":" + retransmits.json() + ",\"cwnd\":" + cwnd.json() +
+               ",\"delivery_rate\":" + delivery_rate.json() + "}";
+    }
+};
+
+struct TcpInfoMetrics
+{
+    LegMetrics client; // in_socket_ of the listener's sessions
+    LegMetrics target; // out_socket_
+};
+
+// samples TCP_INFO of both legs of every forwarding session on one timer, never per
+// chunk, plus once as a session closes. so whether a slow session is the client's
+// link or the target's shows per listener and per target address.
+class TcpInfoSampler
+{
+public:
+    class Probe
+    {
+    public:
+        Probe(int client_fd, int target_fd, TcpInfoMetrics &listener, LegMetrics &target)
+            : fds_{client_fd, target_fd}, listener_(listener), target_(target) {}
+
+        void sample()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!closed_)
+                take();
+        }
+
+        // the final sample; the session closes its sockets only after this returns
+        void finish()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (closed_)
+                return;
+            take();
+            ++listener_.client.sessions;
+            ++listener_.target.sessions;
+            ++target_.sessions;
+            closed_ = true;
+        }
+
+    private:
+        void take()
+        {
+            KernelTcpInfo info;
+            if (read(fds_[0], info))
+                record(info, retransmits_[0], listener_.client, nullptr);
+            if (read(fds_[1], info))
+                record(info, retransmits_[1], listener_.target, &target_);
+        }
+
+        static bool read(int fd, KernelTcpInfo &info)
+        {
+            std::memset(&info, 0, sizeof(info));
+            socklen_t length = sizeof(info);
+            return getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &length) == 0 && length >= sizeof(info.base);
+        }
+
+        static void record(const KernelTcpInfo &info, uint32_t &last_retransmits, LegMetrics &metrics, LegMetrics *also)
+        {
+            uint32_t retransmits = info.base.tcpi_total_retrans - last_retransmits;
+            last_retransmits = info.base.tcpi_total_retrans;
+            for (LegMetrics *leg : {&metrics, also})
+            {
+                if (!leg)
+                    continue;
+                leg->rtt_us.add(info.base.tcpi_rtt);
+                leg->retransmits.add(retransmits);
+                leg->cwnd.add(info.base.tcpi_snd_cwnd);
+                if (info.delivery_rate)
+                    leg->delivery_rate.add(info.delivery_rate);
+            }
+        }
+
+        std::mutex mutex_;
+        bool closed_ = false;
+        int fds_[2];
+        uint32_t retransmits_[2] = {0, 0};
+        TcpInfoMetrics &listener_;
+        LegMetrics &target_;
+    };
+
+    TcpInfoSampler(boost::asio::io_context &io_context, int interval_ms)
+        : timer_(io_context), interval_(std::chrono::milliseconds(interval_ms)) {}
+
+    int interval_ms() const { return static_cast<int>(interval_.count()); }
+
+    void start()
+    {
+        timer_.expires_after(interval_);
+        timer_.async_wait([this](boost::system::error_code ec)
+                          {
+            if (ec)
+                return;
+            tick();
+            start(); });
+    }
+
+    // called once both of a session's sockets are connected
+    std::shared_ptr<Probe> watch(int client_fd, int target_fd, TcpInfoMetrics &listener, const tcp::endpoint &target)
+    {
+        std::string name = target.address().is_v6() ? "[" + target.address().to_string() + "]:" + std::to_string(target.port())
+                                                    : target.address().to_string() + ":" + std::to_string(target.port());
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::unique_ptr<LegMetrics> &metrics = targets_[name];
+        if (!metrics)
+            metrics = std::make_unique<LegMetrics>();
+        auto probe = std::make_shared<Probe>(client_fd, target_fd, listener, *metrics);
+        probes_.push_back(probe);
+        return probe;
+    }
+
+    std::string targets_json() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::string out = "[";
+        for (const auto &entry : targets_)
+            out += (out.size() > 1 ? ",{\"target\":\"" : "{\"target\":\"") + entry.first + "\",\"metrics\":" + entry.second->json() + "}";
+        return out + "]";
+    }
+
+private:
+    void tick()
+    {
+        std::vector<std::shared_ptr<Probe>> live;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            probes_.erase(std::remove_if(probes_.begin(), probes_.end(), [](const std::weak_ptr<Probe> &probe)
+                                         { return probe.expired(); }),
+                          probes_.end());
+            live.reserve(probes_.size());
+            for (auto &weak : probes_)
+            {
+                if (auto probe = weak.lock())
+                    live.push_back(std::move(probe));
+            }
+        }
+        for (auto &probe : live)
+            probe->sample();
+    }
+
+    boost::asio::steady_timer timer_;
+    std::chrono::milliseconds interval_;
+    mutable std::mutex mutex_;
+    std::vector<std::weak_ptr<Probe>> probes_;
+    std::map<std::string, std::unique_ptr<LegMetrics>> targets_;
+};
+
+// why a session ended, as the first path that closed it saw it
+enum class CloseReason : uint8_t
+{
+    unknown,
+    client_closed,       // EOF from the client
+    target_closed,       // EOF from the target
+    client_error,        // reading from or writing to the client failed
+    target_error,        // reading from or writing to the target failed
+    connect_failed,      // retry_attempts connects failed
+    no_target,           // no address known, or every one ejected
+    routing_aborted,     // the client left before its first bytes were routed
+    tls_failed,
+    proxy_header_failed,
+    record_failed,       // a record from the paired forwarder failed to authenticate or decode
+    idle,                // a spliced session saw no bytes for splice_idle_timeout
+    drained              // still open when the shutdown drain ran out of time
+};
+
+inline const char *close_reason_name(CloseReason reason)
+{
+    static const char *const names[] = {"unknown", "client_closed", "target_closed", "client_error", "target_error",
+                                        "connect_failed", "no_target", "routing_aborted", "tls_failed",
+                                        "proxy_header_failed", "record_failed", "idle", "drained"};
+    return names[static_cast<std::size_t>(reason)];
+}
+
+// what one session did, handed over as it is destroyed
+struct AccessRecord
+{
+    uint64_t id = 0;
+    const std::string *listen = nullptr;
+    tcp::endpoint client;
+    std::string target; // host:port as configured or routed
+    tcp::endpoint peer; // the address connected to, unspecified if none was
+    std::chrono::microseconds connect{0}; // accept to connected, zero if never connected
+    std::chrono::microseconds duration{0};
+    uint64_t bytes_up = 0; // client to target
+    uint64_t bytes_down = 0;
+    CloseReason reason = CloseReason::unknown;
+};
+
+// one record per session in place of its per-event log lines, queued on the
+// logger's second sink so the worker writes them in batches. ordinary closes
+// can be sampled; sessions that ended in an error are always recorded.
+class AccessLog
+{
+public:
+    AccessLog(Logger &logger, bool binary, double sample)
+        : logger_(logger), binary_(binary),
+          threshold_(sample >= 1.0 ? UINT64_MAX : static_cast<uint64_t>(sample * 18446744073709551615.0)) {}
+
+    void write(const AccessRecord &record)
+    {
+        bool ordinary = record.reason == CloseReason::client_closed || record.reason == CloseReason::target_closed ||
+                        record.reason == CloseReason::idle;
+        if (ordinary && threshold_ != UINT64_MAX && mix(record.id) > threshold_)
+        {
+            sampled_out_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        records_.fetch_add(1, std::memory_order_relaxed);
+        logger_.access(binary_ ? encode_binary(record) : encode_json(record));
+    }
+
+    std::string stats_json() const
+    {
+        std::ostringstream out;
+        out << "{\"format\":\"" << (binary_ ? "binary" : "json")
+            << "\",\"records\":" << records_.load(std::memory_order_relaxed)
+            << ",\"sampled_out\":" << sampled_out_.load(std::memory_order_relaxed) << "}";
+        return out.str();
+    }
+
+private:
+    // the same sessions stay in or out of the sample whichever process writes them
+    static uint64_t mix(uint64_t x)
+    {
+        x += 0x9e3779b97f4a7c15ULL;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    static std::string encode_json(const AccessRecord &record)
+    {
+        auto unix_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(3);
+        out << "{\"ts\":" << unix_ms.count() / 1000 << "." << std::setw(3) << std::setfill('0') << unix_ms.count() % 1000
+            << std::setfill(' ')
+            << ",\"id\":" << record.id
+            << ",\"listen\":\"" << *record.listen
+            << "\",\"client\":\"" << record.client
+            << "\",\"target\":\"" << record.target << "\"";
+        if (record.connect.count() > 0)
+        {
+            out << ",\"peer\":\"" << record.peer << "\",\"connect_ms\":" << record.connect.count() / 1000.0;
+        }
+        out << ",\"duration_ms\":" << record.duration.count() / 1000.0
+            << ",\"bytes_up\":" << record.bytes_up
+            << ",\"bytes_down\":" << record.bytes_down
+            << ",\"close\":\"" << close_reason_name(record.reason) << "\"}\n";
+        return out.str();
+    }
+
+    // little-endian, length first so a reader can skip records of a later version:
+    // u16 length, u8 version, u8 close reason, u64 id, u64 unix time in us,
+    // u64 connect us, u64 duration us, u64 bytes up, u64 bytes down,
+    // client and peer as u8 family (0, 4 or 6), 16 address bytes, u16 port,
+    // then listen and target as u8 length and that many bytes
+    static std::string encode_binary(const AccessRecord &record)
+    {
+        auto unix_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch());
+        std::string out(2, '\0');
+        put(out, 1, 1);
+        put(out, static_cast<uint8_t>(record.reason), 1);
+        put(out, record.id, 8);
+        put(out, static_cast<uint64_t>(unix_us.count()), 8);
+        put(out, static_cast<uint64_t>(record.connect.count()), 8);
+        put(out, static_cast<uint64_t>(record.duration.count()), 8);
+        put(out, record.bytes_up, 8);
+        put(out, record.bytes_down, 8);
+        put_endpoint(out, record.client);
+        put_endpoint(out, record.connect.count() > 0 ? record.peer : tcp::endpoint());
+        put_string(out, *record.listen);
+        put_string(out, record.target);
+        out[0] = static_cast<char>(out.size());
+        out[1] = static_cast<char>(out.size() >> 8);
+        return out;
+    }
+
+    static void put(std::string &out, uint64_t value, int bytes)
+    {
+        for (int i = 0; i < bytes; ++i)
+            out.push_back(static_cast<char>(value >> (8 * i)));
+    }
+
+    static void put_endpoint(std::string &out, const tcp::endpoint &endpoint)
+    {
+        std::array<unsigned char, 16> address{};
+        uint8_t family = 0;
+        if (endpoint.port() != 0 && endpoint.address().is_v4())
+        {
+            family = 4;
+            auto bytes = endpoint.address().to_v4().to_bytes();
+            std::copy(bytes.begin(), bytes.end(), address.begin());
+        }
+        else if (endpoint.port() != 0)
+        {
+            family = 6;
+            address = endpoint.address().to_v6().to_bytes();
+        }
+        put(out, family, 1);
+        out.append(reinterpret_cast<const char *>(address.data()), address.size());
+        put(out, endpoint.port(), 2);
+    }
+
+    static void put_string(std::string &out, const std::string &value)
+    {
+        std::size_t length = std::min<std::size_t>(value.size(), 255);
+        put(out, length, 1);
+        out.append(value, 0, length);
+    }
+
+    Logger &logger_;
+    bool binary_;
+    uint64_t threshold_;
+    std::atomic<uint64_t> records_{0};
+    std::atomic<uint64_t> sampled_out_{0};
+};
+
+class AdmissionControl;
+
+// holds a connection slot and can be closed early, when a shutdown drain runs out of time
+class Closable
+{
+public:
+    virtual ~Closable() = default;
+    virtual void close_now() = 0;
+    // a shutdown drain began; a holder that no longer needs its slot may give it back
+    virtual void drain_started() {}
+};
+
+using SessionStarter = void (*)(boost::asio::io_context &, tcp::socket, std::shared_ptr<ListenerOptions>, Logger &, AdmissionControl &);
+
+// connection slots of the forwarder. once all max_connections slots are taken, new
+// clients wait in a bounded FIFO that holds only their socket, and an ending session
+// hands its slot straight to the oldest waiter. waiters past the timeout are closed.
+class AdmissionControl
+{
+public:
+    AdmissionControl(boost::asio::io_context &io_context, int max_connections, std::size_t queue_size, int queue_timeout, Logger &logger)
+        : io_context_(io_context),
+          max_connections_(max_connections),
+          queue_size_(queue_size),
+          queue_timeout_(std::chrono::seconds(queue_timeout)),
+          timer_(io_context),
+          logger_(logger) {}
+
+    int active() const { return active_; }
+
+    std::size_t queued() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return queue_.size();
+    }
+
+    // remembers a slot holder for close_all. expired entries are swept whenever the
+    // list has doubled, so it stays proportional to the open sessions
+    void track(const std::shared_ptr<Closable> &holder)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (tracked_.size() >= sweep_at_)
+        {
+            tracked_.erase(std::remove_if(tracked_.begin(), tracked_.end(), [](const std::weak_ptr<Closable> &entry)
+                                          { return entry.expired(); }),
+                           tracked_.end());
+            sweep_at_ = std::max<std::size_t>(64, tracked_.size() * 2);
+        }
+        tracked_.push_back(holder);
+    }
+
+    // closes every queued client and every tracked holder still open, returns how many
+    std::size_t close_all()
+    {
+        std::vector<std::weak_ptr<Closable>> tracked;
+        std::size_t closed = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            tracked.swap(tracked_);
+            for (auto &waiter : queue_)
+            {
+                boost::system::error_code ec;
+                waiter.socket.close(ec);
+                ++closed;
+            }
+            queue_.clear();
+        }
+        for (auto &entry : tracked)
+        {
+            if (auto holder = entry.lock())
+            {
+                holder->close_now();
+                ++closed;
+            }
+        }
+        return closed;
+    }
+
+    // tells every tracked holder a shutdown drain began
+    void start_drain()
+    {
+        std::vector<std::shared_ptr<Closable>> holders;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (auto &entry : tracked_)
+            {
+                if (auto holder = entry.lock())
+                    holders.push_back(std::move(holder));
+            }
+        }
+        for (auto &holder : holders)
+        {
+            holder->drain_started();
+        }
+    }
+
+    // a slot now or none, for streams a mux peer opens: they have no socket to queue
+    bool try_acquire()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (active_ >= max_connections_ || !queue_.empty())
+        {
+            ++rejected_;
+            return false;
+        }
+        ++active_;
+        return true;
+    }
+
+    // starts a session right away when a slot is free, otherwise queues the client
+    void admit(tcp::socket socket, std::shared_ptr<ListenerOptions> options, SessionStarter starter)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (active_ >= max_connections_)
+            {
+                if (queue_.size() >= queue_size_)
+                {
+                    ++rejected_;
+                    logger_.warn("Max connections reached and admission queue full. Rejecting new connection.");
+                    boost::system::error_code ec;
+                    socket.close(ec);
+                    return;
+                }
+
+                queue_.push_back(Waiter{std::move(socket), std::move(options), starter, std::chrono::steady_clock::now()});
+                ++enqueued_;
+                logger_.debug("Max connections reached. Queued new connection, queue depth " + std::to_string(queue_.size()));
+                if (queue_.size() == 1)
+                {
+                    arm_timer();
+                }
+                return;
+            }
+            ++active_;
+        }
+        starter(io_context_, std::move(socket), std::move(options), logger_, *this);
+    }
+
+    // called as a session ends. waiters whose client gave up meanwhile are closed
+    // instead of taking the slot
+    void release()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!queue_.empty() && hung_up(queue_.front().socket))
+        {
+            record_wait(queue_.front());
+            boost::system::error_code ec;
+            queue_.front().socket.close(ec);
+            queue_.pop_front();
+            ++abandoned_;
+            logger_.debug("Queued client hung up before a slot was free.");
+        }
+        if (queue_.empty())
+        {
+            --active_;
+            return;
+        }
+
+        Waiter waiter = std::move(queue_.front());
+        queue_.pop_front();
+        ++admitted_;
+        record_wait(waiter);
+        lock.unlock();
+
+        // started from the io_context rather than inside the ending session's destructor
+        boost::asio::post(io_context_, [this, waiter = std::move(waiter)]() mutable
+                          { waiter.starter(io_context_, std::move(waiter.socket), std::move(waiter.options), logger_, *this); });
+    }
+
+    std::string stats_json() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::ostringstream out;
+        out << "{\"max_connections\":" << max_connections_
+            << ",\"queue_depth\":" << queue_.size()
+            << ",\"queue_size\":" << queue_size_
+            << ",\"enqueued\":" << enqueued_
+            << ",\"admitted\":" << admitted_
+            << ",\"timed_out\":" << timed_out_
+            << ",\"abandoned\":" << abandoned_
+            << ",\"rejected\":" << rejected_
+            << ",\"wait_ms_total\":" << wait_ms_total_
+            << ",\"wait_ms_max\":" << wait_ms_max_ << "}";
+        return out.str();
+    }
+
+private:
+    struct Waiter
+    {
+        tcp::socket socket;
+        std::shared_ptr<ListenerOptions> options;
+        SessionStarter starter;
+        std::chrono::steady_clock::time_point enqueued;
+    };
+
+    // every waiter has the same timeout, so the front of the queue always expires first
+    void arm_timer()
+    {
+        timer_.expires_at(queue_.front().enqueued + queue_timeout_);
+        timer_.async_wait([this](boost::system::error_code ec)
+                          {
+            if (!ec)
+            {
+                expire_waiters();
+            } });
+    }
+
+    void expire_waiters()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto now = std::chrono::steady_clock::now();
+        while (!queue_.empty() && queue_.front().enqueued + queue_timeout_ <= now)
+        {
+            record_wait(queue_.front());
+            boost::system::error_code ec;
+            queue_.front().socket.close(ec);
+            queue_.pop_front();
+            ++timed_out_;
+            logger_.warn("Queued connection timed out waiting for a free slot.");
+        }
+        if (!queue_.empty())
+        {
+            arm_timer();
+        }
+    }
+
+    // reset, or closed without leaving a byte to forward
+    static bool hung_up(tcp::socket &socket)
+    {
+        pollfd fd{socket.native_handle(), POLLIN | POLLRDHUP, 0};
+        if (poll(&fd, 1, 0) <= 0)
+            return false;
+        if (fd.revents & (POLLHUP | POLLERR))
+            return true;
+        int pending = 0;
+        return (fd.revents & POLLRDHUP) && ioctl(socket.native_handle(), FIONREAD, &pending) == 0 && pending == 0;
+    }
+
+    void record_wait(const Waiter &waiter)
+    {
+        auto waited = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - waiter.enqueued).count();
+        wait_ms_total_ += static_cast<uint64_t>(waited);
+        wait_ms_max_ = std::max<uint64_t>(wait_ms_max_, static_cast<uint64_t>(waited));
+    }
+
+    boost::asio::io_context &io_context_;
+    int max_connections_;
+    std::size_t queue_size_;
+    std::chrono::steady_clock::duration queue_timeout_;
+    boost::asio::steady_timer timer_;
+    Logger &logger_;
+    mutable std::mutex mutex_;
+    std::atomic<int> active_{0};
+    std::deque<Waiter> queue_;
+    uint64_t enqueued_ = 0;
+    uint64_t admitted_ = 0;
+    uint64_t timed_out_ = 0;
+    uint64_t abandoned_ = 0;
+    uint64_t rejected_ = 0;
+    uint64_t wait_ms_total_ = 0;
+    uint64_t wait_ms_max_ = 0;
+    std::vector<std::weak_ptr<Closable>> tracked_;
+    std::size_t sweep_at_ = 64;
+};
+
+// process-wide session ids, for logs and capture filters
+static uint64_t next_session_id()
+{
+    static std::atomic<uint64_t> next{1};
+    return next.fetch_add(1, std::memory_order_relaxed);
+}
+
+template <typename Policy>
+class Session : public Closable, public std::enable_shared_from_this<Session<Policy>>
+{
+public:
+    Session(boost::asio::io_context &io_context, tcp::socket in_socket, std::shared_ptr<ListenerOptions> options,
+            Logger &logger, AdmissionControl &admission)
+        : io_context_(io_context),
+          id_(next_session_id()),
+          in_socket_(std::move(in_socket)),
+          out_socket_(io_context),
+          options_(std::move(options)),
+          target_(options_->target),
+          target_port_(options_->target_port),
+          breakers_(options_->breakers.get()),
+          retry_attempts_(options_->retry_attempts),
+          retry_delay_(options_->retry_delay),
+          current_attempt_(0),
+          strand_(boost::asio::make_strand(io_context)),
+          timer_(strand_),
+          logger_(logger),
+          admission_(admission),
+          upstream_(io_context, in_socket_, out_socket_, *options_, options_->stats.bytes_in,
+                    Policy::layered && transforms_upstream(*options_)),
+          downstream_(io_context, out_socket_, in_socket_, *options_, options_->stats.bytes_out,
+                      Policy::layered && !transforms_upstream(*options_)),
+          splicer_(options_->splicer),
+          splice_idle_timeout_(options_->splice_idle_timeout),
+          spliced_(false),
+          source_pool_(options_->source_pool),
+          traced_(options_->trace_chunks),
+          accepted_at_(std::chrono::steady_clock::now())
+    {
+        if constexpr (Policy::counted)
+        {
+            ++options_->stats.sessions;
+        }
+        logger_.debug("Session " + std::to_string(id_) + " created. Active connections: " + std::to_string(admission_.active()));
+
+    boost::system::error_code ec;
+    if (options_->access_log)
+    {
+        client_ = in_socket_.remote_endpoint(ec);
+    }
+    in_socket_.set_option(tcp::no_delay(options_->tcp_no_delay), ec);
+    if (ec)
+    {
+        logger_.error("seting up TCP nodelay on incoming socket failed: " + ec.message());
+    }
+    else
+    {
+        chatter("TCP nodelay has been set on incoming socket");
+    }
+}
+
+~Session()
+    {
+        if (tcp_probe_)
+        {
+            tcp_probe_->finish();
+        }
+        if (breaker_)
+        {
+            breaker_->abandon(trial_);
+        }
+        if (source_pool_)
+        {
+            source_pool_->release(source_);
+        }
+        admission_.release();
+        logger_.debug("Session destroyed. Active connections: " + std::to_string(admission_.active()));
+        if (options_->access_log)
+        {
+            write_access_record();
+        }
+    }
+
+    void close_now() override
+    {
+        boost::asio::post(strand_, [self = this->shared_from_this()]()
+                          { self->clean_up(CloseReason::drained); });
+    }
+    void set_keep_alive_options(tcp::socket &socket)
+    {
+        const KeepAliveOptions &keep_alive = options_->keep_alive;
+        if (keep_alive.enabled)
+        {
+            boost::system::error_code ec;
+            socket.set_option(boost::asio::socket_base::keep_alive(true), ec);
+            if (ec)
+            {
+                logger_.warn("enabling TCP keepalive failed: " + ec.message());
+                return;
+            }
+
+#ifdef _WIN32
             logger_.info("Keepalive enabled but not configurable on Windows");
 #else
-            int idle = tcp_keep_alive_["idle_time"].as<int>();
-            int interval = tcp_keep_alive_["interval"].as<int>();
-            int count = tcp_keep_alive_["count"].as<int>();
+            int idle = keep_alive.idle_time;
+            int interval = keep_alive.interval;
+            int count = keep_alive.count;
+
+            if (setsockopt(socket.native_handle(), SOL_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) < 0 ||
+                setsockopt(socket.native_handle(), SOL_TCP, TCP_KEEPINTVL, &interval, sizeof(interval)) < 0 ||
+                setsockopt(socket.native_handle(), SOL_TCP, TCP_KEEPCNT, &count, sizeof(count)) < 0)
+            {
+                logger_.warn("seting up TCP keepalive parameters failed");
+            }
+            else
+            {
+                chatter("TCP keepalive parameters set: idle=" + std::to_string(idle) +
+                        ", interval=" + std::to_string(interval) +
+                        ", count=" + std::to_string(count));
+            }
+#endif
+        }
+    }
+
+    void start()
+    {
+        logger_.trace("Starting session...");
+        set_keep_alive_options(in_socket_);
+        if (options_->mirror)
+        {
+            upstream_.mirror = std::make_shared<MirrorStream>(io_context_, *options_->mirror, logger_);
+            upstream_.mirror->start();
+            if (options_->mirror->both)
+            {
+                downstream_.mirror = std::make_shared<MirrorStream>(io_context_, *options_->mirror, logger_);
+                downstream_.mirror->start();
+            }
+        }
+        if (options_->tls && !options_->tls->client)
+        {
+            tls_handshake(in_socket_);
+            return;
+        }
+        if (options_->routing)
+        {
+            peek_route();
+            return;
+        }
+        attempt_connection();
+    }
+
+private:
+    // the side whose target is the paired forwarder seals or compresses what it sends upstream
+    static bool transforms_upstream(const ListenerOptions &options)
+    {
+        if (options.seal)
+            return options.seal->seal_upstream;
+        if (Policy::records == RecordLayer::compressed)
+            return options.compression->compress_upstream;
+        return options.tls && options.tls->client;
+    }
+
+    // reads the client's first bytes into upstream_'s buffer, where forwarding takes them
+    // as its first read. clients that speak first send them with the handshake's last ACK,
+    // so this costs no round trip; clients that wait for the server wait peek_timeout.
+    // the timer and the reads run on strand_, so the timeout's cancel never races a read.
+    void peek_route()
+    {
+        boost::asio::dispatch(strand_, [this, self = this->shared_from_this()]()
+                              {
+            timer_.expires_after(options_->routing->peek_timeout);
+            timer_.async_wait([this, self](boost::system::error_code ec)
+                              {
+                if (!ec)
+                {
+                    peek_expired_ = true;
+                    in_socket_.cancel(ec);
+                } });
+            peek_more(); });
+    }
+
+    void peek_more()
+    {
+        boost::asio::mutable_buffer region = read_region(upstream_);
+        auto self(this->shared_from_this());
+        in_socket_.async_read_some(region + peeked_, boost::asio::bind_executor(strand_, [this, self](boost::system::error_code ec, std::size_t length)
+                                   {
+            peeked_ += length;
+            if (ec && !(ec == boost::asio::error::operation_aborted && peek_expired_) && !(ec == boost::asio::error::eof && peeked_))
+            {
+                logger_.info("Client left before routing: " + ec.message());
+                clean_up(CloseReason::routing_aborted);
+                return;
+            }
+            boost::asio::mutable_buffer region = read_region(upstream_);
+            Sniffed sniffed = sniff_stream(static_cast<const char *>(region.data()), peeked_);
+            if (!ec && !sniffed.complete && !peek_expired_ && peeked_ < region.size())
+            {
+                peek_more();
+                return;
+            }
+            if (peek_expired_)
+            {
+                ++options_->routing->timeouts;
+            }
+            route(sniffed); }));
+    }
+
+    void route(const Sniffed &sniffed)
+    {
+        timer_.cancel();
+        RouteRule *rule = options_->routing->match(sniffed);
+        if (rule)
+        {
+            ++rule->hits;
+            target_ = rule->target;
+            target_port_ = rule->target_port;
+            breakers_ = rule->breakers.get();
+            logger_.debug("Routed by " + rule->label + " to " + target_->host() + ":" + std::to_string(target_port_));
+        }
+        else
+        {
+            ++options_->routing->unmatched;
+        }
+        attempt_connection();
+    }
+
+    void attempt_connection()
+    {
+        if (current_attempt_ >= retry_attempts_)
+        {
+            logger_.error("Max retry attempts reached. Connection failed.");
+            closing(CloseReason::connect_failed);
+            return;
+        }
+
+        if (!pick_target())
+        {
+            closing(CloseReason::no_target);
+            return;
+        }
+
+        if (!open_upstream())
+        {
+            retry_local_failure();
+            return;
+        }
+
+        auto self(this->shared_from_this());
+        out_socket_.async_connect(target_endpoint_, [this, self](boost::system::error_code ec)
+                                  {
+        if (!ec)
+        {
+            connected_at_ = std::chrono::steady_clock::now();
+            chatter("Session " + std::to_string(id_) + " connected to target endpoint.");
+            if constexpr (Policy::spliced)
+            {
+                // payload never reaches user space, so a connect is all a spliced session can vouch for
+                target_responded();
+            }
+            set_keep_alive_options(out_socket_);
+            if (options_->tls && options_->tls->client)
+            {
+                tls_handshake(out_socket_);
+                return;
+            }
+            start_forwarding();
+        }
+        else if (local_failure(ec))
+        {
+            logger_.warn("Connection attempt failed on this host: " + ec.message());
+            if (source_)
+            {
+                ++source_->failures;
+            }
+            retry_local_failure();
+        }
+        else
+        {
+            logger_.warn("Connection attempt failed: " + ec.message());
+            if (source_)
+            {
+                ++source_->failures;
+            }
+            target_failed();
+            ++current_attempt_;
+            timer_.expires_after(std::chrono::seconds(retry_delay_));
+            timer_.async_wait([this, self](boost::system::error_code) { attempt_connection(); });
+        } });
+    }
+
+    // next record in rotation whose circuit breaker admits a connection, so ejected
+    // targets cost nothing instead of a connect timeout and retry_attempts
+    bool pick_target()
+    {
+        auto addresses = target_->addresses();
+        std::size_t start = target_->rotate();
+        for (std::size_t i = 0; i < addresses->size(); ++i)
+        {
+            const boost::asio::ip::address &address = (*addresses)[(start + i) % addresses->size()];
+            if (breakers_)
+            {
+                std::shared_ptr<CircuitBreaker> breaker = breakers_->find(*target_, tcp::endpoint(address, target_port_));
+                CircuitBreaker::Admission admission = breaker ? breaker->admit() : CircuitBreaker::Admission::allowed;
+                if (admission == CircuitBreaker::Admission::denied)
+                    continue;
+                breaker_ = breaker;
+                trial_ = admission == CircuitBreaker::Admission::trial;
+            }
+            target_endpoint_ = tcp::endpoint(address, target_port_);
+            return true;
+        }
+
+        logger_.error(addresses->empty() ? "No address known for " + target_->host() + ". Connection failed."
+                                         : "All targets of " + target_->host() + " are ejected. Connection refused.");
+        return false;
+    }
+
+    // the first response settles the breaker trial; both directions may report it at once
+    void target_responded()
+    {
+        if (responded_.exchange(true))
+            return;
+        if (breaker_)
+        {
+            breaker_->success(trial_);
+            trial_ = false;
+        }
+    }
+
+    void target_failed()
+    {
+        if (breaker_)
+        {
+            breaker_->failure(trial_);
+            breaker_ = nullptr;
+            trial_ = false;
+        }
+    }
+
+    // errors this host raised before the target had a say: no descriptor, no local
+    // port, a socket of the wrong family. the target's breaker never hears of them
+    static bool local_failure(const boost::system::error_code &ec)
+    {
+        return ec == boost::asio::error::address_family_not_supported || ec == boost::asio::error::invalid_argument ||
+               ec == boost::asio::error::bad_descriptor || ec == boost::asio::error::no_descriptors ||
+               ec == boost::asio::error::no_buffer_space || ec == boost::asio::error::address_in_use ||
+               ec == boost::system::errc::address_not_available;
+    }
+
+    // a local failure, a source address out of ports or not yet configured, says nothing
+    // about the target, so a trial it was granted goes back and the next attempt waits,
+    // longer each time
+    void retry_local_failure()
+    {
+        if (breaker_)
+        {
+            breaker_->abandon(trial_);
+            breaker_ = nullptr;
+            trial_ = false;
+        }
+        ++current_attempt_;
+        auto self(this->shared_from_this());
+        timer_.expires_after(bind_retry_delay * (1 << std::min(current_attempt_, 6)));
+        timer_.async_wait([this, self](boost::system::error_code ec)
+                          {
+            if (!ec)
+                attempt_connection(); });
+    }
+
+    // every attempt takes a fresh socket of the target's family: a failed connect leaves
+    // the last one open, and the next record may be of the other family. with a source
+    // pool it is bound to the least loaded source address of that family, if there is one
+    bool open_upstream()
+    {
+        boost::system::error_code ec;
+        out_socket_.close(ec);
+        out_socket_.open(target_endpoint_.protocol(), ec);
+        if (ec)
+        {
+            logger_.warn("opening upstream socket failed: " + ec.message());
+            return false;
+        }
+        if (!source_pool_)
+        {
+            return true;
+        }
+
+        source_pool_->release(source_);
+        source_ = source_pool_->acquire(target_endpoint_);
+        if (!source_)
+        {
+            return true;
+        }
+        int one = 1;
+        if (setsockopt(out_socket_.native_handle(), IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one)) < 0)
+        {
+            logger_.debug("IP_BIND_ADDRESS_NO_PORT not supported: " + std::string(strerror(errno)));
+        }
+        out_socket_.bind(tcp::endpoint(source_->address, 0), ec);
+        if (ec)
+        {
+            ++source_->failures;
+            logger_.warn("binding upstream socket to " + source_->address.to_string() + " failed: " + ec.message());
+            return false;
+        }
+        return true;
+    }
+
+    void start_forwarding()
+    {
+        if (options_->tcp_info_sampler)
+        {
+            tcp_probe_ = options_->tcp_info_sampler->watch(in_socket_.native_handle(), out_socket_.native_handle(),
+                                                           *options_->tcp_info, target_endpoint_);
+        }
+        if (options_->proxy_protocol != 0)
+        {
+            send_proxy_header();
+        }
+        else
+        {
+            plz_start_data();
+        }
+    }
+
+    // TLS toward the paired forwarder: the server side's client socket before the
+    // target is dialed, the client side's target socket right after the connect
+    void tls_handshake(tcp::socket &socket)
+    {
+        if (!tls_)
+        {
+            tls_ = std::make_shared<TlsLink>();
+            tls_->ssl = SSL_new(options_->tls->ctx);
+            boost::system::error_code ec;
+            socket.native_non_blocking(true, ec);
+            if (!tls_->ssl || ec || SSL_set_fd(tls_->ssl, socket.native_handle()) != 1)
+            {
+                tls_failed("setting up TLS failed: " + (ec ? ec.message() : tls_error()));
+                return;
+            }
+            SSL_set_app_data(tls_->ssl, tls_.get());
+            if (options_->tls->client)
+            {
+                SSL_set_connect_state(tls_->ssl);
+                if (!options_->tls->server_name.empty())
+                {
+                    SSL_set_tlsext_host_name(tls_->ssl, options_->tls->server_name.c_str());
+                    SSL_set1_host(tls_->ssl, options_->tls->server_name.c_str());
+                }
+            }
+            else
+            {
+                SSL_set_accept_state(tls_->ssl);
+            }
+
+            auto self(this->shared_from_this());
+            timer_.expires_after(std::chrono::seconds(tls_handshake_timeout));
+            timer_.async_wait([this, self](boost::system::error_code ec)
+                              {
+                if (!ec && tls_ && !SSL_is_init_finished(tls_->ssl))
+                {
+                    tls_failed("TLS handshake timed out");
+                } });
+        }
+
+        ERR_clear_error();
+        int rc = SSL_do_handshake(tls_->ssl);
+        if (rc == 1)
+        {
+            timer_.cancel();
+            tls_established();
+            return;
+        }
+        int error = SSL_get_error(tls_->ssl, rc);
+        if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
+        {
+            auto self(this->shared_from_this());
+            socket.async_wait(error == SSL_ERROR_WANT_READ ? tcp::socket::wait_read : tcp::socket::wait_write,
+                              [this, self, &socket](boost::system::error_code ec)
+                              {
+                if (!ec)
+                {
+                    tls_handshake(socket);
+                } });
+            return;
+        }
+        tls_failed("TLS handshake failed: " + tls_error());
+    }
+
+    void tls_established()
+    {
+        ++options_->tls->handshakes;
+        // the directions OpenSSL handed to the kernel; a refused TLS_TX or TLS_RX leaves that one in user space
+        bool kernel_send = BIO_get_ktls_send(SSL_get_wbio(tls_->ssl)) == 1;
+        bool kernel_recv = BIO_get_ktls_recv(SSL_get_rbio(tls_->ssl)) == 1;
+        if (kernel_send && kernel_recv)
+        {
+            ++options_->tls->ktls_sessions;
+            tls_.reset();
+            logger_.info("TLS established, records in kernel.");
+        }
+        else if constexpr (Policy::records == RecordLayer::tls)
+        {
+            if (options_->tls->ktls)
+                ++options_->tls->ktls_fallbacks;
+            if (!kernel_recv)
+                SSL_set0_rbio(tls_->ssl, BIO_new(BIO_s_mem()));
+            if (!kernel_send)
+                SSL_set0_wbio(tls_->ssl, BIO_new(BIO_s_mem()));
+            // upstream seals toward the paired forwarder on the client side, opens on the server side
+            upstream_.layer.attach(tls_, upstream_.transforming ? kernel_send : kernel_recv);
+            downstream_.layer.attach(tls_, downstream_.transforming ? kernel_send : kernel_recv);
+            logger_.info(std::string("TLS established, records ") + (kernel_send ? "sent by the kernel" : kernel_recv ? "received by the kernel" : "in user space") + ".");
+        }
+        else
+        {
+            // compression needs the socket plain both ways
+            ++options_->tls->ktls_fallbacks;
+            tls_failed("kTLS refused for this session, which compression needs");
+            return;
+        }
+
+        if (options_->tls->client)
+        {
+            start_forwarding();
+        }
+        else
+        {
+            attempt_connection();
+        }
+    }
+
+    void tls_failed(const std::string &message)
+    {
+        ++options_->tls->handshake_failures;
+        logger_.warn(message + ". Closing session.");
+        tls_.reset();
+        clean_up(CloseReason::tls_failed);
+    }
+
+    // tells the target who the real client is before any payload
+    void send_proxy_header()
+    {
+        boost::system::error_code ec;
+        tcp::endpoint client = in_socket_.remote_endpoint(ec);
+        tcp::endpoint local = in_socket_.local_endpoint(ec);
+        if (ec)
+        {
+            logger_.warn("reading client endpoints for PROXY header failed: " + ec.message());
+            clean_up(CloseReason::proxy_header_failed);
+            return;
+        }
+
+        proxy_header_ = options_->proxy_protocol == 1 ? proxy_header_v1(client, local) : proxy_header_v2(client, local);
+
+        auto self(this->shared_from_this());
+        boost::asio::async_write(out_socket_, boost::asio::buffer(proxy_header_), [this, self](boost::system::error_code write_ec, std::size_t)
+                                 {
+            if (write_ec)
+            {
+                logger_.warn("Writing PROXY header failed: " + write_ec.message());
+                clean_up(CloseReason::proxy_header_failed);
+                return;
+            }
+            plz_start_data(); });
+    }
+
+    static std::string proxy_header_v1(const tcp::endpoint &client, const tcp::endpoint &local)
+    {
+        bool v4 = both_v4(client, local);
+        std::string src = v4 ? client.address().to_string() : as_v6(client.address()).to_string();
+        std::string dst = v4 ? local.address().to_string() : as_v6(local.address()).to_string();
+        return std::string("PROXY ") + (v4 ? "TCP4 " : "TCP6 ") + src + " " + dst + " " +
+               std::to_string(client.port()) + " " + std::to_string(local.port()) + "\r\n";
+    }
+
+    static std::string proxy_header_v2(const tcp::endpoint &client, const tcp::endpoint &local)
+    {
+        static const char signature[] = "\r\n\r\n\0\r\nQUIT\n";
+        std::string header(signature, 12);
+        header.push_back('\x21'); // version 2, PROXY command
+
+        auto put_port = [&header](unsigned short port)
+        {
+            header.push_back(static_cast<char>(port >> 8));
+            header.push_back(static_cast<char>(port & 0xff));
+        };
+
+        if (both_v4(client, local))
+        {
+            header.push_back('\x11'); // TCP over IPv4
+            put_port(12);
+            auto src = client.address().to_v4().to_bytes();
+            auto dst = local.address().to_v4().to_bytes();
+            header.append(reinterpret_cast<const char *>(src.data()), src.size());
+            header.append(reinterpret_cast<const char *>(dst.data()), dst.size());
+        }
+        else
+        {
+            header.push_back('\x21'); // TCP over IPv6
+            put_port(36);
+            auto src = as_v6(client.address()).to_bytes();
+            auto dst = as_v6(local.address()).to_bytes();
+            header.append(reinterpret_cast<const char *>(src.data()), src.size());
+            header.append(reinterpret_cast<const char *>(dst.data()), dst.size());
+        }
+        put_port(client.port());
+        put_port(local.port());
+        return header;
+    }
+
+    void plz_start_data()
+    {
+        if (options_->capture->armed() && capture_matches(upstream_))
+        {
+            // the zero-copy paths below keep the payload away from the capture
+            plz_forward();
+            return;
+        }
+        if constexpr (Policy::spliced)
+        {
+            plz_splice();
+        }
+        else if (!Policy::layered && !Policy::rate_limited && upstream_.mirror)
+        {
+            plz_tee();
+        }
+        else
+        {
+            plz_forward();
+        }
+    }
+
+    using Layer = std::conditional_t<Policy::records == RecordLayer::sealed, SessionCipher,
+                                     std::conditional_t<Policy::records == RecordLayer::tls, TlsRecords,
+                                                        std::conditional_t<Policy::records == RecordLayer::compressed, CompressedRecords, NoSessionCipher>>>;
+    using Bucket = std::conditional_t<Policy::rate_limited, TokenBucket, NoTokenBucket>;
+
+    struct Direction
+    {
+        Direction(boost::asio::io_context &io_context, tcp::socket &src, tcp::socket &dst,
+                  const ListenerOptions &options, ShardedCounter &bytes_counter, bool transforming)
+            : source(src), destination(dst), layer(options, transforming), buffer(layer.buffer_size(options)),
+              bucket(io_context, options), bytes(bytes_counter), transforming(transforming) {}
+
+        ~Direction()
+        {
+            for (int fd : pipe)
+            {
+                if (fd != -1)
+                    close(fd);
+            }
+        }
+
+        tcp::socket &source;
+        tcp::socket &destination;
+        Layer layer;
+        std::vector<char> buffer;
+        HandlerMemory memory;
+        Bucket bucket;
+        ShardedCounter &bytes;
+        bool transforming;
+        std::shared_ptr<MirrorStream> mirror; // null unless the listener mirrors this direction
+        int pipe[2] = {-1, -1};               // mirrored plain sessions: socket -> pipe -> socket
+        std::size_t piped = 0;                // bytes in pipe not yet passed on
+        uint64_t total = 0;                   // this session's bytes, for its access record
+        std::atomic<uint32_t> capture_seq{1}; // next sequence number in a capture
+        uint64_t capture_seen = 0;            // capture generation capture_on was decided for
+        bool capture_on = false;
+        tcp::endpoint capture_client;
+        tcp::endpoint capture_local;
+    };
+
+    boost::asio::mutable_buffer read_region(Direction &dir)
+    {
+        if constexpr (Policy::layered)
+        {
+            return dir.layer.read_buffer(dir.buffer);
+        }
+        else
+        {
+            return boost::asio::buffer(dir.buffer);
+        }
+    }
+
+    void plz_forward()
+    {
+        logger_.trace("Starting data forwarding...");
+        if (peeked_)
+        {
+            // the bytes routing read count as upstream's first read
+            std::size_t length = peeked_;
+            peeked_ = 0;
+            forward_read(upstream_, this->shared_from_this(), boost::system::error_code(), length);
+        }
+        else
+        {
+            forward_data(upstream_, this->shared_from_this());
+        }
+        forward_data(downstream_, this->shared_from_this());
+    }
+
+    // each direction owns one reference to the session and moves it from handler
+    // to handler, so a chunk costs no refcount traffic and no heap allocation
+    void forward_data(Direction &dir, std::shared_ptr<Session> self)
+    {
+        dir.source.async_read_some(read_region(dir), make_alloc_handler(dir.memory, [this, self = std::move(self), &dir](boost::system::error_code ec, std::size_t length) mutable
+                                                                                           { forward_read(dir, std::move(self), ec, length); }));
+    }
+
+    void read_eof(Direction &dir)
+    {
+        chatter("EOF received.. closing connection.");
+        if (!responded_ && &dir == &downstream_)
+        {
+            // the target hung up without a single byte
+            target_failed();
+        }
+        clean_up(&dir == &upstream_ ? CloseReason::client_closed : CloseReason::target_closed);
+    }
+
+    // the closing record goes to the paired forwarder before the session closes
+    void seal_end(Direction &dir, std::shared_ptr<Session> self)
+    {
+        if (!dir.layer.seal_end(dir.buffer))
+        {
+            clean_up(CloseReason::record_failed);
+            return;
+        }
+        boost::asio::async_write(dir.destination, dir.layer.output(),
+                                 make_alloc_handler(dir.memory, [this, self = std::move(self), &dir](boost::system::error_code write_ec, std::size_t) mutable
+                                                    {
+            if (write_ec)
+            {
+                logger_.warn("Write error: " + write_ec.message());
+                clean_up(write_failed(dir));
+                return;
+            }
+            read_eof(dir); }));
+    }
+
+    void forward_read(Direction &dir, std::shared_ptr<Session> self, boost::system::error_code ec, std::size_t length)
+    {
+        if (!ec)
+        {
+            if (!responded_ && &dir == &downstream_)
+            {
+                target_responded();
+            }
+            if (traced_)
+            {
+                if (logger_.must_log(Logger::LogLevel::DEBUG))
+                    logger_.debug("Data read from source. Length: " + std::to_string(length));
+            }
+            boost::asio::const_buffer chunk = boost::asio::buffer(dir.buffer, length);
+            if (!Policy::layered || dir.transforming)
+            {
+                // the plaintext is what was read, unless the layer opens it
+                observe(dir, static_cast<const char *>(read_region(dir).data()), length);
+            }
+            if constexpr (Policy::records == RecordLayer::compressed)
+            {
+                boost::system::error_code available_ec;
+                dir.layer.expect_more(length == dir.buffer.size() && dir.source.available(available_ec) > 0);
+            }
+            if constexpr (Policy::layered)
+            {
+                if (!dir.layer.transform(dir.buffer, length))
+                {
+                    ++options_->stats.record_failures;
+                    logger_.warn("Stream from the paired forwarder failed to authenticate or decode. Closing session.");
+                    clean_up(CloseReason::record_failed);
+                    return;
+                }
+                chunk = dir.layer.output();
+                if (chunk.size() == 0)
+                {
+                    // no complete record yet
+                    dir.layer.written(dir.buffer);
+                    forward_data(dir, std::move(self));
+                    return;
+                }
+                if (!dir.transforming)
+                {
+                    observe(dir, static_cast<const char *>(chunk.data()), chunk.size());
+                }
+            }
+            boost::asio::async_write(dir.destination, chunk,
+                                     make_alloc_handler(dir.memory, [this, self = std::move(self), &dir](boost::system::error_code write_ec, std::size_t bytes_transferred) mutable
+                                     {
+                                         if (!write_ec)
+                                         {
+                                             if constexpr (Policy::layered)
+                                             {
+                                                 dir.layer.written(dir.buffer);
+                                             }
+                                             if (traced_)
+                                             {
+                                                 logger_.trace("Data forwarded successfully.");
+                                             }
+                                             if constexpr (Policy::counted)
+                                             {
+                                                 dir.bytes.add(bytes_transferred);
+                                                 dir.total += bytes_transferred;
+                                             }
+                                             if constexpr (Policy::rate_limited)
+                                             {
+                                                 auto pause = dir.bucket.consume(bytes_transferred);
+                                                 if (pause > std::chrono::steady_clock::duration::zero())
+                                                 {
+                                                     throttle(dir, pause, std::move(self));
+                                                     return;
+                                                 }
+                                             }
+                                             forward_data(dir, std::move(self));
+                                         }
+                                         else
+                                         {
+                                             logger_.warn("Write error: " + write_ec.message());
+                                             clean_up(write_failed(dir));
+                                         }
+                                     }));
+        }
+        else if (ec == boost::asio::error::eof)
+        {
+            if constexpr (Policy::records == RecordLayer::sealed)
+            {
+                if (dir.transforming)
+                {
+                    seal_end(dir, std::move(self));
+                    return;
+                }
+                if (!dir.layer.finished())
+                {
+                    ++options_->stats.record_failures;
+                    logger_.warn("Stream from the paired forwarder ended without its closing record. Closing session.");
+                    clean_up(CloseReason::record_failed);
+                    return;
+                }
+            }
+            read_eof(dir);
+        }
+        else
+        {
+            logger_.error("Read error: " + ec.message());
+            if (ec == boost::asio::error::connection_reset && &dir == &downstream_)
+            {
+                target_failed();
+            }
+            clean_up(&dir == &upstream_ ? CloseReason::client_error : CloseReason::target_error);
+        }
+    }
+
+    // a plaintext chunk for the mirror and, while some capture is armed, the capture ring
+    void observe(Direction &dir, const char *data, std::size_t length)
+    {
+        if (dir.mirror)
+        {
+            dir.mirror->write(data, length);
+        }
+        if (options_->capture->armed())
+        {
+            capture_chunk(dir, data, length);
+        }
+    }
+
+    void capture_chunk(Direction &dir, const char *data, std::size_t length)
+    {
+        if (!capture_matches(dir))
+        {
+            return;
+        }
+        bool upstream = &dir == &upstream_;
+        uint32_t ack = (upstream ? downstream_ : upstream_).capture_seq.load(std::memory_order_relaxed);
+        uint32_t seq = dir.capture_seq.fetch_add(static_cast<uint32_t>(length), std::memory_order_relaxed);
+        options_->capture->record(id_, upstream, dir.capture_client, dir.capture_local, seq, ack, data, length);
+    }
+
+    // decided again only when the capture filter changed; each direction keeps its own
+    // answer since the two may run on different threads
+    bool capture_matches(Direction &dir)
+    {
+        uint64_t generation = options_->capture->generation();
+        if (generation != dir.capture_seen)
+        {
+            dir.capture_seen = generation;
+            boost::system::error_code client_ec, local_ec;
+            dir.capture_client = in_socket_.remote_endpoint(client_ec);
+            dir.capture_local = in_socket_.local_endpoint(local_ec);
+            dir.capture_on = !client_ec && !local_ec &&
+                             options_->capture->matches(options_->name, dir.capture_client.address(), id_);
+        }
+        return dir.capture_on;
+    }
+
+    // mirrored plain sessions keep their payload out of user space too: each direction
+    // splices socket -> pipe -> socket, and tee() gives the mirror its copy of the pipe.
+    // both directions run on one strand, so neither splices a socket the other closed.
+    void plz_tee()
+    {
+        if (peeked_)
+        {
+            // what routing read is the only payload that passes through user space
+            upstream_.mirror->write(upstream_.buffer.data(), peeked_);
+            write_peeked([this](std::shared_ptr<Session>)
+                         { start_tee(); });
+            return;
+        }
+        start_tee();
+    }
+
+    void start_tee()
+    {
+        boost::system::error_code ec;
+        in_socket_.native_non_blocking(true, ec);
+        if (!ec)
+        {
+            out_socket_.native_non_blocking(true, ec);
+        }
+        if (ec || pipe2(upstream_.pipe, O_NONBLOCK | O_CLOEXEC) < 0 || pipe2(downstream_.pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+        {
+            logger_.warn("Setting up pipes for the mirrored session failed. Forwarding in user space.");
+            plz_forward();
+            return;
+        }
+        boost::asio::post(strand_, [this, self = this->shared_from_this()]() mutable
+                          {
+            tee_forward(upstream_, self);
+            tee_forward(downstream_, std::move(self)); });
+    }
+
+    void tee_forward(Direction &dir, std::shared_ptr<Session> self)
+    {
+        if (!dir.source.is_open() || !dir.destination.is_open())
+        {
+            return;
+        }
+        for (int round = 0; round < tee_rounds; ++round)
+        {
+            if (dir.piped == 0)
+            {
+                ssize_t length = splice(dir.source.native_handle(), nullptr, dir.pipe[1], nullptr, tee_chunk, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if (length < 0 && errno == EAGAIN)
+                {
+                    tee_wait(dir, dir.source, tcp::socket::wait_read, std::move(self));
+                    return;
+                }
+                if (length <= 0)
+                {
+                    tee_closed(dir, length == 0 ? 0 : errno);
+                    return;
+                }
+                if (!responded_ && &dir == &downstream_)
+                {
+                    target_responded();
+                }
+                dir.piped = static_cast<std::size_t>(length);
+                if (dir.mirror)
+                {
+                    dir.mirror->tee(dir.pipe[0], dir.piped);
+                }
+            }
+
+            ssize_t moved = splice(dir.pipe[0], nullptr, dir.destination.native_handle(), nullptr, dir.piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (moved < 0 && errno == EAGAIN)
+            {
+                tee_wait(dir, dir.destination, tcp::socket::wait_write, std::move(self));
+                return;
+            }
+            if (moved <= 0)
+            {
+                logger_.warn("Write error: " + std::string(strerror(errno)));
+                clean_up(write_failed(dir));
+                return;
+            }
+            dir.piped -= static_cast<std::size_t>(moved);
+            if constexpr (Policy::counted)
+            {
+                dir.bytes.add(static_cast<uint64_t>(moved));
+                dir.total += static_cast<uint64_t>(moved);
+            }
+        }
+        // a busy direction yields to the other one and to other sessions
+        boost::asio::post(strand_, make_alloc_handler(dir.memory, [this, self = std::move(self), &dir]() mutable
+                                                          { tee_forward(dir, std::move(self)); }));
+    }
+
+    void tee_wait(Direction &dir, tcp::socket &socket, tcp::socket::wait_type what, std::shared_ptr<Session> self)
+    {
+        socket.async_wait(what, boost::asio::bind_executor(strand_, make_alloc_handler(dir.memory, [this, self = std::move(self), &dir](boost::system::error_code ec) mutable
+                                                                                             {
+            if (!ec)
+            {
+                tee_forward(dir, std::move(self));
+            } })));
+    }
+
+    void tee_closed(Direction &dir, int error)
+    {
+        bool client = &dir == &upstream_;
+        if (error == 0)
+        {
+            chatter("EOF received.. closing connection.");
+            if (!responded_ && !client)
+            {
+                target_failed();
+            }
+        }
+        else
+        {
+            logger_.error("Read error: " + std::string(strerror(error)));
+            if (error == ECONNRESET && !client)
+            {
+                target_failed();
+            }
+        }
+        clean_up(error == 0 ? (client ? CloseReason::client_closed : CloseReason::target_closed)
+                            : (client ? CloseReason::client_error : CloseReason::target_error));
+    }
+
+    void throttle(Direction &dir, std::chrono::steady_clock::duration pause, std::shared_ptr<Session> self)
+    {
+        dir.bucket.timer.expires_after(pause);
+        dir.bucket.timer.async_wait(make_alloc_handler(dir.memory, [this, self = std::move(self), &dir](boost::system::error_code ec) mutable
+                                                       {
+            if (!ec)
+            {
+                forward_data(dir, std::move(self));
+            } }));
+    }
+
+    // the splice lifecycle, from draining to unsplice or close, runs on strand_
+    void plz_splice()
+    {
+        boost::asio::dispatch(strand_, [this, self = this->shared_from_this()]() mutable
+                              {
+            if (peeked_)
+            {
+                // the bytes routing read go out before the sockets join the sockhash
+                write_peeked([this](std::shared_ptr<Session> self)
+                             { drain_pending(upstream_, std::move(self)); });
+                return;
+            }
+            drain_pending(upstream_, std::move(self)); });
+    }
+
+    // sends the bytes routing read to the target, then hands over to `next` on strand_
+    template <typename Next>
+    void write_peeked(Next next)
+    {
+        boost::asio::async_write(out_socket_, boost::asio::buffer(upstream_.buffer, peeked_),
+                                 boost::asio::bind_executor(strand_, [this, self = this->shared_from_this(), next = std::move(next)](boost::system::error_code ec, std::size_t written) mutable
+                                                            {
+            peeked_ = 0;
+            if constexpr (Policy::counted)
+            {
+                upstream_.bytes.add(written);
+                upstream_.total += written;
+            }
+            if (ec)
+            {
+                logger_.warn("Writing the routed bytes failed: " + ec.message());
+                clean_up(CloseReason::target_error);
+                return;
+            }
+            next(std::move(self)); }));
+    }
+
+    // whatever arrived before the sockets join the sockhash is still queued on them:
+    // upstream's is passed on first, then downstream's, then the sockets are joined
+    void drain_pending(Direction &dir, std::shared_ptr<Session> self)
+    {
+        boost::system::error_code ec;
+        std::size_t pending = dir.source.available(ec);
+        if (ec)
+        {
+            drain_failed(ec);
+            return;
+        }
+        if (pending == 0)
+        {
+            if (&dir == &upstream_)
+            {
+                drain_pending(downstream_, std::move(self));
+            }
+            else
+            {
+                join_sockhash();
+            }
+            return;
+        }
+
+        dir.source.async_read_some(boost::asio::buffer(dir.buffer, std::min(pending, dir.buffer.size())),
+                                   boost::asio::bind_executor(strand_, [this, self = std::move(self), &dir](boost::system::error_code read_ec, std::size_t length) mutable
+                                                              {
+            if (read_ec)
+            {
+                drain_failed(read_ec);
+                return;
+            }
+            boost::asio::async_write(dir.destination, boost::asio::buffer(dir.buffer, length),
+                                     boost::asio::bind_executor(strand_, [this, self = std::move(self), &dir](boost::system::error_code write_ec, std::size_t written) mutable
+                                                                {
+                if (write_ec)
+                {
+                    drain_failed(write_ec);
+                    return;
+                }
+                if constexpr (Policy::counted)
+                {
+                    dir.bytes.add(written);
+                    dir.total += written;
+                }
+                drain_pending(dir, std::move(self)); })); }));
+    }
+
+    void drain_failed(const boost::system::error_code &ec)
+    {
+        logger_.warn("Draining pending data before splicing failed: " + ec.message());
+        clean_up(CloseReason::unknown);
+    }
+
+    void join_sockhash()
+    {
+        if (!splicer_->splice(in_socket_.native_handle(), out_socket_.native_handle(), in_cookie_, out_cookie_))
+        {
+            logger_.warn("Splicing session failed: " + std::string(strerror(errno)) + ". Forwarding in user space.");
+            plz_forward();
+            return;
+        }
+        spliced_ = true;
+        in_written_ = bytes_written(in_socket_);
+        out_written_ = bytes_written(out_socket_);
+
+        boost::system::error_code ec;
+        if (in_socket_.available(ec) > 0 || out_socket_.available(ec) > 0)
+        {
+            logger_.debug("Data raced the sockhash insert. Forwarding in user space.");
+            unsplice_and_forward();
+            return;
+        }
+
+        logger_.info("Session spliced in kernel.");
+        watch_spliced(in_socket_);
+        watch_spliced(out_socket_);
+        schedule_idle_check(0);
+    }
+
+    // a spliced socket only becomes readable in user space on EOF, error, or when the
+    // verdict program passed an skb up because its peer entry was gone
+    void watch_spliced(tcp::socket &socket)
+    {
+        auto self(this->shared_from_this());
+        socket.async_wait(tcp::socket::wait_read, boost::asio::bind_executor(strand_, [this, self, &socket](boost::system::error_code ec)
+                                                                            {
+            if (ec || !spliced_)
+                return;
+
+            char probe;
+            ssize_t n = recv(socket.native_handle(), &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+            if (n > 0)
+            {
+                logger_.debug("Spliced socket has data queued in user space. Forwarding in user space.");
+                unsplice_and_forward();
+            }
+            else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                watch_spliced(socket);
+            }
+            else if (n == 0)
+            {
+                chatter("Spliced session closed by peer.");
+                flush_spliced(&socket == &in_socket_ ? out_socket_ : in_socket_,
+                              &socket == &in_socket_ ? CloseReason::client_closed : CloseReason::target_closed,
+                              std::chrono::steady_clock::now() + spliced_flush_timeout);
+            }
+            else
+            {
+                logger_.error("Read error: " + std::string(strerror(errno)));
+                clean_up(&socket == &in_socket_ ? CloseReason::client_error : CloseReason::target_error);
+            } }));
+    }
+
+    // what the verdict program redirected may still be queued on the other socket, in
+    // the kernel's sockmap backlog where no socket counter shows it, and closing the
+    // socket drops it. so the session closes once the peer acknowledged every byte that
+    // socket was given, or at the deadline
+    void flush_spliced(tcp::socket &socket, CloseReason reason, std::chrono::steady_clock::time_point deadline)
+    {
+        uint64_t given = &socket == &out_socket_ ? out_written_ + splicer_->bytes(in_cookie_)
+                                                 : in_written_ + splicer_->bytes(out_cookie_);
+        KernelTcpInfo info;
+        if (!read_tcp_info(socket, info) || info.bytes_acked >= given || std::chrono::steady_clock::now() >= deadline)
+        {
+            clean_up(reason);
+            return;
+        }
+
+        auto self(this->shared_from_this());
+        timer_.expires_after(spliced_flush_poll);
+        timer_.async_wait([this, self, &socket, reason, deadline](boost::system::error_code ec)
+                          {
+            if (ec || !spliced_)
+                return;
+            flush_spliced(socket, reason, deadline); });
+    }
+
+    // bytes written to the socket so far, acknowledged or still queued
+    static uint64_t bytes_written(tcp::socket &socket)
+    {
+        KernelTcpInfo info;
+        int unsent = 0;
+        if (!read_tcp_info(socket, info) || ioctl(socket.native_handle(), SIOCOUTQ, &unsent) < 0)
+            return 0;
+        return info.bytes_acked + static_cast<uint64_t>(unsent);
+    }
+
+    static bool read_tcp_info(tcp::socket &socket, KernelTcpInfo &info)
+    {
+        std::memset(&info, 0, sizeof(info));
+        socklen_t length = sizeof(info);
+        return getsockopt(socket.native_handle(), IPPROTO_TCP, TCP_INFO, &info, &length) == 0 &&
+               length >= offsetof(KernelTcpInfo, bytes_received);
+    }
+
+    void schedule_idle_check(uint64_t last_bytes)
+    {
+        if (splice_idle_timeout_ <= 0)
+            return;
+
+        auto self(this->shared_from_this());
+        timer_.expires_after(std::chrono::seconds(splice_idle_timeout_));
+        timer_.async_wait([this, self, last_bytes](boost::system::error_code ec)
+                          {
+            if (ec || !spliced_)
+                return;
+
+            uint64_t bytes = splicer_->bytes(in_cookie_) + splicer_->bytes(out_cookie_);
+            if (bytes == last_bytes)
+            {
+                logger_.info("Spliced session idle for " + std::to_string(splice_idle_timeout_) + "s. Closing.");
+                clean_up(CloseReason::idle);
+                return;
+            }
+            schedule_idle_check(bytes); });
+    }
+
+    // hands the kernel's byte counts to the listener stats and drops the map entries
+    uint64_t finish_splice()
+    {
+        if constexpr (Policy::counted)
+        {
+            uint64_t up = splicer_->bytes(in_cookie_);
+            uint64_t down = splicer_->bytes(out_cookie_);
+            upstream_.bytes.add(up);
+            downstream_.bytes.add(down);
+            upstream_.total += up;
+            downstream_.total += down;
+        }
+        return splicer_->unsplice(in_cookie_, out_cookie_);
+    }
+
+    void unsplice_and_forward()
+    {
+        if (!spliced_.exchange(false))
+            return;
+
+        finish_splice();
+        boost::system::error_code ec;
+        timer_.cancel();
+        in_socket_.cancel(ec);
+        out_socket_.cancel(ec);
+        plz_forward();
+    }
+
+    // the first reason recorded is the one the access log gets; later ones are the fallout
+    void closing(CloseReason reason)
+    {
+        CloseReason expected = CloseReason::unknown;
+        close_reason_.compare_exchange_strong(expected, reason, std::memory_order_relaxed);
+    }
+
+    CloseReason write_failed(const Direction &dir) const
+    {
+        return &dir == &upstream_ ? CloseReason::target_error : CloseReason::client_error;
+    }
+
+    // per-session INFO lines, which the access record stands in for when it is on
+    void chatter(const std::string &message)
+    {
+        if (options_->access_log)
+            logger_.debug(message);
+        else
+            logger_.info(message);
+    }
+
+    void write_access_record()
+    {
+        auto now = std::chrono::steady_clock::now();
+        AccessRecord record;
+        record.id = id_;
+        record.listen = &options_->name;
+        record.client = client_;
+        record.target = target_->host() + ":" + std::to_string(target_port_);
+        record.peer = target_endpoint_;
+        if (connected_at_ != std::chrono::steady_clock::time_point())
+        {
+            record.connect = std::chrono::duration_cast<std::chrono::microseconds>(connected_at_ - accepted_at_);
+        }
+        record.duration = std::chrono::duration_cast<std::chrono::microseconds>(now - accepted_at_);
+        record.bytes_up = upstream_.total;
+        record.bytes_down = downstream_.total;
+        record.reason = close_reason_.load(std::memory_order_relaxed);
+        options_->access_log->write(record);
+    }
+
+    void clean_up(CloseReason reason)
+    {
+        closing(reason);
+        if constexpr (Policy::spliced)
+        {
+            if (spliced_.exchange(false))
+            {
+                uint64_t bytes = finish_splice();
+                chatter("Spliced session finished. Bytes forwarded in kernel: " + std::to_string(bytes));
+            }
+        }
+        if constexpr (Policy::rate_limited)
+        {
+            upstream_.bucket.timer.cancel();
+            downstream_.bucket.timer.cancel();
+        }
+        timer_.cancel();
+        if (upstream_.mirror)
+        {
+            upstream_.mirror->finish();
+        }
+        if (downstream_.mirror)
+        {
+            downstream_.mirror->finish();
+        }
+        if (tcp_probe_)
+        {
+            tcp_probe_->finish();
+        }
+
+        boost::system::error_code ec;
+        if (in_socket_.is_open())
+        {
+            in_socket_.shutdown(tcp::socket::shutdown_both, ec);
+            in_socket_.close(ec);
+        }
+        if (out_socket_.is_open())
+        {
+            out_socket_.shutdown(tcp::socket::shutdown_both, ec);
+            out_socket_.close(ec);
+        }
+        chatter("Session cleaned up. Sockets closed.");
+    }
+
+    void close_sockets()
+    {
+        boost::system::error_code ec;
+        in_socket_.close(ec);
+        out_socket_.close(ec);
+        logger_.info("Sockets closed");
+    }
+
+    boost::asio::io_context &io_context_;
+    uint64_t id_;
+    tcp::socket in_socket_;
+    tcp::socket out_socket_;
+    std::shared_ptr<ListenerOptions> options_;
+    std::shared_ptr<ResolvedTarget> target_; // the listener's, or the one its routing picked
+    unsigned short target_port_;
+    TargetBreakers *breakers_;
+    tcp::endpoint target_endpoint_;
+    int retry_attempts_;
+    int retry_delay_;
+    int current_attempt_;
+    boost::asio::strand<boost::asio::io_context::executor_type> strand_; // tee and splice paths, timer_, close_now
+    boost::asio::steady_timer timer_;
+    Logger &logger_;
+    AdmissionControl &admission_;
+    Direction upstream_;
+    Direction downstream_;
+    SockmapSplicer *splicer_;
+    int splice_idle_timeout_;
+    std::atomic<bool> spliced_;
+    uint64_t in_cookie_ = 0;
+    uint64_t out_cookie_ = 0;
+    uint64_t in_written_ = 0;  // bytes written to each socket in user space before it was spliced
+    uint64_t out_written_ = 0;
+    SourceAddressPool *source_pool_;
+    SourceAddressPool::Source *source_ = nullptr;
+    const bool traced_;  // trace_chunks
+    std::string proxy_header_;
+    std::shared_ptr<CircuitBreaker> breaker_;
+    bool trial_ = false;
+    std::atomic<bool> responded_{false}; // read and set by both directions
+    std::shared_ptr<TlsLink> tls_; // only while handshaking, or for good without kTLS
+    std::size_t peeked_ = 0;      // first bytes of the client, read by routing into upstream_'s buffer
+    std::atomic<bool> peek_expired_{false};
+    std::shared_ptr<TcpInfoSampler::Probe> tcp_probe_; // once forwarding, when TCP_INFO sampling is enabled
+    std::chrono::steady_clock::time_point accepted_at_;
+    std::chrono::steady_clock::time_point connected_at_; // epoch until the target connect succeeds
+    tcp::endpoint client_;                                // only read when the access log is on
+    std::atomic<CloseReason> close_reason_{CloseReason::unknown};
+    static constexpr int tee_rounds = 16;
+    static constexpr std::size_t tee_chunk = 65536; // a pipe's default capacity
+    static constexpr int tls_handshake_timeout = 10;
+    static constexpr std::chrono::milliseconds spliced_flush_poll{10};
+    static constexpr std::chrono::milliseconds bind_retry_delay{50};
+    static constexpr std::chrono::seconds spliced_flush_timeout{30};
+};
+
+template <typename Policy>
+void start_session(boost::asio::io_context &io_context, tcp::socket in_socket, std::shared_ptr<ListenerOptions> options,
+                   Logger &logger, AdmissionControl &admission)
+{
+    auto session = std::make_shared<Session<Policy>>(io_context, std::move(in_socket), std::move(options), logger, admission);
+    admission.track(session);
+    session->start();
+}
+
+template <typename Next>
+SessionStarter with_flag(bool flag, Next &&next)
+{
+    return flag ? next(std::true_type{}) : next(std::false_type{});
+}
+
+template <typename Next>
+SessionStarter with_records(RecordLayer records, Next &&next)
+{
+    switch (records)
+    {
+    case RecordLayer::sealed:
+        return next(std::integral_constant<RecordLayer, RecordLayer::sealed>{});
+    case RecordLayer::tls:
+        return next(std::integral_constant<RecordLayer, RecordLayer::tls>{});
+    case RecordLayer::compressed:
+        return next(std::integral_constant<RecordLayer, RecordLayer::compressed>{});
+    default:
+        return next(std::integral_constant<RecordLayer, RecordLayer::plain>{});
+    }
+}
+
+// framing of the mux tunnel between paired forwarders. every frame starts with a
+// fixed header: type, stream id, and a length that is the payload size of data
+// frames and the credit of window frames. the side that connects opens streams.
+enum class MuxFrameType : uint8_t
+{
+    hello = 1,  // first frame each way; length is the sender's receive window per stream
+    open = 2,   // new stream, data may follow right away
+    data = 3,
+    window = 4, // the receiver wrote `length` more bytes of the stream out
+    close = 5,  // the sender will send no more data on the stream
+    reset = 6,  // stream aborted in both directions
+    ping = 7    // keepalive, stream 0; length 0 asks for an answer, 1 is the answer
+};
+
+struct MuxHeader
+{
+    static constexpr std::size_t size = 12;
+    static constexpr uint32_t version = 0x4d555831; // "MUX1", stream field of hello frames
+    using Bytes = std::array<unsigned char, size>;
+
+    MuxFrameType type;
+    uint32_t stream;
+    uint32_t length;
+
+    void encode(Bytes &out) const
+    {
+        out[0] = static_cast<unsigned char>(type);
+        out[1] = out[2] = out[3] = 0;
+        put32(out, 4, stream);
+        put32(out, 8, length);
+    }
+
+    static MuxHeader decode(const Bytes &in)
+    {
+        return MuxHeader{static_cast<MuxFrameType>(in[0]), get32(in, 4), get32(in, 8)};
+    }
+
+private:
+    static void put32(Bytes &out, std::size_t pos, uint32_t value)
+    {
+        out[pos] = static_cast<unsigned char>(value >> 24);
+        out[pos + 1] = static_cast<unsigned char>(value >> 16);
+        out[pos + 2] = static_cast<unsigned char>(value >> 8);
+        out[pos + 3] = static_cast<unsigned char>(value);
+    }
+
+    static uint32_t get32(const Bytes &in, std::size_t pos)
+    {
+        return (static_cast<uint32_t>(in[pos]) << 24) | (static_cast<uint32_t>(in[pos + 1]) << 16) |
+               (static_cast<uint32_t>(in[pos + 2]) << 8) | static_cast<uint32_t>(in[pos + 3]);
+    }
+};
+
+class MuxConnection;
+
+// one client connection carried over a mux connection. the socket side sends at
+// most one data frame at a time, straight from its read buffer and never beyond
+// the peer's window. the receive side is a ring the size of our own window that the
+// mux reader fills in place; credit goes back only once bytes reach the socket, so
+// a slow stream stalls only itself and never the connection.
+class MuxStream : public Closable, public std::enable_shared_from_this<MuxStream>
+{
+public:
+    MuxStream(std::shared_ptr<MuxConnection> connection, uint32_t id, tcp::socket socket, std::shared_ptr<ListenerOptions> options,
+              std::size_t send_window, Logger &logger, AdmissionControl *admission);
+    ~MuxStream();
+
+    uint32_t id() const { return id_; }
+
+    void start_accepted();
+    void start_connecting();
+
+    // ring space for an incoming data frame; false when the peer overran its window
+    bool receive_buffers(std::size_t length, std::array<boost::asio::mutable_buffer, 2> &buffers);
+    void received(std::size_t length);
+
+    void sent();
+    void window(uint32_t credit);
+    void peer_closed();
+    void abort(bool tell_peer);
+    void close_now() override;
+
+private:
+    void read_socket();
+    void write_socket();
+    void maybe_finish();
+
+    std::shared_ptr<MuxConnection> connection_;
+    uint32_t id_;
+    tcp::socket socket_;
+    std::shared_ptr<ListenerOptions> options_;
+    Logger &logger_;
+    AdmissionControl *admission_;
+    std::vector<char> send_buffer_;
+    std::size_t send_window_;
+    // left uninitialized, so window pages a stream never fills are never touched
+    std::unique_ptr<char[]> ring_;
+    std::size_t ring_size_;
+    std::size_t ring_head_ = 0;
+    std::size_t ring_used_ = 0;
+    std::size_t pending_credit_ = 0;
+    bool connected_ = false;
+    bool sending_ = false;
+    bool writing_ = false;
+    bool local_eof_ = false;
+    bool peer_eof_ = false;
+    bool done_ = false;
+};
+
+class MuxConnection : public Closable, public std::enable_shared_from_this<MuxConnection>
+{
+public:
+    using StateHandler = std::function<void(bool up)>;
+
+    MuxConnection(boost::asio::io_context &io_context, tcp::socket socket, std::shared_ptr<ListenerOptions> options, bool opener,
+                  Logger &logger, AdmissionControl *admission)
+        : io_context_(io_context),
+          socket_(std::move(socket)),
+          strand_(boost::asio::make_strand(io_context)),
+          options_(std::move(options)),
+          opener_(opener),
+          logger_(logger),
+          admission_(admission),
+          next_stream_id_(opener ? 1 : 2),
+          liveness_(strand_),
+          discard_(options_->buffer_size) {}
+
+    ~MuxConnection()
+    {
+        release_slot();
+    }
+
+    boost::asio::strand<boost::asio::io_context::executor_type> &strand() { return strand_; }
+
+    int streams() const { return active_streams_; }
+
+    void start(StateHandler on_state)
+    {
+        on_state_ = std::move(on_state);
+        ++options_->mux.connections;
+        boost::system::error_code ec;
+        socket_.set_option(tcp::no_delay(true), ec);
+        boost::asio::dispatch(strand_, [self = shared_from_this()]()
+                              {
+            self->send_frame(MuxFrameType::hello, MuxHeader::version, static_cast<uint32_t>(self->options_->mux_window));
+            self->last_received_ = std::chrono::steady_clock::now();
+            self->watch_liveness();
+            self->read_header(); });
+    }
+
+    // runs on the strand
+    void open_stream(tcp::socket socket, AdmissionControl *admission)
+    {
+        if (closed_)
+        {
+            boost::system::error_code ec;
+            socket.close(ec);
+            if (admission)
+                admission->release();
+            return;
+        }
+        if (next_stream_id_ > last_stream_id)
+        {
+            // opens dispatched before the link retired ran past its reserve of ids
+            logger_.warn("Mux connection out of stream ids. Closing client.");
+            boost::system::error_code ec;
+            socket.close(ec);
+            if (admission)
+                admission->release();
+            return;
+        }
+        uint32_t id = next_stream_id_;
+        next_stream_id_ += 2;
+        auto stream = std::make_shared<MuxStream>(shared_from_this(), id, std::move(socket), options_, peer_window_, logger_, admission);
+        if (admission)
+            admission->track(stream);
+        streams_[id] = stream;
+        ++active_streams_;
+        send_frame(MuxFrameType::open, id, 0);
+        stream->start_accepted();
+        if (next_stream_id_ > retire_stream_id && on_state_)
+        {
+            // ids would wrap into ones the peer may still know, so new streams go to a
+            // new link and this one closes once its streams are done
+            logger_.info("Mux connection used up its stream ids, retiring it.");
+            retiring_ = true;
+            auto on_state = std::move(on_state_);
+            on_state_ = nullptr;
+            on_state(false);
+        }
+    }
+
+    void send_frame(MuxFrameType type, uint32_t stream, uint32_t length, boost::asio::const_buffer payload = {},
+                    std::shared_ptr<MuxStream> notify = nullptr)
+    {
+        if (closed_)
+            return;
+        outgoing_.push_back(Outgoing{{}, payload, std::move(notify)});
+        MuxHeader{type, stream, length}.encode(outgoing_.back().header);
+        if (!writing_)
+        {
+            write_frames();
+        }
+    }
+
+    void remove_stream(uint32_t id)
+    {
+        if (streams_.erase(id))
+        {
+            --active_streams_;
+        }
+        if (draining_ && streams_.empty())
+        {
+            release_slot();
+        }
+        if (retiring_ && streams_.empty())
+        {
+            close();
+        }
+    }
+
+    void close_now() override
+    {
+        boost::asio::dispatch(strand_, [self = shared_from_this()]()
+                              { self->close(); });
+    }
+
+    // far side: the streams hold slots of their own, so once they are done a draining
+    // link holds nothing worth waiting for
+    void drain_started() override
+    {
+        boost::asio::dispatch(strand_, [self = shared_from_this()]()
+                              {
+            self->draining_ = true;
+            if (self->streams_.empty())
+                self->release_slot(); });
+    }
+
+    void close()
+    {
+        if (closed_)
+            return;
+        closed_ = true;
+        boost::system::error_code ec;
+        socket_.close(ec);
+        liveness_.cancel();
+        outgoing_.clear();
+        auto streams = std::move(streams_);
+        streams_.clear();
+        active_streams_ = 0;
+        for (auto &entry : streams)
+        {
+            entry.second->abort(false);
+        }
+        --options_->mux.connections;
+        if (on_state_)
+        {
+            auto on_state = std::move(on_state_);
+            on_state(false);
+        }
+    }
+
+private:
+    struct Outgoing
+    {
+        MuxHeader::Bytes header;
+        boost::asio::const_buffer payload;
+        std::shared_ptr<MuxStream> notify;
+    };
+
+    // queued frames go out in one gathered write: headers and payloads stay where
+    // they are, nothing is copied into a send buffer
+    void write_frames()
+    {
+        gather_.clear();
+        std::size_t frames = 0;
+        for (auto it = outgoing_.begin(); it != outgoing_.end() && frames < 64; ++it, ++frames)
+        {
+            gather_.push_back(boost::asio::buffer(it->header));
+            if (it->payload.size())
+                gather_.push_back(it->payload);
+        }
+        writing_ = true;
+        boost::asio::async_write(socket_, gather_, boost::asio::bind_executor(strand_, [self = shared_from_this(), frames](boost::system::error_code ec, std::size_t)
+                                                                              {
+            self->writing_ = false;
+            if (ec)
+            {
+                self->logger_.warn("Mux write failed: " + ec.message());
+                self->close();
+                return;
+            }
+            for (std::size_t i = 0; i < frames && !self->outgoing_.empty(); ++i)
+            {
+                std::shared_ptr<MuxStream> notify = std::move(self->outgoing_.front().notify);
+                self->outgoing_.pop_front();
+                if (notify)
+                    notify->sent();
+            }
+            if (!self->outgoing_.empty())
+                self->write_frames(); }));
+    }
+
+    // pings every keepalive interval; a link that stays silent past the timeout, or
+    // never says hello, is taken down so its streams fail fast and the client reconnects
+    void watch_liveness()
+    {
+        liveness_.expires_after(std::chrono::seconds(options_->mux_keepalive));
+        liveness_.async_wait(boost::asio::bind_executor(strand_, [self = shared_from_this()](boost::system::error_code ec)
+                                                         {
+            if (ec || self->closed_)
+                return;
+            if (std::chrono::steady_clock::now() - self->last_received_ >= std::chrono::seconds(self->options_->mux_timeout))
+            {
+                ++self->options_->mux.timeouts;
+                self->logger_.warn(self->hello_received_ ? "Mux peer silent for " + std::to_string(self->options_->mux_timeout) + "s. Closing mux connection."
+                                                         : std::string("Mux peer sent no hello. Closing mux connection."));
+                self->close();
+                return;
+            }
+            if (self->hello_received_)
+                self->send_frame(MuxFrameType::ping, 0, 0);
+            self->watch_liveness(); }));
+    }
+
+    void read_header()
+    {
+        boost::asio::async_read(socket_, boost::asio::buffer(header_in_), boost::asio::bind_executor(strand_, [self = shared_from_this()](boost::system::error_code ec, std::size_t)
+                                                                                                      {
+            if (ec)
+            {
+                if (ec != boost::asio::error::operation_aborted)
+                    self->logger_.info("Mux connection closed: " + ec.message());
+                self->close();
+                return;
+            }
+            self->last_received_ = std::chrono::steady_clock::now();
+            self->handle_frame(MuxHeader::decode(self->header_in_)); }));
+    }
+
+    void handle_frame(const MuxHeader &header)
+    {
+        if (!hello_received_ && header.type != MuxFrameType::hello)
+        {
+            protocol_error("frame before hello");
+            return;
+        }
+
+        auto found = streams_.find(header.stream);
+        std::shared_ptr<MuxStream> stream = found == streams_.end() ? nullptr : found->second;
+
+        switch (header.type)
+        {
+        case MuxFrameType::hello:
+            if (hello_received_)
+            {
+                protocol_error("duplicate hello");
+                return;
+            }
+            if (header.stream != MuxHeader::version || header.length == 0)
+            {
+                protocol_error("unsupported peer");
+                return;
+            }
+            hello_received_ = true;
+            peer_window_ = header.length;
+            if (on_state_)
+                on_state_(true);
+            break;
+        case MuxFrameType::open:
+            if (opener_ || stream || (header.stream & 1) == 0)
+            {
+                protocol_error("bad stream open");
+                return;
+            }
+            // each stream counts against max_connections like the client it carries
+            if (admission_ && !admission_->try_acquire())
+            {
+                logger_.warn("Max connections reached. Resetting new mux stream.");
+                send_frame(MuxFrameType::reset, header.stream, 0);
+                break;
+            }
+            stream = std::make_shared<MuxStream>(shared_from_this(), header.stream, tcp::socket(io_context_), options_, peer_window_, logger_, admission_);
+            if (admission_)
+                admission_->track(stream);
+            streams_[header.stream] = stream;
+            ++active_streams_;
+            stream->start_connecting();
+            break;
+        case MuxFrameType::data:
+            read_payload(stream, header.length);
+            return;
+        case MuxFrameType::window:
+            if (stream)
+                stream->window(header.length);
+            break;
+        case MuxFrameType::close:
+            if (stream)
+                stream->peer_closed();
+            break;
+        case MuxFrameType::reset:
+            if (stream)
+                stream->abort(false);
+            break;
+        case MuxFrameType::ping:
+            if (header.length == 0)
+                send_frame(MuxFrameType::ping, 0, 1);
+            break;
+        default:
+            protocol_error("unknown frame type");
+            return;
+        }
+        read_header();
+    }
+
+    // data lands directly in the stream's ring; frames of streams already gone are skipped
+    void read_payload(std::shared_ptr<MuxStream> stream, std::size_t length)
+    {
+        if (!stream)
+        {
+            discard(length);
+            return;
+        }
+
+        std::array<boost::asio::mutable_buffer, 2> buffers;
+        if (!stream->receive_buffers(length, buffers))
+        {
+            protocol_error("window exceeded");
+            return;
+        }
+        boost::asio::async_read(socket_, buffers, boost::asio::bind_executor(strand_, [self = shared_from_this(), stream, length](boost::system::error_code ec, std::size_t)
+                                                                              {
+            if (ec)
+            {
+                self->close();
+                return;
+            }
+            stream->received(length);
+            self->read_header(); }));
+    }
+
+    void discard(std::size_t remaining)
+    {
+        if (remaining == 0)
+        {
+            read_header();
+            return;
+        }
+        std::size_t chunk = std::min(remaining, discard_.size());
+        boost::asio::async_read(socket_, boost::asio::buffer(discard_.data(), chunk), boost::asio::bind_executor(strand_, [self = shared_from_this(), remaining, chunk](boost::system::error_code ec, std::size_t)
+                                                                                                                  {
+            if (ec)
+            {
+                self->close();
+                return;
+            }
+            self->discard(remaining - chunk); }));
+    }
+
+    void protocol_error(const std::string &what)
+    {
+        logger_.error("Mux protocol error: " + what + ". Closing mux connection.");
+        close();
+    }
+
+    void release_slot()
+    {
+        if (admission_ && holds_slot_)
+        {
+            holds_slot_ = false;
+            admission_->release();
+        }
+    }
+
+    boost::asio::io_context &io_context_;
+    tcp::socket socket_;
+    boost::asio::strand<boost::asio::io_context::executor_type> strand_;
+    std::shared_ptr<ListenerOptions> options_;
+    bool opener_;
+    Logger &logger_;
+    AdmissionControl *admission_;
+    bool holds_slot_ = true; // the link's own slot, given back early in a drain
+    bool draining_ = false;
+    StateHandler on_state_;
+    std::unordered_map<uint32_t, std::shared_ptr<MuxStream>> streams_;
+    std::atomic<int> active_streams_{0};
+    uint32_t next_stream_id_;
+    std::size_t peer_window_ = 0;
+    bool hello_received_ = false;
+    bool retiring_ = false; // out of stream ids, closes with its last stream
+    bool closed_ = false;
+    boost::asio::steady_timer liveness_;
+    std::chrono::steady_clock::time_point last_received_;
+    MuxHeader::Bytes header_in_;
+    std::deque<Outgoing> outgoing_;
+    std::vector<boost::asio::const_buffer> gather_;
+    bool writing_ = false;
+    std::vector<char> discard_;
+
+    // a link retires a few thousand ids early, for opens already on their way to it
+    static constexpr uint32_t retire_stream_id = 0xffff0000u;
+    static constexpr uint32_t last_stream_id = 0xfffffffdu;
+};
+
+MuxStream::MuxStream(std::shared_ptr<MuxConnection> connection, uint32_t id, tcp::socket socket, std::shared_ptr<ListenerOptions> options,
+                     std::size_t send_window, Logger &logger, AdmissionControl *admission)
+    : connection_(std::move(connection)),
+      id_(id),
+      socket_(std::move(socket)),
+      options_(std::move(options)),
+      logger_(logger),
+      admission_(admission),
+      send_buffer_(options_->buffer_size),
+      send_window_(send_window),
+      ring_(new char[options_->mux_window]),
+      ring_size_(options_->mux_window)
+{
+    ++options_->mux.streams;
+    ++options_->mux.streams_opened;
+}
+
+MuxStream::~MuxStream()
+{
+    --options_->mux.streams;
+    if (admission_)
+    {
+        admission_->release();
+    }
+}
+
+void MuxStream::start_accepted()
+{
+    connected_ = true;
+    boost::system::error_code ec;
+    socket_.set_option(tcp::no_delay(options_->tcp_no_delay), ec);
+    read_socket();
+}
+
+// far side: the stream's data may already be arriving while the target connect runs
+void MuxStream::start_connecting()
+{
+    auto addresses = options_->target->addresses();
+    if (addresses->empty())
+    {
+        logger_.error("No address known for " + options_->target->host() + ". Resetting mux stream.");
+        abort(true);
+        return;
+    }
+    tcp::endpoint endpoint((*addresses)[options_->target->rotate() % addresses->size()], options_->target_port);
+    socket_.async_connect(endpoint, boost::asio::bind_executor(connection_->strand(), [self = shared_from_this()](boost::system::error_code ec)
+                                                                {
+        if (self->done_)
+            return;
+        if (ec)
+        {
+            self->logger_.warn("Mux stream connect failed: " + ec.message());
+            self->abort(true);
+            return;
+        }
+        self->connected_ = true;
+        boost::system::error_code option_ec;
+        self->socket_.set_option(tcp::no_delay(self->options_->tcp_no_delay), option_ec);
+        self->read_socket();
+        self->write_socket(); }));
+}
+
+void MuxStream::read_socket()
+{
+    if (!connected_ || sending_ || local_eof_ || done_)
+        return;
+    if (send_window_ == 0)
+    {
+        ++options_->mux.window_stalls;
+        return;
+    }
+
+    sending_ = true;
+    std::size_t limit = std::min(send_buffer_.size(), send_window_);
+    socket_.async_read_some(boost::asio::buffer(send_buffer_.data(), limit), boost::asio::bind_executor(connection_->strand(), [self = shared_from_this()](boost::system::error_code ec, std::size_t length)
+                                                                                                        {
+        if (self->done_)
+            return;
+        if (!ec)
+        {
+            self->send_window_ -= length;
+            self->connection_->send_frame(MuxFrameType::data, self->id_, static_cast<uint32_t>(length),
+                                          boost::asio::buffer(self->send_buffer_.data(), length), self);
+            return;
+        }
+        self->sending_ = false;
+        if (ec == boost::asio::error::eof)
+        {
+            self->local_eof_ = true;
+            self->connection_->send_frame(MuxFrameType::close, self->id_, 0);
+            self->maybe_finish();
+        }
+        else
+        {
+            self->abort(true);
+        } }));
+}
+
+void MuxStream::sent()
+{
+    sending_ = false;
+    read_socket();
+}
+
+void MuxStream::window(uint32_t credit)
+{
+    send_window_ += credit;
+    read_socket();
+}
+
+bool MuxStream::receive_buffers(std::size_t length, std::array<boost::asio::mutable_buffer, 2> &buffers)
+{
+    if (length > ring_size_ - ring_used_ || peer_eof_)
+        return false;
+    std::size_t tail = (ring_head_ + ring_used_) % ring_size_;
+    std::size_t first = std::min(length, ring_size_ - tail);
+    buffers[0] = boost::asio::buffer(ring_.get() + tail, first);
+    buffers[1] = boost::asio::buffer(ring_.get(), length - first);
+    return true;
+}
+
+void MuxStream::received(std::size_t length)
+{
+    ring_used_ += length;
+    write_socket();
+}
+
+void MuxStream::write_socket()
+{
+    if (!connected_ || writing_ || done_)
+        return;
+    if (ring_used_ == 0)
+    {
+        if (peer_eof_)
+        {
+            boost::system::error_code ec;
+            socket_.shutdown(tcp::socket::shutdown_send, ec);
+            maybe_finish();
+        }
+        return;
+    }
+
+    writing_ = true;
+    std::size_t contiguous = std::min(ring_used_, ring_size_ - ring_head_);
+    boost::asio::async_write(socket_, boost::asio::buffer(ring_.get() + ring_head_, contiguous), boost::asio::bind_executor(connection_->strand(), [self = shared_from_this()](boost::system::error_code ec, std::size_t written)
+                                                                                                                               {
+        self->writing_ = false;
+        if (self->done_)
+            return;
+        if (ec)
+        {
+            self->abort(true);
+            return;
+        }
+        self->ring_head_ = (self->ring_head_ + written) % self->ring_size_;
+        self->ring_used_ -= written;
+        self->pending_credit_ += written;
+        // credit goes back in batches, a quarter window at a time
+        if (self->pending_credit_ >= self->ring_size_ / 4 || (self->ring_used_ == 0 && !self->peer_eof_))
+        {
+            self->connection_->send_frame(MuxFrameType::window, self->id_, static_cast<uint32_t>(self->pending_credit_));
+            self->pending_credit_ = 0;
+        }
+        self->write_socket(); }));
+}
+
+void MuxStream::peer_closed()
+{
+    peer_eof_ = true;
+    write_socket();
+}
+
+void MuxStream::maybe_finish()
+{
+    if (local_eof_ && peer_eof_ && ring_used_ == 0 && !sending_ && !done_)
+    {
+        done_ = true;
+        boost::system::error_code ec;
+        socket_.close(ec);
+        connection_->remove_stream(id_);
+    }
+}
+
+void MuxStream::abort(bool tell_peer)
+{
+    if (done_)
+        return;
+    done_ = true;
+    ++options_->mux.resets;
+    if (tell_peer)
+    {
+        connection_->send_frame(MuxFrameType::reset, id_, 0);
+    }
+    boost::system::error_code ec;
+    socket_.close(ec);
+    connection_->remove_stream(id_);
+}
+
+void MuxStream::close_now()
+{
+    boost::asio::dispatch(connection_->strand(), [self = shared_from_this()]()
+                          { self->abort(true); });
+}
+
+// near side of a mux tunnel: a few persistent connections to the peer forwarder,
+// each new client becomes a stream on the least busy one. clients that arrive
+// while no connection is up wait for the next one.
+class MuxClient
+{
+public:
+    MuxClient(boost::asio::io_context &io_context, std::shared_ptr<ListenerOptions> options, int connections, Logger &logger)
+        : io_context_(io_context),
+          options_(std::move(options)),
+          logger_(logger),
+          slots_(connections) {}
+
+    void start()
+    {
+        for (std::size_t i = 0; i < slots_.size(); ++i)
+        {
+            connect(i);
+        }
+    }
+
+    void open(tcp::socket socket, AdmissionControl &admission)
+    {
+        std::shared_ptr<MuxConnection> best;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (const auto &slot : slots_)
+            {
+                if (slot.ready && (!best || slot.connection->streams() < best->streams()))
+                    best = slot.connection;
+            }
+            if (!best)
+            {
+                waiting_.emplace_back(std::move(socket), &admission);
+                return;
+            }
+        }
+        boost::asio::dispatch(best->strand(), [best, socket = std::move(socket), &admission]() mutable
+                              { best->open_stream(std::move(socket), &admission); });
+    }
+
+private:
+    struct Slot
+    {
+        std::shared_ptr<MuxConnection> connection;
+        bool ready = false;
+    };
+
+    void connect(std::size_t index)
+    {
+        auto addresses = options_->target->addresses();
+        if (addresses->empty())
+        {
+            retry(index);
+            return;
+        }
+        tcp::endpoint endpoint((*addresses)[options_->target->rotate() % addresses->size()], options_->target_port);
+        auto socket = std::make_shared<tcp::socket>(io_context_);
+        socket->async_connect(endpoint, [this, index, socket, endpoint](boost::system::error_code ec)
+                              {
+            if (ec)
+            {
+                logger_.warn("Mux connect to " + endpoint.address().to_string() + " failed: " + ec.message());
+                retry(index);
+                return;
+            }
+            logger_.info("Mux connection " + std::to_string(index) + " up to " + endpoint.address().to_string());
+            auto connection = std::make_shared<MuxConnection>(io_context_, std::move(*socket), options_, true, logger_, nullptr);
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                slots_[index].connection = connection;
+                slots_[index].ready = false;
+            }
+            connection->start([this, index, connection](bool up)
+                              { up ? ready(index, connection) : retry(index); }); });
+    }
+
+    void ready(std::size_t index, std::shared_ptr<MuxConnection> connection)
+    {
+        std::deque<std::pair<tcp::socket, AdmissionControl *>> waiting;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            slots_[index].ready = true;
+            waiting.swap(waiting_);
+        }
+        // already on the connection's strand
+        for (auto &client : waiting)
+        {
+            connection->open_stream(std::move(client.first), client.second);
+        }
+    }
+
+    void retry(std::size_t index)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            slots_[index].connection.reset();
+            slots_[index].ready = false;
+        }
+        auto timer = std::make_shared<boost::asio::steady_timer>(io_context_, std::chrono::seconds(1));
+        timer->async_wait([this, index, timer](boost::system::error_code)
+                          { connect(index); });
+    }
+
+    boost::asio::io_context &io_context_;
+    std::shared_ptr<ListenerOptions> options_;
+    Logger &logger_;
+    std::mutex mutex_;
+    std::vector<Slot> slots_;
+    std::deque<std::pair<tcp::socket, AdmissionControl *>> waiting_;
+};
+
+// near side: each accepted client becomes a stream on the listener's mux connections
+void start_mux_stream(boost::asio::io_context &, tcp::socket in_socket, std::shared_ptr<ListenerOptions> options,
+                      Logger &, AdmissionControl &admission)
+{
+    options->mux_client->open(std::move(in_socket), admission);
+}
+
+// far side: each accepted socket is a mux connection from the peer forwarder
+void start_mux_connection(boost::asio::io_context &io_context, tcp::socket in_socket, std::shared_ptr<ListenerOptions> options,
+                          Logger &logger, AdmissionControl &admission)
+{
+    auto connection = std::make_shared<MuxConnection>(io_context, std::move(in_socket), std::move(options), false, logger, &admission);
+    admission.track(connection);
+    connection->start(nullptr);
+}
+
+// resolves a listener's runtime options into the matching Session specialization
+SessionStarter select_session_starter(const ListenerOptions &options)
+{
+    if (options.mux_client)
+        return &start_mux_stream;
+    if (options.mux_server)
+        return &start_mux_connection;
+
+    // the kernel can neither throttle, seal nor compress, so those listeners stay in user
+    // space (SessionPolicy asserts the rule, so those combinations are never instantiated).
+    // the sockhash refuses sockets that carry a ULP, so TLS sessions use read/write.
+    // mirrored listeners need their bytes on the way; plain ones tee() them (plz_tee).
+    bool spliced = options.splicer && options.splicer->ready() && options.rate_limit == 0 && !options.seal && !options.tls &&
+                   !options.compression && !options.mirror;
+    RecordLayer records = options.seal                        ? RecordLayer::sealed
+                          : options.compression               ? RecordLayer::compressed
+                          : options.tls                       ? RecordLayer::tls
+                                                              : RecordLayer::plain;
+
+    // only what a config can ask for is instantiated: every record layer counted or not,
+    // throttled or not, plus plain spliced sessions counted or not. 18 in all
+    return with_records(records, [&](auto layer)
+                        { return with_flag(options.count_bytes, [&](auto counted)
+                                           {
+        constexpr RecordLayer records_of = decltype(layer)::value;
+        constexpr bool counted_of = decltype(counted)::value;
+        if constexpr (records_of == RecordLayer::plain)
+        {
+            if (spliced)
+                return &start_session<SessionPolicy<true, RecordLayer::plain, counted_of, false>>;
+        }
+        if (options.rate_limit > 0)
+            return &start_session<SessionPolicy<false, records_of, counted_of, true>>;
+        return &start_session<SessionPolicy<false, records_of, counted_of, false>>; }); });
+}
+
+class HealthChecker
+{
+public:
+    HealthChecker(boost::asio::io_context &io_context, int interval, Logger &logger)
+        : timer_(io_context),
+          interval_(interval),
+          logger_(logger) {}
+
+    void start()
+    {
+    
+        logger_.trace("Starting health checks...");
+        schedule_check();
+    }
+
+private:
+    void schedule_check()
+    {
+        timer_.expires_after(std::chrono::seconds(interval_));
+        timer_.async_wait([this](boost::system::error_code ec)
+                          {
+            if (!ec) {
+                logger_.info("Health check: System is operational");
+                schedule_check();
+            } });
+    }
+
+    boost::asio::steady_timer timer_;
+    int interval_;
+    Logger &logger_;
+};
+
+// measures how late the io_context runs a periodic timer. every handler queued ahead
+// of it delays it, so the overshoot is the scheduling lag sessions see. with shedding
+// on, a smoothed lag above high_lag_ms sheds load until it drops below low_lag_ms.
+class LoopMonitor
+{
+public:
+    using ShedHandler = std::function<void(bool shedding)>;
+
+    LoopMonitor(boost::asio::io_context &io_context, const YAML::Node &config, Logger &logger)
+        : timer_(io_context),
+          interval_(std::chrono::milliseconds(config["interval_ms"].as<int>())),
+          shedding_enabled_(config["shedding"].as<bool>()),
+          high_lag_ms_(config["high_lag_ms"].as<double>()),
+          low_lag_ms_(config["low_lag_ms"].as<double>()),
+          shed_log_level_(config["log_level"].as<std::string>()),
+          logger_(logger) {}
+
+    void on_shed(ShedHandler handler)
+    {
+        shed_handler_ = std::move(handler);
+    }
+
+    void start()
+    {
+        schedule_probe();
+    }
+
+    double lag_ms() const { return lag_ms_.load(); }
+
+    std::string stats_json() const
+    {
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(3)
+            << "{\"lag_ms\":" << lag_ms_.load()
+            << ",\"lag_avg_ms\":" << lag_avg_ms_.load()
+            << ",\"lag_max_ms\":" << lag_max_ms_.load()
+            << ",\"samples\":" << samples_
+            << ",\"shedding\":" << (shedding_ ? "true" : "false")
+            << ",\"shed_events\":" << shed_events_ << "}";
+        return out.str();
+    }
+
+private:
+    void schedule_probe()
+    {
+        expected_ = std::chrono::steady_clock::now() + interval_;
+        timer_.expires_at(expected_);
+        timer_.async_wait([this](boost::system::error_code ec)
+                          {
+            if (!ec)
+            {
+                sample();
+                schedule_probe();
+            } });
+    }
+
+    void sample()
+    {
+        double lag = std::max(0.0, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - expected_).count());
+        double avg = samples_++ == 0 ? lag : lag_avg_ms_ * 0.8 + lag * 0.2;
+        lag_ms_ = lag;
+        lag_avg_ms_ = avg;
+        lag_max_ms_ = std::max(lag_max_ms_.load(), lag);
+
+        if (!shedding_enabled_)
+            return;
+
+        if (!shedding_ && avg > high_lag_ms_)
+        {
+            shedding_ = true;
+            ++shed_events_;
+            logger_.warn("Event loop lag " + std::to_string(avg) + "ms above " + std::to_string(high_lag_ms_) + "ms, shedding load");
+            if (!shed_log_level_.empty())
+            {
+                // shedding only ever quiets the log, a stricter configured level stays
+                normal_log_level_ = logger_.level();
+                logger_.set_level(Logger::stricter(normal_log_level_, Logger::parse_level(shed_log_level_)));
+            }
+            if (shed_handler_)
+                shed_handler_(true);
+        }
+        else if (shedding_ && avg < low_lag_ms_)
+        {
+            shedding_ = false;
+            if (!shed_log_level_.empty())
+                logger_.set_level(normal_log_level_);
+            if (shed_handler_)
+                shed_handler_(false);
+            logger_.warn("Event loop lag " + std::to_string(avg) + "ms below " + std::to_string(low_lag_ms_) + "ms, load shedding stopped");
+        }
+    }
+
+    boost::asio::steady_timer timer_;
+    std::chrono::steady_clock::duration interval_;
+    std::chrono::steady_clock::time_point expected_;
+    bool shedding_enabled_;
+    double high_lag_ms_;
+    double low_lag_ms_;
+    std::string shed_log_level_;
+    Logger::LogLevel normal_log_level_ = Logger::LogLevel::ALL;
+    Logger &logger_;
+    ShedHandler shed_handler_;
+    std::atomic<double> lag_ms_{0};
+    std::atomic<double> lag_avg_ms_{0};
+    std::atomic<double> lag_max_ms_{0};
+    std::atomic<uint64_t> samples_{0};
+    std::atomic<bool> shedding_{false};
+    std::atomic<uint64_t> shed_events_{0};
+};
+
+// minimal HTTP/1.0 endpoint for the dashboard and scripts: one GET per connection,
+// JSON (or the route's content type) in the response body, connection closed after the reply.
+// named counters and gauges, as GET /stream sends them
+using CounterSnapshot = std::vector<std::pair<std::string, int64_t>>;
+
+class ControlServer
+{
+public:
+    using Handler = std::function<std::string(const std::string &query)>;
+    using Sampler = std::function<CounterSnapshot()>;
+
+    ControlServer(boost::asio::io_context &io_context, const tcp::endpoint &endpoint, Logger &logger)
+        : acceptor_(io_context, endpoint),
+          logger_(logger) {}
+
+    void add_route(const std::string &path, Handler handler, const std::string &content_type = "application/json")
+    {
+        routes_[path] = Route{std::move(handler), content_type};
+    }
+
+    // a Server-Sent Events stream: the first event is a whole snapshot, later ones only
+    // the counters that changed, as differences. ?interval_ms= overrides the interval.
+    void add_stream(const std::string &path, std::chrono::milliseconds interval, Sampler sampler)
+    {
+        streams_[path] = Stream{std::move(sampler), interval};
+    }
+
+    void start()
+    {
+        logger_.info("Control server listening on " + acceptor_.local_endpoint().address().to_string() + ":" +
+                     std::to_string(acceptor_.local_endpoint().port()));
+        plz_accept();
+    }
+
+private:
+    class Connection : public std::enable_shared_from_this<Connection>
+    {
+    public:
+        Connection(tcp::socket socket, ControlServer &server)
+            : socket_(std::move(socket)),
+              strand_(boost::asio::make_strand(socket_.get_executor())),
+              timer_(strand_),
+              request_(8192),
+              server_(server) {}
+
+        // a client that connects and never finishes its request is closed at the deadline
+        void start()
+        {
+            auto self(shared_from_this());
+            boost::asio::dispatch(strand_, [this, self]()
+                                  {
+                timer_.expires_after(request_timeout);
+                timer_.async_wait([this, self](boost::system::error_code ec)
+                                  {
+                    boost::system::error_code ignored;
+                    if (!ec)
+                        socket_.close(ignored); });
+                read_request(); });
+        }
+
+    private:
+        void read_request()
+        {
+            auto self(shared_from_this());
+            boost::asio::async_read_until(socket_, request_, "\r\n\r\n", boost::asio::bind_executor(strand_, [this, self](boost::system::error_code ec, std::size_t)
+                                                                                                         {
+                timer_.cancel();
+                if (ec)
+                    return;
+
+                std::istream stream(&request_);
+                std::string method, target;
+                stream >> method >> target;
+                if (server_.subscribe(method, target, socket_))
+                    return;
+                response_ = server_.respond(method, target);
+
+                boost::asio::async_write(socket_, boost::asio::buffer(response_), [this, self](boost::system::error_code, std::size_t)
+                                         {
+                    boost::system::error_code ignored;
+                    socket_.shutdown(tcp::socket::shutdown_both, ignored); }); }));
+        }
+
+        tcp::socket socket_;
+        boost::asio::strand<tcp::socket::executor_type> strand_;
+        boost::asio::steady_timer timer_;
+        boost::asio::streambuf request_;
+        std::string response_;
+        ControlServer &server_;
+    };
+
+    // one stream subscriber. nothing samples while no one subscribes, and a tick that
+    // finds the last event still unwritten is skipped, so a slow reader gets bigger
+    // deltas rather than a growing queue.
+    class Subscriber : public std::enable_shared_from_this<Subscriber>
+    {
+    public:
+        Subscriber(tcp::socket socket, const Sampler &sampler, std::chrono::milliseconds interval)
+            : socket_(std::move(socket)),
+              strand_(boost::asio::make_strand(socket_.get_executor())),
+              timer_(strand_),
+              sampler_(sampler),
+              interval_(interval) {}
+
+        void start()
+        {
+            pending_ = "HTTP/1.0 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\n\r\n"
+                       "retry: " + std::to_string(interval_.count()) + "\n\n";
+            auto self(shared_from_this());
+            boost::asio::dispatch(strand_, [this, self]()
+                                  {
+                watch_close();
+                tick(); });
+        }
+
+    private:
+        void tick()
+        {
+            if (!socket_.is_open())
+                return;
+            if (!writing_)
+            {
+                pending_ += encode(sampler_());
+                event_.swap(pending_);
+                pending_.clear();
+                writing_ = true;
+                auto self(shared_from_this());
+                boost::asio::async_write(socket_, boost::asio::buffer(event_), boost::asio::bind_executor(strand_, [this, self](boost::system::error_code ec, std::size_t)
+                                                                                                      {
+                    writing_ = false;
+                    if (ec)
+                        close(); }));
+            }
+            auto self(shared_from_this());
+            timer_.expires_after(interval_);
+            timer_.async_wait([this, self](boost::system::error_code ec)
+                              {
+                if (!ec)
+                    tick(); });
+        }
+
+        // subscribers send nothing after the request, so a read completing means they left
+        void watch_close()
+        {
+            auto self(shared_from_this());
+            socket_.async_read_some(boost::asio::buffer(discard_), boost::asio::bind_executor(strand_, [this, self](boost::system::error_code ec, std::size_t)
+                                                                                               {
+                if (ec)
+                    close();
+                else
+                    watch_close(); }));
+        }
+
+        void close()
+        {
+            boost::system::error_code ignored;
+            timer_.cancel();
+            socket_.close(ignored);
+        }
+
+        std::string encode(const CounterSnapshot &counters)
+        {
+            bool whole = counters.size() != last_.size();
+            for (std::size_t i = 0; !whole && i < counters.size(); ++i)
+                whole = counters[i].first != last_[i].first;
+
+            auto now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
+            std::ostringstream out;
+            out << "event: " << (whole ? "snapshot" : "delta") << "\ndata: {\"t\":" << now.count() << ",\"counters\":{";
+            bool first = true;
+            for (std::size_t i = 0; i < counters.size(); ++i)
+            {
+                int64_t value = whole ? counters[i].second : counters[i].second - last_[i].second;
+                if (!whole && value == 0)
+                    continue;
+                out << (first ? "" : ",") << "\"" << counters[i].first << "\":" << value;
+                first = false;
+            }
+            out << "}}\n\n";
+            last_ = counters;
+            return out.str();
+        }
+
+        tcp::socket socket_;
+        boost::asio::strand<tcp::socket::executor_type> strand_;
+        boost::asio::steady_timer timer_;
+        const Sampler &sampler_;
+        std::chrono::milliseconds interval_;
+        CounterSnapshot last_;
+        std::string pending_;
+        std::string event_;
+        bool writing_ = false;
+        char discard_[256];
+    };
+
+    bool subscribe(const std::string &method, const std::string &target, tcp::socket &socket)
+    {
+        std::size_t query_pos = target.find('?');
+        auto stream = streams_.find(target.substr(0, query_pos));
+        if (method != "GET" || stream == streams_.end())
+            return false;
+
+        std::chrono::milliseconds interval = stream->second.interval;
+        std::string requested = query_pos == std::string::npos ? "" : query_param(target.substr(query_pos + 1), "interval_ms");
+        if (!requested.empty())
+        {
+            try
+            {
+                interval = std::chrono::milliseconds(std::max(std::stoi(requested), min_stream_interval_ms));
+            }
+            catch (const std::exception &)
+            {
+            }
+        }
+        logger_.debug("Stats stream subscriber, every " + std::to_string(interval.count()) + "ms");
+        std::make_shared<Subscriber>(std::move(socket), stream->second.sampler, interval)->start();
+        return true;
+    }
+
+    void plz_accept()
+    {
+        acceptor_.async_accept([this](boost::system::error_code ec, tcp::socket socket)
+                               {
+            if (!ec)
+            {
+                std::make_shared<Connection>(std::move(socket), *this)->start();
+            }
+            else
+            {
+                logger_.warn("Control server accept error: " + ec.message());
+            }
+            plz_accept(); });
+    }
+
+    std::string respond(const std::string &method, const std::string &target)
+    {
+        std::size_t query_pos = target.find('?');
+        std::string path = target.substr(0, query_pos);
+        std::string query = query_pos == std::string::npos ? "" : target.substr(query_pos + 1);
+
+        auto route = routes_.find(path);
+        if (method != "GET" || route == routes_.end())
+        {
+            return http_response("404 Not Found", "{\"error\":\"not found\"}");
+        }
+
+        try
+        {
+            return http_response("200 OK", route->second.handler(query), route->second.content_type);
+        }
+        catch (const std::exception &e)
+        {
+            logger_.warn("Control request " + path + " failed: " + e.what());
+            return http_response("400 Bad Request", "{\"error\":\"bad request\"}");
+        }
+    }
+
+    static std::string http_response(const std::string &status, const std::string &body,
+                                     const std::string &content_type = "application/json")
+    {
+        return "HTTP/1.0 " + status + "\r\nContent-Type: " + content_type + "\r\nContent-Length: " +
+               std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+    }
+
+    struct Route
+    {
+        Handler handler;
+        std::string content_type;
+    };
+
+    struct Stream
+    {
+        Sampler sampler;
+        std::chrono::milliseconds interval;
+    };
+
+    tcp::acceptor acceptor_;
+    Logger &logger_;
+    std::map<std::string, Route> routes_;
+    std::map<std::string, Stream> streams_;
+    static constexpr std::chrono::seconds request_timeout{10};
+    static constexpr int min_stream_interval_ms = 100;
+};
+
+// listening sockets passed in by systemd socket activation (LISTEN_FDS from fd 3 on,
+// for the process in LISTEN_PID). a listener bound to the same address and port takes
+// one over instead of binding; the kernel kept queueing connections on it meanwhile.
+class InheritedSockets
+{
+public:
+    explicit InheritedSockets(Logger &logger) : logger_(logger)
+    {
+        const char *pid = getenv("LISTEN_PID");
+        const char *fds = getenv("LISTEN_FDS");
+        if (!pid || !fds)
+            return;
+        // not passed on to children, and ignored when they were meant for another process
+        bool ours = strtol(pid, nullptr, 10) == getpid();
+        unsetenv("LISTEN_PID");
+        unsetenv("LISTEN_FDS");
+        unsetenv("LISTEN_FDNAMES");
+        if (!ours)
+            return;
+
+        int count = atoi(fds);
+        for (int fd = first_fd; fd < first_fd + count; ++fd)
+        {
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            sockaddr_storage address;
+            socklen_t length = sizeof(address);
+            int type = 0, listening = 0;
+            socklen_t option_length = sizeof(type);
+            bool usable = getsockname(fd, reinterpret_cast<sockaddr *>(&address), &length) == 0 &&
+                          (address.ss_family == AF_INET || address.ss_family == AF_INET6) &&
+                          getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &option_length) == 0 && type == SOCK_STREAM &&
+                          getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &option_length) == 0 && listening;
+            if (!usable)
+            {
+                logger_.warn("Inherited fd " + std::to_string(fd) + " is not a listening TCP socket, closing it");
+                close(fd);
+                continue;
+            }
+            tcp::endpoint endpoint;
+            std::memcpy(endpoint.data(), &address, length);
+            endpoint.resize(length);
+            sockets_[endpoint] = fd;
+        }
+        logger_.info("Inherited " + std::to_string(sockets_.size()) + " listening sockets");
+    }
+
+    // the inherited socket bound to endpoint, or -1. each is handed out once
+    int claim(const tcp::endpoint &endpoint)
+    {
+        auto found = sockets_.find(endpoint);
+        if (found == sockets_.end())
+            return -1;
+        int fd = found->second;
+        sockets_.erase(found);
+        return fd;
+    }
+
+    // sockets no forwarder entry matched would queue connections no one accepts
+    void close_unclaimed()
+    {
+        for (const auto &entry : sockets_)
+        {
+            logger_.warn("Inherited socket on " + entry.first.address().to_string() + ":" + std::to_string(entry.first.port()) +
+                         " matches no forwarder, closing it");
+            close(entry.second);
+        }
+        sockets_.clear();
+    }
+
+private:
+    static constexpr int first_fd = 3; // SD_LISTEN_FDS_START
+    Logger &logger_;
+    std::map<tcp::endpoint, int> sockets_;
+};
+
+class TCPForwarder
+{
+public:
+    TCPForwarder(boost::asio::io_context &io_context, const YAML::Node &config, Logger &logger)
+        : io_context_(io_context),
+          logger_(logger),
+          config_(config),
+          admission_(io_context, config["max_connections"].as<int>(), config["admission_queue"]["size"].as<std::size_t>(),
+                     config["admission_queue"]["timeout"].as<int>(), logger),
+          monitor_(io_context, config["loop_monitor"], logger),
+          capture_(config["capture"] && config["capture"]["ring_bytes"] ? config["capture"]["ring_bytes"].as<std::size_t>() : 4194304,
+                   config["capture"] && config["capture"]["snap_bytes"] ? config["capture"]["snap_bytes"].as<std::size_t>() : 65000)
+    {
+        logger_.trace("Initializing TCP Forwarder...");
 
-            if (setsockopt(socket.native_handle(), SOL_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) < 0 ||
-                setsockopt(socket.native_handle(), SOL_TCP, TCP_KEEPINTVL, &interval, sizeof(interval)) < 0 ||
-                setsockopt(socket.native_handle(), SOL_TCP, TCP_KEEPCNT, &count, sizeof(count)) < 0)
+        if (config["sockmap_splice"]["enabled"].as<bool>())
+        {
+            splicer_ = std::make_unique<SockmapSplicer>(config["sockmap_splice"]["max_sessions"].as<std::size_t>(), logger_);
+        }
+
+        resolver_ = std::make_unique<DnsResolver>(config["dns"], logger_);
+
+        if (config["tcp_info"] && config["tcp_info"]["enabled"].as<bool>())
+        {
+            int interval_ms = config["tcp_info"]["interval_ms"] ? config["tcp_info"]["interval_ms"].as<int>() : 1000;
+            if (interval_ms < 10)
+                throw std::runtime_error("'tcp_info.interval_ms' must be at least 10");
+            tcp_info_ = std::make_unique<TcpInfoSampler>(io_context, interval_ms);
+            tcp_info_->start();
+        }
+
+        if (config["access_log"] && config["access_log"]["enabled"].as<bool>())
+        {
+            const YAML::Node &access = config["access_log"];
+            std::string format = access["format"] ? access["format"].as<std::string>() : "json";
+            double sample = access["sample"] ? access["sample"].as<double>() : 1.0;
+            if (format != "json" && format != "binary")
+                throw std::runtime_error("'access_log.format' must be json or binary");
+            if (sample <= 0 || sample > 1)
+                throw std::runtime_error("'access_log.sample' must be in (0, 1]");
+            if (logger_.open_access(access["file"].as<std::string>()))
             {
-                logger_.warn("seting up TCP keepalive parameters failed");
+                access_log_ = std::make_unique<AccessLog>(logger_, format == "binary", sample);
+            }
+        }
+
+        const YAML::Node &outliers = config["outlier_detection"];
+        outlier_options_.enabled = outliers["enabled"].as<bool>();
+        outlier_options_.consecutive_failures = outliers["consecutive_failures"].as<int>();
+        outlier_options_.failure_ratio = outliers["failure_ratio"].as<double>();
+        outlier_options_.min_requests = outliers["min_requests"].as<int>();
+        outlier_options_.interval = std::chrono::seconds(outliers["interval"].as<int>());
+        outlier_options_.base_ejection_time = std::chrono::seconds(outliers["base_ejection_time"].as<int>());
+        outlier_options_.max_ejection_time = std::chrono::seconds(outliers["max_ejection_time"].as<int>());
+
+        if (config["loop_monitor"]["pause_accept"].as<bool>())
+        {
+            monitor_.on_shed([this](bool shedding)
+                             { pause_accepting(shedding); });
+        }
+        monitor_.start();
+
+        if (!config["forwarders"] || !config["forwarders"].IsSequence())
+        {
+            throw std::runtime_error("Error: 'forwarders' must be specified and must be a sequence.");
+        }
+
+        InheritedSockets inherited(logger_);
+
+        for (const auto &forwarder : config["forwarders"])
+        {
+            if (!forwarder["listen_address"] || !forwarder["target_address"])
+            {
+                logger_.error("Forwarder configuration must include 'listen_address' and 'target_address'. Skipping this entry.");
+                continue;
+            }
+
+            std::string listen_address = forwarder["listen_address"].as<std::string>();
+            std::string target_address = forwarder["target_address"].as<std::string>();
+
+            try
+            {
+                std::shared_ptr<ResolvedTarget> target = resolver_->target(target_address);
+
+                SourceAddressPool *source_pool = nullptr;
+                if (forwarder["source_addresses"])
+                {
+                    source_pools_.emplace_back(listen_address + " -> " + target_address,
+                                               std::make_unique<SourceAddressPool>(forwarder["source_addresses"].as<std::vector<std::string>>()));
+                    source_pool = source_pools_.back().second.get();
+                }
+
+                if (forwarder["port_range"])
+                {
+                    int start_port = forwarder["port_range"]["start"].as<int>();
+                    int end_port = forwarder["port_range"]["end"].as<int>();
+                    for (int port = start_port; port <= end_port; ++port)
+                    {
+                        tcp::endpoint listen_endpoint(boost::asio::ip::make_address(listen_address), port);
+                        start_con(listen_endpoint, make_listener_options(forwarder, listen_endpoint, target, port, source_pool), inherited);
+                    }
+                }
+                else
+                {
+
+                    if (!forwarder["listen_port"] || !forwarder["target_port"])
+                    {
+                        logger_.error("Forwarder configuration must include 'listen_port' and 'target_port' if 'port_range' is not specified.");
+                        continue;
+                    }
+
+                    int listen_port = forwarder["listen_port"].as<int>();
+                    int target_port = forwarder["target_port"].as<int>();
+
+                    tcp::endpoint listen_endpoint(boost::asio::ip::make_address(listen_address), listen_port);
+                    start_con(listen_endpoint, make_listener_options(forwarder, listen_endpoint, target, target_port, source_pool), inherited);
+                }
+            }
+            catch (const std::exception &e)
+            {
+                logger_.error("initializing forwarder failed: " + std::string(e.what()));
+            }
+        }
+        inherited.close_unclaimed();
+    }
+
+    CaptureRing &capture() { return capture_; }
+
+    // what GET /stream sends: loads of atomics and per-thread counter slots, no locks
+    CounterSnapshot counters() const
+    {
+        CounterSnapshot counters;
+        counters.emplace_back("active_connections", admission_.active());
+        counters.emplace_back("loop_lag_us", static_cast<int64_t>(monitor_.lag_ms() * 1000));
+        for (const auto &listener : listeners_)
+        {
+            if (listener->count_bytes)
+            {
+                counters.emplace_back(listener->name + "/sessions", listener->stats.sessions.load(std::memory_order_relaxed));
+                counters.emplace_back(listener->name + "/bytes_in", listener->stats.bytes_in.load());
+                counters.emplace_back(listener->name + "/bytes_out", listener->stats.bytes_out.load());
+                counters.emplace_back(listener->name + "/record_failures", listener->stats.record_failures.load(std::memory_order_relaxed));
+            }
+            if (listener->mux_client || listener->mux_server)
+            {
+                counters.emplace_back(listener->name + "/mux_streams", listener->mux.streams.load(std::memory_order_relaxed));
+            }
+        }
+        return counters;
+    }
+
+    // shutdown: closes the listeners and lets admitted sessions finish. whatever is still
+    // open at the deadline is closed; done runs once nothing is left, or drain_grace
+    // after the deadline regardless
+    void drain(std::chrono::seconds timeout, std::function<void()> done)
+    {
+        {
+            std::lock_guard<std::mutex> lock(accept_mutex_);
+            if (drain_.active)
+                return;
+            drain_.active = true;
+            drain_.started = std::chrono::steady_clock::now();
+            drain_.deadline = drain_.started + timeout;
+            boost::system::error_code ec;
+            for (auto &acceptor : acceptors_)
+                acceptor->close(ec);
+            parked_acceptors_.clear();
+        }
+        drain_done_ = std::move(done);
+        drain_timer_ = std::make_unique<boost::asio::steady_timer>(io_context_);
+        logger_.info("Draining: listeners closed, waiting up to " + std::to_string(timeout.count()) + "s for " +
+                     std::to_string(admission_.active()) + " sessions");
+        admission_.start_drain();
+        check_drain();
+    }
+
+    std::string stats_json() const
+    {
+        std::ostringstream out;
+        out << "{\"active_connections\":" << admission_.active();
+        out << ",\"admission\":" << admission_.stats_json();
+        out << ",\"loop\":" << monitor_.stats_json();
+        {
+            std::lock_guard<std::mutex> lock(accept_mutex_);
+            out << ",\"accept_paused\":" << (accept_paused_ ? "true" : "false");
+            out << ",\"drain\":{\"draining\":" << (drain_.active ? "true" : "false");
+            if (drain_.active)
+            {
+                auto now = std::chrono::steady_clock::now();
+                out << ",\"elapsed_ms\":" << std::chrono::duration_cast<std::chrono::milliseconds>(now - drain_.started).count()
+                    << ",\"remaining_ms\":" << std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::milliseconds>(drain_.deadline - now).count())
+                    << ",\"queued\":" << admission_.queued()
+                    << ",\"closed_at_deadline\":" << drain_.closed;
+            }
+            out << "}";
+        }
+
+        out << ",\"source_addresses\":[";
+        for (std::size_t i = 0; i < source_pools_.size(); ++i)
+        {
+            out << (i ? "," : "") << "{\"forwarder\":\"" << source_pools_[i].first
+                << "\",\"sources\":" << source_pools_[i].second->stats_json() << "}";
+        }
+        out << "]";
+
+        out << ",\"listeners\":[";
+        bool first = true;
+        for (const auto &listener : listeners_)
+        {
+            if (!listener->count_bytes)
+                continue;
+            out << (first ? "" : ",") << "{\"listen\":\"" << listener->name
+                << "\",\"sessions\":" << listener->stats.sessions
+                << ",\"bytes_in\":" << listener->stats.bytes_in.load()
+                << ",\"bytes_out\":" << listener->stats.bytes_out.load() << "}";
+            first = false;
+        }
+        out << "]";
+
+        out << ",\"dns\":" << resolver_->stats_json();
+
+        out << ",\"mux\":[";
+        first = true;
+        for (const auto &listener : listeners_)
+        {
+            if (!listener->mux_client && !listener->mux_server)
+                continue;
+            out << (first ? "" : ",") << "{\"listen\":\"" << listener->name << "\",\"role\":\""
+                << (listener->mux_client ? "client" : "server") << "\",\"connections\":" << listener->mux.connections
+                << ",\"streams\":" << listener->mux.streams << ",\"streams_opened\":" << listener->mux.streams_opened
+                << ",\"resets\":" << listener->mux.resets << ",\"window_stalls\":" << listener->mux.window_stalls
+                << ",\"timeouts\":" << listener->mux.timeouts << "}";
+            first = false;
+        }
+        out << "]";
+
+        out << ",\"encryption\":[";
+        first = true;
+        for (const auto &listener : listeners_)
+        {
+            if (!listener->seal)
+                continue;
+            out << (first ? "" : ",") << "{\"listen\":\"" << listener->name << "\",\"side\":\""
+                << (listener->seal->seal_upstream ? "client" : "server") << "\",\"cipher\":\""
+                << (listener->seal->cipher == SealCipher::aes_256_gcm ? "aes-256-gcm" : "chacha20-poly1305")
+                << "\",\"auth_failures\":" << listener->stats.record_failures << "}";
+            first = false;
+        }
+        out << "]";
+
+        out << ",\"tls\":[";
+        first = true;
+        for (const auto &listener : listeners_)
+        {
+            if (!listener->tls)
+                continue;
+            const TlsOptions &tls = *listener->tls;
+            out << (first ? "" : ",") << "{\"listen\":\"" << listener->name << "\",\"side\":\""
+                << (tls.client ? "client" : "server") << "\",\"ktls\":" << (tls.ktls ? "true" : "false")
+                << ",\"handshakes\":" << tls.handshakes << ",\"handshake_failures\":" << tls.handshake_failures
+                << ",\"ktls_sessions\":" << tls.ktls_sessions << ",\"ktls_fallbacks\":" << tls.ktls_fallbacks
+                << ",\"auth_failures\":" << listener->stats.record_failures << "}";
+            first = false;
+        }
+        out << "]";
+
+        out << ",\"compression\":[";
+        first = true;
+        for (const auto &listener : listeners_)
+        {
+            if (!listener->compression)
+                continue;
+            const CompressionOptions &compression = *listener->compression;
+            uint64_t raw_out = compression.raw_out;
+            uint64_t wire_out = compression.wire_out;
+            uint64_t raw_in = compression.raw_in;
+            uint64_t wire_in = compression.wire_in;
+            out << (first ? "" : ",") << "{\"listen\":\"" << listener->name << "\",\"side\":\""
+                << (compression.compress_upstream ? "client" : "server") << "\",\"algorithm\":\""
+                << (compression.algorithm == CompressionAlgorithm::zstd ? "zstd" : "lz4")
+                << "\",\"raw_out\":" << raw_out << ",\"wire_out\":" << wire_out
+                << ",\"ratio_out\":" << (wire_out ? static_cast<double>(raw_out) / wire_out : 0.0)
+                << ",\"bypassed\":" << compression.bypassed
+                << ",\"raw_in\":" << raw_in << ",\"wire_in\":" << wire_in
+                << ",\"ratio_in\":" << (wire_in ? static_cast<double>(raw_in) / wire_in : 0.0)
+                << ",\"compress_ms\":" << compression.compress_ns / 1000000
+                << ",\"decompress_ms\":" << compression.decompress_ns / 1000000
+                << ",\"decode_failures\":" << listener->stats.record_failures << "}";
+            first = false;
+        }
+        out << "]";
+
+        out << ",\"routing\":[";
+        first = true;
+        for (const auto &listener : listeners_)
+        {
+            if (!listener->routing)
+                continue;
+            const RoutingOptions &routing = *listener->routing;
+            out << (first ? "" : ",") << "{\"listen\":\"" << listener->name << "\",\"timeouts\":" << routing.timeouts
+                << ",\"unmatched\":" << routing.unmatched << ",\"rules\":[";
+            for (std::size_t i = 0; i < routing.rules.size(); ++i)
+            {
+                const RouteRule &rule = *routing.rules[i];
+                out << (i ? "," : "") << "{\"match\":\"" << rule.label << "\",\"target\":\"" << rule.target->host() << ":"
+                    << rule.target_port << "\",\"hits\":" << rule.hits;
+                if (rule.breakers)
+                    out << ",\"breakers\":" << rule.breakers->stats_json();
+                out << "}";
+            }
+            out << "]}";
+            first = false;
+        }
+        out << "]";
+
+        out << ",\"mirror\":[";
+        first = true;
+        for (const auto &listener : listeners_)
+        {
+            if (!listener->mirror)
+                continue;
+            const MirrorOptions &mirror = *listener->mirror;
+            out << (first ? "" : ",") << "{\"listen\":\"" << listener->name << "\",\"target\":\"" << mirror.target->host() << ":"
+                << mirror.target_port << "\",\"directions\":\"" << (mirror.both ? "both" : "upstream") << "\",\"streams\":" << mirror.streams
+                << ",\"bytes\":" << mirror.bytes << ",\"dropped_bytes\":" << mirror.dropped_bytes << ",\"cut_streams\":" << mirror.cut_streams
+                << ",\"connect_failures\":" << mirror.connect_failures << "}";
+            first = false;
+        }
+        out << "]";
+
+        out << ",\"outliers\":[";
+        first = true;
+        for (const auto &listener : listeners_)
+        {
+            if (!listener->breakers)
+                continue;
+            out << (first ? "" : ",") << "{\"listen\":\"" << listener->name << "\",\"target\":\"" << listener->target->host()
+                << ":" << listener->target_port << "\",\"breakers\":" << listener->breakers->stats_json() << "}";
+            first = false;
+        }
+        out << "]";
+
+        if (tcp_info_)
+        {
+            out << ",\"tcp_info\":{\"interval_ms\":" << tcp_info_->interval_ms() << ",\"listeners\":[";
+            first = true;
+            for (const auto &listener : listeners_)
+            {
+                if (!listener->tcp_info)
+                    continue;
+                out << (first ? "" : ",") << "{\"listen\":\"" << listener->name << "\",\"client\":" << listener->tcp_info->client.json()
+                    << ",\"target\":" << listener->tcp_info->target.json() << "}";
+                first = false;
+            }
+            out << "],\"targets\":" << tcp_info_->targets_json() << "}";
+        }
+        if (access_log_)
+        {
+            out << ",\"access_log\":" << access_log_->stats_json();
+        }
+
+        out << ",\"sockmap_splice\":{\"enabled\":" << (splicer_ && splicer_->ready() ? "true" : "false");
+        if (splicer_)
+        {
+            out << ",\"sessions\":" << splicer_->spliced_sessions() << ",\"bytes\":" << splicer_->spliced_bytes();
+        }
+        out << "}}";
+        return out.str();
+    }
+
+private:
+    void check_drain()
+    {
+        std::size_t left = static_cast<std::size_t>(admission_.active()) + admission_.queued();
+        auto now = std::chrono::steady_clock::now();
+        bool forced;
+        {
+            std::lock_guard<std::mutex> lock(accept_mutex_);
+            forced = drain_.forced;
+            if (!forced && now >= drain_.deadline && left > 0)
+                drain_.forced = true;
+        }
+        if (left == 0 || (forced && now >= drain_.deadline + drain_grace))
+        {
+            if (left == 0)
+                logger_.info("Drained, all sessions finished");
+            else
+                logger_.warn("Drain gave up with " + std::to_string(left) + " sessions still open");
+            logger_.info("Final stats: " + stats_json());
+            drain_done_();
+            return;
+        }
+        if (!forced && now >= drain_.deadline)
+        {
+            std::size_t closed = admission_.close_all();
+            {
+                std::lock_guard<std::mutex> lock(accept_mutex_);
+                drain_.closed = closed;
+            }
+            logger_.warn("Drain deadline reached, closing " + std::to_string(closed) + " sessions");
+        }
+        drain_timer_->expires_after(std::chrono::milliseconds(100));
+        drain_timer_->async_wait([this](boost::system::error_code ec)
+                                 {
+            if (!ec)
+                check_drain(); });
+    }
+
+    struct ParkedAcceptor
+    {
+        std::shared_ptr<tcp::acceptor> acceptor;
+        std::shared_ptr<ListenerOptions> options;
+        SessionStarter starter;
+    };
+
+    // while paused each acceptor parks after its next completion, and new clients
+    // wait in the kernel's listen backlog
+    void pause_accepting(bool paused)
+    {
+        std::vector<ParkedAcceptor> resumed;
+        {
+            std::lock_guard<std::mutex> lock(accept_mutex_);
+            accept_paused_ = paused;
+            if (!paused && !drain_.active)
+                resumed.swap(parked_acceptors_);
+        }
+        for (auto &parked : resumed)
+        {
+            plz_accept(parked.acceptor, parked.options, parked.starter);
+        }
+    }
+
+    std::shared_ptr<ListenerOptions> make_listener_options(const YAML::Node &forwarder, const tcp::endpoint &listen_endpoint,
+                                                           std::shared_ptr<ResolvedTarget> target, int target_port, SourceAddressPool *source_pool)
+    {
+        auto options = std::make_shared<ListenerOptions>();
+        options->name = listen_endpoint.address().to_string() + ":" + std::to_string(listen_endpoint.port());
+        options->target = std::move(target);
+        options->target_port = static_cast<unsigned short>(target_port);
+        if (outlier_options_.enabled)
+        {
+            options->breakers = std::make_unique<TargetBreakers>(outlier_options_);
+        }
+        options->buffer_size = config_["buffer_size"].as<std::size_t>();
+        options->tcp_no_delay = config_["tcp_no_delay"].as<bool>();
+        options->retry_attempts = config_["retry_attempts"].as<int>();
+        options->retry_delay = config_["retry_delay"].as<int>();
+
+        const YAML::Node &keep_alive = config_["tcp_keep_alive"];
+        options->keep_alive.enabled = keep_alive["enabled"].as<bool>();
+        if (keep_alive["idle_time"])
+            options->keep_alive.idle_time = keep_alive["idle_time"].as<int>();
+        if (keep_alive["interval"])
+            options->keep_alive.interval = keep_alive["interval"].as<int>();
+        if (keep_alive["count"])
+            options->keep_alive.count = keep_alive["count"].as<int>();
+
+        options->splicer = splicer_.get();
+        options->capture = &capture_;
+        if (tcp_info_)
+        {
+            options->tcp_info_sampler = tcp_info_.get();
+            options->tcp_info = std::make_unique<TcpInfoMetrics>();
+        }
+        options->splice_idle_timeout = config_["sockmap_splice"]["idle_timeout"].as<int>();
+        options->source_pool = source_pool;
+        options->count_bytes = forwarder["count_bytes"] ? forwarder["count_bytes"].as<bool>() : config_["control"]["enabled"].as<bool>();
+        if (access_log_)
+        {
+            // access records carry the session's byte counts
+            options->access_log = access_log_.get();
+            options->count_bytes = true;
+        }
+        options->rate_limit = forwarder["rate_limit"] ? forwarder["rate_limit"].as<std::size_t>() : 0;
+        options->proxy_protocol = forwarder["proxy_protocol"] ? forwarder["proxy_protocol"].as<int>() : 0;
+        if (options->proxy_protocol < 0 || options->proxy_protocol > 2)
+        {
+            throw std::runtime_error("'proxy_protocol' must be 1 or 2");
+        }
+        options->trace_chunks = logger_.must_log(Logger::LogLevel::DEBUG);
+
+        if (const YAML::Node &mux = forwarder["mux"])
+        {
+            std::string role = mux["role"].as<std::string>();
+            if (mux["window"])
+                options->mux_window = mux["window"].as<std::size_t>();
+            if (options->mux_window < options->buffer_size)
+                throw std::runtime_error("'mux.window' must be at least buffer_size");
+            if (mux["keepalive"])
+                options->mux_keepalive = mux["keepalive"].as<int>();
+            if (mux["timeout"])
+                options->mux_timeout = mux["timeout"].as<int>();
+            if (options->mux_keepalive <= 0 || options->mux_timeout <= options->mux_keepalive)
+                throw std::runtime_error("'mux.keepalive' must be positive and below 'mux.timeout'");
+            if (role == "server")
+            {
+                options->mux_server = true;
+            }
+            else if (role == "client")
+            {
+                int connections = mux["connections"] ? mux["connections"].as<int>() : 2;
+                mux_clients_.push_back(std::make_unique<MuxClient>(io_context_, options, std::max(connections, 1), logger_));
+                options->mux_client = mux_clients_.back().get();
+                options->mux_client->start();
+            }
+            else
+            {
+                throw std::runtime_error("'mux.role' must be client or server");
+            }
+        }
+
+        if (const YAML::Node &encryption = forwarder["encryption"])
+        {
+            if (options->mux_client || options->mux_server)
+                throw std::runtime_error("'encryption' does not apply to mux listeners");
+            options->seal = std::make_unique<SealOptions>();
+            std::string side = encryption["side"].as<std::string>();
+            if (side != "client" && side != "server")
+                throw std::runtime_error("'encryption.side' must be client or server");
+            options->seal->seal_upstream = side == "client";
+            if (options->seal->seal_upstream && options->proxy_protocol != 0)
+                throw std::runtime_error("'proxy_protocol' goes on the server side of an encrypted pair");
+            options->seal->cipher = parse_seal_cipher(encryption["cipher"] ? encryption["cipher"].as<std::string>() : "auto");
+
+            std::string key = encryption["key"].as<std::string>();
+            if (key.size() != 64 || key.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos)
+                throw std::runtime_error("'encryption.key' must be 64 hex digits");
+            for (std::size_t i = 0; i < 32; ++i)
+                options->seal->key[i] = static_cast<unsigned char>(std::stoi(key.substr(2 * i, 2), nullptr, 16));
+        }
+
+        if (const YAML::Node &tls = forwarder["tls"])
+        {
+            if (options->mux_client || options->mux_server || options->seal)
+                throw std::runtime_error("'tls' does not apply to mux or encrypted listeners");
+            options->tls = make_tls_options(tls);
+            if (options->tls->client && options->proxy_protocol != 0)
+                throw std::runtime_error("'proxy_protocol' goes on the server side of a TLS pair");
+            if (options->tls->client && !tls["ca"])
+                logger_.warn("TLS client " + options->name + " does not verify its peer; set 'tls.ca'");
+        }
+
+        if (const YAML::Node &compression = forwarder["compression"])
+        {
+            if (options->mux_client || options->mux_server || options->seal)
+                throw std::runtime_error("'compression' does not apply to mux or encrypted listeners");
+            std::string side = compression["side"].as<std::string>();
+            if (side != "client" && side != "server")
+                throw std::runtime_error("'compression.side' must be client or server");
+            if (side == "client" && options->proxy_protocol != 0)
+                throw std::runtime_error("'proxy_protocol' goes on the server side of a compressed pair");
+
+            // user-space TLS already is the session's record layer. refusing the config on both
+            // sides beats one side compressing into a peer that does not expect it
+            if (options->tls && !options->tls->ktls)
+                throw std::runtime_error("'compression' on a TLS link needs kTLS; remove 'tls.ktls: false' or the compression");
+
+            options->compression = std::make_unique<CompressionOptions>();
+            options->compression->compress_upstream = side == "client";
+            options->compression->algorithm = parse_compression_algorithm(compression["algorithm"] ? compression["algorithm"].as<std::string>() : "zstd");
+            if (compression["level"])
+                options->compression->level = compression["level"].as<int>();
+            if (compression["bypass"])
+                options->compression->bypass = compression["bypass"].as<bool>();
+        }
+
+        if (const YAML::Node &routing = forwarder["routing"])
+        {
+            if (options->mux_client || options->mux_server)
+                throw std::runtime_error("'routing' does not apply to mux listeners");
+            if ((options->seal && !options->seal->seal_upstream) || (options->tls && !options->tls->client) ||
+                (options->compression && !options->compression->compress_upstream))
+                throw std::runtime_error("'routing' needs the clients' own bytes, not the server side of a paired link");
+            options->routing = make_routing_options(routing);
+        }
+
+        if (const YAML::Node &mirror = forwarder["mirror"])
+        {
+            if (options->mux_client || options->mux_server)
+                throw std::runtime_error("'mirror' does not apply to mux listeners");
+            if (!mirror["target_address"] || !mirror["target_port"])
+                throw std::runtime_error("'mirror' needs target_address and target_port");
+            options->mirror = std::make_unique<MirrorOptions>();
+            options->mirror->target = resolver_->target(mirror["target_address"].as<std::string>());
+            options->mirror->target_port = static_cast<unsigned short>(mirror["target_port"].as<int>());
+            std::string directions = mirror["directions"] ? mirror["directions"].as<std::string>() : "upstream";
+            if (directions != "upstream" && directions != "both")
+                throw std::runtime_error("'mirror.directions' must be upstream or both");
+            options->mirror->both = directions == "both";
+            if (mirror["queue_bytes"])
+                options->mirror->queue_bytes = mirror["queue_bytes"].as<std::size_t>();
+        }
+        return options;
+    }
+
+    std::unique_ptr<RoutingOptions> make_routing_options(const YAML::Node &node)
+    {
+        auto routing = std::make_unique<RoutingOptions>();
+        if (node["peek_timeout_ms"])
+            routing->peek_timeout = std::chrono::milliseconds(node["peek_timeout_ms"].as<int>());
+        for (const auto &entry : node["rules"])
+        {
+            auto rule = std::make_unique<RouteRule>();
+            if (entry["sni"])
+            {
+                rule->protocol = SniffedProtocol::tls;
+                rule->name = entry["sni"].as<std::string>();
+                rule->label = "sni " + rule->name;
+            }
+            else if (entry["host"])
+            {
+                rule->protocol = SniffedProtocol::http;
+                rule->name = entry["host"].as<std::string>();
+                rule->label = "host " + rule->name;
+            }
+            else if (entry["protocol"])
+            {
+                std::string protocol = entry["protocol"].as<std::string>();
+                rule->protocol = protocol == "tls" ? SniffedProtocol::tls : protocol == "http" ? SniffedProtocol::http
+                                                                       : protocol == "ssh"    ? SniffedProtocol::ssh
+                                                                                              : SniffedProtocol::unknown;
+                if (rule->protocol == SniffedProtocol::unknown)
+                    throw std::runtime_error("'routing' protocol must be tls, http or ssh");
+                rule->label = "protocol " + protocol;
+            }
+            else
+            {
+                throw std::runtime_error("each 'routing' rule needs sni, host or protocol");
+            }
+            if (!entry["target_address"] || !entry["target_port"])
+                throw std::runtime_error("each 'routing' rule needs target_address and target_port");
+            rule->target = resolver_->target(entry["target_address"].as<std::string>());
+            rule->target_port = static_cast<unsigned short>(entry["target_port"].as<int>());
+            if (outlier_options_.enabled)
+            {
+                rule->breakers = std::make_unique<TargetBreakers>(outlier_options_);
+            }
+            routing->rules.push_back(std::move(rule));
+        }
+        return routing;
+    }
+
+    void start_con(const tcp::endpoint &listen_endpoint, std::shared_ptr<ListenerOptions> options, InheritedSockets &inherited)
+    {
+        try
+        {
+            std::shared_ptr<tcp::acceptor> acceptor;
+            int inherited_fd = inherited.claim(listen_endpoint);
+            if (inherited_fd != -1)
+            {
+                acceptor = std::make_shared<tcp::acceptor>(io_context_, listen_endpoint.protocol(), inherited_fd);
+                logger_.info("Listening on " + listen_endpoint.address().to_string() + ":" + std::to_string(listen_endpoint.port()) + " (inherited)");
             }
             else
             {
-                logger_.info("TCP keepalive parameters set: idle=" + std::to_string(idle) +
-                             ", interval=" + std::to_string(interval) +
-                             ", count=" + std::to_string(count));
+                acceptor = std::make_shared<tcp::acceptor>(io_context_, listen_endpoint);
+                logger_.info("Listening on " + listen_endpoint.address().to_string() + ":" + std::to_string(listen_endpoint.port()));
+            }
+
+            SessionStarter starter = select_session_starter(*options);
+            listeners_.push_back(options);
+            {
+                std::lock_guard<std::mutex> lock(accept_mutex_);
+                acceptors_.push_back(acceptor);
+            }
+
+            plz_accept(acceptor, options, starter);
+        }
+        catch (const std::exception &e)
+        {
+            logger_.error("couldn't start listener on " + listen_endpoint.address().to_string() + ":" +
+                          std::to_string(listen_endpoint.port()) + ". error: " + e.what());
+        }
+    }
+
+    void plz_accept(std::shared_ptr<tcp::acceptor> acceptor, std::shared_ptr<ListenerOptions> options, SessionStarter starter)
+    {
+        acceptor->async_accept([this, acceptor, options, starter](boost::system::error_code ec, tcp::socket in_socket)
+                               {
+            if (!ec)
+            {
+                if (options->access_log)
+                    logger_.debug("Accepted new connection");
+                else
+                    logger_.info("Accepted new connection");
+                admission_.admit(std::move(in_socket), options, starter);
+            }
+            else if (ec != boost::asio::error::operation_aborted)
+            {
+                logger_.error("Accept error: " + ec.message());
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(accept_mutex_);
+                if (drain_.active)
+                    return;
+                if (accept_paused_)
+                {
+                    parked_acceptors_.push_back({acceptor, options, starter});
+                    return;
+                }
             }
-#endif
-        }
+            plz_accept(acceptor, options, starter); });
     }
 
-    void start()
+    boost::asio::io_context &io_context_;
+    Logger &logger_;
+    YAML::Node config_;
+    AdmissionControl admission_;
+    LoopMonitor monitor_;
+    CaptureRing capture_;
+    mutable std::mutex accept_mutex_;
+    bool accept_paused_ = false;
+    std::vector<ParkedAcceptor> parked_acceptors_;
+    std::vector<std::shared_ptr<tcp::acceptor>> acceptors_;
+    struct
     {
-        logger_.trace("Starting session...");
-        set_keep_alive_options(in_socket_);
-        attempt_connection();
-    }
+        bool active = false;
+        bool forced = false; // the deadline passed and close_all ran
+        std::size_t closed = 0;
+        std::chrono::steady_clock::time_point started;
+        std::chrono::steady_clock::time_point deadline;
+    } drain_; // guarded by accept_mutex_
+    std::unique_ptr<boost::asio::steady_timer> drain_timer_;
+    std::function<void()> drain_done_;
+    static constexpr std::chrono::seconds drain_grace{2}; // for closed sessions to unwind
+    std::unique_ptr<SockmapSplicer> splicer_;
+    std::unique_ptr<DnsResolver> resolver_;
+    std::unique_ptr<TcpInfoSampler> tcp_info_;
+    std::unique_ptr<AccessLog> access_log_;
+    std::vector<std::unique_ptr<MuxClient>> mux_clients_;
+    OutlierOptions outlier_options_;
+    std::vector<std::pair<std::string, std::unique_ptr<SourceAddressPool>>> source_pools_;
+    std::vector<std::shared_ptr<ListenerOptions>> listeners_;
+};
 
-private:
-    void attempt_connection()
+// counters of the prefork workers in one shared memory segment, a slot per worker. a
+// worker rewrites its slot under a sequence number that is odd while it writes; the
+// supervisor copies a slot out and retries when the number moved meanwhile.
+class WorkerStats
+{
+public:
+    static constexpr std::size_t slot_bytes = 262144;
+
+    ~WorkerStats()
     {
-        if (current_attempt_ >= retry_attempts_)
-        {
-            logger_.error("Max retry attempts reached. Connection failed.");
-            return;
-        }
+        if (base_)
+            munmap(base_, size_);
+        if (fd_ >= 0)
+            close(fd_);
+    }
 
-        auto self(shared_from_this());
-        out_socket_.async_connect(target_endpoint_, [this, self](boost::system::error_code ec)
-                                  {
-        if (!ec)
-        {
-            logger_.info("Connected to target endpoint.");
-            set_keep_alive_options(out_socket_);
-            plz_forward();
-        }
-        else
-        {
-            logger_.warn("Connection attempt failed: " + ec.message());
-            ++current_attempt_;
-            timer_.expires_after(std::chrono::seconds(retry_delay_));
-            timer_.async_wait([this, self](boost::system::error_code) { attempt_connection(); });
-        } });
+    // supervisor: a segment for workers slots, inherited by them as fd()
+    void create(int workers)
+    {
+        size_ = slot_bytes * workers;
+        fd_ = memfd_create("tcp_forwarder_stats", MFD_CLOEXEC);
+        if (fd_ < 0 || ftruncate(fd_, static_cast<off_t>(size_)) < 0)
+            throw std::runtime_error("creating the worker stats segment failed: " + std::string(strerror(errno)));
+        map();
     }
 
-    void plz_forward()
+    // worker: its own slot in the segment passed in as fd
+    void attach(int fd, int index)
     {
-        logger_.trace("Starting data forwarding...");
-        forward_data(in_socket_, out_socket_, data_in_);
-        forward_data(out_socket_, in_socket_, data_out_);
+        struct stat st;
+        if (fstat(fd, &st) < 0 || static_cast<std::size_t>(st.st_size) < slot_bytes * (index + 1))
+            throw std::runtime_error("worker stats segment is missing or too small");
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        fd_ = fd;
+        size_ = static_cast<std::size_t>(st.st_size);
+        map();
+        index_ = index;
     }
 
-    void forward_data(tcp::socket &source, tcp::socket &destination, std::vector<char> &buffer)
+    int fd() const { return fd_; }
+
+    void publish(const CounterSnapshot &counters)
     {
-        auto self(shared_from_this());
-        source.async_read_some(boost::asio::buffer(buffer), [this, self, &source, &destination, &buffer](boost::system::error_code ec, std::size_t length)
-                               {
-        if (!ec)
-        {
-            logger_.debug("Data read from source. Length: " + std::to_string(length));
-            boost::asio::async_write(destination, boost::asio::buffer(buffer, length),
-                                     [this, self, &source, &destination, &buffer](boost::system::error_code write_ec, std::size_t /*bytes_transferred*/)
-                                     {
-                                         if (!write_ec)
-                                         {
-                                             logger_.trace("Data forwarded successfully.");
-                                             forward_data(source, destination, buffer); 
-                                         }
-                                         else
-                                         {
-                                             logger_.warn("Write error: " + write_ec.message());
-                                             clean_up(); 
-                                         }
-                                     });
-        }
-        else if (ec == boost::asio::error::eof)
+        Slot &slot = this->slot(index_);
+        uint64_t seq = slot.seq.load(std::memory_order_relaxed);
+        slot.seq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        std::size_t used = 0;
+        uint32_t count = 0;
+        for (const auto &counter : counters)
         {
-            logger_.info("EOF received.. closing connection.");
-            clean_up(); 
+            uint16_t length = static_cast<uint16_t>(std::min<std::size_t>(counter.first.size(), UINT16_MAX));
+            if (used + sizeof(length) + length + sizeof(int64_t) > sizeof(slot.data))
+                break;
+            std::memcpy(slot.data + used, &length, sizeof(length));
+            std::memcpy(slot.data + used + sizeof(length), counter.first.data(), length);
+            std::memcpy(slot.data + used + sizeof(length) + length, &counter.second, sizeof(int64_t));
+            used += sizeof(length) + length + sizeof(int64_t);
+            ++count;
         }
-        else
-        {
-            logger_.error("Read error: " + ec.message());
-            clean_up(); 
-        } });
+        slot.count = count;
+        slot.used = static_cast<uint32_t>(used);
+        slot.seq.store(seq + 2, std::memory_order_release);
     }
 
-    void clean_up()
+    // a consistent copy of one worker's counters; empty until it first published
+    CounterSnapshot read(int index) const
     {
-        boost::system::error_code ec;
-        if (in_socket_.is_open())
+        const Slot &slot = this->slot(index);
+        std::vector<char> copy;
+        uint32_t count = 0, used = 0;
+        for (int attempt = 0; attempt < 100; ++attempt)
         {
-            in_socket_.shutdown(tcp::socket::shutdown_both, ec);
-            in_socket_.close(ec);
+            uint64_t before = slot.seq.load(std::memory_order_acquire);
+            if (before & 1)
+                continue;
+            count = slot.count;
+            used = std::min<uint32_t>(slot.used, sizeof(slot.data));
+            copy.assign(slot.data, slot.data + used);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.seq.load(std::memory_order_relaxed) == before)
+                break;
+            count = 0;
         }
-        if (out_socket_.is_open())
+
+        CounterSnapshot counters;
+        std::size_t pos = 0;
+        for (uint32_t i = 0; i < count && pos + sizeof(uint16_t) <= used; ++i)
         {
-            out_socket_.shutdown(tcp::socket::shutdown_both, ec);
-            out_socket_.close(ec);
+            uint16_t length;
+            std::memcpy(&length, copy.data() + pos, sizeof(length));
+            if (pos + sizeof(length) + length + sizeof(int64_t) > used)
+                break;
+            int64_t value;
+            std::memcpy(&value, copy.data() + pos + sizeof(length) + length, sizeof(value));
+            counters.emplace_back(std::string(copy.data() + pos + sizeof(length), length), value);
+            pos += sizeof(length) + length + sizeof(int64_t);
         }
-        logger_.info("Session cleaned up. Sockets closed.");
+        return counters;
     }
 
-    void close_sockets()
+    // a worker that crashed mid-write leaves an odd sequence number; its successor starts clean
+    void reset(int index)
     {
-        boost::system::error_code ec;
-        in_socket_.close(ec);
-        out_socket_.close(ec);
-        logger_.info("Sockets closed");
+        Slot &slot = this->slot(index);
+        slot.count = 0;
+        slot.used = 0;
+        slot.seq.store(0, std::memory_order_release);
     }
 
-    boost::asio::io_context &io_context_;
-    tcp::socket in_socket_;
-    tcp::socket out_socket_;
-    tcp::endpoint target_endpoint_;
-    std::size_t buffer_size_;
-    bool tcp_no_delay_;
-    int retry_attempts_;
-    int retry_delay_;
-    int current_attempt_;
-    boost::asio::steady_timer timer_;
-    Logger &logger_;
-    std::atomic<int> &active_connections_;
-    std::vector<char> data_in_;
-    std::vector<char> data_out_;
-    YAML::Node tcp_keep_alive_;
-};
-
-class HealthChecker
-{
-public:
-    HealthChecker(boost::asio::io_context &io_context, int interval, Logger &logger)
-        : timer_(io_context),
-          interval_(interval),
-          logger_(logger) {}
-
-    void start()
+private:
+    struct Slot
     {
-    
-        logger_.trace("Starting health checks...");
-        schedule_check();
-    }
+        std::atomic<uint64_t> seq;
+        uint32_t count;
+        uint32_t used;
+        char data[slot_bytes - 16];
+    };
+    static_assert(sizeof(Slot) == slot_bytes, "worker stats slot layout");
 
-private:
-    void schedule_check()
+    void map()
     {
-        timer_.expires_after(std::chrono::seconds(interval_));
-        timer_.async_wait([this](boost::system::error_code ec)
-                          {
-            if (!ec) {
-                logger_.info("Health check: System is operational");
-                schedule_check();
-            } });
+        void *base = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (base == MAP_FAILED)
+            throw std::runtime_error("mapping the worker stats segment failed: " + std::string(strerror(errno)));
+        base_ = base;
     }
 
-    boost::asio::steady_timer timer_;
-    int interval_;
-    Logger &logger_;
+    Slot &slot(int index) const { return static_cast<Slot *>(base_)[index]; }
+
+    int fd_ = -1;
+    void *base_ = nullptr;
+    std::size_t size_ = 0;
+    int index_ = 0;
 };
 
-class TCPForwarder
+// prefork mode: the supervisor binds every listener once per worker with SO_REUSEPORT,
+// so the kernel spreads connections over the workers, and keeps those sockets while a
+// worker is down, so its share queues until the restart instead of being refused. each
+// worker is this binary again, handed its sockets the way socket activation does it.
+// crashed workers restart after a backoff that doubles while they keep crashing early.
+class Supervisor
 {
 public:
-    TCPForwarder(boost::asio::io_context &io_context, const YAML::Node &config, Logger &logger)
+    Supervisor(boost::asio::io_context &io_context, const YAML::Node &config, const std::string &config_path, Logger &logger)
         : io_context_(io_context),
+          config_path_(config_path),
           logger_(logger),
-          config_(config),
-          active_connections_(0)
+          signals_(io_context, SIGCHLD),
+          base_backoff_(config["prefork"]["backoff_ms"].as<int>()),
+          max_backoff_(config["prefork"]["max_backoff_ms"].as<int>())
     {
-        logger_.trace("Initializing TCP Forwarder...");
-
-        std::size_t buffer_size = config["buffer_size"].as<std::size_t>();
-        bool tcp_no_delay = config["tcp_no_delay"].as<bool>();
-        int retry_attempts = config["retry_attempts"].as<int>();
-        int retry_delay = config["retry_delay"].as<int>();
-        int max_connections = config["max_connections"].as<int>();
-
-        if (!config["forwarders"] || !config["forwarders"].IsSequence())
+        int count = config["prefork"]["workers"].as<int>();
+        std::vector<tcp::endpoint> endpoints = listen_endpoints(config);
+        workers_.resize(count);
+        for (auto &worker : workers_)
         {
-            throw std::runtime_error("Error: 'forwarders' must be specified and must be a sequence.");
+            worker.timer = std::make_unique<boost::asio::steady_timer>(io_context);
+            worker.backoff = base_backoff_;
+            for (const auto &endpoint : endpoints)
+                worker.sockets.push_back(bind_shared(endpoint));
         }
+        stats_.create(count);
+        logger_.info("Prefork: " + std::to_string(count) + " workers sharing " + std::to_string(endpoints.size()) + " listeners");
+    }
 
-        for (const auto &forwarder : config["forwarders"])
+    ~Supervisor()
+    {
+        for (auto &worker : workers_)
         {
-            if (!forwarder["listen_address"] || !forwarder["target_address"])
-            {
-                logger_.error("Forwarder configuration must include 'listen_address' and 'target_address'. Skipping this entry.");
-                continue;
-            }
+            for (int fd : worker.sockets)
+                close(fd);
+        }
+    }
 
-            std::string listen_address = forwarder["listen_address"].as<std::string>();
-            std::string target_address = forwarder["target_address"].as<std::string>();
+    void start()
+    {
+        wait_children();
+        for (std::size_t i = 0; i < workers_.size(); ++i)
+            spawn(i);
+    }
 
-            try
+    // forwards the signal, so the workers drain; stops once all of them are gone
+    void shutdown(int signal_number)
+    {
+        stopping_ = true;
+        for (auto &worker : workers_)
+        {
+            worker.timer->cancel();
+            if (worker.pid > 0)
+                kill(worker.pid, signal_number);
+        }
+        stop_when_idle();
+    }
+
+    CounterSnapshot counters() const
+    {
+        CounterSnapshot total;
+        std::map<std::string, std::size_t> position;
+        int up = 0;
+        uint64_t restarts = 0;
+        for (std::size_t i = 0; i < workers_.size(); ++i)
+        {
+            up += workers_[i].pid > 0;
+            restarts += workers_[i].restarts;
+            for (auto &counter : stats_.read(static_cast<int>(i)))
             {
-                if (forwarder["port_range"])
+                auto found = position.find(counter.first);
+                if (found == position.end())
                 {
-                    int start_port = forwarder["port_range"]["start"].as<int>();
-                    int end_port = forwarder["port_range"]["end"].as<int>();
-                    for (int port = start_port; port <= end_port; ++port)
-                    {
-                        tcp::endpoint listen_endpoint(boost::asio::ip::make_address(listen_address), port);
-                        tcp::endpoint target_endpoint(boost::asio::ip::make_address(target_address), port);
-                        start_con(listen_endpoint, target_endpoint, buffer_size, tcp_no_delay, retry_attempts, retry_delay, max_connections);
-                    }
+                    position.emplace(counter.first, total.size());
+                    total.push_back(std::move(counter));
                 }
+                else if (counter.first == "loop_lag_us")
+                    total[found->second].second = std::max(total[found->second].second, counter.second);
                 else
-                {
-
-                    if (!forwarder["listen_port"] || !forwarder["target_port"])
-                    {
-                        logger_.error("Forwarder configuration must include 'listen_port' and 'target_port' if 'port_range' is not specified.");
-                        continue;
-                    }
+                    total[found->second].second += counter.second;
+            }
+        }
+        total.emplace_back("workers_up", up);
+        total.emplace_back("worker_restarts", static_cast<int64_t>(restarts));
+        return total;
+    }
 
-                    int listen_port = forwarder["listen_port"].as<int>();
-                    int target_port = forwarder["target_port"].as<int>();
+    std::string stats_json() const
+    {
+        auto object = [](const CounterSnapshot &counters)
+        {
+            std::ostringstream out;
+            out << "{";
+            for (std::size_t i = 0; i < counters.size(); ++i)
+                out << (i ? "," : "") << "\"" << counters[i].first << "\":" << counters[i].second;
+            out << "}";
+            return out.str();
+        };
+        auto now = std::chrono::steady_clock::now();
+        std::ostringstream out;
+        out << "{\"mode\":\"prefork\",\"stopping\":" << (stopping_ ? "true" : "false") << ",\"workers\":[";
+        for (std::size_t i = 0; i < workers_.size(); ++i)
+        {
+            const Worker &worker = workers_[i];
+            out << (i ? "," : "") << "{\"index\":" << i << ",\"pid\":" << worker.pid
+                << ",\"up\":" << (worker.pid > 0 ? "true" : "false") << ",\"restarts\":" << worker.restarts
+                << ",\"uptime_s\":" << (worker.pid > 0 ? std::chrono::duration_cast<std::chrono::seconds>(now - worker.started).count() : 0)
+                << ",\"next_backoff_ms\":" << worker.backoff
+                << ",\"counters\":" << object(stats_.read(static_cast<int>(i))) << "}";
+        }
+        out << "],\"counters\":" << object(counters()) << "}";
+        return out.str();
+    }
 
-                    tcp::endpoint listen_endpoint(boost::asio::ip::make_address(listen_address), listen_port);
-                    tcp::endpoint target_endpoint(boost::asio::ip::make_address(target_address), target_port);
-                    start_con(listen_endpoint, target_endpoint, buffer_size, tcp_no_delay, retry_attempts, retry_delay, max_connections);
-                }
+    // every endpoint the forwarders section listens on, as TCPForwarder reads it
+    static std::vector<tcp::endpoint> listen_endpoints(const YAML::Node &config)
+    {
+        std::vector<tcp::endpoint> endpoints;
+        for (const auto &forwarder : config["forwarders"])
+        {
+            if (!forwarder["listen_address"])
+                continue;
+            auto address = boost::asio::ip::make_address(forwarder["listen_address"].as<std::string>());
+            if (forwarder["port_range"])
+            {
+                int end_port = forwarder["port_range"]["end"].as<int>();
+                for (int port = forwarder["port_range"]["start"].as<int>(); port <= end_port; ++port)
+                    endpoints.emplace_back(address, static_cast<unsigned short>(port));
             }
-            catch (const std::exception &e)
+            else if (forwarder["listen_port"])
             {
-                logger_.error("initializing forwarder failed: " + std::string(e.what()));
+                endpoints.emplace_back(address, static_cast<unsigned short>(forwarder["listen_port"].as<int>()));
             }
         }
+        return endpoints;
     }
 
 private:
-    void start_con(const tcp::endpoint &listen_endpoint, const tcp::endpoint &target_endpoint, std::size_t buffer_size,
-                   bool tcp_no_delay, int retry_attempts, int retry_delay, int max_connections)
+    struct Worker
     {
-        try
+        pid_t pid = 0;
+        uint64_t restarts = 0;
+        int backoff = 0; // ms before the next restart
+        std::chrono::steady_clock::time_point started;
+        std::unique_ptr<boost::asio::steady_timer> timer;
+        std::vector<int> sockets;
+    };
+
+    int bind_shared(const tcp::endpoint &endpoint)
+    {
+        int fd = socket(endpoint.protocol().family(), SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int on = 1;
+        if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+            setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0 ||
+            bind(fd, endpoint.data(), static_cast<socklen_t>(endpoint.size())) < 0 || listen(fd, SOMAXCONN) < 0)
         {
-            auto acceptor = std::make_shared<tcp::acceptor>(io_context_, listen_endpoint);
-            logger_.info("Listening on " + listen_endpoint.address().to_string() + ":" + std::to_string(listen_endpoint.port()));
+            std::string error = strerror(errno);
+            if (fd >= 0)
+                close(fd);
+            throw std::runtime_error("binding " + endpoint.address().to_string() + ":" + std::to_string(endpoint.port()) + " failed: " + error);
+        }
+        return fd;
+    }
 
-            YAML::Node tcp_keep_alive_config = config_["tcp_keep_alive"];
+    // fork and exec this binary with the worker's sockets from fd 3 on and the stats
+    // segment after them. only async-signal-safe calls run between fork and exec.
+    void spawn(std::size_t index)
+    {
+        Worker &worker = workers_[index];
+        stats_.reset(static_cast<int>(index));
+
+        std::vector<int> fds = worker.sockets;
+        fds.push_back(stats_.fd());
+        int high = *std::max_element(fds.begin(), fds.end()) + 1;
 
-            plz_accept(acceptor, target_endpoint, buffer_size, tcp_no_delay, retry_attempts, retry_delay, max_connections, tcp_keep_alive_config);
+        std::vector<std::string> env;
+        for (char **entry = environ; *entry; ++entry)
+        {
+            if (strncmp(*entry, "LISTEN_", 7) != 0 && strncmp(*entry, "TCP_FORWARDER_WORKER=", 21) != 0)
+                env.emplace_back(*entry);
         }
-        catch (const std::exception &e)
+        env.push_back("LISTEN_FDS=" + std::to_string(worker.sockets.size()));
+        env.push_back("TCP_FORWARDER_WORKER=" + std::to_string(index) + ":" + std::to_string(3 + worker.sockets.size()));
+        env.push_back("LISTEN_PID=" + std::string(20, ' '));
+        std::vector<char *> envp;
+        for (auto &entry : env)
+            envp.push_back(&entry[0]);
+        envp.push_back(nullptr);
+        char *pid_field = &env.back()[11];
+        // the binary's own path rather than /proc/self/exe, so workers keep its name for ps and pgrep
+        char self[PATH_MAX];
+        ssize_t length = readlink("/proc/self/exe", self, sizeof(self) - 1);
+        if (length <= 0)
         {
-            logger_.error("couldn't start listener on " + listen_endpoint.address().to_string() + ":" +
-                          std::to_string(listen_endpoint.port()) + ". error: " + e.what());
+            logger_.error("Locating the tcp_forwarder binary failed: " + std::string(strerror(errno)));
+            schedule_restart(index);
+            return;
+        }
+        self[length] = '\0';
+        char *argv[] = {self, &config_path_[0], nullptr};
+
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            // its own process group, so a ^C reaches the supervisor only and is forwarded once
+            setpgid(0, 0);
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            sigset_t none;
+            sigemptyset(&none);
+            sigprocmask(SIG_SETMASK, &none, nullptr);
+            // move every fd above the range first, so the dup2s below never clobber one
+            for (int &fd : fds)
+                fd = fcntl(fd, F_DUPFD_CLOEXEC, high);
+            for (std::size_t i = 0; i < fds.size(); ++i)
+                dup2(fds[i], 3 + static_cast<int>(i));
+            syscall(SYS_close_range, 3 + fds.size(), ~0U, 0);
+            unsigned long value = static_cast<unsigned long>(getpid());
+            char digits[20];
+            int digit_count = 0;
+            do
+            {
+                digits[digit_count++] = static_cast<char>('0' + value % 10);
+                value /= 10;
+            } while (value);
+            for (int i = 0; i < digit_count; ++i)
+                pid_field[i] = digits[digit_count - 1 - i];
+            pid_field[digit_count] = '\0';
+            execve(argv[0], argv, envp.data());
+            _exit(127);
+        }
+        if (pid < 0)
+        {
+            logger_.error("Forking worker " + std::to_string(index) + " failed: " + strerror(errno));
+            schedule_restart(index);
+            return;
         }
+        worker.pid = pid;
+        worker.started = std::chrono::steady_clock::now();
+        logger_.info("Worker " + std::to_string(index) + " started, pid " + std::to_string(pid));
     }
 
-    void plz_accept(std::shared_ptr<tcp::acceptor> acceptor, const tcp::endpoint &target_endpoint, std::size_t buffer_size,
-                    bool tcp_no_delay, int retry_attempts, int retry_delay, int max_connections, const YAML::Node &tcp_keep_alive_config)
+    void wait_children()
     {
-        acceptor->async_accept([this, acceptor, target_endpoint, buffer_size, tcp_no_delay, retry_attempts, retry_delay, max_connections, tcp_keep_alive_config](boost::system::error_code ec, tcp::socket in_socket)
-                               {
-            if (!ec)
+        signals_.async_wait([this](const boost::system::error_code &ec, int)
+                            {
+            if (ec)
+                return;
+            reap();
+            wait_children(); });
+    }
+
+    void reap()
+    {
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        {
+            for (std::size_t i = 0; i < workers_.size(); ++i)
             {
-                if (active_connections_ >= max_connections)
-                {
-                    logger_.warn("Max connections reached. Rejecting new connection.");
-                    in_socket.close();
-                }
-                else
+                Worker &worker = workers_[i];
+                if (worker.pid != pid)
+                    continue;
+                worker.pid = 0;
+                std::string how = WIFSIGNALED(status) ? "killed by signal " + std::to_string(WTERMSIG(status))
+                                                      : "exited with status " + std::to_string(WEXITSTATUS(status));
+                if (stopping_)
                 {
-                    logger_.info("Accepted new connection");
-                    std::make_shared<Session>(io_context_, std::move(in_socket), target_endpoint, buffer_size, tcp_no_delay,
-                                              retry_attempts, retry_delay, logger_, active_connections_, tcp_keep_alive_config)
-                        ->start();
+                    logger_.info("Worker " + std::to_string(i) + " " + how);
+                    continue;
                 }
+                logger_.error("Worker " + std::to_string(i) + " (pid " + std::to_string(pid) + ") " + how);
+                // a worker that ran for a while crashed on its own, not in a restart loop
+                if (std::chrono::steady_clock::now() - worker.started >= stable_after)
+                    worker.backoff = base_backoff_;
+                schedule_restart(i);
             }
-            else
-            {
-                logger_.error("Accept error: " + ec.message());
-            }
+        }
+        if (stopping_)
+            stop_when_idle();
+    }
+
+    void schedule_restart(std::size_t index)
+    {
+        Worker &worker = workers_[index];
+        logger_.warn("Restarting worker " + std::to_string(index) + " in " + std::to_string(worker.backoff) + "ms");
+        worker.timer->expires_after(std::chrono::milliseconds(worker.backoff));
+        worker.timer->async_wait([this, index](const boost::system::error_code &ec)
+                                 {
+            if (ec || stopping_)
+                return;
+            ++workers_[index].restarts;
+            spawn(index); });
+        worker.backoff = std::min(worker.backoff * 2, max_backoff_);
+    }
 
-            plz_accept(acceptor, target_endpoint, buffer_size, tcp_no_delay, retry_attempts, retry_delay, max_connections, tcp_keep_alive_config); });
+    void stop_when_idle()
+    {
+        for (const auto &worker : workers_)
+        {
+            if (worker.pid > 0)
+                return;
+        }
+        logger_.info("All workers exited");
+        io_context_.stop();
     }
 
     boost::asio::io_context &io_context_;
+    std::string config_path_;
     Logger &logger_;
-    YAML::Node config_;
-    std::atomic<int> active_connections_;
+    boost::asio::signal_set signals_;
+    WorkerStats stats_;
+    std::vector<Worker> workers_;
+    int base_backoff_;
+    int max_backoff_;
+    bool stopping_ = false;
+    static constexpr std::chrono::seconds stable_after{10};
 };
 
 int main(int argc, char *argv[])
@@ -680,11 +8546,71 @@ int main(int argc, char *argv[])
         YAML::Node config = YAML::LoadFile(argv[1]);
         validate_and_set_defaults(config);
 
+        // a prefork worker gets its sockets and stats segment from the supervisor, and
+        // logs to files of its own
+        int worker_index = -1, worker_stats_fd = -1;
+        if (const char *worker = getenv("TCP_FORWARDER_WORKER"))
+        {
+            if (sscanf(worker, "%d:%d", &worker_index, &worker_stats_fd) != 2)
+                throw std::runtime_error("malformed TCP_FORWARDER_WORKER");
+            unsetenv("TCP_FORWARDER_WORKER");
+            std::string suffix = ".worker" + std::to_string(worker_index);
+            config["logging"]["file"] = config["logging"]["file"].as<std::string>() + suffix;
+            if (config["access_log"] && config["access_log"]["file"])
+                config["access_log"]["file"] = config["access_log"]["file"].as<std::string>() + suffix;
+        }
+
         bool logging_enabled = config["logging"]["enabled"].as<bool>();
         std::string log_file = config["logging"]["file"].as<std::string>();
         std::string log_level = config["logging"]["level"].as<std::string>();
 
-        Logger logger(logging_enabled, log_file, log_level);
+        RotationOptions rotation;
+        const YAML::Node &rotate = config["logging"]["rotate"];
+        if (rotate)
+        {
+            rotation.max_bytes = rotate["max_bytes"] ? rotate["max_bytes"].as<std::size_t>() : 0;
+            rotation.max_seconds = rotate["max_seconds"] ? rotate["max_seconds"].as<int>() : 0;
+            rotation.keep = rotate["keep"] ? rotate["keep"].as<int>() : 10;
+            rotation.compress = rotate["compress"] ? rotate["compress"].as<bool>() : true;
+        }
+
+        Logger logger(logging_enabled, log_file, log_level, rotation);
+
+        if (config["prefork"]["workers"].as<int>() > 0 && worker_index < 0)
+        {
+            boost::asio::io_context io_context;
+            Supervisor supervisor(io_context, config, argv[1], logger);
+
+            std::unique_ptr<ControlServer> control_server;
+            if (config["control"]["enabled"].as<bool>())
+            {
+                tcp::endpoint control_endpoint(boost::asio::ip::make_address(config["control"]["address"].as<std::string>()),
+                                               config["control"]["tcp_port"].as<int>());
+                control_server = std::make_unique<ControlServer>(io_context, control_endpoint, logger);
+                control_server->add_route("/stats", [&supervisor](const std::string &)
+                                          { return supervisor.stats_json(); });
+                control_server->add_stream("/stream", std::chrono::milliseconds(config["control"]["stream_interval_ms"].as<int>()), [&supervisor]()
+                                           { return supervisor.counters(); });
+                control_server->start();
+            }
+
+            boost::asio::signal_set signals(io_context, SIGINT, SIGTERM);
+            std::function<void()> wait_signal = [&]()
+            {
+                signals.async_wait([&](const boost::system::error_code &ec, int signal_number)
+                                   {
+                    if (ec)
+                        return;
+                    logger.info("Received signal " + std::to_string(signal_number) + ", stopping the workers");
+                    supervisor.shutdown(signal_number);
+                    wait_signal(); });
+            };
+            wait_signal();
+
+            supervisor.start();
+            io_context.run();
+            return 0;
+        }
 
         int num_threads = config["thread_pool"]["threads"].as<int>();
         bool health_check_enabled = config["health_check"]["enabled"].as<bool>();
@@ -695,12 +8621,68 @@ int main(int argc, char *argv[])
 
         TCPForwarder forwarder(io_context, config, logger);
 
+        // a worker publishes its counters for the supervisor, which owns the control port
+        WorkerStats worker_stats;
+        boost::asio::steady_timer publish_timer(io_context);
+        std::function<void()> publish = [&]()
+        {
+            worker_stats.publish(forwarder.counters());
+            publish_timer.expires_after(std::chrono::milliseconds(500));
+            publish_timer.async_wait([&](const boost::system::error_code &ec)
+                                     {
+                if (!ec)
+                    publish(); });
+        };
+        if (worker_index >= 0)
+        {
+            worker_stats.attach(worker_stats_fd, worker_index);
+            publish();
+        }
+
+        std::unique_ptr<ControlServer> control_server;
+        if (config["control"]["enabled"].as<bool>() && worker_index < 0)
+        {
+            tcp::endpoint control_endpoint(boost::asio::ip::make_address(config["control"]["address"].as<std::string>()),
+                                           config["control"]["tcp_port"].as<int>());
+            control_server = std::make_unique<ControlServer>(io_context, control_endpoint, logger);
+            control_server->add_route("/stats", [&forwarder](const std::string &)
+                                      { return forwarder.stats_json(); });
+            control_server->add_route("/capture", [&forwarder](const std::string &)
+                                      { return forwarder.capture().status_json(); });
+            control_server->add_route("/capture/start", [&forwarder](const std::string &query)
+                                      { return forwarder.capture().start(query); });
+            control_server->add_route("/capture/stop", [&forwarder](const std::string &)
+                                      { return forwarder.capture().stop(); });
+            control_server->add_route("/capture/dump", [&forwarder](const std::string &)
+                                      { return forwarder.capture().dump_pcapng(); }, "application/x-pcapng");
+            control_server->add_stream("/stream", std::chrono::milliseconds(config["control"]["stream_interval_ms"].as<int>()), [&forwarder]()
+                                       { return forwarder.counters(); });
+            control_server->start();
+        }
+
         if (health_check_enabled)
         {
             HealthChecker health_checker(io_context, health_check_interval, logger);
             health_checker.start();
         }
 
+        // the first signal drains, a second one stops without waiting
+        boost::asio::signal_set signals(io_context, SIGINT, SIGTERM);
+        std::chrono::seconds drain_timeout(config["shutdown"]["drain_timeout"].as<int>());
+        signals.async_wait([&](const boost::system::error_code &ec, int signal_number)
+                           {
+            if (ec)
+                return;
+            logger.info("Received signal " + std::to_string(signal_number) + ", shutting down");
+            forwarder.drain(drain_timeout, [&io_context]()
+                            { io_context.stop(); });
+            signals.async_wait([&io_context, &logger](const boost::system::error_code &ec, int)
+                               {
+                if (ec)
+                    return;
+                logger.warn("Second signal, exiting without waiting for the drain");
+                io_context.stop(); }); });
+
         for (int i = 0; i < num_threads; ++i)
         {
             boost::asio::post(thread_pool, [&io_context]()
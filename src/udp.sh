@@ -10,12 +10,28 @@ function print_info() { echo -e "${BLUE}[INFO]${RESET} $1"; }
 function print_success() { echo -e "${GREEN}[SUCCESS]${RESET} $1"; }
 function print_error() { echo -e "${RED}[ERROR]${RESET} $1"; }
 
+# SIGTERM drains (shutdown.drain_timeout in the config, 30s by default); kill -9 only
+# once it has had that long and a little more to flush its logs
+function stop_gracefully() {
+    kill -TERM $@ 2>/dev/null
+    for _ in $(seq 1 ${DRAIN_WAIT:-40}); do
+        local alive=0
+        for pid in "$@"; do
+            kill -0 "$pid" 2>/dev/null && alive=1
+        done
+        [ "$alive" -eq 0 ] && return 0
+        sleep 1
+    done
+    print_error "Forwarder still running after ${DRAIN_WAIT:-40}s, killing it."
+    kill -9 $@ 2>/dev/null
+}
+
 function kill_existing_forwarder() {
     print_info "Checking for existing forwarder processes..."
     existing_pid=$(pgrep -f "udp_forwarder")
     if [ -n "$existing_pid" ]; then
-        print_info "Killing existing UDP forwarder process (PID: $existing_pid)..."
-        kill -9 "$existing_pid"
+        print_info "Stopping existing UDP forwarder process (PID: $existing_pid), letting its sessions drain..."
+        stop_gracefully $existing_pid
         print_success "Existing UDP forwarder process terminated."
     else
         print_info "No existing UDP forwarder process found."
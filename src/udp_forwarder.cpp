@@ -11,6 +11,7 @@
 #include <condition_variable>
 #include <yaml-cpp/yaml.h>
 #include <unordered_map>
+#include <unordered_set>
 #include <thread>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -19,7 +20,33 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/epoll.h>
+#include <poll.h>
+#include <csignal>
+#include <netinet/tcp.h>
+#include <sys/auxv.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/rand.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 #include <list>
+#include <sstream>
+#include <map>
+#include <functional>
+#include <algorithm>
+#include <limits>
+#include <chrono>
+#include <netdb.h>
+#include <resolv.h>
+#include <arpa/nameser.h>
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
 
 class Logger
 {
@@ -35,21 +62,8 @@ public:
     };
 
     Logger(bool enabled, const std::string &file, const std::string &level)
-        : enabled_(enabled), stop_worker_(false)
+        : enabled_(enabled), stop_worker_(false), log_level_(parse_level(level))
     {
-        if (level == "TRACE")
-            log_level_ = LogLevel::TRACE;
-        else if (level == "DEBUG")
-            log_level_ = LogLevel::DEBUG;
-        else if (level == "INFO")
-            log_level_ = LogLevel::INFO;
-        else if (level == "WARN")
-            log_level_ = LogLevel::WARN;
-        else if (level == "ERROR")
-            log_level_ = LogLevel::ERROR;
-        else
-            log_level_ = LogLevel::ALL;
-
         if (enabled_)
         {
             logfile_.open(file, std::ios::app);
@@ -112,6 +126,37 @@ public:
     void warn(const std::string &message) { log("WARN", message, LogLevel::WARN); }
     void error(const std::string &message) { log("ERROR", message, LogLevel::ERROR); }
 
+    static LogLevel parse_level(const std::string &level)
+    {
+        if (level == "TRACE")
+            return LogLevel::TRACE;
+        else if (level == "DEBUG")
+            return LogLevel::DEBUG;
+        else if (level == "INFO")
+            return LogLevel::INFO;
+        else if (level == "WARN")
+            return LogLevel::WARN;
+        else if (level == "ERROR")
+            return LogLevel::ERROR;
+        else
+            return LogLevel::ALL;
+    }
+
+    LogLevel level() const { return log_level_; }
+
+    // the level that logs less of the two; ALL logs everything
+    static LogLevel stricter(LogLevel a, LogLevel b)
+    {
+        if (a == LogLevel::ALL)
+            return b;
+        if (b == LogLevel::ALL)
+            return a;
+        return std::max(a, b);
+    }
+
+    // load shedding raises the threshold while the event loop lags
+    void set_level(LogLevel level) { log_level_ = level; }
+
 private:
     bool must_log(LogLevel msg_level)
     {
@@ -152,7 +197,7 @@ private:
     std::condition_variable queue_cv_;
     std::thread worker_thread_;
     std::atomic<bool> stop_worker_;
-    LogLevel log_level_;
+    std::atomic<LogLevel> log_level_;
 };
 
 struct sockaddr_inx
@@ -165,308 +210,3128 @@ struct sockaddr_inx
     };
 };
 
-struct ProxyConn
-{
-    sockaddr_inx cli_addr;
-    int svr_sock;
-    time_t last_active;
-};
-
-class UDPProxy
+// addresses a destination name currently resolves to; flows read the snapshot
+// without locking and the resolver thread swaps in a new one when records change
+class ResolvedTarget
 {
 public:
-    UDPProxy(const std::string &srcAddrPort, const std::string &dstAddrPort, int timeout, int buffer_size, Logger &logger)
-        : timeout(timeout), buffer_size(buffer_size), connTblHashSize(256), logger(logger)
+    explicit ResolvedTarget(const std::string &host)
+        : host(host), addrs(std::make_shared<const std::vector<sockaddr_inx>>()) {}
+
+    const std::string &name() const { return host; }
+
+    std::shared_ptr<const std::vector<sockaddr_inx>> addresses() const { return std::atomic_load(&addrs); }
+
+    void update(std::vector<sockaddr_inx> newAddrs)
     {
-        pAddress(srcAddrPort, srcAddr);
-        pAddress(dstAddrPort, dstAddr);
-        setupSocket();
-        initiateConnectionTable();
+        std::atomic_store(&addrs, std::shared_ptr<const std::vector<sockaddr_inx>>(
+                                      std::make_shared<const std::vector<sockaddr_inx>>(std::move(newAddrs))));
     }
 
-    ~UDPProxy()
+    // next record in rotation with the port filled in; false until the name resolved once
+    bool next(int port, sockaddr_inx &addr)
     {
-        if (srcSocket != -1)
-            close(srcSocket);
+        auto current = addresses();
+        if (current->empty())
+            return false;
+        addr = (*current)[nextAddr++ % current->size()];
+        if (addr.sa.sa_family == AF_INET6)
+            addr.in6.sin6_port = htons(port);
+        else
+            addr.in.sin_port = htons(port);
+        return true;
     }
 
-    void processConnections();
-
 private:
-    int timeout;
-    int buffer_size;
-    sockaddr_inx srcAddr, dstAddr;
-    int srcSocket = -1;
-    int epollFd = -1;
-    int connTblHashSize;
-    Logger &logger;
-
-    std::list<ProxyConn> connTable[256];
-    std::unordered_map<int, ProxyConn *> connMap;
-    std::mutex connMutex;
-
-    void pAddress(const std::string &addrPort, sockaddr_inx &sockAddr);
-    void setupSocket();
-    void initiateConnectionTable();
-    void recycleConnections();
-    int hashAddress(sockaddr_inx *addr);
-    ProxyConn *tOrCreateConnection(sockaddr_inx &cliAddr);
-    void rlsConnection(ProxyConn *conn);
-    static void setNonBlocking(int sockfd);
-    static bool compareAddresses(sockaddr_inx *a, sockaddr_inx *b);
+    std::string host;
+    std::shared_ptr<const std::vector<sockaddr_inx>> addrs;
+    std::atomic<size_t> nextAddr{0};
 };
 
-void UDPProxy::pAddress(const std::string &addrPort, sockaddr_inx &sockAddr)
+static std::string addrToString(const sockaddr_inx &addr)
 {
-    std::string ip = addrPort.substr(0, addrPort.find(':'));
-    int port = std::stoi(addrPort.substr(addrPort.find_last_of(':') + 1));
-
-    memset(&sockAddr, 0, sizeof(sockAddr));
-    if (ip.find(':') != std::string::npos)
-    { // IPv6 address
-        sockAddr.in6.sin6_family = AF_INET6;
-        inet_pton(AF_INET6, ip.c_str(), &sockAddr.in6.sin6_addr);
-        sockAddr.in6.sin6_port = htons(port);
-    }
+    char text[INET6_ADDRSTRLEN] = {0};
+    if (addr.sa.sa_family == AF_INET6)
+        inet_ntop(AF_INET6, &addr.in6.sin6_addr, text, sizeof(text));
     else
-    { // IPv4 address
-        sockAddr.in.sin_family = AF_INET;
-        inet_pton(AF_INET, ip.c_str(), &sockAddr.in.sin_addr);
-        sockAddr.in.sin_port = htons(port);
-    }
-
-    logger.debug("Parsed address: " + ip + ":" + std::to_string(port));
+        inet_ntop(AF_INET, &addr.in.sin_addr, text, sizeof(text));
+    return text;
 }
 
-void UDPProxy::setupSocket()
+// resolves destination names outside the packet path: once at startup, then from a
+// background thread before the records' TTL runs out. failed refreshes keep the
+// last good records.
+class DnsResolver
 {
-    // Determine the address family dynamically
-    int addrFamily = srcAddr.sa.sa_family;
+public:
+    DnsResolver(int minTtl, int maxTtl, int retryInterval, Logger &logger)
+        : minTtl(minTtl), maxTtl(maxTtl), retryInterval(retryInterval), logger(logger) {}
 
-    srcSocket = socket(addrFamily, SOCK_DGRAM, 0);
-    if (srcSocket < 0)
+    ~DnsResolver()
     {
-        logger.error("Socket creation failed: " + std::string(strerror(errno)));
-        throw std::runtime_error("Socket creation failed");
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopWorker = true;
+        }
+        wake.notify_one();
+        if (worker.joinable())
+            worker.join();
     }
 
-    int reuse = 1;
-    setsockopt(srcSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-
-    if (bind(srcSocket, (struct sockaddr *)&srcAddr,
-             (addrFamily == AF_INET6) ? sizeof(srcAddr.in6) : sizeof(srcAddr.in)) < 0)
+    // literal addresses resolve to themselves and are never refreshed. the first
+    // lookup of a name blocks the caller, but not the resolver thread or other callers
+    std::shared_ptr<ResolvedTarget> target(const std::string &host)
     {
-        logger.error("Binding socket failed for address: " +
-                     std::string((addrFamily == AF_INET6) ? "[IPv6]" : "[IPv4]") +
-                     " Error: " + std::string(strerror(errno)));
-        throw std::runtime_error("Binding socket failed");
-    }
+        if (auto known = find(host))
+            return known;
 
-    setNonBlocking(srcSocket);
+        auto target = std::make_shared<ResolvedTarget>(host);
+        sockaddr_inx literal;
+        memset(&literal, 0, sizeof(literal));
+        if (inet_pton(AF_INET6, host.c_str(), &literal.in6.sin6_addr) == 1)
+        {
+            literal.in6.sin6_family = AF_INET6;
+            target->update({literal});
+            return target;
+        }
+        if (inet_pton(AF_INET, host.c_str(), &literal.in.sin_addr) == 1)
+        {
+            literal.in.sin_family = AF_INET;
+            target->update({literal});
+            return target;
+        }
 
-    epollFd = epoll_create1(0);
-    if (epollFd < 0)
+        auto entry = std::make_unique<Entry>(target);
+        refresh(*entry);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto &known : entries)
+        {
+            // another caller resolved the same name meanwhile
+            if (known->target->name() == host)
+                return known->target;
+        }
+        entries.push_back(std::move(entry));
+        if (!worker.joinable())
+            worker = std::thread(&DnsResolver::run, this);
+        return target;
+    }
+
+    std::string statsJson() const
     {
-        logger.error("Creating epoll file descriptor failed: " + std::string(strerror(errno)));
-        throw std::runtime_error("Creating epoll file descriptor failed");
+        std::lock_guard<std::mutex> lock(mutex);
+        std::ostringstream out;
+        out << "[";
+        for (size_t i = 0; i < entries.size(); ++i)
+        {
+            const Entry &entry = *entries[i];
+            auto addrs = entry.target->addresses();
+            out << (i ? "," : "") << "{\"host\":\"" << entry.target->name() << "\",\"addresses\":[";
+            for (size_t j = 0; j < addrs->size(); ++j)
+                out << (j ? "," : "") << "\"" << addrToString((*addrs)[j]) << "\"";
+            out << "],\"ttl\":" << entry.ttl << ",\"refreshes\":" << entry.refreshes << ",\"failures\":" << entry.failures << "}";
+        }
+        out << "]";
+        return out.str();
     }
 
-    struct epoll_event ev;
-    ev.events = EPOLLIN;
-    ev.data.fd = srcSocket;
-    epoll_ctl(epollFd, EPOLL_CTL_ADD, srcSocket, &ev);
+private:
+    struct Entry
+    {
+        explicit Entry(std::shared_ptr<ResolvedTarget> resolved) : target(std::move(resolved)) {}
 
-    logger.info("Socket successfully set and bound to address");
-}
+        std::shared_ptr<ResolvedTarget> target;
+        std::chrono::steady_clock::time_point refreshAt;
+        std::atomic<int> ttl{0};
+        std::atomic<uint64_t> refreshes{0};
+        std::atomic<uint64_t> failures{0};
+    };
 
-void UDPProxy::setNonBlocking(int sockfd)
+    int minTtl;
+    int maxTtl;
+    int retryInterval;
+    Logger &logger;
+    mutable std::mutex mutex;
+    std::condition_variable wake;
+    bool stopWorker = false;
+    std::vector<std::unique_ptr<Entry>> entries;
+    std::thread worker;
+
+    std::shared_ptr<ResolvedTarget> find(const std::string &host) const;
+    void run();
+    void refresh(Entry &entry);
+    void schedule(Entry &entry, std::chrono::steady_clock::time_point at);
+    static void query(const std::string &host, int type, std::vector<sockaddr_inx> &addrs, uint32_t &ttl);
+    static void lookupHosts(const std::string &host, std::vector<sockaddr_inx> &addrs);
+};
+
+std::shared_ptr<ResolvedTarget> DnsResolver::find(const std::string &host) const
 {
-    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFD, 0) | O_NONBLOCK);
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto &entry : entries)
+    {
+        if (entry->target->name() == host)
+            return entry->target;
+    }
+    return nullptr;
 }
 
-void UDPProxy::initiateConnectionTable()
+void DnsResolver::run()
 {
-    for (int i = 0; i < connTblHashSize; ++i)
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopWorker)
     {
-        connTable[i].clear();
+        auto now = std::chrono::steady_clock::now();
+        auto wakeAt = now + std::chrono::seconds(maxTtl);
+        std::vector<Entry *> due;
+        for (const auto &entry : entries)
+        {
+            if (entry->refreshAt <= now)
+                due.push_back(entry.get());
+            else
+                wakeAt = std::min(wakeAt, entry->refreshAt);
+        }
+
+        if (due.empty())
+        {
+            wake.wait_until(lock, wakeAt);
+            continue;
+        }
+
+        lock.unlock();
+        for (Entry *entry : due)
+            refresh(*entry);
+        lock.lock();
     }
-    logger.debug("Connection table initialized");
 }
 
-void UDPProxy::processConnections()
+// queries without holding the mutex; only the refresh time is written under it
+void DnsResolver::refresh(Entry &entry)
 {
-    struct epoll_event events[10];
-    sockaddr_inx clientAddr{};
-    socklen_t clientLen = sizeof(clientAddr);
-    std::vector<char> buffer(buffer_size);
+    const std::string &host = entry.target->name();
+    std::vector<sockaddr_inx> addrs;
+    uint32_t ttl = std::numeric_limits<uint32_t>::max();
+    query(host, ns_t_a, addrs, ttl);
+    query(host, ns_t_aaaa, addrs, ttl);
+    if (addrs.empty())
+    {
+        // /etc/hosts and other NSS sources carry no TTL
+        lookupHosts(host, addrs);
+        ttl = static_cast<uint32_t>(minTtl);
+    }
 
-    while (true)
+    ++entry.refreshes;
+    auto now = std::chrono::steady_clock::now();
+    if (addrs.empty())
     {
-        int nfds = epoll_wait(epollFd, events, 10, 2000);
-        recycleConnections();
+        ++entry.failures;
+        schedule(entry, now + std::chrono::seconds(retryInterval));
+        logger.warn("Resolving " + host + " failed, keeping " + std::to_string(entry.target->addresses()->size()) + " cached address(es)");
+        return;
+    }
 
-        if (nfds < 0)
-        {
-            if (errno == EINTR)
-                continue;
-            logger.error("epoll wait failed");
-            throw std::runtime_error("epoll wait failed");
-        }
+    int clamped = static_cast<int>(std::min<uint32_t>(std::max<uint32_t>(ttl, minTtl), maxTtl));
+    entry.ttl = clamped;
+    // refresh at three quarters of the TTL so new records are in place before the old ones expire
+    schedule(entry, now + std::chrono::milliseconds(static_cast<int64_t>(clamped) * 750));
+
+    std::vector<std::string> oldNames, newNames;
+    for (const auto &addr : *entry.target->addresses())
+        oldNames.push_back(addrToString(addr));
+    for (const auto &addr : addrs)
+        newNames.push_back(addrToString(addr));
+    std::sort(oldNames.begin(), oldNames.end());
+    std::sort(newNames.begin(), newNames.end());
+    if (oldNames != newNames)
+    {
+        std::string list;
+        for (const auto &name : newNames)
+            list += (list.empty() ? "" : ", ") + name;
+        logger.info(host + " resolved to " + list + " (ttl " + std::to_string(clamped) + "s)");
+        entry.target->update(std::move(addrs));
+    }
+}
 
-        for (int i = 0; i < nfds; ++i)
+void DnsResolver::schedule(Entry &entry, std::chrono::steady_clock::time_point at)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    entry.refreshAt = at;
+}
+
+// A or AAAA records straight from the DNS answer, so their TTL is known
+void DnsResolver::query(const std::string &host, int type, std::vector<sockaddr_inx> &addrs, uint32_t &ttl)
+{
+    struct __res_state state;
+    memset(&state, 0, sizeof(state));
+    if (res_ninit(&state) != 0)
+        return;
+
+    unsigned char answer[4096];
+    int len = res_nsearch(&state, host.c_str(), ns_c_in, type, answer, sizeof(answer));
+    res_nclose(&state);
+    if (len < NS_HFIXEDSZ)
+        return;
+    len = std::min<int>(len, sizeof(answer));
+
+    auto get16 = [&answer](int pos)
+    { return (answer[pos] << 8) | answer[pos + 1]; };
+    auto skipName = [&answer, len](int pos)
+    {
+        while (pos < len)
         {
-            int sockfd = events[i].data.fd;
+            if (answer[pos] == 0)
+                return pos + 1;
+            if ((answer[pos] & 0xC0) == 0xC0)
+                return pos + 2;
+            pos += answer[pos] + 1;
+        }
+        return len;
+    };
 
-            if (sockfd == srcSocket)
-            {
-                int len = recvfrom(srcSocket, buffer.data(), buffer.size(), 0, (struct sockaddr *)&clientAddr, &clientLen);
-                if (len > 0)
-                {
-                    logger.debug("Received data from client");
+    int pos = NS_HFIXEDSZ;
+    for (int i = get16(4); i > 0 && pos < len; --i)
+        pos = skipName(pos) + NS_QFIXEDSZ;
 
-                    std::lock_guard<std::mutex> lock(connMutex);
-                    ProxyConn *conn = tOrCreateConnection(clientAddr);
-                    if (conn)
-                    {
-                        send(conn->svr_sock, buffer.data(), len, 0);
-                        logger.trace("Data sent to server");
-                    }
-                }
-            }
-            else
-            {
-                std::lock_guard<std::mutex> lock(connMutex);
-                ProxyConn *conn = connMap[sockfd];
-                if (conn)
-                {
-                    int len = recv(conn->svr_sock, buffer.data(), buffer.size(), 0);
-                    if (len > 0)
-                    {
-                        sendto(srcSocket, buffer.data(), len, 0, (struct sockaddr *)&conn->cli_addr, sizeof(conn->cli_addr.in));
-                        logger.trace("Data sent to client");
-                    }
-                    else
-                    {
-                        rlsConnection(conn);
-                        logger.warn("Connection released due to read error");
-                    }
-                }
-            }
+    for (int i = get16(6); i > 0; --i)
+    {
+        pos = skipName(pos);
+        if (pos + NS_RRFIXEDSZ > len)
+            break;
+        int rrType = get16(pos);
+        uint32_t rrTtl = (static_cast<uint32_t>(get16(pos + 4)) << 16) | static_cast<uint32_t>(get16(pos + 6));
+        int rdLength = get16(pos + 8);
+        pos += NS_RRFIXEDSZ;
+        if (pos + rdLength > len)
+            break;
+
+        sockaddr_inx addr;
+        memset(&addr, 0, sizeof(addr));
+        if (rrType == type && type == ns_t_a && rdLength == 4)
+        {
+            addr.in.sin_family = AF_INET;
+            memcpy(&addr.in.sin_addr, answer + pos, 4);
+            addrs.push_back(addr);
+            ttl = std::min(ttl, rrTtl);
+        }
+        else if (rrType == type && type == ns_t_aaaa && rdLength == 16)
+        {
+            addr.in6.sin6_family = AF_INET6;
+            memcpy(&addr.in6.sin6_addr, answer + pos, 16);
+            addrs.push_back(addr);
+            ttl = std::min(ttl, rrTtl);
         }
+        pos += rdLength;
     }
 }
 
-void UDPProxy::recycleConnections()
+void DnsResolver::lookupHosts(const std::string &host, std::vector<sockaddr_inx> &addrs)
 {
-    time_t now = time(nullptr);
-    std::lock_guard<std::mutex> lock(connMutex);
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    addrinfo *result = nullptr;
+    if (getaddrinfo(host.c_str(), nullptr, &hints, &result) != 0)
+        return;
+
+    for (addrinfo *info = result; info; info = info->ai_next)
+    {
+        if (info->ai_family != AF_INET && info->ai_family != AF_INET6)
+            continue;
+        sockaddr_inx addr;
+        memset(&addr, 0, sizeof(addr));
+        memcpy(&addr, info->ai_addr, std::min<size_t>(info->ai_addrlen, sizeof(addr)));
+        addrs.push_back(addr);
+    }
+    freeaddrinfo(result);
+}
 
-    for (int i = 0; i < connTblHashSize; ++i)
+// load shedding shared by the proxy loops. a loop whose smoothed lag crosses
+// high_lag_ms refuses new flows until it drops below low_lag_ms, and while any
+// loop sheds the log level is raised
+class LoadShedder
+{
+public:
+    LoadShedder(const YAML::Node &config, Logger &logger) : logger(logger)
+    {
+        if (!config)
+            return;
+        if (config["shedding"])
+            enabled = config["shedding"].as<bool>();
+        if (config["high_lag_ms"])
+            highLagMs = config["high_lag_ms"].as<double>();
+        if (config["low_lag_ms"])
+            lowLagMs = config["low_lag_ms"].as<double>();
+        if (config["refuse_new_flows"])
+            refuseNewFlows = config["refuse_new_flows"].as<bool>();
+        if (config["log_level"])
+            shedLogLevel = config["log_level"].as<std::string>();
+    }
+
+    bool refusesNewFlows() const { return refuseNewFlows; }
+
+    // returns whether the loop sheds after this sample
+    bool update(bool shedding, double lagAvgMs, const std::string &loop)
     {
-        auto &bucket = connTable[i];
-        for (auto it = bucket.begin(); it != bucket.end();)
+        if (!enabled)
+            return false;
+
+        if (!shedding && lagAvgMs > highLagMs)
         {
-            if (now - it->last_active > timeout)
+            logger.warn("Loop " + loop + " lag " + std::to_string(lagAvgMs) + "ms above " + std::to_string(highLagMs) + "ms, shedding load");
+            std::lock_guard<std::mutex> lock(mutex);
+            if (sheddingLoops++ == 0 && !shedLogLevel.empty())
             {
-                logger.info("Recycling idle connection for client.");
-                rlsConnection(&(*it));
-                it = bucket.erase(it);
+                // shedding only ever quiets the log, a stricter configured level stays
+                normalLogLevel = logger.level();
+                logger.set_level(Logger::stricter(normalLogLevel, Logger::parse_level(shedLogLevel)));
             }
-            else
+            return true;
+        }
+        if (shedding && lagAvgMs < lowLagMs)
+        {
             {
-                ++it;
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--sheddingLoops == 0 && !shedLogLevel.empty())
+                    logger.set_level(normalLogLevel);
             }
+            logger.warn("Loop " + loop + " lag " + std::to_string(lagAvgMs) + "ms below " + std::to_string(lowLagMs) + "ms, load shedding stopped");
+            return false;
         }
+        return shedding;
     }
-}
 
-int UDPProxy::hashAddress(sockaddr_inx *addr)
+private:
+    Logger &logger;
+    bool enabled = false;
+    double highLagMs = 50;
+    double lowLagMs = 10;
+    bool refuseNewFlows = true;
+    std::string shedLogLevel = "WARN";
+    Logger::LogLevel normalLogLevel = Logger::LogLevel::ALL;
+    int sheddingLoops = 0;
+    std::mutex mutex;
+};
+
+// ciphers of encrypted datagrams; each datagram names its own, so paired forwarders
+// may prefer different ones
+static const EVP_CIPHER *sealCipher(uint8_t id)
 {
-    return ntohl(addr->in.sin_addr.s_addr) % connTblHashSize;
+    if (id == 1)
+        return EVP_aes_256_gcm();
+    if (id == 2)
+        return EVP_chacha20_poly1305();
+    return nullptr;
 }
 
-bool UDPProxy::compareAddresses(sockaddr_inx *a, sockaddr_inx *b)
+// AES-GCM where the CPU has AES and carry-less multiply instructions, ChaCha20-Poly1305
+// elsewhere. libcrypto then picks its AVX-512/AVX2/NEON code for either at run time.
+static uint8_t parseSealCipher(const std::string &name)
 {
-    if (a->sa.sa_family != b->sa.sa_family)
-        return false;
-
-    if (a->sa.sa_family == AF_INET)
-        return (a->in.sin_addr.s_addr == b->in.sin_addr.s_addr &&
-                a->in.sin_port == b->in.sin_port);
-
-    if (a->sa.sa_family == AF_INET6)
-        return (memcmp(&a->in6.sin6_addr, &b->in6.sin6_addr, sizeof(a->in6.sin6_addr)) == 0 &&
-                a->in6.sin6_port == b->in6.sin6_port);
+    if (name == "aes-256-gcm")
+        return 1;
+    if (name == "chacha20-poly1305")
+        return 2;
+    if (name != "auto")
+        throw std::runtime_error("Unknown cipher: " + name);
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul"))
+        return 1;
+#elif defined(__aarch64__)
+    if ((getauxval(AT_HWCAP) & HWCAP_AES) && (getauxval(AT_HWCAP) & HWCAP_PMULL))
+        return 1;
+#endif
+    return 2;
+}
 
-    return false;
+static const char *sealCipherName(uint8_t id)
+{
+    return id == 1 ? "aes-256-gcm" : "chacha20-poly1305";
 }
 
-ProxyConn *UDPProxy::tOrCreateConnection(sockaddr_inx &cliAddr)
+// authenticated encryption of datagrams between paired udp_forwarders, laid out as
+// [cipher id][salt][counter][ciphertext][tag]. every proxy seals under its own key,
+// derived from the shared key and a random salt it picks at start, so the counters
+// of different proxies and of restarts never meet under one key. the opening side
+// keeps the keys of the senders it heard from, each with a window against replays.
+// works in place: the payload needs headroom bytes free before it and tagSize after.
+class DatagramCipher
 {
-    int bucket = hashAddress(&cliAddr);
-    auto &list = connTable[bucket];
+public:
+    static const int saltSize = 16;
+    static const int headroom = 1 + saltSize + 8;
+    static const int tagSize = 16;
+    static const int overhead = headroom + tagSize;
 
-    logger.debug("Checking connection table for client address...");
-    for (auto &conn : list)
+    DatagramCipher(const unsigned char *key, uint8_t cipherId)
+        : cipherId(cipherId)
     {
-        if (compareAddresses(&conn.cli_addr, &cliAddr))
-        {
-            conn.last_active = time(nullptr);
-            logger.debug("Reused existing connection for client.");
-            return &conn;
-        }
+        memcpy(sharedKey, key, sizeof(sharedKey));
+        RAND_bytes(salt, sizeof(salt));
+        sealCtx = EVP_CIPHER_CTX_new();
+        unsigned char subkey[32];
+        if (!deriveKey(salt, subkey) || EVP_EncryptInit_ex(sealCtx, sealCipher(cipherId), nullptr, subkey, nullptr) != 1)
+            throw std::runtime_error("Setting up datagram encryption failed");
+        OPENSSL_cleanse(subkey, sizeof(subkey));
     }
 
-    logger.debug("No existing connection found. Creating a new one.");
+    ~DatagramCipher()
+    {
+        OPENSSL_cleanse(sharedKey, sizeof(sharedKey));
+        EVP_CIPHER_CTX_free(sealCtx);
+    }
 
-    int svrSock = (dstAddr.sa.sa_family == AF_INET6) ? socket(AF_INET6, SOCK_DGRAM, 0) : socket(AF_INET, SOCK_DGRAM, 0);
-    if (svrSock < 0)
+    DatagramCipher(const DatagramCipher &) = delete;
+    DatagramCipher &operator=(const DatagramCipher &) = delete;
+
+    uint8_t id() const { return cipherId; }
+
+    // returns the start of the sealed datagram; len grows by overhead
+    char *seal(char *data, int &len)
     {
-        logger.error("Creating server socket failed: " + std::string(strerror(errno)));
-        return nullptr;
+        unsigned char *start = reinterpret_cast<unsigned char *>(data) - headroom;
+        unsigned char *payload = reinterpret_cast<unsigned char *>(data);
+        start[0] = cipherId;
+        memcpy(start + 1, salt, sizeof(salt));
+        putCounter(start + 1 + saltSize, counter++);
+
+        unsigned char nonce[12];
+        makeNonce(start + 1 + saltSize, nonce);
+        int outLen = 0;
+        if (EVP_EncryptInit_ex(sealCtx, nullptr, nullptr, nullptr, nonce) != 1 ||
+            EVP_EncryptUpdate(sealCtx, nullptr, &outLen, start, headroom) != 1 ||
+            EVP_EncryptUpdate(sealCtx, payload, &outLen, payload, len) != 1 ||
+            EVP_EncryptFinal_ex(sealCtx, payload + len, &outLen) != 1 ||
+            EVP_CIPHER_CTX_ctrl(sealCtx, EVP_CTRL_AEAD_GET_TAG, tagSize, payload + len) != 1)
+            return nullptr;
+        len += overhead;
+        return reinterpret_cast<char *>(start);
     }
 
-    if (connect(svrSock, (struct sockaddr *)&dstAddr,
-                (dstAddr.sa.sa_family == AF_INET6) ? sizeof(dstAddr.in6) : sizeof(dstAddr.in)) < 0)
+    // returns the plaintext, or nullptr when the datagram fails to authenticate or
+    // was seen before
+    char *open(char *data, int &len)
     {
-        logger.error("Connecting to server socket failed: " + std::string(strerror(errno)));
-        close(svrSock);
-        return nullptr;
+        unsigned char *start = reinterpret_cast<unsigned char *>(data);
+        if (len < overhead || (start[0] != 1 && start[0] != 2))
+            return nullptr;
+        // our own datagrams reflected back would open under our own key
+        if (memcmp(start + 1, salt, saltSize) == 0)
+            return nullptr;
+        unsigned char *payload = start + headroom;
+        int payloadLen = len - overhead;
+        uint64_t number = getCounter(start + 1 + saltSize);
+
+        // a sender is only remembered once one of its datagrams authenticated, so
+        // forged salts cost a key derivation but never displace a real sender
+        std::unique_ptr<Sender> fresh;
+        Sender *sender = findSender(start + 1, start[0]);
+        if (!sender)
+        {
+            fresh = newSender(start + 1, start[0]);
+            if (!fresh)
+                return nullptr;
+            sender = fresh.get();
+        }
+        if (!sender->window.fresh(number))
+            return nullptr;
+
+        unsigned char nonce[12];
+        makeNonce(start + 1 + saltSize, nonce);
+        int outLen = 0;
+        if (EVP_DecryptInit_ex(sender->ctx, nullptr, nullptr, nullptr, nonce) != 1 ||
+            EVP_DecryptUpdate(sender->ctx, nullptr, &outLen, start, headroom) != 1 ||
+            EVP_DecryptUpdate(sender->ctx, payload, &outLen, payload, payloadLen) != 1 ||
+            EVP_CIPHER_CTX_ctrl(sender->ctx, EVP_CTRL_AEAD_SET_TAG, tagSize, payload + payloadLen) != 1 ||
+            EVP_DecryptFinal_ex(sender->ctx, payload + payloadLen, &outLen) != 1)
+            return nullptr;
+
+        sender->window.accept(number);
+        if (fresh)
+            remember(std::move(fresh));
+        sender->lastUse = ++uses;
+        len = payloadLen;
+        return reinterpret_cast<char *>(payload);
     }
 
-    setNonBlocking(svrSock);
+private:
+    // the last windowSize counters of one sender, as a ring of bits
+    struct ReplayWindow
+    {
+        static const uint64_t windowSize = 1024;
 
-    list.push_back({cliAddr, svrSock, time(nullptr)});
-    connMap[svrSock] = &list.back();
+        uint64_t highest = 0;
+        bool any = false;
+        uint64_t bits[windowSize / 64] = {};
 
-    struct epoll_event ev;
-    ev.events = EPOLLIN;
-    ev.data.fd = svrSock;
-    epoll_ctl(epollFd, EPOLL_CTL_ADD, svrSock, &ev);
+        bool fresh(uint64_t number) const
+        {
+            if (!any || number > highest)
+                return true;
+            if (highest - number >= windowSize)
+                return false;
+            return !(bits[(number % windowSize) / 64] & (uint64_t(1) << (number % 64)));
+        }
 
-    return &list.back();
+        void accept(uint64_t number)
+        {
+            if (!any || number > highest)
+            {
+                // clear the slots the window moves past
+                uint64_t from = any ? highest + 1 : number;
+                if (number - from >= windowSize)
+                    memset(bits, 0, sizeof(bits));
+                else
+                    for (uint64_t n = from; n < number; ++n)
+                        bits[(n % windowSize) / 64] &= ~(uint64_t(1) << (n % 64));
+                highest = number;
+                any = true;
+            }
+            bits[(number % windowSize) / 64] |= uint64_t(1) << (number % 64);
+        }
+    };
+
+    struct Sender
+    {
+        ~Sender() { EVP_CIPHER_CTX_free(ctx); }
+
+        unsigned char salt[saltSize];
+        uint8_t cipherId = 0;
+        EVP_CIPHER_CTX *ctx = nullptr;
+        ReplayWindow window;
+        uint64_t lastUse = 0;
+    };
+
+    static const size_t maxSenders = 64;
+
+    Sender *findSender(const unsigned char *saltIn, uint8_t id)
+    {
+        for (auto &sender : senders)
+        {
+            if (sender->cipherId == id && memcmp(sender->salt, saltIn, saltSize) == 0)
+                return sender.get();
+        }
+        return nullptr;
+    }
+
+    std::unique_ptr<Sender> newSender(const unsigned char *saltIn, uint8_t id)
+    {
+        auto sender = std::make_unique<Sender>();
+        memcpy(sender->salt, saltIn, saltSize);
+        sender->cipherId = id;
+        sender->ctx = EVP_CIPHER_CTX_new();
+        unsigned char subkey[32];
+        bool ready = sender->ctx && deriveKey(saltIn, subkey) &&
+                     EVP_DecryptInit_ex(sender->ctx, sealCipher(id), nullptr, subkey, nullptr) == 1;
+        OPENSSL_cleanse(subkey, sizeof(subkey));
+        return ready ? std::move(sender) : nullptr;
+    }
+
+    // past maxSenders the one heard from least recently is forgotten
+    void remember(std::unique_ptr<Sender> sender)
+    {
+        if (senders.size() >= maxSenders)
+        {
+            auto oldest = std::min_element(senders.begin(), senders.end(), [](const std::unique_ptr<Sender> &a, const std::unique_ptr<Sender> &b)
+                                           { return a->lastUse < b->lastUse; });
+            *oldest = std::move(sender);
+            return;
+        }
+        senders.push_back(std::move(sender));
+    }
+
+    bool deriveKey(const unsigned char *saltIn, unsigned char *subkey) const
+    {
+        static const unsigned char info[] = "udp_forwarder datagram";
+        size_t keyLen = 32;
+        EVP_PKEY_CTX *kdf = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr);
+        bool derived = kdf && EVP_PKEY_derive_init(kdf) > 0 && EVP_PKEY_CTX_set_hkdf_md(kdf, EVP_sha256()) > 0 &&
+                       EVP_PKEY_CTX_set1_hkdf_salt(kdf, saltIn, saltSize) > 0 && EVP_PKEY_CTX_set1_hkdf_key(kdf, sharedKey, sizeof(sharedKey)) > 0 &&
+                       EVP_PKEY_CTX_add1_hkdf_info(kdf, info, sizeof(info) - 1) > 0 && EVP_PKEY_derive(kdf, subkey, &keyLen) > 0;
+        EVP_PKEY_CTX_free(kdf);
+        return derived;
+    }
+
+    static void putCounter(unsigned char *out, uint64_t value)
+    {
+        for (int i = 0; i < 8; ++i)
+            out[i] = static_cast<unsigned char>(value >> (8 * i));
+    }
+
+    static uint64_t getCounter(const unsigned char *in)
+    {
+        uint64_t value = 0;
+        for (int i = 0; i < 8; ++i)
+            value |= uint64_t(in[i]) << (8 * i);
+        return value;
+    }
+
+    // the counter, zero-padded to the 96-bit nonce; unique under each sender's key
+    static void makeNonce(const unsigned char *number, unsigned char *nonce)
+    {
+        memcpy(nonce, number, 8);
+        memset(nonce + 8, 0, 4);
+    }
+
+    uint8_t cipherId;
+    unsigned char sharedKey[32];
+    unsigned char salt[saltSize];
+    uint64_t counter = 0;
+    EVP_CIPHER_CTX *sealCtx;
+    std::vector<std::unique_ptr<Sender>> senders;
+    uint64_t uses = 0;
+};
+
+// GF(2^8) with the 0x11d polynomial, the field of the Reed-Solomon code below
+struct GaloisField
+{
+    uint8_t exp[512];
+    uint8_t log[256];
+    uint8_t mul[256][256];
+
+    GaloisField()
+    {
+        int x = 1;
+        for (int i = 0; i < 255; ++i)
+        {
+            exp[i] = exp[i + 255] = static_cast<uint8_t>(x);
+            log[x] = static_cast<uint8_t>(i);
+            x <<= 1;
+            if (x & 0x100)
+                x ^= 0x11d;
+        }
+        exp[510] = exp[511] = exp[0];
+        log[0] = 0;
+        for (int a = 0; a < 256; ++a)
+            for (int b = 0; b < 256; ++b)
+                mul[a][b] = (a && b) ? exp[log[a] + log[b]] : 0;
+    }
+
+    uint8_t inv(uint8_t a) const { return exp[255 - log[a]]; }
+};
+
+static const GaloisField galoisField;
+
+// dst ^= c * src over a whole region. the vector versions look the products of c
+// with both nibbles of 16 or 32 bytes up at once through a byte shuffle
+typedef void (*GfMulAddFn)(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len);
+
+static void gfMulAddScalar(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+    const uint8_t *row = galoisField.mul[c];
+    for (size_t i = 0; i < len; ++i)
+        dst[i] ^= row[src[i]];
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2"))) static void gfMulAddAvx2(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+    const uint8_t *row = galoisField.mul[c];
+    alignas(16) uint8_t lo[16], hi[16];
+    for (int x = 0; x < 16; ++x)
+    {
+        lo[x] = row[x];
+        hi[x] = row[x << 4];
+    }
+    const __m256i loTable = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i *>(lo)));
+    const __m256i hiTable = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i *>(hi)));
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i in = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+        __m256i product = _mm256_xor_si256(_mm256_shuffle_epi8(loTable, _mm256_and_si256(in, mask)),
+                                           _mm256_shuffle_epi8(hiTable, _mm256_and_si256(_mm256_srli_epi64(in, 4), mask)));
+        __m256i *out = reinterpret_cast<__m256i *>(dst + i);
+        _mm256_storeu_si256(out, _mm256_xor_si256(_mm256_loadu_si256(out), product));
+    }
+    gfMulAddScalar(dst + i, src + i, c, len - i);
+}
+
+__attribute__((target("ssse3"))) static void gfMulAddSsse3(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+    const uint8_t *row = galoisField.mul[c];
+    alignas(16) uint8_t lo[16], hi[16];
+    for (int x = 0; x < 16; ++x)
+    {
+        lo[x] = row[x];
+        hi[x] = row[x << 4];
+    }
+    const __m128i loTable = _mm_load_si128(reinterpret_cast<const __m128i *>(lo));
+    const __m128i hiTable = _mm_load_si128(reinterpret_cast<const __m128i *>(hi));
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        __m128i product = _mm_xor_si128(_mm_shuffle_epi8(loTable, _mm_and_si128(in, mask)),
+                                        _mm_shuffle_epi8(hiTable, _mm_and_si128(_mm_srli_epi64(in, 4), mask)));
+        __m128i *out = reinterpret_cast<__m128i *>(dst + i);
+        _mm_storeu_si128(out, _mm_xor_si128(_mm_loadu_si128(out), product));
+    }
+    gfMulAddScalar(dst + i, src + i, c, len - i);
+}
+#elif defined(__aarch64__)
+static void gfMulAddNeon(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+    const uint8_t *row = galoisField.mul[c];
+    uint8_t lo[16], hi[16];
+    for (int x = 0; x < 16; ++x)
+    {
+        lo[x] = row[x];
+        hi[x] = row[x << 4];
+    }
+    const uint8x16_t loTable = vld1q_u8(lo);
+    const uint8x16_t hiTable = vld1q_u8(hi);
+    const uint8x16_t mask = vdupq_n_u8(0x0f);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        uint8x16_t in = vld1q_u8(src + i);
+        uint8x16_t product = veorq_u8(vqtbl1q_u8(loTable, vandq_u8(in, mask)), vqtbl1q_u8(hiTable, vshrq_n_u8(in, 4)));
+        vst1q_u8(dst + i, veorq_u8(vld1q_u8(dst + i), product));
+    }
+    gfMulAddScalar(dst + i, src + i, c, len - i);
+}
+#endif
+
+static GfMulAddFn pickGfMulAdd()
+{
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2"))
+        return gfMulAddAvx2;
+    if (__builtin_cpu_supports("ssse3"))
+        return gfMulAddSsse3;
+#elif defined(__aarch64__)
+    return gfMulAddNeon;
+#endif
+    return gfMulAddScalar;
+}
+
+static const GfMulAddFn gfMulAdd = pickGfMulAdd();
+
+static const char *gfKernelName()
+{
+#if defined(__x86_64__)
+    if (gfMulAdd == gfMulAddAvx2)
+        return "avx2";
+    if (gfMulAdd == gfMulAddSsse3)
+        return "ssse3";
+#elif defined(__aarch64__)
+    return "neon";
+#endif
+    return "scalar";
+}
+
+// forward error correction between paired udp_forwarders: a systematic Reed-Solomon
+// code over GF(2^8). datagrams go out at once behind a header of [type][group][index]
+// [k][m]; after every `data` datagrams of a flow (or fewer once flushMs passed) come
+// `parity` datagrams, so any `parity` losses in a group can be rebuilt. a symbol is
+// the datagram's 2-byte length and payload, zero padded to the longest in the group.
+struct FecOptions
+{
+    bool enabled = false;
+    bool encodeUpstream = true; // client side: dstAddrPorts is the paired forwarder
+    int data = 8;
+    int parity = 2;
+    int flushMs = 20;        // longest a partial group waits for its parity
+    int window = 32;         // groups per flow kept for reassembly
+
+    static const int headerSize = 6;
+    static const int maxData = 128;
+    static const int maxParity = 128;
+
+    // Cauchy matrix, so every square submatrix of [identity; parity rows] can be inverted
+    static uint8_t coefficient(int parityIndex, int dataIndex)
+    {
+        return galoisField.inv(static_cast<uint8_t>(parityIndex ^ (maxData + dataIndex)));
+    }
+};
+
+// FEC state of one flow: the group it is sending and the groups it is receiving
+struct FecFlow
+{
+    enum : uint8_t
+    {
+        dataType = 1,
+        parityType = 2
+    };
+
+    struct Group
+    {
+        bool used = false;
+        bool done = false;
+        uint16_t id = 0;
+        int k = 0; // data datagrams in the group, known once parity arrives
+        int dataReceived = 0;
+        int parityReceived = 0;
+        size_t symbolLen = 0;
+        std::vector<std::vector<uint8_t>> symbols; // data symbols, then parity symbols
+        std::vector<bool> present;
+    };
+
+    uint16_t group = 0;
+    int count = 0;
+    size_t symbolLen = 0;
+    std::vector<std::vector<uint8_t>> parity;
+    std::chrono::steady_clock::time_point openedAt;
+    std::vector<Group> groups;
+};
+
+// copies of each flow's plaintext datagrams sent to a shadow target. the copy socket's
+// send buffer is the bounded queue: a datagram that does not fit is dropped and
+// counted, and whatever the shadow answers is never read
+struct MirrorOptions
+{
+    bool enabled = false;
+    std::string target;       // host:port
+    bool both = false;        // downstream datagrams too, on a second socket per flow
+    int queueBytes = 1048576; // send buffer of each copy socket
+};
+
+// local address upstream flow sockets bind to before connect(); the kernel then
+// picks the port per 4-tuple, so every source adds its own ephemeral port space
+struct UpstreamSource
+{
+    sockaddr_inx addr;
+    std::string name;
+    std::atomic<int> active{0};
+    std::atomic<uint64_t> flows{0};
+    std::atomic<uint64_t> failures{0};
+};
+
+struct ProxyConn
+{
+    sockaddr_inx cli_addr;
+    int svr_sock;
+    time_t last_active;
+    UpstreamSource *source;
+    int tunnel_sock = -1; // tunnel the flow arrived on (tcp-listen side)
+    uint32_t flow_id = 0; // id of the flow inside its tunnel, 0 when not tunneled
+    std::unique_ptr<FecFlow> fec{};
+    int mirror_socks[2] = {-1, -1}; // copies of upstream and downstream datagrams, -2 after a failed open
+    std::list<ProxyConn *>::iterator lru{}; // place in the proxy's recency order
+};
+
+// how a proxy reaches its destination: plain UDP, a TCP tunnel to a peer
+// udp_forwarder ("tcp"), or the peer end accepting such tunnels ("tcp-listen")
+enum class Transport
+{
+    udp,
+    tunnelClient,
+    tunnelServer
+};
+
+struct TunnelOptions
+{
+    int flushMs = 1;                 // longest a queued datagram waits for more to batch with
+    size_t batchBytes = 65536;       // queued bytes that are written out at once
+    size_t maxPending = 4194304;     // unsent bytes per tunnel before datagrams are dropped
+};
+
+// bounds on each proxy's flow table, against floods of new (possibly spoofed) sources
+struct FlowLimits
+{
+    size_t maxFlows = 65536;         // at the cap the least recently active flow is evicted, 0 = no cap
+    double newFlowsPerSecond = 0;    // per client source prefix, 0 = unlimited
+    double burst = 0;                // new flows a prefix may open at once
+    int prefixV4 = 24;
+    int prefixV6 = 64;
+    static constexpr size_t maxPrefixes = 65536; // tracked prefixes per family; unseen ones are refused beyond it
+};
+
+// one TCP connection carrying the datagrams of many flows, each framed as a
+// 4-byte flow id and a 2-byte length (big-endian) followed by the payload. flow id 0
+// is never given out; its frames carry the 4-byte id of a flow the sender released.
+struct TunnelConn
+{
+    static const size_t headerSize = 6;
+
+    int sock = -1;
+    bool connecting = false;
+    bool writeArmed = false;
+    sockaddr_inx peerAddr{};
+    std::string peer;
+    std::vector<char> inBuf = std::vector<char>(262144);
+    size_t inLen = 0;
+    std::vector<char> outBuf;
+    size_t outOff = 0;
+    size_t outLen = 0;
+    bool queued = false; // bytes queued since the last write attempt
+    std::chrono::steady_clock::time_point queuedSince;
+};
+
+// listening sockets passed in by systemd socket activation (LISTEN_FDS from fd 3 on,
+// for the process in LISTEN_PID). a proxy bound to the same address and port takes one
+// over instead of binding, and keeps the datagrams the kernel queued on it meanwhile.
+class InheritedSockets
+{
+public:
+    explicit InheritedSockets(Logger &logger) : logger(logger)
+    {
+        const char *pid = getenv("LISTEN_PID");
+        const char *fds = getenv("LISTEN_FDS");
+        if (!pid || !fds)
+            return;
+        // not passed on to children, and ignored when they were meant for another process
+        bool ours = strtol(pid, nullptr, 10) == getpid();
+        unsetenv("LISTEN_PID");
+        unsetenv("LISTEN_FDS");
+        unsetenv("LISTEN_FDNAMES");
+        if (!ours)
+            return;
+
+        int count = atoi(fds);
+        for (int fd = firstFd; fd < firstFd + count; ++fd)
+        {
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            Entry entry{};
+            entry.fd = fd;
+            socklen_t len = sizeof(entry.addr);
+            socklen_t optLen = sizeof(entry.type);
+            if (getsockname(fd, &entry.addr.sa, &len) < 0 ||
+                (entry.addr.sa.sa_family != AF_INET && entry.addr.sa.sa_family != AF_INET6) ||
+                getsockopt(fd, SOL_SOCKET, SO_TYPE, &entry.type, &optLen) < 0)
+            {
+                logger.warn("Inherited fd " + std::to_string(fd) + " is not an IP socket, closing it");
+                close(fd);
+                continue;
+            }
+            sockets.push_back(entry);
+        }
+        logger.info("Inherited " + std::to_string(sockets.size()) + " sockets");
+    }
+
+    // the inherited socket of this type bound to addr, or -1. each is handed out once
+    int claim(const sockaddr_inx &addr, int type)
+    {
+        for (auto it = sockets.begin(); it != sockets.end(); ++it)
+        {
+            if (it->type == type && sameAddress(it->addr, addr))
+            {
+                int fd = it->fd;
+                sockets.erase(it);
+                return fd;
+            }
+        }
+        return -1;
+    }
+
+    // sockets no proxy matched would queue datagrams no one reads
+    void closeUnclaimed()
+    {
+        for (const auto &entry : sockets)
+        {
+            logger.warn("Inherited fd " + std::to_string(entry.fd) + " matches no srcAddrPorts entry, closing it");
+            close(entry.fd);
+        }
+        sockets.clear();
+    }
+
+private:
+    struct Entry
+    {
+        sockaddr_inx addr;
+        int type;
+        int fd;
+    };
+
+    static bool sameAddress(const sockaddr_inx &a, const sockaddr_inx &b)
+    {
+        if (a.sa.sa_family != b.sa.sa_family)
+            return false;
+        if (a.sa.sa_family == AF_INET)
+            return a.in.sin_port == b.in.sin_port && a.in.sin_addr.s_addr == b.in.sin_addr.s_addr;
+        return a.in6.sin6_port == b.in6.sin6_port && memcmp(&a.in6.sin6_addr, &b.in6.sin6_addr, sizeof(a.in6.sin6_addr)) == 0;
+    }
+
+    static constexpr int firstFd = 3; // SD_LISTEN_FDS_START
+    Logger &logger;
+    std::vector<Entry> sockets;
+};
+
+// named counters and gauges, as GET /stream sends them
+using CounterSnapshot = std::vector<std::pair<std::string, int64_t>>;
+
+class UDPProxy
+{
+public:
+    UDPProxy(const std::string &srcAddrPort, const std::string &dstAddrPort, int timeout, int buffer_size,
+             const std::vector<std::string> &sourceAddrs, Transport transport, const TunnelOptions &tunnelOptions,
+             const FlowLimits &flowLimits, std::unique_ptr<DatagramCipher> cipher, bool sealUpstream, const FecOptions &fecOptions,
+             const MirrorOptions &mirrorOptions, DnsResolver &resolver, LoadShedder &shedder, InheritedSockets &inherited, Logger &logger)
+        : timeout(timeout), buffer_size(std::min(buffer_size, 65535)), connTblHashSize(256), logger(logger), shedder(shedder),
+          srcAddrPort(srcAddrPort), dstAddrPort(dstAddrPort), flowLimits(flowLimits), transport(transport),
+          tunnelOptions(tunnelOptions), cipher(std::move(cipher)), sealUpstream(sealUpstream), fecOptions(fecOptions), mirrorOptions(mirrorOptions)
+    {
+        // a tunnel is sealed by the side that opened it toward its peer
+        if (this->cipher && (transport == Transport::tunnelClient ? !sealUpstream : transport == Transport::tunnelServer && sealUpstream))
+            throw std::runtime_error("Encryption side of " + srcAddrPort + " must be client for tcp and server for tcp-listen");
+        if (fecOptions.enabled && transport != Transport::udp)
+            throw std::runtime_error("Forward error correction of " + srcAddrPort + " needs the udp transport");
+        if (mirrorOptions.enabled && transport != Transport::udp)
+            throw std::runtime_error("Mirroring of " + srcAddrPort + " needs the udp transport");
+        readHeadroom = (this->cipher ? DatagramCipher::headroom : 0) + (fecOptions.enabled ? FecOptions::headerSize : 0);
+        readSize = this->buffer_size + (this->cipher ? DatagramCipher::overhead : 0) + (fecOptions.enabled ? FecOptions::headerSize + 2 : 0);
+        if (fecOptions.enabled)
+            fecOut.resize(readHeadroom + readSize + DatagramCipher::overhead);
+
+        pAddress(srcAddrPort, srcAddr);
+        std::string dstHost;
+        splitHostPort(dstAddrPort, dstHost, dstPort);
+        dstTarget = resolver.target(dstHost);
+        if (mirrorOptions.enabled)
+        {
+            std::string mirrorHost;
+            splitHostPort(mirrorOptions.target, mirrorHost, mirrorPort);
+            mirrorTarget = resolver.target(mirrorHost);
+        }
+        pSources(sourceAddrs);
+        setupSocket(inherited);
+        initiateConnectionTable();
+    }
+
+    ~UDPProxy()
+    {
+        if (srcSocket != -1)
+            close(srcSocket);
+        if (tunnel.sock != -1)
+            close(tunnel.sock);
+        for (auto &entry : tunnels)
+            close(entry.first);
+    }
+
+    void processConnections();
+    std::string statsJson() const;
+    void appendCounters(CounterSnapshot &counters) const;
+
+    // shutdown: a draining proxy keeps serving its flows but opens no new ones, and a
+    // stopped one returns from processConnections within one epoll wait
+    void startDrain() { draining = true; }
+    void stop() { stopping = true; }
+    int flowCount() const { return activeFlows; }
+    time_t quietSeconds();
+
+private:
+    int timeout;
+    int buffer_size;
+    sockaddr_inx srcAddr;
+    std::shared_ptr<ResolvedTarget> dstTarget;
+    int dstPort = 0;
+    int srcSocket = -1;
+    int epollFd = -1;
+    int connTblHashSize;
+    Logger &logger;
+    LoadShedder &shedder;
+
+    std::string srcAddrPort;
+    std::string dstAddrPort;
+    std::vector<std::unique_ptr<UpstreamSource>> sources;
+    size_t nextSource = 0;
+    std::atomic<int> activeFlows{0};
+
+    // traffic read from clients (in) and from targets (out). only the proxy's own
+    // thread writes them, so counting is a plain load and store, and the control
+    // thread reads them without a lock
+    std::atomic<uint64_t> datagramsIn{0};
+    std::atomic<uint64_t> bytesIn{0};
+    std::atomic<uint64_t> datagramsOut{0};
+    std::atomic<uint64_t> bytesOut{0};
+    void countIn(size_t len)
+    {
+        datagramsIn.store(datagramsIn.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        bytesIn.store(bytesIn.load(std::memory_order_relaxed) + len, std::memory_order_relaxed);
+    }
+    void countOut(size_t len)
+    {
+        datagramsOut.store(datagramsOut.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        bytesOut.store(bytesOut.load(std::memory_order_relaxed) + len, std::memory_order_relaxed);
+    }
+
+    // lag of this proxy's epoll loop: time spent handling one batch of events, or
+    // how far epoll_wait overslept its timeout when nothing was ready
+    std::atomic<double> lagMs{0};
+    std::atomic<double> lagAvgMs{0};
+    std::atomic<double> lagMaxMs{0};
+    std::atomic<bool> shedding{false};
+    std::atomic<uint64_t> refusedFlows{0};
+
+    std::list<ProxyConn> connTable[256];
+    std::unordered_map<int, ProxyConn *> connMap;
+    std::unordered_map<uint64_t, ProxyConn *> flowMap; // tunneled flows by flowKey()
+    std::mutex connMutex;
+
+    // every flow, least recently active first: expiry and eviction take from the front
+    std::list<ProxyConn *> lruFlows;
+    FlowLimits flowLimits;
+    struct PrefixBucket
+    {
+        double tokens;
+        std::chrono::steady_clock::time_point refilled;
+    };
+    std::unordered_map<uint64_t, PrefixBucket> prefixBuckets[2]; // new-flow allowance by IPv4 and IPv6 prefix
+    std::chrono::steady_clock::time_point prefixSweepAt;
+    std::atomic<uint64_t> evictedFlows{0};
+    std::atomic<uint64_t> rateLimited{0};
+    std::atomic<bool> draining{false};
+    std::atomic<bool> stopping{false};
+    std::atomic<uint64_t> drainRefused{0};
+
+    Transport transport;
+    TunnelOptions tunnelOptions;
+    TunnelConn tunnel;                                           // tcp: the link to the peer
+    std::unordered_map<int, std::unique_ptr<TunnelConn>> tunnels; // tcp-listen: links from peers
+    std::chrono::steady_clock::time_point tunnelRetryAt;
+    uint32_t nextFlowId = 1;
+    std::vector<char> tunnelScratch;
+    std::atomic<int> tunnelsUp{0};
+    std::atomic<uint64_t> framesOut{0};
+    std::atomic<uint64_t> framesIn{0};
+    std::atomic<uint64_t> tunnelWrites{0};
+    std::atomic<uint64_t> tunnelReads{0};
+    std::atomic<uint64_t> tunnelDrops{0};
+
+    // encryption toward the paired forwarder: at dstAddrPorts when sealUpstream (client
+    // side), behind the srcAddrPorts clients otherwise (server side)
+    std::unique_ptr<DatagramCipher> cipher;
+    bool sealUpstream;
+    int readHeadroom = 0;
+    int readSize = 0;
+    std::atomic<uint64_t> authFailures{0};
+
+    // forward error correction toward the paired forwarder, encoded on the same side
+    // encryption would seal
+    FecOptions fecOptions;
+    std::unordered_set<ProxyConn *> fecOpen; // flows with a partial group waiting for its parity
+    std::vector<char> fecScratch;
+    std::vector<char> fecOut;
+    std::vector<uint8_t> fecSymbol;
+    std::atomic<uint64_t> fecGroups{0};
+    std::atomic<uint64_t> fecParitySent{0};
+    std::atomic<uint64_t> fecRecovered{0};
+    std::atomic<uint64_t> fecLostGroups{0};
+    std::atomic<uint64_t> fecDuplicates{0};
+    std::atomic<uint64_t> fecMalformed{0};
+
+    MirrorOptions mirrorOptions;
+    std::shared_ptr<ResolvedTarget> mirrorTarget;
+    int mirrorPort = 0;
+    std::atomic<uint64_t> mirrorSockets{0};
+    std::atomic<uint64_t> mirrorDatagrams{0};
+    std::atomic<uint64_t> mirrorBytes{0};
+    std::atomic<uint64_t> mirrorDrops{0};
+    std::atomic<uint64_t> mirrorFailures{0};
+
+    static void splitHostPort(const std::string &addrPort, std::string &host, int &port);
+    void pAddress(const std::string &addrPort, sockaddr_inx &sockAddr);
+    void pSources(const std::vector<std::string> &sourceAddrs);
+    UpstreamSource *pickSource(int family);
+    bool bindSource(int sockfd, UpstreamSource *source);
+    void setupSocket(InheritedSockets &inherited);
+    void initiateConnectionTable();
+    void recycleConnections();
+    void trackFlow(ProxyConn *conn);
+    void touchFlow(ProxyConn *conn);
+    void makeRoom();
+    bool admitNewFlow(const sockaddr_inx &addr);
+    void sweepPrefixes();
+    void sampleLag(double sampleMs);
+    int hashAddress(sockaddr_inx *addr);
+    ProxyConn *tOrCreateConnection(sockaddr_inx &cliAddr);
+    int connectUpstream(UpstreamSource *&source);
+    void rlsConnection(ProxyConn *conn);
+    static uint64_t flowKey(int tunnelSock, uint32_t flowId) { return (uint64_t(uint32_t(tunnelSock)) << 32) | flowId; }
+    void openTunnel();
+    void acceptTunnels();
+    void closeTunnel(TunnelConn &conn);
+    void armTunnel(TunnelConn &conn, bool writable);
+    void handleTunnelEvent(TunnelConn &conn, uint32_t events);
+    bool readTunnel(TunnelConn &conn);
+    size_t deliverDatagrams(TunnelConn &conn);
+    ProxyConn *tunnelFlow(TunnelConn &conn, uint32_t flowId);
+    char *reserveFrame(TunnelConn &conn, size_t payloadLen);
+    void commitFrame(TunnelConn &conn, uint32_t flowId, size_t payloadLen);
+    void sendFlowClose(uint32_t flowId);
+    bool writeTunnel(TunnelConn &conn);
+    int flushTunnels(int waitMs);
+    void readClientsToTunnel();
+    void readFlowToTunnel(ProxyConn *conn);
+    char *crypt(bool upstream, char *data, int &len);
+    void forwardDatagram(ProxyConn *conn, bool upstream, char *data, int len);
+    void relayDatagram(ProxyConn *conn, bool upstream, char *data, int len);
+    void transmit(ProxyConn *conn, bool upstream, const char *data, int len);
+    void fecSend(ProxyConn *conn, bool upstream, char *data, int len);
+    void fecCloseGroup(ProxyConn *conn);
+    void fecReceive(ProxyConn *conn, bool upstream, char *data, int len);
+    void fecRecover(ProxyConn *conn, bool upstream, FecFlow::Group &group);
+    int flushFec(int waitMs);
+    void mirrorDatagram(ProxyConn *conn, bool upstream, const char *data, int len);
+    int openMirror();
+    static void setNonBlocking(int sockfd);
+    static bool compareAddresses(sockaddr_inx *a, sockaddr_inx *b);
+};
+
+// "host:port" or "[v6]:port"; the port always follows the last colon
+void UDPProxy::splitHostPort(const std::string &addrPort, std::string &host, int &port)
+{
+    size_t colon = addrPort.find_last_of(':');
+    if (colon == std::string::npos)
+        throw std::runtime_error("Missing port in address: " + addrPort);
+
+    host = addrPort.substr(0, colon);
+    if (host.size() >= 2 && host.front() == '[' && host.back() == ']')
+        host = host.substr(1, host.size() - 2);
+    port = std::stoi(addrPort.substr(colon + 1));
+}
+
+void UDPProxy::pAddress(const std::string &addrPort, sockaddr_inx &sockAddr)
+{
+    std::string ip;
+    int port;
+    splitHostPort(addrPort, ip, port);
+
+    memset(&sockAddr, 0, sizeof(sockAddr));
+    if (ip.find(':') != std::string::npos)
+    { // IPv6 address
+        sockAddr.in6.sin6_family = AF_INET6;
+        if (inet_pton(AF_INET6, ip.c_str(), &sockAddr.in6.sin6_addr) != 1)
+            throw std::runtime_error("Invalid listen address: " + addrPort);
+        sockAddr.in6.sin6_port = htons(port);
+    }
+    else
+    { // IPv4 address
+        sockAddr.in.sin_family = AF_INET;
+        if (inet_pton(AF_INET, ip.c_str(), &sockAddr.in.sin_addr) != 1)
+            throw std::runtime_error("Invalid listen address: " + addrPort);
+        sockAddr.in.sin_port = htons(port);
+    }
+
+    logger.debug("Parsed address: " + ip + ":" + std::to_string(port));
+}
+
+void UDPProxy::pSources(const std::vector<std::string> &sourceAddrs)
+{
+    for (const auto &ip : sourceAddrs)
+    {
+        auto source = std::make_unique<UpstreamSource>();
+        memset(&source->addr, 0, sizeof(source->addr));
+        source->name = ip;
+
+        if (inet_pton(AF_INET6, ip.c_str(), &source->addr.in6.sin6_addr) == 1)
+        {
+            source->addr.in6.sin6_family = AF_INET6;
+        }
+        else if (inet_pton(AF_INET, ip.c_str(), &source->addr.in.sin_addr) == 1)
+        {
+            source->addr.in.sin_family = AF_INET;
+        }
+        else
+        {
+            logger.error("Invalid upstream source address: " + ip);
+            throw std::runtime_error("Invalid upstream source address");
+        }
+
+        sources.push_back(std::move(source));
+    }
+}
+
+// least busy source of the destination's family, rotating the starting point so ties spread evenly
+UpstreamSource *UDPProxy::pickSource(int family)
+{
+    UpstreamSource *best = nullptr;
+    for (size_t i = 0; i < sources.size(); ++i)
+    {
+        UpstreamSource *source = sources[(nextSource + i) % sources.size()].get();
+        if (source->addr.sa.sa_family != family)
+            continue;
+        if (!best || source->active < best->active)
+            best = source;
+    }
+    ++nextSource;
+    return best;
+}
+
+bool UDPProxy::bindSource(int sockfd, UpstreamSource *source)
+{
+    int one = 1;
+    setsockopt(sockfd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+
+    socklen_t len = (source->addr.sa.sa_family == AF_INET6) ? sizeof(source->addr.in6) : sizeof(source->addr.in);
+    if (bind(sockfd, &source->addr.sa, len) < 0)
+    {
+        ++source->failures;
+        logger.error("Binding upstream socket to " + source->name + " failed: " + std::string(strerror(errno)));
+        return false;
+    }
+    return true;
+}
+
+std::string UDPProxy::statsJson() const
+{
+    std::ostringstream out;
+    out << "{\"listen\":\"" << srcAddrPort << "\",\"destination\":\"" << dstAddrPort
+        << "\",\"active_flows\":" << activeFlows << ",\"max_flows\":" << flowLimits.maxFlows
+        << ",\"evicted_flows\":" << evictedFlows << ",\"rate_limited\":" << rateLimited
+        << ",\"datagrams_in\":" << datagramsIn << ",\"bytes_in\":" << bytesIn
+        << ",\"datagrams_out\":" << datagramsOut << ",\"bytes_out\":" << bytesOut
+        << std::fixed << std::setprecision(3)
+        << ",\"loop\":{\"lag_ms\":" << lagMs.load() << ",\"lag_avg_ms\":" << lagAvgMs.load()
+        << ",\"lag_max_ms\":" << lagMaxMs.load() << ",\"shedding\":" << (shedding ? "true" : "false")
+        << ",\"refused_flows\":" << refusedFlows << "}"
+        << ",\"draining\":" << (draining ? "true" : "false") << ",\"drain_refused\":" << drainRefused;
+    if (transport != Transport::udp)
+        out << ",\"tunnel\":{\"transport\":\"" << (transport == Transport::tunnelClient ? "tcp" : "tcp-listen")
+            << "\",\"up\":" << tunnelsUp << ",\"frames_out\":" << framesOut << ",\"frames_in\":" << framesIn
+            << ",\"writes\":" << tunnelWrites << ",\"reads\":" << tunnelReads << ",\"drops\":" << tunnelDrops << "}";
+    if (cipher)
+        out << ",\"encryption\":{\"side\":\"" << (sealUpstream ? "client" : "server") << "\",\"cipher\":\""
+            << sealCipherName(cipher->id()) << "\",\"auth_failures\":" << authFailures << "}";
+    if (fecOptions.enabled)
+        out << ",\"fec\":{\"side\":\"" << (fecOptions.encodeUpstream ? "client" : "server") << "\",\"data\":" << fecOptions.data
+            << ",\"parity\":" << fecOptions.parity << ",\"kernel\":\"" << gfKernelName() << "\",\"groups\":" << fecGroups
+            << ",\"parity_sent\":" << fecParitySent << ",\"recovered\":" << fecRecovered << ",\"lost_groups\":" << fecLostGroups
+            << ",\"duplicates\":" << fecDuplicates << ",\"malformed\":" << fecMalformed << "}";
+    if (mirrorOptions.enabled)
+        out << ",\"mirror\":{\"target\":\"" << mirrorOptions.target << "\",\"directions\":\"" << (mirrorOptions.both ? "both" : "upstream")
+            << "\",\"sockets\":" << mirrorSockets << ",\"datagrams\":" << mirrorDatagrams << ",\"bytes\":" << mirrorBytes
+            << ",\"dropped\":" << mirrorDrops << ",\"failures\":" << mirrorFailures << "}";
+    out << ",\"sources\":[";
+    for (size_t i = 0; i < sources.size(); ++i)
+    {
+        const UpstreamSource &source = *sources[i];
+        out << (i ? "," : "") << "{\"address\":\"" << source.name << "\",\"active\":" << source.active
+            << ",\"flows\":" << source.flows << ",\"failures\":" << source.failures << "}";
+    }
+    out << "]}";
+    return out.str();
+}
+
+// seconds since any flow last saw a datagram from its client
+time_t UDPProxy::quietSeconds()
+{
+    time_t now = time(nullptr);
+    std::lock_guard<std::mutex> lock(connMutex);
+    time_t last = lruFlows.empty() ? 0 : lruFlows.back()->last_active;
+    return last ? now - last : std::numeric_limits<time_t>::max();
+}
+
+void UDPProxy::appendCounters(CounterSnapshot &counters) const
+{
+    counters.emplace_back(srcAddrPort + "/active_flows", activeFlows.load());
+    counters.emplace_back(srcAddrPort + "/datagrams_in", datagramsIn.load(std::memory_order_relaxed));
+    counters.emplace_back(srcAddrPort + "/bytes_in", bytesIn.load(std::memory_order_relaxed));
+    counters.emplace_back(srcAddrPort + "/datagrams_out", datagramsOut.load(std::memory_order_relaxed));
+    counters.emplace_back(srcAddrPort + "/bytes_out", bytesOut.load(std::memory_order_relaxed));
+    counters.emplace_back(srcAddrPort + "/refused_flows", refusedFlows.load(std::memory_order_relaxed));
+    counters.emplace_back(srcAddrPort + "/evicted_flows", evictedFlows.load(std::memory_order_relaxed));
+    counters.emplace_back(srcAddrPort + "/rate_limited", rateLimited.load(std::memory_order_relaxed));
+    counters.emplace_back(srcAddrPort + "/loop_lag_us", static_cast<int64_t>(lagMs.load() * 1000));
+}
+
+void UDPProxy::setupSocket(InheritedSockets &inherited)
+{
+    // Determine the address family dynamically
+    int addrFamily = srcAddr.sa.sa_family;
+    int type = transport == Transport::tunnelServer ? SOCK_STREAM : SOCK_DGRAM;
+
+    srcSocket = inherited.claim(srcAddr, type);
+    if (srcSocket != -1)
+    {
+        logger.info("Using inherited socket for " + srcAddrPort);
+    }
+    else
+    {
+        srcSocket = socket(addrFamily, type, 0);
+        if (srcSocket < 0)
+        {
+            logger.error("Socket creation failed: " + std::string(strerror(errno)));
+            throw std::runtime_error("Socket creation failed");
+        }
+
+        int reuse = 1;
+        setsockopt(srcSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+        if (bind(srcSocket, (struct sockaddr *)&srcAddr,
+                 (addrFamily == AF_INET6) ? sizeof(srcAddr.in6) : sizeof(srcAddr.in)) < 0)
+        {
+            logger.error("Binding socket failed for address: " +
+                         std::string((addrFamily == AF_INET6) ? "[IPv6]" : "[IPv4]") +
+                         " Error: " + std::string(strerror(errno)));
+            throw std::runtime_error("Binding socket failed");
+        }
+
+        if (transport == Transport::tunnelServer && listen(srcSocket, 64) < 0)
+        {
+            logger.error("Listening for tunnels failed: " + std::string(strerror(errno)));
+            throw std::runtime_error("Listening for tunnels failed");
+        }
+    }
+
+    setNonBlocking(srcSocket);
+
+    epollFd = epoll_create1(0);
+    if (epollFd < 0)
+    {
+        logger.error("Creating epoll file descriptor failed: " + std::string(strerror(errno)));
+        throw std::runtime_error("Creating epoll file descriptor failed");
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = srcSocket;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, srcSocket, &ev);
+
+    logger.info("Socket successfully set and bound to address");
+}
+
+void UDPProxy::setNonBlocking(int sockfd)
+{
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFD, 0) | O_NONBLOCK);
+}
+
+void UDPProxy::initiateConnectionTable()
+{
+    for (int i = 0; i < connTblHashSize; ++i)
+    {
+        connTable[i].clear();
+    }
+    logger.debug("Connection table initialized");
+}
+
+void UDPProxy::processConnections()
+{
+    struct epoll_event events[10];
+    sockaddr_inx clientAddr{};
+    socklen_t clientLen = sizeof(clientAddr);
+    std::vector<char> buffer(readHeadroom + readSize + DatagramCipher::overhead);
+
+    const int waitTimeoutMs = 2000;
+    while (!stopping)
+    {
+        if (transport == Transport::tunnelClient && tunnel.sock == -1 && std::chrono::steady_clock::now() >= tunnelRetryAt)
+            openTunnel();
+
+        int waitMs = flushFec(flushTunnels(waitTimeoutMs));
+        auto waitStart = std::chrono::steady_clock::now();
+        int nfds = epoll_wait(epollFd, events, 10, waitMs);
+        auto iterationStart = std::chrono::steady_clock::now();
+        recycleConnections();
+
+        if (nfds < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            logger.error("epoll wait failed");
+            throw std::runtime_error("epoll wait failed");
+        }
+
+        for (int i = 0; i < nfds; ++i)
+        {
+            int sockfd = events[i].data.fd;
+
+            if (sockfd == srcSocket && transport == Transport::tunnelServer)
+            {
+                acceptTunnels();
+            }
+            else if (sockfd == srcSocket && transport == Transport::tunnelClient)
+            {
+                readClientsToTunnel();
+            }
+            else if (transport == Transport::tunnelClient && sockfd == tunnel.sock)
+            {
+                handleTunnelEvent(tunnel, events[i].events);
+            }
+            else if (transport == Transport::tunnelServer && tunnels.count(sockfd))
+            {
+                handleTunnelEvent(*tunnels[sockfd], events[i].events);
+            }
+            else if (sockfd == srcSocket)
+            {
+                int len = recvfrom(srcSocket, buffer.data() + readHeadroom, readSize, 0, (struct sockaddr *)&clientAddr, &clientLen);
+                if (len > 0)
+                {
+                    logger.debug("Received data from client");
+                    countIn(len);
+
+                    std::lock_guard<std::mutex> lock(connMutex);
+                    ProxyConn *conn = tOrCreateConnection(clientAddr);
+                    if (conn)
+                        forwardDatagram(conn, true, buffer.data() + readHeadroom, len);
+                }
+            }
+            else
+            {
+                std::lock_guard<std::mutex> lock(connMutex);
+                auto found = connMap.find(sockfd);
+                ProxyConn *conn = found == connMap.end() ? nullptr : found->second;
+                if (conn && conn->tunnel_sock != -1)
+                {
+                    readFlowToTunnel(conn);
+                }
+                else if (conn)
+                {
+                    int len = recv(conn->svr_sock, buffer.data() + readHeadroom, readSize, 0);
+                    if (len > 0)
+                    {
+                        countOut(len);
+                        forwardDatagram(conn, false, buffer.data() + readHeadroom, len);
+                    }
+                    else if (len == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                    {
+                        rlsConnection(conn);
+                        logger.warn("Connection released due to read error");
+                    }
+                }
+            }
+        }
+
+        auto iterationEnd = std::chrono::steady_clock::now();
+        double busyMs = std::chrono::duration<double, std::milli>(iterationEnd - iterationStart).count();
+        double overshootMs = nfds == 0 ? std::chrono::duration<double, std::milli>(iterationStart - waitStart).count() - waitMs : 0;
+        sampleLag(std::max(busyMs, overshootMs));
+    }
+}
+
+void UDPProxy::sampleLag(double sampleMs)
+{
+    double avg = lagAvgMs * 0.8 + sampleMs * 0.2;
+    lagMs = sampleMs;
+    lagAvgMs = avg;
+    if (sampleMs > lagMaxMs)
+        lagMaxMs = sampleMs;
+    shedding = shedder.update(shedding, avg, srcAddrPort);
+}
+
+void UDPProxy::recycleConnections()
+{
+    time_t now = time(nullptr);
+    std::lock_guard<std::mutex> lock(connMutex);
+
+    // oldest first, so only the flows that expire are visited
+    while (!lruFlows.empty() && now - lruFlows.front()->last_active > timeout)
+    {
+        logger.info("Recycling idle connection for client.");
+        rlsConnection(lruFlows.front());
+    }
+    sweepPrefixes();
+}
+
+void UDPProxy::trackFlow(ProxyConn *conn)
+{
+    conn->lru = lruFlows.insert(lruFlows.end(), conn);
+}
+
+void UDPProxy::touchFlow(ProxyConn *conn)
+{
+    conn->last_active = time(nullptr);
+    lruFlows.splice(lruFlows.end(), lruFlows, conn->lru);
+}
+
+// at the cap, the least recently active flow gives its slot (and socket) to the new one
+void UDPProxy::makeRoom()
+{
+    if (flowLimits.maxFlows == 0 || lruFlows.size() < flowLimits.maxFlows)
+        return;
+    ++evictedFlows;
+    logger.debug("Flow table full, evicting the least recently active flow");
+    rlsConnection(lruFlows.front());
+}
+
+// token bucket per client source prefix, refilled at newFlowsPerSecond up to burst
+bool UDPProxy::admitNewFlow(const sockaddr_inx &addr)
+{
+    if (flowLimits.newFlowsPerSecond <= 0)
+        return true;
+
+    bool v6 = addr.sa.sa_family == AF_INET6;
+    uint64_t prefix = 0;
+    if (v6)
+    {
+        for (int i = 0; i < 8; ++i)
+            prefix = (prefix << 8) | addr.in6.sin6_addr.s6_addr[i];
+        prefix = flowLimits.prefixV6 ? prefix >> (64 - flowLimits.prefixV6) : 0;
+    }
+    else
+    {
+        uint64_t ip = ntohl(addr.in.sin_addr.s_addr);
+        prefix = flowLimits.prefixV4 ? ip >> (32 - flowLimits.prefixV4) : 0;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    auto &buckets = prefixBuckets[v6];
+    auto found = buckets.find(prefix);
+    if (found == buckets.end())
+    {
+        // a flood from more prefixes than this waits for the next sweep
+        if (buckets.size() >= FlowLimits::maxPrefixes)
+            return false;
+        found = buckets.emplace(prefix, PrefixBucket{flowLimits.burst, now}).first;
+    }
+
+    PrefixBucket &bucket = found->second;
+    double elapsed = std::chrono::duration<double>(now - bucket.refilled).count();
+    bucket.tokens = std::min(flowLimits.burst, bucket.tokens + elapsed * flowLimits.newFlowsPerSecond);
+    bucket.refilled = now;
+    if (bucket.tokens < 1)
+        return false;
+    bucket.tokens -= 1;
+    return true;
+}
+
+// once a second, forgets the prefixes whose bucket has filled up again
+void UDPProxy::sweepPrefixes()
+{
+    auto now = std::chrono::steady_clock::now();
+    if (flowLimits.newFlowsPerSecond <= 0 || now < prefixSweepAt)
+        return;
+    prefixSweepAt = now + std::chrono::seconds(1);
+
+    for (auto &buckets : prefixBuckets)
+    {
+        for (auto it = buckets.begin(); it != buckets.end();)
+        {
+            double elapsed = std::chrono::duration<double>(now - it->second.refilled).count();
+            if (it->second.tokens + elapsed * flowLimits.newFlowsPerSecond >= flowLimits.burst)
+                it = buckets.erase(it);
+            else
+                ++it;
+        }
+    }
+}
+
+int UDPProxy::hashAddress(sockaddr_inx *addr)
+{
+    return ntohl(addr->in.sin_addr.s_addr) % connTblHashSize;
+}
+
+bool UDPProxy::compareAddresses(sockaddr_inx *a, sockaddr_inx *b)
+{
+    if (a->sa.sa_family != b->sa.sa_family)
+        return false;
+
+    if (a->sa.sa_family == AF_INET)
+        return (a->in.sin_addr.s_addr == b->in.sin_addr.s_addr &&
+                a->in.sin_port == b->in.sin_port);
+
+    if (a->sa.sa_family == AF_INET6)
+        return (memcmp(&a->in6.sin6_addr, &b->in6.sin6_addr, sizeof(a->in6.sin6_addr)) == 0 &&
+                a->in6.sin6_port == b->in6.sin6_port);
+
+    return false;
+}
+
+ProxyConn *UDPProxy::tOrCreateConnection(sockaddr_inx &cliAddr)
+{
+    int bucket = hashAddress(&cliAddr);
+    auto &list = connTable[bucket];
+
+    logger.debug("Checking connection table for client address...");
+    for (auto &conn : list)
+    {
+        if (compareAddresses(&conn.cli_addr, &cliAddr))
+        {
+            touchFlow(&conn);
+            logger.debug("Reused existing connection for client.");
+            return &conn;
+        }
+    }
+
+    if (shedding && shedder.refusesNewFlows())
+    {
+        ++refusedFlows;
+        logger.debug("Loop is shedding load, refusing new flow.");
+        return nullptr;
+    }
+
+    if (draining)
+    {
+        ++drainRefused;
+        return nullptr;
+    }
+
+    if (!admitNewFlow(cliAddr))
+    {
+        ++rateLimited;
+        return nullptr;
+    }
+
+    logger.debug("No existing connection found. Creating a new one.");
+
+    if (transport == Transport::tunnelClient)
+    {
+        // the peer opens the upstream socket; here the flow is only an id on the tunnel
+        makeRoom();
+        ProxyConn flow{cliAddr, -1, time(nullptr), nullptr};
+        flow.flow_id = nextFlowId++;
+        if (nextFlowId == 0)
+            nextFlowId = 1;
+        list.push_back(std::move(flow));
+        flowMap[flowKey(-1, list.back().flow_id)] = &list.back();
+        trackFlow(&list.back());
+        ++activeFlows;
+        return &list.back();
+    }
+
+    // connected before anything is evicted, so a flow that fails to open costs no live one
+    UpstreamSource *source = nullptr;
+    int svrSock = connectUpstream(source);
+    if (svrSock < 0)
+        return nullptr;
+
+    makeRoom();
+    list.push_back({cliAddr, svrSock, time(nullptr), source});
+    connMap[svrSock] = &list.back();
+    trackFlow(&list.back());
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = svrSock;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, svrSock, &ev);
+
+    return &list.back();
+}
+
+// connected, non-blocking socket to the next destination address, or -1
+int UDPProxy::connectUpstream(UpstreamSource *&source)
+{
+    sockaddr_inx dstAddr;
+    if (!dstTarget->next(dstPort, dstAddr))
+    {
+        logger.error("No address known for " + dstTarget->name() + ", dropping datagram");
+        return -1;
+    }
+
+    int svrSock = (dstAddr.sa.sa_family == AF_INET6) ? socket(AF_INET6, SOCK_DGRAM, 0) : socket(AF_INET, SOCK_DGRAM, 0);
+    if (svrSock < 0)
+    {
+        logger.error("Creating server socket failed: " + std::string(strerror(errno)));
+        return -1;
+    }
+
+    source = sources.empty() ? nullptr : pickSource(dstAddr.sa.sa_family);
+    if (source && !bindSource(svrSock, source))
+    {
+        close(svrSock);
+        return -1;
+    }
+
+    if (connect(svrSock, (struct sockaddr *)&dstAddr,
+                (dstAddr.sa.sa_family == AF_INET6) ? sizeof(dstAddr.in6) : sizeof(dstAddr.in)) < 0)
+    {
+        logger.error("Connecting to server socket failed: " + std::string(strerror(errno)));
+        if (source)
+            ++source->failures;
+        close(svrSock);
+        return -1;
+    }
+
+    setNonBlocking(svrSock);
+
+    if (source)
+    {
+        ++source->active;
+        ++source->flows;
+    }
+    ++activeFlows;
+    return svrSock;
+}
+
+void UDPProxy::rlsConnection(ProxyConn *conn)
+{
+    if (conn->svr_sock != -1)
+    {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, conn->svr_sock, nullptr);
+        connMap.erase(conn->svr_sock);
+        close(conn->svr_sock);
+        conn->svr_sock = -1;
+        if (conn->source)
+            --conn->source->active;
+        --activeFlows;
+    }
+    else if (conn->flow_id && flowMap.count(flowKey(conn->tunnel_sock, conn->flow_id)))
+    {
+        --activeFlows;
+        sendFlowClose(conn->flow_id);
+    }
+    if (conn->flow_id)
+        flowMap.erase(flowKey(conn->tunnel_sock, conn->flow_id));
+    fecOpen.erase(conn);
+    for (int sock : conn->mirror_socks)
+    {
+        if (sock >= 0)
+            close(sock);
+    }
+
+    lruFlows.erase(conn->lru);
+
+    // frees conn
+    auto &bucket = connTable[hashAddress(&conn->cli_addr)];
+    bucket.remove_if([&](const ProxyConn &item)
+                     { return &item == conn; });
+    logger.info("Released & closed connection");
+}
+
+// tcp: (re)connects the tunnel to the peer; datagrams arriving while it is down are dropped
+void UDPProxy::openTunnel()
+{
+    tunnelRetryAt = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+
+    sockaddr_inx peerAddr;
+    if (!dstTarget->next(dstPort, peerAddr))
+    {
+        logger.error("No address known for tunnel peer " + dstTarget->name());
+        return;
+    }
+
+    int sock = socket(peerAddr.sa.sa_family, SOCK_STREAM, 0);
+    if (sock < 0)
+    {
+        logger.error("Creating tunnel socket failed: " + std::string(strerror(errno)));
+        return;
+    }
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setNonBlocking(sock);
+
+    socklen_t len = (peerAddr.sa.sa_family == AF_INET6) ? sizeof(peerAddr.in6) : sizeof(peerAddr.in);
+    if (connect(sock, &peerAddr.sa, len) < 0 && errno != EINPROGRESS)
+    {
+        logger.warn("Tunnel connect to " + addrToString(peerAddr) + " failed: " + std::string(strerror(errno)));
+        close(sock);
+        return;
+    }
+
+    tunnel.sock = sock;
+    tunnel.connecting = true;
+    tunnel.writeArmed = true;
+    tunnel.peerAddr = peerAddr;
+    tunnel.peer = addrToString(peerAddr) + ":" + std::to_string(dstPort);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.fd = sock;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, sock, &ev);
+}
+
+// tcp-listen: every accepted connection is a tunnel from a peer forwarder
+void UDPProxy::acceptTunnels()
+{
+    while (true)
+    {
+        sockaddr_inx peerAddr;
+        socklen_t len = sizeof(peerAddr);
+        int sock = accept4(srcSocket, &peerAddr.sa, &len, SOCK_NONBLOCK);
+        if (sock < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                logger.error("Accepting tunnel failed: " + std::string(strerror(errno)));
+            return;
+        }
+        int one = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        auto conn = std::make_unique<TunnelConn>();
+        conn->sock = sock;
+        conn->peerAddr = peerAddr;
+        conn->peer = addrToString(peerAddr);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = sock;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, sock, &ev);
+
+        logger.info("Tunnel from " + conn->peer + " accepted");
+        std::lock_guard<std::mutex> lock(connMutex);
+        tunnels[sock] = std::move(conn);
+        ++tunnelsUp;
+    }
+}
+
+void UDPProxy::closeTunnel(TunnelConn &conn)
+{
+    if (!conn.connecting)
+    {
+        logger.warn("Tunnel " + std::string(transport == Transport::tunnelClient ? "to " : "from ") + conn.peer + " closed");
+        --tunnelsUp;
+    }
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, conn.sock, nullptr);
+    close(conn.sock);
+
+    if (transport == Transport::tunnelServer)
+    {
+        // its flows end with it; the peer opens them again on its next tunnel
+        std::vector<ProxyConn *> flows;
+        for (auto &entry : flowMap)
+        {
+            if (entry.second->tunnel_sock == conn.sock)
+                flows.push_back(entry.second);
+        }
+        for (ProxyConn *flow : flows)
+            rlsConnection(flow);
+        tunnels.erase(conn.sock);
+        return;
+    }
+
+    // flows stay mapped, the peer opens their upstream sockets again when data arrives
+    conn.sock = -1;
+    conn.connecting = false;
+    conn.writeArmed = false;
+    conn.inLen = conn.outOff = conn.outLen = 0;
+    conn.queued = false;
+    tunnelRetryAt = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+}
+
+void UDPProxy::armTunnel(TunnelConn &conn, bool writable)
+{
+    if (conn.writeArmed == writable)
+        return;
+    struct epoll_event ev;
+    ev.events = EPOLLIN | (writable ? uint32_t(EPOLLOUT) : 0u);
+    ev.data.fd = conn.sock;
+    epoll_ctl(epollFd, EPOLL_CTL_MOD, conn.sock, &ev);
+    conn.writeArmed = writable;
+}
+
+void UDPProxy::handleTunnelEvent(TunnelConn &conn, uint32_t events)
+{
+    std::lock_guard<std::mutex> lock(connMutex);
+    if (conn.connecting)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(conn.sock, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err)
+        {
+            logger.warn("Tunnel connect to " + conn.peer + " failed: " + std::string(strerror(err)));
+            closeTunnel(conn);
+            return;
+        }
+        conn.connecting = false;
+        ++tunnelsUp;
+        armTunnel(conn, false);
+        logger.info("Tunnel to " + conn.peer + " up");
+        return;
+    }
+
+    if ((events & EPOLLOUT) && !writeTunnel(conn))
+    {
+        closeTunnel(conn);
+        return;
+    }
+    if ((events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && !readTunnel(conn))
+        closeTunnel(conn);
+}
+
+// false once the peer closed the tunnel or it failed
+bool UDPProxy::readTunnel(TunnelConn &conn)
+{
+    while (true)
+    {
+        // every complete frame is delivered after each read, so less than one frame is
+        // ever left over and the buffer always has room
+        size_t room = conn.inBuf.size() - conn.inLen;
+        ssize_t len = recv(conn.sock, conn.inBuf.data() + conn.inLen, room, 0);
+        if (len == 0)
+            return false;
+        if (len < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        ++tunnelReads;
+        conn.inLen += len;
+
+        size_t used = deliverDatagrams(conn);
+        memmove(conn.inBuf.data(), conn.inBuf.data() + used, conn.inLen - used);
+        conn.inLen -= used;
+
+        if (size_t(len) < room)
+            return true;
+    }
+}
+
+// splits complete frames back into datagrams and sends consecutive ones that share a
+// socket with a single sendmmsg; returns the bytes consumed
+size_t UDPProxy::deliverDatagrams(TunnelConn &conn)
+{
+    const int maxBatch = 64;
+    struct mmsghdr msgs[maxBatch];
+    struct iovec iovs[maxBatch];
+    int count = 0;
+    int batchSock = -1;
+
+    auto sendBatch = [&]()
+    {
+        for (int sent = 0; sent < count;)
+        {
+            int n = sendmmsg(batchSock, msgs + sent, count - sent, 0);
+            if (n <= 0)
+            {
+                ++tunnelDrops;
+                n = 1;
+            }
+            sent += n;
+        }
+        count = 0;
+    };
+
+    size_t pos = 0;
+    while (conn.inLen - pos >= TunnelConn::headerSize)
+    {
+        uint32_t flowId;
+        uint16_t len;
+        memcpy(&flowId, conn.inBuf.data() + pos, 4);
+        memcpy(&len, conn.inBuf.data() + pos + 4, 2);
+        flowId = ntohl(flowId);
+        len = ntohs(len);
+        if (conn.inLen - pos < TunnelConn::headerSize + len)
+            break;
+        char *payload = conn.inBuf.data() + pos + TunnelConn::headerSize;
+        pos += TunnelConn::headerSize + len;
+        if (flowId == 0)
+        {
+            if (transport == Transport::tunnelServer && len == 4)
+            {
+                memcpy(&flowId, payload, 4);
+                auto found = flowMap.find(flowKey(conn.sock, ntohl(flowId)));
+                if (found != flowMap.end())
+                {
+                    // its socket may be in the pending batch
+                    sendBatch();
+                    rlsConnection(found->second);
+                }
+            }
+            continue;
+        }
+        ++framesIn;
+        if (transport == Transport::tunnelServer)
+            countIn(len);
+        else
+            countOut(len);
+
+        int payloadLen = len;
+        payload = crypt(transport == Transport::tunnelServer, payload, payloadLen);
+        if (!payload)
+            continue;
+
+        int sock;
+        sockaddr_inx *name = nullptr;
+        if (transport == Transport::tunnelServer)
+        {
+            ProxyConn *flow = tunnelFlow(conn, flowId);
+            if (!flow)
+                continue;
+            sock = flow->svr_sock;
+        }
+        else
+        {
+            auto found = flowMap.find(flowKey(-1, flowId));
+            if (found == flowMap.end())
+            {
+                ++tunnelDrops;
+                continue;
+            }
+            sock = srcSocket;
+            name = &found->second->cli_addr;
+            touchFlow(found->second);
+        }
+
+        if (count && (sock != batchSock || count == maxBatch))
+            sendBatch();
+        batchSock = sock;
+        iovs[count] = {payload, size_t(payloadLen)};
+        memset(&msgs[count], 0, sizeof(msgs[count]));
+        msgs[count].msg_hdr.msg_iov = &iovs[count];
+        msgs[count].msg_hdr.msg_iovlen = 1;
+        if (name)
+        {
+            msgs[count].msg_hdr.msg_name = name;
+            msgs[count].msg_hdr.msg_namelen = (name->sa.sa_family == AF_INET6) ? sizeof(name->in6) : sizeof(name->in);
+        }
+        ++count;
+    }
+    sendBatch();
+    return pos;
+}
+
+// tcp-listen: flow of a tunnel by the id the peer gave it, opening its upstream socket on first use
+ProxyConn *UDPProxy::tunnelFlow(TunnelConn &conn, uint32_t flowId)
+{
+    auto found = flowMap.find(flowKey(conn.sock, flowId));
+    if (found != flowMap.end())
+    {
+        touchFlow(found->second);
+        return found->second;
+    }
+
+    if (shedding && shedder.refusesNewFlows())
+    {
+        ++refusedFlows;
+        return nullptr;
+    }
+
+    if (draining)
+    {
+        ++drainRefused;
+        return nullptr;
+    }
+
+    // only the cap applies: one peer carries many flows, so it is not rate limited by
+    // prefix. the eviction waits for a connected socket
+    UpstreamSource *source = nullptr;
+    int svrSock = connectUpstream(source);
+    if (svrSock < 0)
+        return nullptr;
+    makeRoom();
+
+    // tunneled flows sit in the table under the tunnel's address, lookups go through flowMap
+    auto &list = connTable[hashAddress(&conn.peerAddr)];
+    list.push_back({conn.peerAddr, svrSock, time(nullptr), source});
+    ProxyConn *flow = &list.back();
+    flow->tunnel_sock = conn.sock;
+    flow->flow_id = flowId;
+    connMap[svrSock] = flow;
+    flowMap[flowKey(conn.sock, flowId)] = flow;
+    trackFlow(flow);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = svrSock;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, svrSock, &ev);
+    return flow;
+}
+
+// room for one frame's payload at the end of the tunnel's send buffer, or nullptr when
+// the tunnel is down or too far behind
+char *UDPProxy::reserveFrame(TunnelConn &conn, size_t payloadLen)
+{
+    if (conn.sock == -1 || conn.connecting ||
+        conn.outLen - conn.outOff + TunnelConn::headerSize + payloadLen > tunnelOptions.maxPending)
+        return nullptr;
+
+    if (conn.outOff == conn.outLen)
+        conn.outOff = conn.outLen = 0;
+    if (conn.outLen + TunnelConn::headerSize + payloadLen > conn.outBuf.size())
+    {
+        memmove(conn.outBuf.data(), conn.outBuf.data() + conn.outOff, conn.outLen - conn.outOff);
+        conn.outLen -= conn.outOff;
+        conn.outOff = 0;
+        size_t need = conn.outLen + TunnelConn::headerSize + payloadLen;
+        if (need > conn.outBuf.size())
+            conn.outBuf.resize(std::max(need, conn.outBuf.size() * 2));
+    }
+    return conn.outBuf.data() + conn.outLen + TunnelConn::headerSize;
+}
+
+void UDPProxy::commitFrame(TunnelConn &conn, uint32_t flowId, size_t payloadLen)
+{
+    uint32_t id = htonl(flowId);
+    uint16_t len = htons(uint16_t(payloadLen));
+    memcpy(conn.outBuf.data() + conn.outLen, &id, 4);
+    memcpy(conn.outBuf.data() + conn.outLen + 4, &len, 2);
+    conn.outLen += TunnelConn::headerSize + payloadLen;
+    ++framesOut;
+    if (!conn.queued)
+    {
+        conn.queued = true;
+        conn.queuedSince = std::chrono::steady_clock::now();
+    }
+}
+
+// tcp: tells the peer a flow ended here, so it closes the flow's upstream socket now
+// rather than when the flow idles out there. lost with the tunnel if it is down,
+// where the peer drops the flows of the old tunnel anyway
+void UDPProxy::sendFlowClose(uint32_t flowId)
+{
+    if (transport != Transport::tunnelClient)
+        return;
+    char *payload = reserveFrame(tunnel, 4);
+    if (!payload)
+        return;
+    uint32_t id = htonl(flowId);
+    memcpy(payload, &id, 4);
+    commitFrame(tunnel, 0, 4);
+}
+
+// false when the tunnel failed; a full socket buffer leaves the rest for EPOLLOUT
+bool UDPProxy::writeTunnel(TunnelConn &conn)
+{
+    conn.queued = false;
+    while (conn.outOff < conn.outLen)
+    {
+        ssize_t len = send(conn.sock, conn.outBuf.data() + conn.outOff, conn.outLen - conn.outOff, MSG_NOSIGNAL);
+        if (len < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                armTunnel(conn, true);
+                return true;
+            }
+            logger.warn("Writing to tunnel " + conn.peer + " failed: " + std::string(strerror(errno)));
+            return false;
+        }
+        ++tunnelWrites;
+        conn.outOff += len;
+    }
+    conn.outOff = conn.outLen = 0;
+    armTunnel(conn, false);
+    return true;
+}
+
+// writes out tunnels whose queued frames fill a batch or have waited flush_ms, which
+// bounds the latency batching adds; returns how long the loop may sleep before the
+// next tunnel is due
+int UDPProxy::flushTunnels(int waitMs)
+{
+    if (transport == Transport::udp)
+        return waitMs;
+
+    std::lock_guard<std::mutex> lock(connMutex);
+    auto now = std::chrono::steady_clock::now();
+    auto untilMs = [&](std::chrono::steady_clock::time_point at)
+    {
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(at - now).count();
+        return us <= 0 ? 0 : int((us + 999) / 1000);
+    };
+    auto flush = [&](TunnelConn &conn)
+    {
+        if (!conn.queued || conn.writeArmed)
+            return;
+        auto due = conn.queuedSince + std::chrono::milliseconds(tunnelOptions.flushMs);
+        if (conn.outLen - conn.outOff < tunnelOptions.batchBytes && now < due)
+        {
+            waitMs = std::min(waitMs, untilMs(due));
+            return;
+        }
+        if (!writeTunnel(conn))
+            closeTunnel(conn);
+    };
+
+    if (transport == Transport::tunnelClient)
+    {
+        if (tunnel.sock == -1)
+            waitMs = std::min(waitMs, untilMs(tunnelRetryAt));
+        else
+            flush(tunnel);
+        return waitMs;
+    }
+
+    for (auto it = tunnels.begin(); it != tunnels.end();)
+    {
+        TunnelConn &conn = *(it++)->second;
+        flush(conn);
+    }
+    return waitMs;
+}
+
+// tcp: drains the client socket in recvmmsg batches and queues every datagram on the tunnel
+void UDPProxy::readClientsToTunnel()
+{
+    const int batch = 32;
+    struct mmsghdr msgs[batch];
+    struct iovec iovs[batch];
+    sockaddr_inx addrs[batch];
+    const size_t slotSize = buffer_size + 2 * DatagramCipher::overhead;
+    if (tunnelScratch.empty())
+        tunnelScratch.resize(size_t(batch) * slotSize);
+
+    for (int round = 0; round < 8; ++round)
+    {
+        for (int i = 0; i < batch; ++i)
+        {
+            iovs[i] = {tunnelScratch.data() + size_t(i) * slotSize + readHeadroom, size_t(readSize)};
+            memset(&msgs[i], 0, sizeof(msgs[i]));
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int count = recvmmsg(srcSocket, msgs, batch, MSG_DONTWAIT, nullptr);
+        if (count <= 0)
+            return;
+
+        std::lock_guard<std::mutex> lock(connMutex);
+        for (int i = 0; i < count; ++i)
+        {
+            ProxyConn *conn = tOrCreateConnection(addrs[i]);
+            if (!conn)
+                continue;
+            int len = msgs[i].msg_len;
+            countIn(len);
+            char *data = crypt(true, static_cast<char *>(iovs[i].iov_base), len);
+            if (!data)
+                continue;
+            char *payload = reserveFrame(tunnel, len);
+            if (!payload)
+            {
+                ++tunnelDrops;
+                continue;
+            }
+            memcpy(payload, data, len);
+            commitFrame(tunnel, conn->flow_id, len);
+        }
+        if (count < batch)
+            return;
+    }
+}
+
+// tcp-listen: replies of one flow are received straight into its tunnel's send buffer
+void UDPProxy::readFlowToTunnel(ProxyConn *conn)
+{
+    auto found = tunnels.find(conn->tunnel_sock);
+    if (found == tunnels.end())
+    {
+        rlsConnection(conn);
+        return;
+    }
+    TunnelConn &tunnelConn = *found->second;
+    if (tunnelScratch.empty())
+        tunnelScratch.resize(readSize);
+
+    for (int i = 0; i < 64; ++i)
+    {
+        char *payload = reserveFrame(tunnelConn, readSize + (cipher ? DatagramCipher::overhead : 0));
+        ssize_t len = recv(conn->svr_sock, payload ? payload + readHeadroom : tunnelScratch.data(), readSize, 0);
+        if (len < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                rlsConnection(conn);
+                logger.warn("Connection released due to read error");
+            }
+            return;
+        }
+        countOut(len);
+        if (!payload)
+        {
+            ++tunnelDrops;
+            continue;
+        }
+        int frameLen = len;
+        if (crypt(false, payload + readHeadroom, frameLen))
+            commitFrame(tunnelConn, conn->flow_id, frameLen);
+    }
+}
+
+// seals or opens a datagram in place, depending on which side of the pair this proxy is and
+// which way the datagram goes; nullptr drops it
+char *UDPProxy::crypt(bool upstream, char *data, int &len)
+{
+    if (!cipher)
+        return data;
+    if (upstream == sealUpstream)
+        return cipher->seal(data, len);
+
+    char *plain = cipher->open(data, len);
+    if (!plain)
+    {
+        ++authFailures;
+        logger.debug("Dropping datagram that failed to authenticate");
+    }
+    return plain;
+}
+
+// a datagram read from either side: taken apart first when it arrives over the FEC link
+void UDPProxy::forwardDatagram(ProxyConn *conn, bool upstream, char *data, int len)
+{
+    if (fecOptions.enabled && upstream != fecOptions.encodeUpstream)
+        fecReceive(conn, upstream, data, len);
+    else
+        relayDatagram(conn, upstream, data, len);
+}
+
+// data needs the headroom crypt() and fecSend() write in front of it
+void UDPProxy::relayDatagram(ProxyConn *conn, bool upstream, char *data, int len)
+{
+    // the shadow gets plaintext: before sealing, after opening
+    bool sealing = !cipher || upstream == sealUpstream;
+    if (sealing)
+        mirrorDatagram(conn, upstream, data, len);
+    data = crypt(upstream, data, len);
+    if (!data)
+        return;
+    if (!sealing)
+        mirrorDatagram(conn, upstream, data, len);
+    if (fecOptions.enabled && upstream == fecOptions.encodeUpstream)
+        fecSend(conn, upstream, data, len);
+    else
+        transmit(conn, upstream, data, len);
+}
+
+void UDPProxy::transmit(ProxyConn *conn, bool upstream, const char *data, int len)
+{
+    if (upstream)
+    {
+        send(conn->svr_sock, data, len, 0);
+        logger.trace("Data sent to server");
+    }
+    else
+    {
+        sendto(srcSocket, data, len, 0, (struct sockaddr *)&conn->cli_addr, sizeof(conn->cli_addr.in));
+        logger.trace("Data sent to client");
+    }
+}
+
+// never blocks the flow: a full send buffer or an unreachable shadow costs the copy only
+void UDPProxy::mirrorDatagram(ProxyConn *conn, bool upstream, const char *data, int len)
+{
+    if (!mirrorOptions.enabled || (!upstream && !mirrorOptions.both))
+        return;
+    int &sock = conn->mirror_socks[upstream ? 0 : 1];
+    if (sock == -1)
+        sock = openMirror();
+    if (sock < 0)
+    {
+        ++mirrorDrops;
+        return;
+    }
+    if (send(sock, data, len, MSG_DONTWAIT) < 0)
+    {
+        ++mirrorDrops;
+        return;
+    }
+    ++mirrorDatagrams;
+    mirrorBytes += len;
 }
 
-void UDPProxy::rlsConnection(ProxyConn *conn)
+// connected copy socket with a send buffer of queueBytes; -2 when it cannot be opened,
+// so a flow does not retry for every datagram
+int UDPProxy::openMirror()
 {
-    if (conn->svr_sock != -1)
+    sockaddr_inx shadowAddr;
+    if (!mirrorTarget->next(mirrorPort, shadowAddr))
     {
-        epoll_ctl(epollFd, EPOLL_CTL_DEL, conn->svr_sock, nullptr);
-        close(conn->svr_sock);
-        conn->svr_sock = -1;
+        ++mirrorFailures;
+        return -2;
+    }
+    int sock = socket(shadowAddr.sa.sa_family, SOCK_DGRAM, 0);
+    if (sock < 0)
+    {
+        ++mirrorFailures;
+        logger.warn("Creating mirror socket failed: " + std::string(strerror(errno)));
+        return -2;
+    }
+    int sndbuf = mirrorOptions.queueBytes;
+    int rcvbuf = 1; // the kernel rounds up to its minimum; responses pile up there and are dropped
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    if (connect(sock, &shadowAddr.sa, shadowAddr.sa.sa_family == AF_INET6 ? sizeof(shadowAddr.in6) : sizeof(shadowAddr.in)) < 0)
+    {
+        ++mirrorFailures;
+        logger.warn("Connecting mirror socket failed: " + std::string(strerror(errno)));
+        close(sock);
+        return -2;
     }
+    setNonBlocking(sock);
+    ++mirrorSockets;
+    return sock;
+}
 
-    auto &bucket = connTable[hashAddress(&conn->cli_addr)];
-    bucket.remove_if([&](const ProxyConn &item)
-                     { return &item == conn; });
-    connMap.erase(conn->svr_sock);
-    logger.info("Released & closed connection");
+static void writeFecHeader(char *header, uint8_t type, uint16_t group, int index, int k, int m)
+{
+    header[0] = static_cast<char>(type);
+    header[1] = static_cast<char>(group >> 8);
+    header[2] = static_cast<char>(group);
+    header[3] = static_cast<char>(index);
+    header[4] = static_cast<char>(k);
+    header[5] = static_cast<char>(m);
+}
+
+// sends a data datagram at once and folds it into the parity of the flow's open group
+void UDPProxy::fecSend(ProxyConn *conn, bool upstream, char *data, int len)
+{
+    if (len > 0xffff)
+        return;
+    if (!conn->fec)
+        conn->fec = std::make_unique<FecFlow>();
+    FecFlow &fec = *conn->fec;
+    if (fec.count == 0)
+    {
+        fec.openedAt = std::chrono::steady_clock::now();
+        fec.symbolLen = 0;
+        fec.parity.resize(fecOptions.parity);
+        for (auto &parity : fec.parity)
+            parity.clear();
+        fecOpen.insert(conn);
+    }
+
+    const uint8_t prefix[2] = {static_cast<uint8_t>(len >> 8), static_cast<uint8_t>(len)};
+    size_t symbolLen = size_t(len) + 2;
+    if (symbolLen > fec.symbolLen)
+    {
+        for (auto &parity : fec.parity)
+            parity.resize(symbolLen, 0);
+        fec.symbolLen = symbolLen;
+    }
+    for (int p = 0; p < fecOptions.parity; ++p)
+    {
+        uint8_t c = FecOptions::coefficient(p, fec.count);
+        gfMulAdd(fec.parity[p].data(), prefix, c, 2);
+        gfMulAdd(fec.parity[p].data() + 2, reinterpret_cast<const uint8_t *>(data), c, len);
+    }
+
+    char *header = data - FecOptions::headerSize;
+    writeFecHeader(header, FecFlow::dataType, fec.group, fec.count, fecOptions.data, fecOptions.parity);
+    ++fec.count;
+    transmit(conn, upstream, header, len + FecOptions::headerSize);
+    if (fec.count == fecOptions.data)
+        fecCloseGroup(conn);
+}
+
+// sends the parity of the open group; a partial group tells the receiver its real size
+void UDPProxy::fecCloseGroup(ProxyConn *conn)
+{
+    FecFlow &fec = *conn->fec;
+    fecScratch.resize(FecOptions::headerSize + fec.symbolLen);
+    for (int p = 0; p < fecOptions.parity; ++p)
+    {
+        writeFecHeader(fecScratch.data(), FecFlow::parityType, fec.group, p, fec.count, fecOptions.parity);
+        memcpy(fecScratch.data() + FecOptions::headerSize, fec.parity[p].data(), fec.symbolLen);
+        transmit(conn, fecOptions.encodeUpstream, fecScratch.data(), int(fecScratch.size()));
+        ++fecParitySent;
+    }
+    ++fecGroups;
+    ++fec.group;
+    fec.count = 0;
+    fecOpen.erase(conn);
+}
+
+// data datagrams are passed on as they arrive; what is kept of them only serves to rebuild
+// the ones missing once enough parity is in
+void UDPProxy::fecReceive(ProxyConn *conn, bool upstream, char *data, int len)
+{
+    const uint8_t *header = reinterpret_cast<const uint8_t *>(data);
+    int payloadLen = len - FecOptions::headerSize;
+    if (payloadLen < 0)
+    {
+        ++fecMalformed;
+        return;
+    }
+    uint8_t type = header[0];
+    uint16_t id = static_cast<uint16_t>(header[1] << 8 | header[2]);
+    int index = header[3], k = header[4], m = header[5];
+    if (m != fecOptions.parity || k < 1 || k > fecOptions.data ||
+        !(type == FecFlow::dataType ? index < k : type == FecFlow::parityType && index < m && payloadLen >= 2))
+    {
+        ++fecMalformed;
+        logger.debug("Dropping malformed FEC datagram");
+        return;
+    }
+    char *payload = data + FecOptions::headerSize;
+
+    if (!conn->fec)
+        conn->fec = std::make_unique<FecFlow>();
+    FecFlow &fec = *conn->fec;
+    if (fec.groups.empty())
+        fec.groups.resize(fecOptions.window);
+    FecFlow::Group &group = fec.groups[id % fecOptions.window];
+    int16_t age = static_cast<int16_t>(id - group.id);
+    if (!group.used || age > 0)
+    {
+        if (group.used && !group.done && group.k && group.dataReceived < group.k)
+            ++fecLostGroups;
+        group.used = true;
+        group.done = false;
+        group.id = id;
+        group.k = 0;
+        group.dataReceived = 0;
+        group.parityReceived = 0;
+        group.symbolLen = 0;
+        group.present.assign(fecOptions.data + fecOptions.parity, false);
+        group.symbols.resize(fecOptions.data + fecOptions.parity);
+    }
+    else if (age < 0)
+    {
+        // the group already left the window: its data is still worth delivering
+        if (type == FecFlow::dataType)
+            relayDatagram(conn, upstream, payload, payloadLen);
+        return;
+    }
+
+    int slot = type == FecFlow::dataType ? index : fecOptions.data + index;
+    if (group.present[slot])
+    {
+        ++fecDuplicates;
+        return;
+    }
+    if (type == FecFlow::parityType)
+    {
+        if ((group.k && group.k != k) || (group.symbolLen && group.symbolLen != size_t(payloadLen)))
+        {
+            ++fecMalformed;
+            return;
+        }
+        group.present[slot] = true;
+        group.k = k;
+        group.symbolLen = payloadLen;
+        ++group.parityReceived;
+        if (!group.done)
+            group.symbols[slot].assign(payload, payload + payloadLen);
+    }
+    else
+    {
+        group.present[slot] = true;
+        ++group.dataReceived;
+        if (!group.done)
+        {
+            auto &symbol = group.symbols[slot];
+            symbol.resize(size_t(payloadLen) + 2);
+            symbol[0] = static_cast<uint8_t>(payloadLen >> 8);
+            symbol[1] = static_cast<uint8_t>(payloadLen);
+            memcpy(symbol.data() + 2, payload, payloadLen);
+        }
+        relayDatagram(conn, upstream, payload, payloadLen);
+    }
+    if (!group.done && group.k)
+        fecRecover(conn, upstream, group);
+}
+
+// solves the missing data symbols from as many parity symbols, once the group's size is known
+void UDPProxy::fecRecover(ProxyConn *conn, bool upstream, FecFlow::Group &group)
+{
+    std::vector<int> lost, rows;
+    for (int i = 0; i < fecOptions.data; ++i)
+    {
+        if (!group.present[i])
+        {
+            if (i < group.k)
+                lost.push_back(i);
+        }
+        else if (i >= group.k || group.symbols[i].size() > group.symbolLen)
+        {
+            ++fecMalformed;
+            group.done = true;
+            return;
+        }
+    }
+    if (lost.empty())
+    {
+        group.done = true;
+        return;
+    }
+    if (group.parityReceived < int(lost.size()))
+        return;
+    for (int p = 0; p < fecOptions.parity && rows.size() < lost.size(); ++p)
+        if (group.present[fecOptions.data + p])
+            rows.push_back(p);
+
+    // invert the rows of the code that cover the missing symbols
+    size_t n = lost.size();
+    std::vector<uint8_t> matrix(n * n), inverse(n * n, 0);
+    for (size_t r = 0; r < n; ++r)
+    {
+        inverse[r * n + r] = 1;
+        for (size_t c = 0; c < n; ++c)
+            matrix[r * n + c] = FecOptions::coefficient(rows[r], lost[c]);
+    }
+    for (size_t col = 0; col < n; ++col)
+    {
+        size_t pivot = col;
+        while (pivot < n && !matrix[pivot * n + col])
+            ++pivot;
+        if (pivot == n)
+        {
+            ++fecMalformed;
+            group.done = true;
+            return;
+        }
+        for (size_t c = 0; c < n; ++c)
+        {
+            std::swap(matrix[col * n + c], matrix[pivot * n + c]);
+            std::swap(inverse[col * n + c], inverse[pivot * n + c]);
+        }
+        const uint8_t *scale = galoisField.mul[galoisField.inv(matrix[col * n + col])];
+        for (size_t c = 0; c < n; ++c)
+        {
+            matrix[col * n + c] = scale[matrix[col * n + c]];
+            inverse[col * n + c] = scale[inverse[col * n + c]];
+        }
+        for (size_t r = 0; r < n; ++r)
+        {
+            uint8_t factor = matrix[r * n + col];
+            if (r == col || !factor)
+                continue;
+            const uint8_t *row = galoisField.mul[factor];
+            for (size_t c = 0; c < n; ++c)
+            {
+                matrix[r * n + c] ^= row[matrix[col * n + c]];
+                inverse[r * n + c] ^= row[inverse[col * n + c]];
+            }
+        }
+    }
+
+    // strip the symbols that did arrive out of the parity used
+    for (size_t r = 0; r < n; ++r)
+    {
+        auto &parity = group.symbols[fecOptions.data + rows[r]];
+        for (int i = 0; i < group.k; ++i)
+            if (group.present[i])
+                gfMulAdd(parity.data(), group.symbols[i].data(), FecOptions::coefficient(rows[r], i), group.symbols[i].size());
+    }
+    group.done = true;
+    for (size_t c = 0; c < n; ++c)
+    {
+        fecSymbol.assign(group.symbolLen, 0);
+        for (size_t r = 0; r < n; ++r)
+            gfMulAdd(fecSymbol.data(), group.symbols[fecOptions.data + rows[r]].data(), inverse[c * n + r], group.symbolLen);
+        int len = fecSymbol[0] << 8 | fecSymbol[1];
+        if (size_t(len) + 2 > group.symbolLen)
+        {
+            ++fecMalformed;
+            continue;
+        }
+        group.present[lost[c]] = true;
+        ++fecRecovered;
+        char *data = fecOut.data() + readHeadroom;
+        memcpy(data, fecSymbol.data() + 2, len);
+        relayDatagram(conn, upstream, data, len);
+    }
+}
+
+// closes the groups that waited flushMs for more data; returns how long epoll may sleep
+int UDPProxy::flushFec(int waitMs)
+{
+    if (!fecOptions.enabled)
+        return waitMs;
+
+    std::lock_guard<std::mutex> lock(connMutex);
+    auto now = std::chrono::steady_clock::now();
+    for (auto it = fecOpen.begin(); it != fecOpen.end();)
+    {
+        ProxyConn *conn = *it++;
+        auto due = conn->fec->openedAt + std::chrono::milliseconds(fecOptions.flushMs);
+        if (due <= now)
+        {
+            fecCloseGroup(conn);
+            continue;
+        }
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(due - now).count();
+        waitMs = std::min(waitMs, int((us + 999) / 1000));
+    }
+    return waitMs;
 }
 
+// minimal HTTP/1.0 endpoint served from its own thread: one GET per connection,
+// JSON in the response body
+class ControlServer
+{
+public:
+    using Handler = std::function<std::string(const std::string &query)>;
+    using Sampler = std::function<CounterSnapshot()>;
+
+    ControlServer(const std::string &address, int port, Logger &logger)
+        : logger(logger)
+    {
+        sockaddr_inx addr;
+        memset(&addr, 0, sizeof(addr));
+        if (inet_pton(AF_INET6, address.c_str(), &addr.in6.sin6_addr) == 1)
+        {
+            addr.in6.sin6_family = AF_INET6;
+            addr.in6.sin6_port = htons(port);
+        }
+        else
+        {
+            addr.in.sin_family = AF_INET;
+            inet_pton(AF_INET, address.c_str(), &addr.in.sin_addr);
+            addr.in.sin_port = htons(port);
+        }
+
+        listenSock = socket(addr.sa.sa_family, SOCK_STREAM, 0);
+        int reuse = 1;
+        setsockopt(listenSock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        socklen_t len = (addr.sa.sa_family == AF_INET6) ? sizeof(addr.in6) : sizeof(addr.in);
+        if (listenSock < 0 || bind(listenSock, &addr.sa, len) < 0 || listen(listenSock, 16) < 0)
+        {
+            logger.error("Control server setup failed: " + std::string(strerror(errno)));
+            throw std::runtime_error("Control server setup failed");
+        }
+        logger.info("Control server listening on " + address + ":" + std::to_string(port));
+    }
+
+    ~ControlServer()
+    {
+        if (listenSock != -1)
+            close(listenSock);
+    }
+
+    ControlServer(const ControlServer &) = delete;
+    ControlServer &operator=(const ControlServer &) = delete;
+
+    void addRoute(const std::string &path, Handler handler) { routes[path] = std::move(handler); }
+
+    // server-sent events on path: a snapshot of the sampler's counters, then only the
+    // counters that changed, as differences, every intervalMs
+    void addStream(const std::string &path, int intervalMs, Sampler sampler)
+    {
+        streams[path] = Stream{std::max(intervalMs, minStreamIntervalMs), std::move(sampler)};
+    }
+
+    void start()
+    {
+        if (!streams.empty())
+        {
+            if (pipe2(wakePipe, O_NONBLOCK | O_CLOEXEC) < 0)
+            {
+                logger.error("Control server stream setup failed: " + std::string(strerror(errno)));
+                throw std::runtime_error("Control server stream setup failed");
+            }
+            std::thread([this]
+                        { writeStreams(); })
+                .detach();
+        }
+        std::thread([this]
+                    { serve(); })
+            .detach();
+    }
+
+private:
+    int listenSock = -1;
+    Logger &logger;
+    std::map<std::string, Handler> routes;
+
+    struct Stream
+    {
+        int intervalMs;
+        Sampler sampler;
+    };
+    std::map<std::string, Stream> streams;
+    static constexpr int minStreamIntervalMs = 100;
+
+    // one stream subscriber, written by writeStreams only
+    struct Subscriber
+    {
+        int sock;
+        int intervalMs;
+        const Sampler *sampler;
+        CounterSnapshot last;
+        std::string pending; // events the socket has not taken yet
+        std::chrono::steady_clock::time_point due;
+        bool done = false;
+    };
+    static constexpr int maxStreamSubscribers = 32;
+    static constexpr size_t maxPendingStreamBytes = 64 * 1024;
+
+    std::mutex joiningMutex;
+    std::vector<Subscriber> joining; // accepted, not yet picked up by writeStreams
+    std::atomic<int> subscriberCount{0};
+    int wakePipe[2] = {-1, -1};
+
+    void serve()
+    {
+        while (true)
+        {
+            int clientSock = accept(listenSock, nullptr, nullptr);
+            if (clientSock < 0)
+            {
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                logger.error("Control server accept failed: " + std::string(strerror(errno)));
+                return;
+            }
+            if (!handleClient(clientSock))
+                close(clientSock);
+        }
+    }
+
+    // returns true when a stream took over the socket
+    bool handleClient(int clientSock)
+    {
+        // bounds what a stalled client costs this thread, which accepts everyone else too
+        struct timeval tv = {2, 0};
+        setsockopt(clientSock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(clientSock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        std::string request;
+        char chunk[1024];
+        while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192)
+        {
+            ssize_t len = recv(clientSock, chunk, sizeof(chunk), 0);
+            if (len <= 0)
+                return false;
+            request.append(chunk, len);
+        }
+
+        std::istringstream stream(request);
+        std::string method, target;
+        stream >> method >> target;
+
+        size_t queryPos = target.find('?');
+        std::string path = target.substr(0, queryPos);
+        std::string query = (queryPos == std::string::npos) ? "" : target.substr(queryPos + 1);
+
+        std::string status = "200 OK";
+        std::string body;
+        auto subscription = streams.find(path);
+        auto route = routes.find(path);
+        if (method == "GET" && subscription != streams.end())
+        {
+            if (subscriberCount.load() < maxStreamSubscribers)
+            {
+                int intervalMs = subscription->second.intervalMs;
+                size_t pos = ("&" + query).find("&interval_ms=");
+                if (pos != std::string::npos)
+                    intervalMs = std::max(atoi(query.c_str() + pos + strlen("interval_ms=")), minStreamIntervalMs);
+                logger.debug("Stats stream subscriber, every " + std::to_string(intervalMs) + "ms");
+                subscribe(clientSock, intervalMs, subscription->second.sampler);
+                return true;
+            }
+            logger.warn("Stats stream subscriber refused, " + std::to_string(maxStreamSubscribers) + " already connected");
+            status = "503 Service Unavailable";
+            body = "{\"error\":\"too many stream subscribers\"}";
+        }
+        else if (method != "GET" || route == routes.end())
+        {
+            status = "404 Not Found";
+            body = "{\"error\":\"not found\"}";
+        }
+        else
+        {
+            try
+            {
+                body = route->second(query);
+            }
+            catch (const std::exception &e)
+            {
+                logger.warn("Control request " + path + " failed: " + e.what());
+                status = "400 Bad Request";
+                body = "{\"error\":\"bad request\"}";
+            }
+        }
+
+        std::string response = "HTTP/1.0 " + status + "\r\nContent-Type: application/json\r\nContent-Length: " +
+                               std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        send(clientSock, response.data(), response.size(), MSG_NOSIGNAL);
+        return false;
+    }
+
+    void subscribe(int clientSock, int intervalMs, const Sampler &sampler)
+    {
+        Subscriber subscriber{clientSock, intervalMs, &sampler, {}, {}, std::chrono::steady_clock::now()};
+        subscriber.pending = "HTTP/1.0 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\n\r\n"
+                             "retry: " + std::to_string(intervalMs) + "\n\n";
+        ++subscriberCount;
+        {
+            std::lock_guard<std::mutex> lock(joiningMutex);
+            joining.push_back(std::move(subscriber));
+        }
+        // a full pipe already holds a wakeup
+        char wake = 0;
+        if (write(wakePipe[1], &wake, 1) < 0 && errno != EAGAIN)
+            logger.warn("Waking the stats stream writer failed: " + std::string(strerror(errno)));
+    }
+
+    // every subscriber is served from this one thread, so nothing samples while no one
+    // is listening. sends never block: a reader that lets more than
+    // maxPendingStreamBytes pile up is dropped, as is one that closes or sends anything
+    void writeStreams()
+    {
+        std::vector<Subscriber> subscribers;
+        std::vector<pollfd> fds;
+        while (true)
+        {
+            {
+                std::lock_guard<std::mutex> lock(joiningMutex);
+                for (auto &subscriber : joining)
+                    subscribers.push_back(std::move(subscriber));
+                joining.clear();
+            }
+
+            auto now = std::chrono::steady_clock::now();
+            int waitMs = -1;
+            for (auto &subscriber : subscribers)
+            {
+                if (subscriber.due <= now)
+                {
+                    subscriber.pending += nextEvent(subscriber);
+                    subscriber.due = now + std::chrono::milliseconds(subscriber.intervalMs);
+                }
+                ssize_t sent = send(subscriber.sock, subscriber.pending.data(), subscriber.pending.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+                if (sent > 0)
+                    subscriber.pending.erase(0, sent);
+                else if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                    subscriber.done = true;
+                if (subscriber.pending.size() > maxPendingStreamBytes)
+                    subscriber.done = true;
+
+                auto us = std::chrono::duration_cast<std::chrono::microseconds>(subscriber.due - now).count();
+                int dueMs = int((us + 999) / 1000);
+                waitMs = waitMs < 0 ? dueMs : std::min(waitMs, dueMs);
+            }
+            dropFinished(subscribers);
+
+            fds.assign(1, pollfd{wakePipe[0], POLLIN, 0});
+            for (const auto &subscriber : subscribers)
+                fds.push_back(pollfd{subscriber.sock, short(POLLIN | (subscriber.pending.empty() ? 0 : POLLOUT)), 0});
+            if (poll(fds.data(), fds.size(), waitMs) <= 0)
+                continue;
+
+            char drain[64];
+            while (read(wakePipe[0], drain, sizeof(drain)) > 0)
+            {
+            }
+            for (size_t i = 0; i < subscribers.size(); ++i)
+            {
+                if (fds[i + 1].revents & (POLLIN | POLLERR | POLLHUP))
+                    subscribers[i].done = true;
+            }
+            dropFinished(subscribers);
+        }
+    }
+
+    void dropFinished(std::vector<Subscriber> &subscribers)
+    {
+        auto finished = std::remove_if(subscribers.begin(), subscribers.end(), [this](const Subscriber &subscriber)
+                                       {
+            if (!subscriber.done)
+                return false;
+            close(subscriber.sock);
+            --subscriberCount;
+            return true; });
+        subscribers.erase(finished, subscribers.end());
+    }
+
+    // a snapshot of all counters when the set of names changed, else only the
+    // differences of those that moved
+    static std::string nextEvent(Subscriber &subscriber)
+    {
+        CounterSnapshot counters = (*subscriber.sampler)();
+        const CounterSnapshot &last = subscriber.last;
+        bool whole = counters.size() != last.size();
+        for (size_t i = 0; !whole && i < counters.size(); ++i)
+            whole = counters[i].first != last[i].first;
+
+        auto now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
+        std::ostringstream event;
+        event << "event: " << (whole ? "snapshot" : "delta") << "\ndata: {\"t\":" << now.count() << ",\"counters\":{";
+        bool first = true;
+        for (size_t i = 0; i < counters.size(); ++i)
+        {
+            int64_t value = whole ? counters[i].second : counters[i].second - last[i].second;
+            if (!whole && value == 0)
+                continue;
+            event << (first ? "" : ",") << "\"" << counters[i].first << "\":" << value;
+            first = false;
+        }
+        event << "}}\n\n";
+        subscriber.last = std::move(counters);
+        return event.str();
+    }
+};
+
 int main()
 {
     try
     {
+        // blocked before any thread starts, so every thread inherits the mask and only
+        // main takes them, with sigwait below
+        sigset_t shutdownSignals;
+        sigemptyset(&shutdownSignals);
+        sigaddset(&shutdownSignals, SIGINT);
+        sigaddset(&shutdownSignals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &shutdownSignals, nullptr);
+
         YAML::Node config = YAML::LoadFile("config.yaml");
         std::vector<std::string> srcAddrPorts = config["srcAddrPorts"].as<std::vector<std::string>>();
         std::vector<std::string> dstAddrPorts = config["dstAddrPorts"].as<std::vector<std::string>>();
@@ -485,10 +3350,180 @@ int main()
             throw std::runtime_error("Mismatch in the number of source and destination addresses");
         }
 
+        // optional, one list of local source IPs per dstAddrPorts entry
+        std::vector<std::vector<std::string>> upstreamSourceAddrs(dstAddrPorts.size());
+        if (config["upstreamSourceAddrs"])
+        {
+            for (size_t i = 0; i < config["upstreamSourceAddrs"].size() && i < dstAddrPorts.size(); ++i)
+            {
+                upstreamSourceAddrs[i] = config["upstreamSourceAddrs"][i].as<std::vector<std::string>>();
+            }
+        }
+
+        // hostnames in dstAddrPorts are resolved here and refreshed in the background
+        int minTtl = 5, maxTtl = 3600, retryInterval = 5;
+        if (config["dns"])
+        {
+            if (config["dns"]["min_ttl"])
+                minTtl = config["dns"]["min_ttl"].as<int>();
+            if (config["dns"]["max_ttl"])
+                maxTtl = config["dns"]["max_ttl"].as<int>();
+            if (config["dns"]["retry_interval"])
+                retryInterval = config["dns"]["retry_interval"].as<int>();
+        }
+        DnsResolver resolver(minTtl, maxTtl, retryInterval, logger);
+
+        // optional, one transport per dstAddrPorts entry: "udp" (default), "tcp" or "tcp-listen"
+        std::vector<Transport> transports(dstAddrPorts.size(), Transport::udp);
+        if (config["transports"])
+        {
+            for (size_t i = 0; i < config["transports"].size() && i < dstAddrPorts.size(); ++i)
+            {
+                std::string name = config["transports"][i].as<std::string>();
+                if (name == "tcp")
+                    transports[i] = Transport::tunnelClient;
+                else if (name == "tcp-listen")
+                    transports[i] = Transport::tunnelServer;
+                else if (name != "udp")
+                    throw std::runtime_error("Unknown transport: " + name);
+            }
+        }
+        // optional, encryption between paired udp_forwarders, one side per dstAddrPorts entry
+        std::vector<std::string> encryptionSides(dstAddrPorts.size(), "none");
+        unsigned char encryptionKey[32] = {0};
+        uint8_t cipherId = 0;
+        if (config["encryption"])
+        {
+            std::string key = config["encryption"]["key"].as<std::string>();
+            if (key.size() != 64 || key.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos)
+                throw std::runtime_error("Encryption key must be 64 hex digits");
+            for (int i = 0; i < 32; ++i)
+                encryptionKey[i] = static_cast<unsigned char>(std::stoi(key.substr(2 * i, 2), nullptr, 16));
+            cipherId = parseSealCipher(config["encryption"]["cipher"] ? config["encryption"]["cipher"].as<std::string>() : "auto");
+            for (size_t i = 0; i < config["encryption"]["sides"].size() && i < dstAddrPorts.size(); ++i)
+            {
+                encryptionSides[i] = config["encryption"]["sides"][i].as<std::string>();
+                if (encryptionSides[i] != "none" && encryptionSides[i] != "client" && encryptionSides[i] != "server")
+                    throw std::runtime_error("Unknown encryption side: " + encryptionSides[i]);
+            }
+        }
+
+        // optional, forward error correction between paired udp_forwarders, sides as for encryption
+        std::vector<std::string> fecSides(dstAddrPorts.size(), "none");
+        FecOptions fecOptions;
+        if (config["fec"])
+        {
+            const YAML::Node &fec = config["fec"];
+            if (fec["data"])
+                fecOptions.data = fec["data"].as<int>();
+            if (fec["parity"])
+                fecOptions.parity = fec["parity"].as<int>();
+            if (fec["flush_ms"])
+                fecOptions.flushMs = fec["flush_ms"].as<int>();
+            if (fec["window"])
+                fecOptions.window = fec["window"].as<int>();
+            if (fecOptions.data < 1 || fecOptions.data > FecOptions::maxData || fecOptions.parity < 1 || fecOptions.parity > FecOptions::maxParity)
+                throw std::runtime_error("FEC data and parity must be between 1 and 128");
+            if (fecOptions.window < 2 || fecOptions.window > 1024 || fecOptions.flushMs < 1)
+                throw std::runtime_error("FEC window must be between 2 and 1024 groups and flush_ms positive");
+            for (size_t i = 0; i < fec["sides"].size() && i < dstAddrPorts.size(); ++i)
+            {
+                fecSides[i] = fec["sides"][i].as<std::string>();
+                if (fecSides[i] != "none" && fecSides[i] != "client" && fecSides[i] != "server")
+                    throw std::runtime_error("Unknown FEC side: " + fecSides[i]);
+            }
+        }
+
+        // optional, a shadow target per dstAddrPorts entry ("" for none) receiving copies of each flow
+        std::vector<std::string> mirrorTargets(dstAddrPorts.size());
+        MirrorOptions mirrorOptions;
+        if (config["mirror"])
+        {
+            const YAML::Node &mirror = config["mirror"];
+            for (size_t i = 0; i < mirror["targets"].size() && i < dstAddrPorts.size(); ++i)
+                mirrorTargets[i] = mirror["targets"][i].as<std::string>();
+            std::string directions = mirror["directions"] ? mirror["directions"].as<std::string>() : "upstream";
+            if (directions != "upstream" && directions != "both")
+                throw std::runtime_error("Mirror directions must be upstream or both");
+            mirrorOptions.both = directions == "both";
+            if (mirror["queue_bytes"])
+                mirrorOptions.queueBytes = mirror["queue_bytes"].as<int>();
+            if (mirrorOptions.queueBytes < 4096)
+                throw std::runtime_error("Mirror queue_bytes must be at least 4096");
+        }
+
+        TunnelOptions tunnelOptions;
+        if (config["tunnel"])
+        {
+            if (config["tunnel"]["flush_ms"])
+                tunnelOptions.flushMs = config["tunnel"]["flush_ms"].as<int>();
+            if (config["tunnel"]["batch_bytes"])
+                tunnelOptions.batchBytes = config["tunnel"]["batch_bytes"].as<size_t>();
+            if (config["tunnel"]["max_pending"])
+                tunnelOptions.maxPending = config["tunnel"]["max_pending"].as<size_t>();
+        }
+        LoadShedder shedder(config["loop_monitor"], logger);
+
+        FlowLimits flowLimits;
+        if (config["flow_limits"])
+        {
+            const YAML::Node &limits = config["flow_limits"];
+            if (limits["max_flows"])
+                flowLimits.maxFlows = limits["max_flows"].as<size_t>();
+            if (limits["new_flows_per_second"])
+                flowLimits.newFlowsPerSecond = limits["new_flows_per_second"].as<double>();
+            if (limits["burst"])
+                flowLimits.burst = limits["burst"].as<double>();
+            if (limits["prefix_v4"])
+                flowLimits.prefixV4 = limits["prefix_v4"].as<int>();
+            if (limits["prefix_v6"])
+                flowLimits.prefixV6 = limits["prefix_v6"].as<int>();
+            if (flowLimits.prefixV4 < 0 || flowLimits.prefixV4 > 32 || flowLimits.prefixV6 < 0 || flowLimits.prefixV6 > 64)
+                throw std::runtime_error("Flow limit prefix_v4 must be between 0 and 32, prefix_v6 between 0 and 64");
+        }
+        if (flowLimits.burst < 1)
+            flowLimits.burst = std::max(1.0, flowLimits.newFlowsPerSecond);
+
+        InheritedSockets inherited(logger);
         std::vector<std::unique_ptr<UDPProxy>> proxies;
         for (size_t i = 0; i < srcAddrPorts.size(); ++i)
         {
-            proxies.push_back(std::make_unique<UDPProxy>(srcAddrPorts[i], dstAddrPorts[i], timeout, buffer_size, logger));
+            std::unique_ptr<DatagramCipher> cipher;
+            if (encryptionSides[i] != "none")
+                cipher = std::make_unique<DatagramCipher>(encryptionKey, cipherId);
+            FecOptions proxyFec = fecOptions;
+            proxyFec.enabled = fecSides[i] != "none";
+            proxyFec.encodeUpstream = fecSides[i] == "client";
+            MirrorOptions proxyMirror = mirrorOptions;
+            proxyMirror.enabled = !mirrorTargets[i].empty();
+            proxyMirror.target = mirrorTargets[i];
+            proxies.push_back(std::make_unique<UDPProxy>(srcAddrPorts[i], dstAddrPorts[i], timeout, buffer_size,
+                                                         upstreamSourceAddrs[i], transports[i], tunnelOptions,
+                                                         flowLimits, std::move(cipher), encryptionSides[i] == "client", proxyFec,
+                                                         proxyMirror, resolver, shedder, inherited, logger));
+        }
+        inherited.closeUnclaimed();
+
+        std::unique_ptr<ControlServer> controlServer;
+        if (config["control"] && config["control"]["enabled"] && config["control"]["enabled"].as<bool>())
+        {
+            std::string controlAddress = config["control"]["address"] ? config["control"]["address"].as<std::string>() : "127.0.0.1";
+            int controlPort = config["control"]["udp_port"] ? config["control"]["udp_port"].as<int>() : 9101;
+            controlServer = std::make_unique<ControlServer>(controlAddress, controlPort, logger);
+            controlServer->addRoute("/stats", [&proxies, &resolver](const std::string &)
+                                    {
+                std::string body = "{\"proxies\":[";
+                for (size_t i = 0; i < proxies.size(); ++i)
+                    body += (i ? "," : "") + proxies[i]->statsJson();
+                return body + "],\"dns\":" + resolver.statsJson() + "}"; });
+            int streamInterval = config["control"]["stream_interval_ms"] ? config["control"]["stream_interval_ms"].as<int>() : 1000;
+            controlServer->addStream("/stream", streamInterval, [&proxies]()
+                                     {
+                CounterSnapshot counters;
+                for (auto &proxy : proxies)
+                    proxy->appendCounters(counters);
+                return counters; });
+            controlServer->start();
         }
 
         std::vector<std::thread> threads;
@@ -502,6 +3537,56 @@ int main()
                                      } });
         }
 
+        // the first signal drains: no new flows, and the process exits once no flow has
+        // heard from its client for flow_idle seconds or at drain_timeout. a second exits at once
+        int drainTimeout = 30, flowIdle = 5;
+        if (config["shutdown"])
+        {
+            if (config["shutdown"]["drain_timeout"])
+                drainTimeout = config["shutdown"]["drain_timeout"].as<int>();
+            if (config["shutdown"]["flow_idle"])
+                flowIdle = config["shutdown"]["flow_idle"].as<int>();
+        }
+        int signalNumber = 0;
+        sigwait(&shutdownSignals, &signalNumber);
+        logger.info("Received signal " + std::to_string(signalNumber) + ", draining for up to " + std::to_string(drainTimeout) + "s");
+        for (auto &proxy : proxies)
+            proxy->startDrain();
+
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(drainTimeout);
+        const timespec pollInterval = {0, 250000000};
+        while (true)
+        {
+            int flows = 0;
+            bool quiet = true;
+            for (auto &proxy : proxies)
+            {
+                flows += proxy->flowCount();
+                if (proxy->quietSeconds() < flowIdle)
+                    quiet = false;
+            }
+            if (quiet)
+            {
+                logger.info("Drained, " + std::to_string(flows) + " flows quiet for " + std::to_string(flowIdle) + "s");
+                break;
+            }
+            if (std::chrono::steady_clock::now() >= deadline)
+            {
+                logger.warn("Drain deadline reached with " + std::to_string(flows) + " flows");
+                break;
+            }
+            if (sigtimedwait(&shutdownSignals, nullptr, &pollInterval) > 0)
+            {
+                logger.warn("Second signal, exiting without waiting for the drain");
+                break;
+            }
+        }
+
+        for (auto &proxy : proxies)
+        {
+            logger.info("Final stats: " + proxy->statsJson());
+            proxy->stop();
+        }
         for (auto &thread : threads)
         {
             thread.join();
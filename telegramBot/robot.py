@@ -223,12 +223,13 @@ async def unban_ip(chat_id, ip, context):
 
 async def tunnel_logs(update: Update, context: CallbackContext):
     chat_id = update.effective_chat.id
-    data = api_request("api/tunnel-logs")
+    # the API reads the newest lines through the log index, however large the log has grown
+    data = api_request("api/tunnel-logs?lines=40")
     
     if "error" in data:
         message = f"❌ خطا: {data['error']}"
     else:
-        logs = data.get("logs", "لاگی برای نمایش وجود ندارد.")
+        logs = data.get("logs", "لاگی برای نمایش وجود ندارد.")[-3500:]  # telegram caps messages at 4096 characters
         message = f"📝 لاگ‌های تانل:\n```\n{logs}\n```"
 
     keyboard = [[InlineKeyboardButton(u"🔙 بازگشت به منو", callback_data="show_menu")]]